@@ -22,8 +22,10 @@
 #include <cctype>
 #include <string>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
@@ -51,7 +53,8 @@ namespace transpiler {
 //     ...
 //
 // And define static methods TranslateHeader, NodeReference, ParamBitReference,
-// OutputBitReference, CopyTo, InitializeNode, Execute, Prelude, and Conclusion.
+// OutputBitReference, CopyTo, AliasTo, InitializeNode, SetToZero, Execute,
+// Prelude, and Conclusion.
 template <typename TranspilerT>
 class AbstractXLSTranspiler {
  public:
@@ -64,7 +67,8 @@ class AbstractXLSTranspiler {
                          Prelude(function, metadata));
 
     // Generate code implementing each node
-    XLS_ASSIGN_OR_RETURN(const std::string body, TranslateNodes(function));
+    XLS_ASSIGN_OR_RETURN(const std::string body,
+                         TranslateNodes(function, metadata));
 
     XLS_ASSIGN_OR_RETURN(const std::string handle_outputs,
                          CollectOutputs(function, metadata));
@@ -198,9 +202,15 @@ class AbstractXLSTranspiler {
   static std::string CopyTo(std::string destination, std::string source) {
     return TranspilerT::CopyTo(destination, source);
   }
+  static std::string AliasTo(std::string destination, std::string source) {
+    return TranspilerT::AliasTo(destination, source);
+  }
   static std::string InitializeNode(const xls::Node* node) {
     return TranspilerT::InitializeNode(node);
   }
+  static std::string SetToZero(std::string destination) {
+    return TranspilerT::SetToZero(destination);
+  }
 
   static absl::StatusOr<std::string> Execute(const xls::Node* node) {
     return TranspilerT::Execute(node);
@@ -216,6 +226,55 @@ class AbstractXLSTranspiler {
     return TranspilerT::Conclusion();
   }
 
+ protected:
+  // The names of the in/out params.
+  static absl::flat_hash_set<std::string> OutParams(
+      const xlscc_metadata::MetadataOutput& metadata) {
+    absl::flat_hash_set<std::string> out_params;
+    for (const auto& param : metadata.top_func_proto().params()) {
+      if (!param.is_const() && param.is_reference()) {
+        out_params.insert(param.name());
+      }
+    }
+    return out_params;
+  }
+
+  // Whether code is generated for `node` itself. The rest only select bits
+  // of other nodes, which HandleBitSlice and CollectNodeValue walk up the xls
+  // tree to find.
+  static bool IsEvaluated(const xls::Node* node) {
+    return !(
+        node->op() == xls::Op::kArray || node->op() == xls::Op::kArrayIndex ||
+        node->op() == xls::Op::kConcat || node->op() == xls::Op::kParam ||
+        node->op() == xls::Op::kShrl || node->op() == xls::Op::kTuple ||
+        node->op() == xls::Op::kTupleIndex);
+  }
+
+  // Whether `node` is a bit slice that HandleBitSlice aliases to a param bit,
+  // rather than initializing a node of its own.
+  static absl::StatusOr<bool> AliasesParamBit(
+      const xls::Node* node,
+      const absl::flat_hash_set<std::string>& out_params) {
+    if (!node->Is<xls::BitSlice>()) {
+      return false;
+    }
+    XLS_ASSIGN_OR_RETURN(auto param_bit,
+                         ResolveBitSlice(node->As<xls::BitSlice>()));
+    return param_bit.first->GetType()->GetFlatBitCount() != param_bit.second &&
+           !out_params.contains(param_bit.first->GetName());
+  }
+
+  // Generates the code for a node for which IsEvaluated() holds.
+  static absl::StatusOr<std::string> TranslateNode(
+      const xls::Node* node,
+      const absl::flat_hash_set<std::string>& out_params) {
+    if (node->Is<xls::BitSlice>()) {
+      return HandleBitSlice(node->As<xls::BitSlice>(), out_params);
+    }
+    XLS_ASSIGN_OR_RETURN(const std::string operation, Execute(node));
+    return absl::StrCat(InitializeNode(node), operation);
+  }
+
  private:
   static absl::StatusOr<int64_t> GetOffsetInArrayIndex(
       const xls::ArrayIndex* array_index) {
@@ -274,8 +333,9 @@ class AbstractXLSTranspiler {
     return offset;
   }
 
-  // This method copies the relevant bit from input params into a temp node.
-  static absl::StatusOr<std::string> HandleBitSlice(
+  // Returns the param a BitSlice reads from, and the offset of the bit within
+  // it.
+  static absl::StatusOr<std::pair<const xls::Node*, int>> ResolveBitSlice(
       const xls::BitSlice* bit_slice) {
     xls::Node* operand = bit_slice->operand(0);
     int slice_idx = 0;
@@ -315,11 +375,34 @@ class AbstractXLSTranspiler {
           absl::StrCat("Invalid BitSlice operand: ", operand->ToString()));
     }
 
-    // Overflow SHR, can be ignored.
-    if (operand->GetType()->GetFlatBitCount() == slice_idx) return "";
+    return std::make_pair(operand, slice_idx);
+  }
+
+  // This method makes a temp node refer to the relevant bit of an input param.
+  // Params that are also written as outputs (in/out params) are copied, so
+  // that writing the outputs cannot clobber a bit another output still reads;
+  // all other bits are aliased.
+  static absl::StatusOr<std::string> HandleBitSlice(
+      const xls::BitSlice* bit_slice,
+      const absl::flat_hash_set<std::string>& out_params) {
+    XLS_ASSIGN_OR_RETURN(auto param_bit, ResolveBitSlice(bit_slice));
+    const xls::Node* param = param_bit.first;
+    const int slice_idx = param_bit.second;
+
+    // Overflow SHR: the bit shifted in past the top is zero.
+    if (param->GetType()->GetFlatBitCount() == slice_idx) {
+      return absl::StrCat(InitializeNode(bit_slice),
+                          SetToZero(NodeReference(bit_slice)), "\n");
+    }
 
+    if (!out_params.contains(param->GetName())) {
+      return absl::StrCat(
+          AliasTo(NodeReference(bit_slice), ParamBitReference(param, slice_idx)),
+          "\n");
+    }
     return absl::StrCat(
-        CopyTo(NodeReference(bit_slice), ParamBitReference(operand, slice_idx)),
+        InitializeNode(bit_slice),
+        CopyTo(NodeReference(bit_slice), ParamBitReference(param, slice_idx)),
         "\n");
   }
 
@@ -392,29 +475,19 @@ class AbstractXLSTranspiler {
   }
 
   static absl::StatusOr<std::string> TranslateNodes(
-      const xls::Function* function) {
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata) {
+    const absl::flat_hash_set<std::string> out_params = OutParams(metadata);
+
     std::string res;
     for (xls::Node* node :
          xls::TopoSort(const_cast<xls::Function*>(function))) {
-      if (node->op() == xls::Op::kArray || node->op() == xls::Op::kArrayIndex ||
-          node->op() == xls::Op::kConcat || node->op() == xls::Op::kParam ||
-          node->op() == xls::Op::kShrl || node->op() == xls::Op::kTuple ||
-          node->op() == xls::Op::kTupleIndex) {
-        // Do nothing as HandleBitSlice and CollectNodeValue walk up the xls
-        // tree to find the right bits to extract.
+      if (!IsEvaluated(node)) {
         continue;
       }
-
-      absl::StrAppend(&res, InitializeNode(node));
-
-      if (node->Is<xls::BitSlice>()) {
-        XLS_ASSIGN_OR_RETURN(const std::string operation,
-                             HandleBitSlice(node->As<xls::BitSlice>()));
-        absl::StrAppend(&res, operation);
-      } else {
-        XLS_ASSIGN_OR_RETURN(const std::string operation, Execute(node));
-        absl::StrAppend(&res, operation);
-      }
+      XLS_ASSIGN_OR_RETURN(const std::string operation,
+                           TranslateNode(node, out_params));
+      absl::StrAppend(&res, operation);
     }
     return res;
   }
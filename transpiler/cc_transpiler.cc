@@ -70,8 +70,17 @@ std::string CcTranspiler::CopyTo(std::string destination, std::string source) {
   return absl::Substitute("  $0 = $1;\n", destination, source);
 }
 
+// Plain bits are as cheap to copy as to point to.
+std::string CcTranspiler::AliasTo(std::string destination, std::string source) {
+  return CopyTo(destination, source);
+}
+
 std::string CcTranspiler::InitializeNode(const Node* node) { return ""; }
 
+std::string CcTranspiler::SetToZero(std::string destination) {
+  return CopyTo(destination, "false");
+}
+
 // Input: Node(id = 5, op = kNot, operands = Node(id = 2))
 // Output: "  temp_nodes[5] = !temp_nodes[2];\n"
 absl::StatusOr<std::string> CcTranspiler::Execute(const Node* node) {
@@ -107,6 +116,28 @@ absl::StatusOr<std::string> CcTranspiler::Execute(const Node* node) {
       op_result =
           absl::Substitute("$0 || $1", NodeReference(node->operands()[0]),
                            NodeReference(node->operands()[1]));
+    } else if (node->op() == Op::kXor) {
+      XLS_CHECK_EQ(node->operands().size(), 2);
+      op_result =
+          absl::Substitute("$0 != $1", NodeReference(node->operands()[0]),
+                           NodeReference(node->operands()[1]));
+    } else if (node->op() == Op::kNand) {
+      XLS_CHECK_EQ(node->operands().size(), 2);
+      op_result =
+          absl::Substitute("!($0 && $1)", NodeReference(node->operands()[0]),
+                           NodeReference(node->operands()[1]));
+    } else if (node->op() == Op::kNor) {
+      XLS_CHECK_EQ(node->operands().size(), 2);
+      op_result =
+          absl::Substitute("!($0 || $1)", NodeReference(node->operands()[0]),
+                           NodeReference(node->operands()[1]));
+    } else if (node->op() == Op::kSel) {
+      // Operands are the selector, then the cases for 0 and 1.
+      XLS_CHECK_EQ(node->operands().size(), 3);
+      op_result = absl::Substitute("$0 ? $2 : $1",
+                                   NodeReference(node->operands()[0]),
+                                   NodeReference(node->operands()[1]),
+                                   NodeReference(node->operands()[2]));
     } else {
       return absl::InvalidArgumentError("Unsupported Op kind.");
     }
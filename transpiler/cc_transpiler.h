@@ -45,7 +45,9 @@ class CcTranspiler : public AbstractXLSTranspiler<CcTranspiler> {
   static std::string OutputBitReference(absl::string_view output_arg,
                                         int offset);
   static std::string CopyTo(std::string destination, std::string source);
+  static std::string AliasTo(std::string destination, std::string source);
   static std::string InitializeNode(const xls::Node* node);
+  static std::string SetToZero(std::string destination);
 
   static absl::StatusOr<std::string> Execute(const xls::Node* node);
 
@@ -14,7 +14,12 @@
 
 #include "transpiler/examples/pir/pir_cloud_service.h"
 
+#include <utility>
+
 #include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "transpiler/tfhe_session.h"
+#include "xls/common/status/status_macros.h"
 
 #ifdef USE_INTERPRETED_TFHE
 #include "transpiler/examples/pir/pir_api_interpreted_tfhe.h"
@@ -24,10 +29,31 @@
 
 namespace fully_homomorphic_encryption {
 
+CloudService::CloudService(FheArray<RecordT> database)
+    : database_(std::move(database)) {}
+
+CloudService::~CloudService() {}
+
 absl::Status CloudService::QueryRecord(
     LweSample* result, LweSample* index,
     const TFheGateBootstrappingCloudKeySet* bk) {
+#ifdef USE_INTERPRETED_TFHE
+  transpiler::TfheSession* session;
+  {
+    // Held while creating, so that concurrent first queries bind the
+    // database once. Runs need no lock of their own.
+    absl::MutexLock lock(&session_lock_);
+    if (session_ == nullptr) {
+      XLS_ASSIGN_OR_RETURN(
+          session_,
+          ::QueryRecord_CreateSession({{"database", database_.get()}}, bk));
+    }
+    session = session_.get();
+  }
+  return session->Run(result, {{"index", index}}, bk);
+#else
   return ::QueryRecord(result, index, database_.get(), bk);
+#endif
 }
 
 }  // namespace fully_homomorphic_encryption
@@ -15,28 +15,43 @@
 #ifndef TRANSPILER_EXAMPLES_PIR_CLOUD_SERVICE_H_
 #define TRANSPILER_EXAMPLES_PIR_CLOUD_SERVICE_H_
 
+#include <memory>
+
+#include "absl/base/thread_annotations.h"
 #include "absl/memory/memory.h"
 #include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
 #include "tfhe/tfhe.h"
 #include "tfhe/tfhe_io.h"
 #include "transpiler/data/fhe_data.h"
 #include "transpiler/examples/pir/pir_api.h"
 
 namespace fully_homomorphic_encryption {
+namespace transpiler {
+class TfheSession;
+}  // namespace transpiler
 
 // Emulates a basic "CloudService" connection which allows for queries to hosted
 // data. Both the queries and the data are encrypted under the client's private
 // key.
 class CloudService {
  public:
-  explicit CloudService(FheArray<RecordT> database)
-      : database_(std::move(database)) {}
+  explicit CloudService(FheArray<RecordT> database);
+  ~CloudService();
 
+  // Looks up the record at `index`. Thread-safe. With the interpreted
+  // backend, the first query binds the database to a session for `bk`, and
+  // every later query must pass the same key.
   absl::Status QueryRecord(LweSample* result, LweSample* index,
                            const TFheGateBootstrappingCloudKeySet* bk);
 
  private:
   FheArray<RecordT> database_;
+  // With the interpreted backend, the database stays bound to a session
+  // created on the first query, so queries pass only the index.
+  absl::Mutex session_lock_;
+  std::unique_ptr<transpiler::TfheSession> session_
+      ABSL_GUARDED_BY(session_lock_);
 };
 
 }  // namespace fully_homomorphic_encryption
@@ -98,10 +98,21 @@ def _fhe_transpile_ir(ctx, src, metadata):
         ctx.executable._xls_opt.path,
         "-transpiler_type",
         ctx.attr.transpiler_type,
+        "-tfhe_schedule",
+        ctx.attr.tfhe_schedule,
     ]
+    outputs = [out_ir, out_cc, out_h]
+
+    # The compiled circuit, for loading with TfheRunner::CreateFromPlanFile.
+    out_plan = None
+    if ctx.attr.transpiler_type == "interpreted_tfhe":
+        out_plan = ctx.actions.declare_file("%s.plan" % library_name)
+        args += ["-output_plan_path", out_plan.path]
+        outputs.append(out_plan)
+
     ctx.actions.run(
         inputs = [src, metadata],
-        outputs = [out_ir, out_cc, out_h],
+        outputs = outputs,
         executable = ctx.executable._fhe_transpiler,
         arguments = args,
         tools = [
@@ -109,7 +120,7 @@ def _fhe_transpile_ir(ctx, src, metadata):
             ctx.executable._xls_opt,
         ],
     )
-    return [out_ir, out_cc, out_h]
+    return [out_ir, out_plan, out_cc, out_h]
 
 def _generate_struct_header(ctx, metadata):
     """Transpile XLS IR into C++ source."""
@@ -138,14 +149,16 @@ def _fhe_transpile_impl(ctx):
     if ctx.attr.transpiler_type != "bool":
         hdrs.append(_generate_struct_header(ctx, metadata_file))
 
-    bool_ir, out_cc, out_h = _fhe_transpile_ir(ctx, ir_file, metadata_file)
+    bool_ir, plan, out_cc, out_h = _fhe_transpile_ir(ctx, ir_file, metadata_file)
+    plans = [plan] if plan else []
     hdrs.append(out_h)
     return [
-        DefaultInfo(files = depset([ir_file, metadata_file, bool_ir, out_cc] + hdrs)),
+        DefaultInfo(files = depset([ir_file, metadata_file, bool_ir, out_cc] + plans + hdrs)),
         OutputGroupInfo(
             sources = depset([out_cc]),
             headers = depset(hdrs),
             bool_ir = depset([bool_ir]),
+            plan = depset(plans),
             metadata = depset([metadata_file]),
         ),
     ]
@@ -194,6 +207,14 @@ fhe_transpile = rule(
             """,
             values = ["tfhe", "interpreted_tfhe", "bool"],
         ),
+        "tfhe_schedule": attr.string(
+            doc = """
+            For transpiler_type "tfhe", the order gates are evaluated in. Choices are
+            {topological, min_live_set}; 'min_live_set' holds fewer ciphertexts at once.
+            """,
+            values = ["topological", "min_live_set"],
+            default = "topological",
+        ),
         "_xlscc": _executable_attr(_XLSCC),
         "_xls_booleanify": _executable_attr(_XLS_BOOLEANIFY),
         "_xls_opt": _executable_attr(_XLS_OPT),
@@ -208,6 +229,7 @@ def fhe_cc_library(
         hdrs,
         num_opt_passes = 1,
         transpiler_type = "tfhe",
+        tfhe_schedule = "topological",
         **kwargs):
     """A rule for building FHE-based cc_libraries.
 
@@ -238,6 +260,9 @@ def fhe_cc_library(
       transpiler_type: Defaults to "tfhe"; Type of FHE library to transpile to. Choices are
             {tfhe, interpreted_tfhe, bool}. 'bool' does Boolean operations on plaintext, and
             doesn't depend on any FHE libraries; mostly useful for debugging.
+      tfhe_schedule: Defaults to "topological"; for transpiler_type "tfhe", the order the
+            generated function evaluates gates in. Choices are {topological, min_live_set};
+            'min_live_set' frees each ciphertext after its last use, holding fewer at once.
       **kwargs: Keyword arguments to pass through to the cc_library target.
     """
     tags = kwargs.pop("tags", None)
@@ -250,6 +275,7 @@ def fhe_cc_library(
         library_name = name,
         num_opt_passes = num_opt_passes,
         transpiler_type = transpiler_type,
+        tfhe_schedule = tfhe_schedule,
         tags = tags,
     )
 
@@ -277,6 +303,14 @@ def fhe_cc_library(
         tags = tags,
     )
 
+    transpiled_plan = "{}.plan".format(name)
+    native.filegroup(
+        name = transpiled_plan,
+        srcs = [":" + transpiled_files],
+        output_group = "plan",
+        tags = tags,
+    )
+
     transpiled_metadata = "{}.metadata".format(name)
     native.filegroup(
         name = transpiled_metadata,
@@ -295,8 +329,12 @@ def fhe_cc_library(
         ])
     elif transpiler_type == "interpreted_tfhe":
         deps.extend([
+            "@com_google_absl//absl/container:flat_hash_map",
             "@com_google_absl//absl/status:statusor",
+            "@com_google_absl//absl/strings",
+            "//transpiler:tfhe_plan",
             "//transpiler:tfhe_runner",
+            "//transpiler:tfhe_session",
             "//transpiler/data:fhe_data",
             "@tfhe//:libtfhe",
             "@com_google_xls//xls/common/status:status_macros",
@@ -0,0 +1,213 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/gate_fusion.h"
+
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/optional.h"
+#include "xls/common/status/status_macros.h"
+#include "xls/ir/function.h"
+#include "xls/ir/node.h"
+#include "xls/ir/node_iterator.h"
+#include "xls/ir/nodes.h"
+#include "xls/ir/op.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+namespace {
+
+using xls::Node;
+using xls::Op;
+
+// Whether one of `a` and `b` is the negation of the other.
+bool AreComplements(const Node* a, const Node* b) {
+  return (a->op() == Op::kNot && a->operand(0) == b) ||
+         (b->op() == Op::kNot && b->operand(0) == a);
+}
+
+// Whether `a` and `b` have the same two operands, in either order.
+bool HaveSameOperands(const Node* a, const Node* b) {
+  return (a->operand(0) == b->operand(0) && a->operand(1) == b->operand(1)) ||
+         (a->operand(0) == b->operand(1) && a->operand(1) == b->operand(0));
+}
+
+class GateFuser {
+ public:
+  explicit GateFuser(xls::Function* function) : function_(function) {}
+
+  absl::StatusOr<bool> Run() {
+    bool changed = false;
+    // The three-gate XOR and MUX patterns go first: the NAND and NOR rewrites
+    // would otherwise break up the NOT(AND) in XOR's second form.
+    for (Node* n : xls::TopoSort(function_)) {
+      if (IsDead(n)) {
+        continue;
+      }
+      bool fused = false;
+      if (IsBinary(n, Op::kOr)) {
+        XLS_ASSIGN_OR_RETURN(fused, FuseSumOfProducts(n));
+      } else if (IsBinary(n, Op::kAnd)) {
+        XLS_ASSIGN_OR_RETURN(fused, FuseProductOfSums(n));
+      }
+      changed |= fused;
+    }
+    for (Node* n : xls::TopoSort(function_)) {
+      if (IsDead(n) || n->op() != Op::kNot) {
+        continue;
+      }
+      Node* operand = n->operand(0);
+      if (IsExclusive(operand, Op::kAnd)) {
+        XLS_RETURN_IF_ERROR(
+            n->ReplaceUsesWithNew<xls::NaryOp>(
+                 std::vector<Node*>(operand->operands().begin(),
+                                    operand->operands().end()),
+                 Op::kNand)
+                .status());
+        changed = true;
+      } else if (IsExclusive(operand, Op::kOr)) {
+        XLS_RETURN_IF_ERROR(
+            n->ReplaceUsesWithNew<xls::NaryOp>(
+                 std::vector<Node*>(operand->operands().begin(),
+                                    operand->operands().end()),
+                 Op::kNor)
+                .status());
+        changed = true;
+      }
+    }
+
+    // Clear away the replaced gates, and any NOTs only they read.
+    for (Node* n : xls::ReverseTopoSort(function_)) {
+      if (IsDead(n) && !n->Is<xls::Param>()) {
+        XLS_RETURN_IF_ERROR(function_->RemoveNode(n));
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+ private:
+  bool IsDead(const Node* n) const {
+    return n->users().empty() && n != function_->return_value();
+  }
+
+  static bool IsBinary(const Node* n, Op op) {
+    return n->op() == op && n->operand_count() == 2;
+  }
+
+  // Whether `n` is a binary `op` that nothing but its one user reads, so that
+  // rewriting the user makes it dead rather than leaving both to evaluate.
+  bool IsExclusive(const Node* n, Op op) const {
+    return IsBinary(n, op) && n->users().size() == 1 &&
+           n != function_->return_value();
+  }
+
+  // Matches `n` = or(and(p0, p1), and(q0, q1)).
+  absl::StatusOr<bool> FuseSumOfProducts(Node* n) {
+    Node* p = n->operand(0);
+    Node* q = n->operand(1);
+    if (!IsExclusive(p, Op::kAnd) || !IsExclusive(q, Op::kAnd)) {
+      return false;
+    }
+
+    // (x & y) | (~x & ~y) is XNOR(x, y).
+    for (int swap = 0; swap < 2; ++swap) {
+      if (AreComplements(p->operand(0), q->operand(swap)) &&
+          AreComplements(p->operand(1), q->operand(1 - swap))) {
+        XLS_RETURN_IF_ERROR(ReplaceWithXnor(n, p->operand(0), p->operand(1)));
+        return true;
+      }
+    }
+
+    // (s & a) | (~s & b) is s ? a : b.
+    for (int i = 0; i < 2; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        Node* s = p->operand(i);
+        Node* not_s = q->operand(j);
+        if (!AreComplements(s, not_s)) {
+          continue;
+        }
+        Node* a = p->operand(1 - i);
+        Node* b = q->operand(1 - j);
+        // Select on the un-negated side, so that the NOT can go away.
+        if (s->op() == Op::kNot && s->operand(0) == not_s) {
+          std::swap(s, not_s);
+          std::swap(a, b);
+        }
+        XLS_RETURN_IF_ERROR(n->ReplaceUsesWithNew<xls::Select>(
+                                 s, std::vector<Node*>{b, a},
+                                 /*default_value=*/absl::nullopt)
+                                .status());
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Matches `n` = and(or(a, b), not(and(a, b))), i.e., XOR(a, b).
+  absl::StatusOr<bool> FuseProductOfSums(Node* n) {
+    for (int i = 0; i < 2; ++i) {
+      Node* sum = n->operand(i);
+      Node* negated = n->operand(1 - i);
+      if (!IsExclusive(sum, Op::kOr) || negated->op() != Op::kNot ||
+          negated->users().size() != 1) {
+        continue;
+      }
+      Node* product = negated->operand(0);
+      if (!IsExclusive(product, Op::kAnd) || !HaveSameOperands(sum, product)) {
+        continue;
+      }
+      XLS_RETURN_IF_ERROR(n->ReplaceUsesWithNew<xls::NaryOp>(
+                               std::vector<Node*>{sum->operand(0),
+                                                  sum->operand(1)},
+                               Op::kXor)
+                              .status());
+      return true;
+    }
+    return false;
+  }
+
+  // Replaces `n` with XNOR(x, y). TFHE's NOT needs no bootstrap, so this is
+  // NOT(XOR(x, y)), or just XOR when one side is itself a NOT to absorb.
+  absl::Status ReplaceWithXnor(Node* n, Node* x, Node* y) {
+    if (x->op() == Op::kNot && y->op() != Op::kNot) {
+      return n->ReplaceUsesWithNew<xls::NaryOp>(
+                  std::vector<Node*>{x->operand(0), y}, Op::kXor)
+          .status();
+    }
+    if (y->op() == Op::kNot && x->op() != Op::kNot) {
+      return n->ReplaceUsesWithNew<xls::NaryOp>(
+                  std::vector<Node*>{x, y->operand(0)}, Op::kXor)
+          .status();
+    }
+    XLS_ASSIGN_OR_RETURN(xls::NaryOp * xor_node,
+                         function_->MakeNode<xls::NaryOp>(
+                             n->loc(), std::vector<Node*>{x, y}, Op::kXor));
+    return n->ReplaceUsesWithNew<xls::UnOp>(xor_node, Op::kNot).status();
+  }
+
+  xls::Function* const function_;
+};
+
+}  // namespace
+
+absl::StatusOr<bool> FuseGates(xls::Function* function) {
+  return GateFuser(function).Run();
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
@@ -0,0 +1,46 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Recovers compound gates from booleanified XLS IR.
+//
+// The booleanifier expresses everything with 1-bit and, or and not, so an
+// XOR comes out as or(and(a, not(b)), and(not(a), b)): three bootstrapped
+// gates where TFHE has a single-bootstrap bootsXOR. Adders and comparators
+// are mostly XORs and selects, so folding the expansions back together cuts
+// their bootstrap count severalfold.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_GATE_FUSION_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_GATE_FUSION_H_
+
+#include "absl/status/statusor.h"
+#include "xls/ir/function.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+// Rewrites, in place:
+//   (a & b) | (~a & ~b)  ->  ~xor(a, b), or xor(a, c) if b is ~c
+//   (s & a) | (~s & b)   ->  sel(s, cases=[b, a])
+//   (a | b) & ~(a & b)   ->  xor(a, b)
+//   ~(a & b), ~(a | b)   ->  nand(a, b), nor(a, b)
+// where the replaced ANDs and ORs have no other users, so that no gate is
+// evaluated twice. Nodes left without users are then removed.
+//
+// Returns whether `function` changed.
+absl::StatusOr<bool> FuseGates(xls::Function* function);
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_GATE_FUSION_H_
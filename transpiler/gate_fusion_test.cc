@@ -0,0 +1,128 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/gate_fusion.h"
+
+#include "absl/strings/string_view.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "xls/common/status/matchers.h"
+#include "xls/ir/function.h"
+#include "xls/ir/ir_parser.h"
+#include "xls/ir/node.h"
+#include "xls/ir/op.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::testing::ElementsAre;
+using ::xls::status_testing::IsOkAndHolds;
+
+TEST(GateFusionTest, FusesXorExpansions) {
+  // The booleanifier's XOR, and the other common way to write it.
+  constexpr absl::string_view kXors = R"(
+package my_package
+
+fn my_package(x: bits[2]) -> bits[2] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  not.3: bits[1] = not(bit_slice.1, id=3)
+  not.4: bits[1] = not(bit_slice.2, id=4)
+  and.5: bits[1] = and(bit_slice.1, not.4, id=5)
+  and.6: bits[1] = and(not.3, bit_slice.2, id=6)
+  or.7: bits[1] = or(and.5, and.6, id=7)
+  or.8: bits[1] = or(bit_slice.1, bit_slice.2, id=8)
+  and.9: bits[1] = and(bit_slice.2, bit_slice.1, id=9)
+  not.10: bits[1] = not(and.9, id=10)
+  and.11: bits[1] = and(or.8, not.10, id=11)
+  ret concat.12: bits[2] = concat(or.7, and.11, id=12)
+}
+)";
+  XLS_ASSERT_OK_AND_ASSIGN(auto package, xls::Parser::ParsePackage(kXors));
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+  xls::Node* xor_expansion = function->return_value()->operand(0);
+  xls::Node* x0 = xor_expansion->operand(0)->operand(0);
+  xls::Node* x1 = xor_expansion->operand(1)->operand(1);
+
+  EXPECT_THAT(FuseGates(function), IsOkAndHolds(true));
+  xls::Node* first = function->return_value()->operand(0);
+  xls::Node* second = function->return_value()->operand(1);
+  EXPECT_EQ(first->op(), xls::Op::kXor);
+  EXPECT_THAT(first->operands(), ElementsAre(x0, x1));
+  EXPECT_EQ(second->op(), xls::Op::kXor);
+  EXPECT_THAT(second->operands(), ElementsAre(x0, x1));
+  // The param, both slices, both XORs and the concat.
+  EXPECT_EQ(function->node_count(), 6);
+}
+
+TEST(GateFusionTest, FusesSelect) {
+  constexpr absl::string_view kSelect = R"(
+package my_package
+
+fn my_package(x: bits[3]) -> bits[1] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(x, start=2, width=1, id=3)
+  not.4: bits[1] = not(bit_slice.3, id=4)
+  and.5: bits[1] = and(not.4, bit_slice.1, id=5)
+  and.6: bits[1] = and(bit_slice.2, bit_slice.3, id=6)
+  ret or.7: bits[1] = or(and.5, and.6, id=7)
+}
+)";
+  XLS_ASSERT_OK_AND_ASSIGN(auto package, xls::Parser::ParsePackage(kSelect));
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+  xls::Node* on_false = function->return_value()->operand(0)->operand(1);
+  xls::Node* on_true = function->return_value()->operand(1)->operand(0);
+  xls::Node* selector = function->return_value()->operand(1)->operand(1);
+
+  EXPECT_THAT(FuseGates(function), IsOkAndHolds(true));
+  xls::Node* select = function->return_value();
+  EXPECT_EQ(select->op(), xls::Op::kSel);
+  EXPECT_THAT(select->operands(), ElementsAre(selector, on_false, on_true));
+  EXPECT_EQ(function->node_count(), 5);
+}
+
+TEST(GateFusionTest, FusesNandAndNorOnlyWhenUnshared) {
+  constexpr absl::string_view kNegations = R"(
+package my_package
+
+fn my_package(x: bits[2]) -> bits[3] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  or.3: bits[1] = or(bit_slice.1, bit_slice.2, id=3)
+  not.4: bits[1] = not(or.3, id=4)
+  and.5: bits[1] = and(bit_slice.1, bit_slice.2, id=5)
+  not.6: bits[1] = not(and.5, id=6)
+  ret concat.7: bits[3] = concat(not.4, not.6, and.5, id=7)
+}
+)";
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kNegations));
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+
+  EXPECT_THAT(FuseGates(function), IsOkAndHolds(true));
+  EXPECT_EQ(function->return_value()->operand(0)->op(), xls::Op::kNor);
+  // and.5 is read by the concat too, so NAND would evaluate it twice.
+  EXPECT_EQ(function->return_value()->operand(1)->op(), xls::Op::kNot);
+  EXPECT_EQ(function->return_value()->operand(2)->op(), xls::Op::kAnd);
+
+  // Nothing is left to fuse.
+  EXPECT_THAT(FuseGates(function), IsOkAndHolds(false));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
@@ -24,7 +24,7 @@
 #include "absl/strings/str_format.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/substitute.h"
-#include "google/protobuf/text_format.h"
+#include "transpiler/tfhe_plan.h"
 #include "xls/common/status/status_macros.h"
 #include "xls/ir/function.h"
 #include "xls/ir/node.h"
@@ -39,35 +39,72 @@ absl::StatusOr<std::string> InterpretedTfheTranspiler::Translate(
     const xls::Function* function,
     const xlscc_metadata::MetadataOutput& metadata) {
   static constexpr absl::string_view kSourceTemplate =
-      R"(#include "absl/status/status.h"
+      R"(#include <memory>
+#include <utility>
+
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
 #include "tfhe/tfhe.h"
 #include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_plan.h"
 #include "transpiler/tfhe_runner.h"
+#include "transpiler/tfhe_session.h"
 #include "xls/common/status/status_macros.h"
 
 namespace {
 
-static constexpr char kXLSPackage[] = R"ir(
-$0
-)ir";
-
-static constexpr char kFunctionMetadata[] = R"pb(
-$1
-)pb";
+// The compiled circuit, as written by TfhePlan::Serialize(). The runner reads
+// it in place, so it must be 8-byte aligned.
+alignas(8) static constexpr char kPlan[] = "$0";
 
+using fully_homomorphic_encryption::transpiler::TfhePlan;
 using fully_homomorphic_encryption::transpiler::TfheRunner;
+using fully_homomorphic_encryption::transpiler::TfheSession;
+
+absl::StatusOr<std::unique_ptr<TfheRunner>> CreateRunner() {
+  XLS_ASSIGN_OR_RETURN(
+      TfhePlan plan,
+      TfhePlan::FromBuffer(absl::string_view(kPlan, sizeof(kPlan) - 1)));
+  return std::make_unique<TfheRunner>(std::move(plan));
+}
+
+// Loads the circuit and starts its worker threads on first use; every later
+// call (from any thread) reuses the same runner. It is intentionally leaked so
+// that no call can race with its destruction at exit.
+absl::StatusOr<TfheRunner*> GetRunner() {
+  static auto* const runner =
+      new absl::StatusOr<std::unique_ptr<TfheRunner>>(CreateRunner());
+  XLS_RETURN_IF_ERROR(runner->status());
+  return runner->value().get();
+}
+
+#ifdef TFHE_RUNNER_EAGER_INIT
+// Builds the runner while the binary loads, rather than on the first call.
+const bool kRunnerInitialized = GetRunner().ok();
+#endif
 
 }  // namespace
 
-$2 {
-  XLS_ASSIGN_OR_RETURN(auto runner, TfheRunner::CreateFromStrings(
-                                    kXLSPackage, kFunctionMetadata));
-  return runner->Run($3, {$4}, bk);
+$1 {
+  XLS_ASSIGN_OR_RETURN(TfheRunner * runner, GetRunner());
+  return runner->Run($2, {$3}, bk);
+}
+
+$4 {
+  XLS_ASSIGN_OR_RETURN(TfheRunner * runner, GetRunner());
+  return runner->Run($2, {$3}, public_args, bk);
+}
+
+$5 {
+  XLS_ASSIGN_OR_RETURN(TfheRunner * runner, GetRunner());
+  return TfheSession::Create(*runner, std::move(bound_args), bk);
 }
 )";
   XLS_ASSIGN_OR_RETURN(const std::string signature,
                        FunctionSignature(function, metadata));
+  XLS_ASSIGN_OR_RETURN(const std::string public_args_signature,
+                       PublicArgsFunctionSignature(function, metadata));
   std::string return_param = "nullptr";
   if (!metadata.top_func_proto().return_type().has_as_void()) {
     return_param = "result";
@@ -77,14 +114,13 @@ $2 {
     param_entries.push_back(absl::Substitute(R"({"$0", $0})", param->name()));
   }
 
-  // Serialize the metadata, removing the trailing null.
-  std::string metadata_text;
-  XLS_CHECK(
-      google::protobuf::TextFormat::PrintToString(metadata, &metadata_text));
+  // Compile the circuit now, so that the generated code need not parse IR.
+  XLS_ASSIGN_OR_RETURN(TfhePlan plan, TfhePlan::Compile(function, metadata));
 
-  return absl::Substitute(kSourceTemplate, function->package()->DumpIr(),
-                          metadata_text, signature, return_param,
-                          absl::StrJoin(param_entries, ", "));
+  return absl::Substitute(kSourceTemplate, absl::CHexEscape(plan.Serialize()),
+                          signature, return_param,
+                          absl::StrJoin(param_entries, ", "),
+                          public_args_signature, SessionSignature(function));
 }
 
 absl::StatusOr<std::string> InterpretedTfheTranspiler::TranslateHeader(
@@ -97,21 +133,63 @@ absl::StatusOr<std::string> InterpretedTfheTranspiler::TranslateHeader(
       R"(#ifndef $1
 #define $1
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "tfhe/tfhe.h"
 #include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_session.h"
 
 $0;
+
+$2;
+
+$3;
 #endif  // $1
 )";
   XLS_ASSIGN_OR_RETURN(std::string signature,
                        FunctionSignature(function, metadata));
-  return absl::Substitute(kHeaderTemplate, signature, header_guard);
+  XLS_ASSIGN_OR_RETURN(std::string public_args_signature,
+                       PublicArgsFunctionSignature(function, metadata));
+  return absl::Substitute(kHeaderTemplate, signature, header_guard,
+                          public_args_signature, SessionSignature(function));
 }
 
 absl::StatusOr<std::string> InterpretedTfheTranspiler::FunctionSignature(
     const xls::Function* function,
     const xlscc_metadata::MetadataOutput& metadata) {
+  return Signature(function, metadata, function->name(),
+                   /*with_public_args=*/false);
+}
+
+absl::StatusOr<std::string>
+InterpretedTfheTranspiler::PublicArgsFunctionSignature(
+    const xls::Function* function,
+    const xlscc_metadata::MetadataOutput& metadata) {
+  return Signature(function, metadata,
+                   absl::StrCat(function->name(), "_WithPublicArgs"),
+                   /*with_public_args=*/true);
+}
+
+std::string InterpretedTfheTranspiler::SessionSignature(
+    const xls::Function* function) {
+  return absl::Substitute(
+      "absl::StatusOr<std::unique_ptr<"
+      "fully_homomorphic_encryption::transpiler::TfheSession>>\n"
+      "$0_CreateSession(\n"
+      "  absl::flat_hash_map<std::string, LweSample*> bound_args,\n"
+      "  const TFheGateBootstrappingCloudKeySet* bk)",
+      function->name());
+}
+
+absl::StatusOr<std::string> InterpretedTfheTranspiler::Signature(
+    const xls::Function* function,
+    const xlscc_metadata::MetadataOutput& metadata,
+    absl::string_view function_name, bool with_public_args) {
   std::vector<std::string> param_signatures;
   if (!metadata.top_func_proto().return_type().has_as_void()) {
     param_signatures.push_back("LweSample* result");
@@ -119,13 +197,18 @@ absl::StatusOr<std::string> InterpretedTfheTranspiler::FunctionSignature(
   for (xls::Param* param : function->params()) {
     param_signatures.push_back(absl::StrCat("LweSample* ", param->name()));
   }
+  if (with_public_args) {
+    param_signatures.push_back(
+        "const absl::flat_hash_map<std::string, std::vector<bool>>& "
+        "public_args");
+  }
 
   constexpr absl::string_view key_param =
       "const TFheGateBootstrappingCloudKeySet* bk";
   if (param_signatures.empty()) {
-    return absl::Substitute("absl::Status $0($1)", function->name(), key_param);
+    return absl::Substitute("absl::Status $0($1)", function_name, key_param);
   } else {
-    return absl::Substitute("absl::Status $0($1,\n  $2)", function->name(),
+    return absl::Substitute("absl::Status $0($1,\n  $2)", function_name,
                             absl::StrJoin(param_signatures, ", "), key_param);
   }
 }
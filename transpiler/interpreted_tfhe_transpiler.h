@@ -34,6 +34,22 @@ class InterpretedTfheTranspiler {
  public:
   // Takes as input an XLS Function node and expected output and returns an FHE
   // C++ method that uses the gate ops from TFHE library.
+  //
+  // The circuit is compiled into a TfhePlan here and embedded in the generated
+  // file in serialized form, so loading it at run time involves no parsing.
+  // The generated method builds its TfheRunner on the first call and shares it
+  // across all later calls in the process. Compiling the generated file with
+  // TFHE_RUNNER_EAGER_INIT defined builds the runner during static
+  // initialization instead.
+  //
+  // A second method, suffixed _WithPublicArgs, additionally takes plaintext
+  // bits for any parameters the caller need not encrypt (the LweSample*
+  // arguments for those are ignored); see TfheRunner::Run(). It goes through
+  // the same shared runner, which keeps the circuits specialized for the
+  // most recently used public values, so repeated values are not folded in
+  // again. A third,
+  // suffixed _CreateSession, binds some parameters to ciphertexts the caller
+  // keeps across calls; see TfheSession.
   static absl::StatusOr<std::string> Translate(
       const xls::Function* function,
       const xlscc_metadata::MetadataOutput& metadata);
@@ -49,7 +65,20 @@ class InterpretedTfheTranspiler {
       const xls::Function* function,
       const xlscc_metadata::MetadataOutput& metadata);
 
+  // The signature of the _WithPublicArgs variant.
+  static absl::StatusOr<std::string> PublicArgsFunctionSignature(
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata);
+
+  // The signature of the _CreateSession function.
+  static std::string SessionSignature(const xls::Function* function);
+
  private:
+  static absl::StatusOr<std::string> Signature(
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata,
+      absl::string_view function_name, bool with_public_args);
+
   static absl::StatusOr<std::string> PathToHeaderGuard(
       absl::string_view header_path);
 };
@@ -0,0 +1,218 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/live_set_schedule.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "xls/common/logging/logging.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+// The most distinct operands a node can free, which bounds how far its live
+// set change can go below zero. Nodes with more operands are rare enough
+// (none of TFHE's gates have more than three) to lump in with these.
+constexpr int kMaxFreed = 3;
+
+// The graph's operand lists, deduplicated, with the number of times each
+// operand is read, and the readers of each node.
+struct Edges {
+  explicit Edges(const DataflowGraph& graph) {
+    const int32_t node_count = graph.node_count();
+    offsets.push_back(0);
+    std::vector<int32_t> user_counts(node_count, 0);
+    for (int32_t i = 0; i < node_count; ++i) {
+      for (int32_t k = graph.operand_offsets[i];
+           k < graph.operand_offsets[i + 1]; ++k) {
+        const int32_t operand = graph.operands[k];
+        auto begin = operands.begin() + offsets.back();
+        auto found = std::find_if(begin, operands.end(), [&](const auto& e) {
+          return e.first == operand;
+        });
+        if (found != operands.end()) {
+          ++found->second;
+        } else {
+          operands.push_back({operand, 1});
+          ++user_counts[operand];
+        }
+      }
+      offsets.push_back(operands.size());
+    }
+    user_offsets.assign(node_count + 1, 0);
+    for (int32_t i = 0; i < node_count; ++i) {
+      user_offsets[i + 1] = user_offsets[i] + user_counts[i];
+    }
+    users.resize(user_offsets.back());
+    std::vector<int32_t> next(user_offsets.begin(), user_offsets.end() - 1);
+    for (int32_t i = 0; i < node_count; ++i) {
+      for (const auto& [operand, reads] : operands_of(i)) {
+        users[next[operand]++] = i;
+      }
+    }
+  }
+
+  absl::Span<const std::pair<int32_t, int32_t>> operands_of(int32_t i) const {
+    return absl::MakeConstSpan(operands).subspan(offsets[i],
+                                                 offsets[i + 1] - offsets[i]);
+  }
+  absl::Span<const int32_t> users_of(int32_t i) const {
+    return absl::MakeConstSpan(users).subspan(
+        user_offsets[i], user_offsets[i + 1] - user_offsets[i]);
+  }
+
+  // Distinct operands, each with the number of times it is read.
+  std::vector<std::pair<int32_t, int32_t>> operands;
+  std::vector<int32_t> offsets;
+  std::vector<int32_t> users;
+  std::vector<int32_t> user_offsets;
+};
+
+// Per node: how many reads of it remain, counting each of a reader's reads.
+std::vector<int32_t> ReadCounts(const Edges& edges, int32_t node_count) {
+  std::vector<int32_t> remaining(node_count, 0);
+  for (const auto& [operand, reads] : edges.operands) {
+    remaining[operand] += reads;
+  }
+  return remaining;
+}
+
+}  // namespace
+
+int32_t DataflowGraph::AddNode(absl::Span<const int32_t> node_operands,
+                               bool node_allocates, bool node_kept) {
+  operands.insert(operands.end(), node_operands.begin(), node_operands.end());
+  operand_offsets.push_back(operands.size());
+  allocates.push_back(node_allocates);
+  kept.push_back(node_kept);
+  return node_count() - 1;
+}
+
+std::vector<int32_t> MinLiveOrder(const DataflowGraph& graph) {
+  const int32_t node_count = graph.node_count();
+  const Edges edges(graph);
+  std::vector<int32_t> remaining_reads = ReadCounts(edges, node_count);
+  std::vector<int32_t> pending_operands(node_count);
+  for (int32_t i = 0; i < node_count; ++i) {
+    pending_operands[i] = edges.operands_of(i).size();
+  }
+
+  // How evaluating ready node i would change the number of live values: one
+  // more for its own, one fewer for each operand it is the last reader of.
+  auto live_change = [&](int32_t i) {
+    int change = graph.allocates[i] ? 1 : 0;
+    for (const auto& [operand, reads] : edges.operands_of(i)) {
+      if (remaining_reads[operand] == reads && graph.allocates[operand] &&
+          !graph.kept[operand]) {
+        --change;
+      }
+    }
+    return std::max(change, -kMaxFreed);
+  };
+
+  // Ready nodes, in a stack per live set change (offset by kMaxFreed). A
+  // node's change only ever falls as its operands' other readers run, at
+  // which point it is pushed again; entries that no longer match the node's
+  // change, or whose node has been evaluated, are skipped.
+  std::array<std::vector<std::pair<int32_t, int>>, kMaxFreed + 2> ready;
+  std::vector<bool> done(node_count, false);
+  auto push = [&](int32_t i) {
+    const int change = live_change(i);
+    ready[change + kMaxFreed].push_back({i, change});
+  };
+  for (int32_t i = 0; i < node_count; ++i) {
+    if (pending_operands[i] == 0) {
+      push(i);
+    }
+  }
+
+  std::vector<int32_t> order;
+  order.reserve(node_count);
+  while (order.size() < node_count) {
+    int32_t next = -1;
+    for (auto& stack : ready) {
+      while (!stack.empty() && next < 0) {
+        const auto [i, change] = stack.back();
+        stack.pop_back();
+        if (!done[i] && live_change(i) == change) {
+          next = i;
+        }
+      }
+      if (next >= 0) break;
+    }
+    XLS_CHECK_GE(next, 0) << "Dataflow graph has a cycle";
+    done[next] = true;
+    order.push_back(next);
+
+    for (const auto& [operand, reads] : edges.operands_of(next)) {
+      remaining_reads[operand] -= reads;
+      // A reader left with every remaining read of this operand would now
+      // free it. A single reader reads a value at most a few times, so
+      // there is no need to look until then.
+      if (remaining_reads[operand] == 0 ||
+          remaining_reads[operand] > kMaxFreed) {
+        continue;
+      }
+      for (int32_t user : edges.users_of(operand)) {
+        if (!done[user] && pending_operands[user] == 0) {
+          push(user);
+        }
+      }
+    }
+    for (int32_t user : edges.users_of(next)) {
+      if (--pending_operands[user] == 0) {
+        push(user);
+      }
+    }
+  }
+  return order;
+}
+
+int64_t PeakLiveValues(const DataflowGraph& graph,
+                       absl::Span<const int32_t> order) {
+  const Edges edges(graph);
+  std::vector<int32_t> remaining_reads = ReadCounts(edges, graph.node_count());
+  int64_t live = 0;
+  int64_t peak = 0;
+  for (int32_t i : order) {
+    if (graph.allocates[i]) {
+      ++live;
+    }
+    peak = std::max(peak, live);
+    for (const auto& [operand, reads] : edges.operands_of(i)) {
+      remaining_reads[operand] -= reads;
+      if (remaining_reads[operand] == 0 && graph.allocates[operand] &&
+          !graph.kept[operand]) {
+        --live;
+      }
+    }
+    // Nothing reads it, so it is dead as soon as made.
+    if (graph.allocates[i] && !graph.kept[i] && remaining_reads[i] == 0 &&
+        edges.users_of(i).empty()) {
+      --live;
+    }
+  }
+  return peak;
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
@@ -0,0 +1,75 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Evaluation orders that keep few values live at once.
+//
+// How many ciphertexts a circuit holds at once depends on the order its gates
+// are evaluated in: level by level, every value of a wide level is live
+// together, while finishing off one value's readers before starting on
+// another's frees each as soon as possible. MinLiveOrder() orders a dataflow
+// graph greedily by register pressure, in the manner of list scheduling:
+// among the nodes whose operands are all evaluated, it picks one that frees
+// the most values, breaking ties in favor of the node made ready last, which
+// works through the graph depth first (much as Sethi-Ullman numbering does
+// for trees).
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_LIVE_SET_SCHEDULE_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_LIVE_SET_SCHEDULE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "absl/types/span.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+// A dataflow graph to order. Operands may repeat (e.g., an AND of a value
+// with itself), and need not precede their readers in node order.
+struct DataflowGraph {
+  // The operands of node i are
+  // operands[operand_offsets[i]] .. operands[operand_offsets[i + 1] - 1].
+  std::vector<int32_t> operand_offsets = {0};
+  std::vector<int32_t> operands;
+  // Per node: whether evaluating it makes a value of its own. Nodes that
+  // stand in for values held elsewhere (e.g., aliased parameter bits) don't.
+  std::vector<bool> allocates;
+  // Per node: whether its value must be kept until every node has been
+  // evaluated (e.g., to be copied to an output), rather than only until its
+  // last reader has.
+  std::vector<bool> kept;
+
+  int32_t node_count() const { return allocates.size(); }
+
+  // Adds a node reading `node_operands`, and returns its index.
+  int32_t AddNode(absl::Span<const int32_t> node_operands, bool allocates,
+                  bool kept);
+};
+
+// Returns an order in which to evaluate every node of `graph` (which must be
+// acyclic), operands first, that keeps few values live; see above.
+std::vector<int32_t> MinLiveOrder(const DataflowGraph& graph);
+
+// Returns the most values live at once when the nodes of `graph` are
+// evaluated one at a time in `order`. A value is live from when its node is
+// evaluated until its last reader has been (or, if kept, until the end),
+// and a node's value and its operands' are live together.
+int64_t PeakLiveValues(const DataflowGraph& graph,
+                       absl::Span<const int32_t> order);
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_LIVE_SET_SCHEDULE_H_
@@ -0,0 +1,101 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/live_set_schedule.h"
+
+#include <stdint.h>
+
+#include <numeric>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+// Returns whether `order` holds every node of `graph` once, each after its
+// operands.
+bool IsTopological(const DataflowGraph& graph,
+                   const std::vector<int32_t>& order) {
+  std::vector<int32_t> position(graph.node_count(), -1);
+  for (int32_t i = 0; i < order.size(); ++i) {
+    if (position[order[i]] != -1) return false;
+    position[order[i]] = i;
+  }
+  for (int32_t i = 0; i < graph.node_count(); ++i) {
+    if (position[i] == -1) return false;
+    for (int32_t k = graph.operand_offsets[i]; k < graph.operand_offsets[i + 1];
+         ++k) {
+      if (position[graph.operands[k]] >= position[i]) return false;
+    }
+  }
+  return true;
+}
+
+// A balanced binary tree reducing `leaves` values to one kept root, built
+// level by level, so that node order is level order.
+DataflowGraph Tree(int leaves) {
+  DataflowGraph graph;
+  std::vector<int32_t> level;
+  for (int i = 0; i < leaves; ++i) {
+    level.push_back(graph.AddNode({}, true, false));
+  }
+  while (level.size() > 1) {
+    std::vector<int32_t> next;
+    for (int i = 0; i < level.size(); i += 2) {
+      next.push_back(graph.AddNode({level[i], level[i + 1]}, true,
+                                   /*kept=*/level.size() == 2));
+    }
+    level = next;
+  }
+  return graph;
+}
+
+TEST(LiveSetScheduleTest, TreeIsEvaluatedDepthFirst) {
+  const DataflowGraph graph = Tree(64);
+  std::vector<int32_t> level_order(graph.node_count());
+  std::iota(level_order.begin(), level_order.end(), 0);
+  EXPECT_EQ(PeakLiveValues(graph, level_order), 65);
+
+  const std::vector<int32_t> order = MinLiveOrder(graph);
+  ASSERT_TRUE(IsTopological(graph, order));
+  // One pending value per level, plus the two being combined.
+  EXPECT_LE(PeakLiveValues(graph, order), 8);
+}
+
+TEST(LiveSetScheduleTest, HandlesRepeatedAndLaterOperands) {
+  DataflowGraph graph;
+  // Node 0 reads node 2, which is added after it, twice over.
+  graph.AddNode({2, 2}, true, true);
+  graph.AddNode({}, false, false);
+  graph.AddNode({1, 1}, true, false);
+  graph.AddNode({2, 1, 2}, true, true);
+
+  const std::vector<int32_t> order = MinLiveOrder(graph);
+  ASSERT_TRUE(IsTopological(graph, order));
+  // The alias never counts, and node 2 is freed once both its readers have
+  // run.
+  EXPECT_EQ(PeakLiveValues(graph, order), 3);
+}
+
+TEST(LiveSetScheduleTest, UnreadValuesAreFreedAtOnce) {
+  DataflowGraph graph;
+  for (int i = 0; i < 10; ++i) {
+    graph.AddNode({}, true, false);
+  }
+  EXPECT_EQ(PeakLiveValues(graph, MinLiveOrder(graph)), 1);
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
@@ -0,0 +1,308 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_checkpointing_runner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "xls/common/status/status_macros.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+// A checkpoint file is this, followed by the checkpoint format version, the
+// plan and argument fingerprints, the number of segments completed and the
+// number of frontier values, then each value's slot and ciphertext.
+constexpr char kMagic[8] = {'T', 'F', 'H', 'E', 'C', 'K', 'P', 'T'};
+constexpr int64_t kVersion = 1;
+
+// 64-bit FNV-1a, which is plenty to tell apart the circuits and arguments a
+// checkpoint might have been taken of; it is no defense against a checkpoint
+// crafted to match.
+constexpr uint64_t kFnvOffset = 14695981039346656037ULL;
+constexpr uint64_t kFnvPrime = 1099511628211ULL;
+
+uint64_t Fingerprint(absl::string_view data, uint64_t hash = kFnvOffset) {
+  for (unsigned char c : data) {
+    hash = (hash ^ c) * kFnvPrime;
+  }
+  return hash;
+}
+
+void WriteInt(std::ostream& out, int64_t value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+int64_t ReadInt(std::istream& in) {
+  int64_t value = 0;
+  in.read(reinterpret_cast<char*>(&value), sizeof(value));
+  return in ? value : 0;
+}
+
+// Writes `data` to `path` durably: to a temporary file, synced, then renamed
+// over `path`, so that a crash at any point leaves either the old file or
+// the new one.
+absl::Status WriteFileAtomically(const std::string& path,
+                                 absl::string_view data) {
+  const std::string temp_path = absl::StrCat(path, ".tmp");
+  const int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return absl::InternalError(absl::StrCat(
+        "Failed to create ", temp_path, ": ", strerror(errno)));
+  }
+  while (!data.empty()) {
+    const ssize_t written = write(fd, data.data(), data.size());
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      const int error = errno;
+      close(fd);
+      return absl::InternalError(absl::StrCat("Failed to write ", temp_path,
+                                              ": ", strerror(error)));
+    }
+    data.remove_prefix(written);
+  }
+  if (fsync(fd) != 0) {
+    const int error = errno;
+    close(fd);
+    return absl::InternalError(
+        absl::StrCat("Failed to sync ", temp_path, ": ", strerror(error)));
+  }
+  close(fd);
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    return absl::InternalError(absl::StrCat("Failed to rename ", temp_path,
+                                            " to ", path, ": ",
+                                            strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<CheckpointingTfheRunner>>
+CheckpointingTfheRunner::Create(TfhePlan plan, Options options) {
+  if (options.checkpoint_path.empty()) {
+    return absl::InvalidArgumentError("No checkpoint path.");
+  }
+  if (options.checkpoint_interval < absl::ZeroDuration()) {
+    return absl::InvalidArgumentError("Negative checkpoint interval.");
+  }
+  XLS_ASSIGN_OR_RETURN(PlanSegments segments,
+                       plan.Segment(options.segment_bootstraps));
+  return absl::WrapUnique(new CheckpointingTfheRunner(
+      plan, std::move(segments), std::move(options)));
+}
+
+CheckpointingTfheRunner::CheckpointingTfheRunner(const TfhePlan& plan,
+                                                 PlanSegments segments,
+                                                 Options options)
+    : options_(std::move(options)),
+      plan_fingerprint_(Fingerprint(plan.Serialize())),
+      param_names_(plan.param_names().begin(), plan.param_names().end()),
+      read_widths_(param_names_.size(), 0),
+      live_after_(std::move(segments.live_after)),
+      // At least one ciphertext, so that the frontier is never null.
+      frontier_size_(std::max(segments.frontier_size, 1)) {
+  for (const PlanNode& node : plan.nodes()) {
+    if (node.op == PlanOp::kParamBit) {
+      read_widths_[node.param] =
+          std::max(read_widths_[node.param], node.param_bit + 1);
+    }
+  }
+  for (TfhePlan& segment : segments.segments) {
+    segments_.push_back(
+        std::make_unique<TfheRunner>(std::move(segment), options_.runner));
+  }
+}
+
+CheckpointingTfheRunner::~CheckpointingTfheRunner() {
+  absl::MutexLock lock(&lock_);
+  if (frontier_ != nullptr) {
+    delete_gate_bootstrapping_ciphertext_array(frontier_size_, frontier_);
+  }
+}
+
+absl::Status CheckpointingTfheRunner::Run(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  return Run(result, std::move(args), bk, TfheRunner::RunOptions());
+}
+
+absl::Status CheckpointingTfheRunner::Run(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk,
+    const TfheRunner::RunOptions& run_options) {
+  // Checked here, rather than left to the segments, since the arguments are
+  // fingerprinted first.
+  if (args.size() != param_names_.size()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Expected ", param_names_.size(), " arguments, got ",
+                     args.size()));
+  }
+  for (int32_t i = 0; i < param_names_.size(); ++i) {
+    auto found = args.find(param_names_[i]);
+    if (found == args.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Missing argument: ", param_names_[i]));
+    }
+    if (found->second == nullptr && read_widths_[i] > 0) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Null argument: ", param_names_[i]));
+    }
+  }
+
+  absl::MutexLock lock(&lock_);
+  stats_ = CallStats();
+  stats_.segment_count = segments_.size();
+  AllocateFrontier(bk->params);
+  const uint64_t args_fingerprint = ArgsFingerprint(args, bk->params);
+  const int32_t resumed = LoadCheckpoint(args_fingerprint, bk->params);
+  stats_.resumed_segments = resumed;
+
+  args[TfhePlan::kExtraParam] = frontier_;
+  absl::Time last_checkpoint = absl::Now();
+  for (int32_t s = resumed; s < segments_.size(); ++s) {
+    const bool last = s + 1 == segments_.size();
+    XLS_RETURN_IF_ERROR(
+        segments_[s]->Run(last ? result : nullptr, args, bk, run_options));
+    if (!last &&
+        absl::Now() - last_checkpoint >= options_.checkpoint_interval) {
+      XLS_RETURN_IF_ERROR(WriteCheckpoint(args_fingerprint, s + 1, bk->params));
+      ++stats_.checkpoints_written;
+      last_checkpoint = absl::Now();
+    }
+  }
+  if (unlink(options_.checkpoint_path.c_str()) != 0 && errno != ENOENT) {
+    return absl::InternalError(absl::StrCat("Failed to remove ",
+                                            options_.checkpoint_path, ": ",
+                                            strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+CheckpointingTfheRunner::CallStats CheckpointingTfheRunner::last_call_stats()
+    const {
+  absl::MutexLock lock(&lock_);
+  return stats_;
+}
+
+uint64_t CheckpointingTfheRunner::ArgsFingerprint(
+    const absl::flat_hash_map<std::string, LweSample*>& args,
+    const TFheGateBootstrappingParameterSet* params) const {
+  uint64_t hash = kFnvOffset;
+  for (int32_t i = 0; i < param_names_.size(); ++i) {
+    std::ostringstream bits;
+    LweSample* arg = args.at(param_names_[i]);
+    for (int32_t bit = 0; bit < read_widths_[i]; ++bit) {
+      export_gate_bootstrapping_ciphertext_toStream(bits, &arg[bit], params);
+    }
+    hash = Fingerprint(bits.str(), hash);
+  }
+  return hash;
+}
+
+int32_t CheckpointingTfheRunner::LoadCheckpoint(
+    uint64_t args_fingerprint,
+    const TFheGateBootstrappingParameterSet* params) {
+  std::ifstream file(options_.checkpoint_path, std::ios::binary);
+  if (!file) {
+    return 0;
+  }
+  char magic[sizeof(kMagic)];
+  file.read(magic, sizeof(magic));
+  if (!file || !std::equal(magic, magic + sizeof(magic), kMagic) ||
+      ReadInt(file) != kVersion ||
+      static_cast<uint64_t>(ReadInt(file)) != plan_fingerprint_ ||
+      static_cast<uint64_t>(ReadInt(file)) != args_fingerprint) {
+    return 0;
+  }
+  const int64_t completed = ReadInt(file);
+  const int64_t value_count = ReadInt(file);
+  if (!file || completed <= 0 || completed >= segments_.size() ||
+      value_count != live_after_[completed - 1].size()) {
+    return 0;
+  }
+  for (int64_t i = 0; i < value_count; ++i) {
+    const int64_t slot = ReadInt(file);
+    if (!file || slot < 0 || slot >= frontier_size_) {
+      return 0;
+    }
+    import_gate_bootstrapping_ciphertext_fromStream(file, &frontier_[slot],
+                                                    params);
+  }
+  // A truncated file, which the atomic rename should rule out, leaves some
+  // of the frontier unread.
+  return file ? completed : 0;
+}
+
+absl::Status CheckpointingTfheRunner::WriteCheckpoint(
+    uint64_t args_fingerprint, int32_t completed,
+    const TFheGateBootstrappingParameterSet* params) {
+  const std::vector<int32_t>& live = live_after_[completed - 1];
+  std::ostringstream out;
+  out.write(kMagic, sizeof(kMagic));
+  WriteInt(out, kVersion);
+  WriteInt(out, plan_fingerprint_);
+  WriteInt(out, args_fingerprint);
+  WriteInt(out, completed);
+  WriteInt(out, live.size());
+  for (int32_t slot : live) {
+    WriteInt(out, slot);
+    export_gate_bootstrapping_ciphertext_toStream(out, &frontier_[slot],
+                                                  params);
+  }
+  return WriteFileAtomically(options_.checkpoint_path, out.str());
+}
+
+void CheckpointingTfheRunner::AllocateFrontier(
+    const TFheGateBootstrappingParameterSet* params) {
+  if (frontier_ != nullptr && frontier_params_ == params) {
+    return;
+  }
+  if (frontier_ != nullptr) {
+    delete_gate_bootstrapping_ciphertext_array(frontier_size_, frontier_);
+  }
+  frontier_ = new_gate_bootstrapping_ciphertext_array(frontier_size_, params);
+  frontier_params_ = params;
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
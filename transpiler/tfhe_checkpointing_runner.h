@@ -0,0 +1,160 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checkpointed evaluation, for circuits that take hours to evaluate on
+// machines that may go away partway through (e.g., preemptible ones).
+//
+// The circuit is evaluated in segments of consecutive levels (see
+// TfhePlan::Segment()). Between segments, once the configured interval has
+// passed since the last checkpoint, the evaluation frontier - which segments
+// are done, and the ciphertexts later segments still read - is written to a
+// file. A call that finds a checkpoint of the same circuit and arguments
+// there picks up after its last segment, so a restarted process loses at
+// most an interval's work.
+//
+// Usage:
+//
+// CheckpointingTfheRunner::Options options;
+// options.checkpoint_path = "/local/ssd/my_circuit.checkpoint";
+// XLS_ASSIGN_OR_RETURN(auto runner, CheckpointingTfheRunner::Create(
+//                                       std::move(plan), options));
+// XLS_RETURN_IF_ERROR(runner->Run(result, {{"x", x}}, bk));
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CHECKPOINTING_RUNNER_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CHECKPOINTING_RUNNER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+class CheckpointingTfheRunner {
+ public:
+  struct Options {
+    // Where checkpoints are written, and looked for when a call starts. A
+    // checkpoint is written to a temporary file next to it, then renamed
+    // over it, so the file always holds a complete checkpoint.
+    std::string checkpoint_path;
+
+    // The least time between checkpoints, which bounds the share of a call
+    // spent writing them.
+    absl::Duration checkpoint_interval = absl::Minutes(10);
+
+    // How finely the circuit is cut up, and so how closely checkpoints can
+    // follow the interval: segments take at least this many bootstraps.
+    // Every segment ends with the workers idling while its last gates
+    // finish, so this should be well above the number of workers.
+    int64_t segment_bootstraps = 4096;
+
+    TfheRunner::Options runner;
+  };
+
+  // What the last call did.
+  struct CallStats {
+    int32_t segment_count = 0;
+    // The segments skipped by resuming from a checkpoint.
+    int32_t resumed_segments = 0;
+    int32_t checkpoints_written = 0;
+  };
+
+  static absl::StatusOr<std::unique_ptr<CheckpointingTfheRunner>> Create(
+      TfhePlan plan, Options options);
+  ~CheckpointingTfheRunner();
+
+  CheckpointingTfheRunner(const CheckpointingTfheRunner&) = delete;
+  CheckpointingTfheRunner& operator=(const CheckpointingTfheRunner&) = delete;
+
+  // Evaluates the circuit, as TfheRunner::Run() does, checkpointing as it
+  // goes. If the checkpoint file holds a checkpoint of this circuit with the
+  // same arguments, the call resumes from it, and `bk` must be a cloud key
+  // for the same secret key as the interrupted call's. A checkpoint of
+  // anything else (or an unreadable one) is ignored, and replaced by this
+  // call's first.
+  //
+  // The checkpoint is removed once the outputs are written. A call that
+  // fails, including one abandoned by `run_options`, leaves its last
+  // checkpoint behind for the next. Calls are serialized.
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk);
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk,
+                   const TfheRunner::RunOptions& run_options);
+
+  CallStats last_call_stats() const;
+
+ private:
+  CheckpointingTfheRunner(const TfhePlan& plan, PlanSegments segments,
+                          Options options);
+
+  // A fingerprint of the argument bits the circuit reads, which a checkpoint
+  // must match to be resumed from.
+  uint64_t ArgsFingerprint(
+      const absl::flat_hash_map<std::string, LweSample*>& args,
+      const TFheGateBootstrappingParameterSet* params) const;
+
+  // Loads the checkpoint file into frontier_ if it is one of this circuit
+  // with arguments matching `args_fingerprint`, returning the number of
+  // segments it covers; otherwise returns 0.
+  int32_t LoadCheckpoint(uint64_t args_fingerprint,
+                         const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Writes the frontier as of the end of segment `completed - 1`.
+  absl::Status WriteCheckpoint(uint64_t args_fingerprint, int32_t completed,
+                               const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Makes sure frontier_ holds ciphertexts for `params`.
+  void AllocateFrontier(const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  const Options options_;
+  // Of the serialized plan.
+  const uint64_t plan_fingerprint_;
+  std::vector<std::string> param_names_;
+  // Per parameter: how many of its leading bits the circuit reads.
+  std::vector<int32_t> read_widths_;
+  std::vector<std::unique_ptr<TfheRunner>> segments_;
+  std::vector<std::vector<int32_t>> live_after_;
+  const int32_t frontier_size_;
+
+  mutable absl::Mutex lock_;
+  LweSample* frontier_ ABSL_GUARDED_BY(lock_) = nullptr;
+  const TFheGateBootstrappingParameterSet* frontier_params_
+      ABSL_GUARDED_BY(lock_) = nullptr;
+  CallStats stats_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CHECKPOINTING_RUNNER_H_
@@ -0,0 +1,144 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_checkpointing_runner.h"
+
+#include <array>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "transpiler/data/fhe_data.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "transpiler/tfhe_test_util.h"
+#include "transpiler/util/temp_file.h"
+#include "xls/common/status/matchers.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::xls::status_testing::StatusIs;
+
+constexpr int kMainMinimumLambda = 120;
+
+TEST(CheckpointingTfheRunnerTest, ResumesFromCheckpoint) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(RippleCarryAdderIr(16)));
+  XLS_ASSERT_OK_AND_ASSIGN(TempFile file, TempFile::Create());
+
+  // Beside the temporary file rather than it, since the runner removes it.
+  const std::string path = absl::StrCat(file.path().string(), ".checkpoint");
+  CheckpointingTfheRunner::Options options;
+  options.checkpoint_path = path;
+  options.checkpoint_interval = absl::ZeroDuration();
+  options.segment_bootstraps = 1;
+
+  auto x = FheValue<int16_t>::Encrypt(12345, key);
+  auto y = FheValue<int16_t>::Encrypt(4321, key);
+  FheValue<int16_t> result(key.params());
+
+  // Interrupt a call once it has written its first checkpoint, as though its
+  // machine had gone away.
+  {
+    XLS_ASSERT_OK_AND_ASSIGN(auto runner,
+                             CheckpointingTfheRunner::Create(plan, options));
+    CancellationToken cancellation;
+    std::thread interrupter([&]() {
+      while (!std::filesystem::exists(path)) {
+        absl::SleepFor(absl::Microseconds(100));
+      }
+      cancellation.Cancel();
+    });
+    TfheRunner::RunOptions run_options;
+    run_options.cancellation = &cancellation;
+    EXPECT_THAT(runner->Run(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                            key.cloud(), run_options),
+                StatusIs(absl::StatusCode::kCancelled));
+    interrupter.join();
+    EXPECT_GT(runner->last_call_stats().checkpoints_written, 0);
+  }
+  ASSERT_TRUE(std::filesystem::exists(path));
+
+  // A new runner picks up where it left off, and cleans up once done.
+  XLS_ASSERT_OK_AND_ASSIGN(auto runner,
+                           CheckpointingTfheRunner::Create(plan, options));
+  XLS_ASSERT_OK(runner->Run(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                            key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 12345 + 4321);
+  CheckpointingTfheRunner::CallStats stats = runner->last_call_stats();
+  EXPECT_GT(stats.segment_count, 1);
+  EXPECT_GT(stats.resumed_segments, 0);
+  EXPECT_LT(stats.resumed_segments, stats.segment_count);
+  EXPECT_FALSE(std::filesystem::exists(path));
+}
+
+TEST(CheckpointingTfheRunnerTest, IgnoresCheckpointOfOtherArguments) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(RippleCarryAdderIr(16)));
+  XLS_ASSERT_OK_AND_ASSIGN(TempFile file, TempFile::Create());
+
+  // Beside the temporary file rather than it, since the runner removes it.
+  const std::string path = absl::StrCat(file.path().string(), ".checkpoint");
+  CheckpointingTfheRunner::Options options;
+  options.checkpoint_path = path;
+  options.checkpoint_interval = absl::ZeroDuration();
+  options.segment_bootstraps = 1;
+  XLS_ASSERT_OK_AND_ASSIGN(auto runner,
+                           CheckpointingTfheRunner::Create(plan, options));
+
+  // A call that fails partway, leaving a checkpoint of its arguments.
+  auto x = FheValue<int16_t>::Encrypt(100, key);
+  auto y = FheValue<int16_t>::Encrypt(200, key);
+  FheValue<int16_t> result(key.params());
+  CancellationToken cancellation;
+  std::thread interrupter([&]() {
+    while (!std::filesystem::exists(path)) {
+      absl::SleepFor(absl::Microseconds(100));
+    }
+    cancellation.Cancel();
+  });
+  TfheRunner::RunOptions run_options;
+  run_options.cancellation = &cancellation;
+  EXPECT_THAT(runner->Run(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                          key.cloud(), run_options),
+              StatusIs(absl::StatusCode::kCancelled));
+  interrupter.join();
+
+  // Different arguments start over.
+  auto z = FheValue<int16_t>::Encrypt(300, key);
+  XLS_ASSERT_OK(runner->Run(result.get(), {{"x", x.get()}, {"y", z.get()}},
+                            key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 400);
+  EXPECT_EQ(runner->last_call_stats().resumed_segments, 0);
+
+  EXPECT_THAT(runner->Run(result.get(), {{"x", x.get()}}, key.cloud()),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  options.segment_bootstraps = 0;
+  EXPECT_THAT(CheckpointingTfheRunner::Create(plan, options).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
@@ -0,0 +1,203 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_ciphertext_pool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "tfhe/tfhe.h"
+#include "xls/common/logging/logging.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+constexpr size_t kHugePageBytes = 2 << 20;
+
+// Maps `bytes` (a multiple of kHugePageBytes) of anonymous memory, preferably
+// backed by huge pages. Returns nullptr on failure.
+void* MapHugePages(size_t bytes) {
+  void* arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  arena = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (arena != MAP_FAILED) {
+    return arena;
+  }
+#endif
+  // No reserved huge pages; ask for transparent ones instead.
+  arena = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED) {
+    return nullptr;
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(arena, bytes, MADV_HUGEPAGE);
+#endif
+  return arena;
+}
+
+}  // namespace
+
+LweSample* NewCiphertextArrayBackedBy(
+    int count, const TFheGateBootstrappingParameterSet* params, void* masks) {
+  const int32_t dimension = params->in_out_params->n;
+  LweSample* samples = new_gate_bootstrapping_ciphertext_array(count, params);
+  // Swap each sample's heap-allocated mask for a slice of `masks`.
+  Torus32* slices = static_cast<Torus32*>(masks);
+  for (int i = 0; i < count; ++i) {
+    delete[] samples[i].a;
+    samples[i].a = slices + i * dimension;
+  }
+  return samples;
+}
+
+void DeleteCiphertextArrayBackedBy(int count, LweSample* samples) {
+  // The masks aren't TFHE's to free.
+  for (int i = 0; i < count; ++i) {
+    samples[i].a = nullptr;
+  }
+  delete_gate_bootstrapping_ciphertext_array(count, samples);
+}
+
+CiphertextPool::CiphertextPool() : CiphertextPool(Options()) {}
+
+CiphertextPool::CiphertextPool(Options options) : options_(options) {
+  XLS_CHECK_GT(options_.slab_size, 0);
+}
+
+CiphertextPool::~CiphertextPool() {
+  absl::MutexLock lock(&lock_);
+  XLS_CHECK_EQ(static_cast<int64_t>(free_.size()), capacity_)
+      << "CiphertextPool destroyed with ciphertexts still in use";
+  FreeSlabs();
+}
+
+LweSample* CiphertextPool::Allocate(
+    const TFheGateBootstrappingParameterSet* params) {
+  absl::MutexLock lock(&lock_);
+  const int32_t dimension = params->in_out_params->n;
+  if (dimension != dimension_) {
+    XLS_CHECK(reservations_ == 0 &&
+              static_cast<int64_t>(free_.size()) == capacity_)
+        << "CiphertextPool mixes LWE dimensions " << dimension_ << " and "
+        << dimension;
+    FreeSlabs();
+    dimension_ = dimension;
+  }
+  if (free_.empty()) {
+    AddSlab(params);
+  }
+  LweSample* sample = free_.back();
+  free_.pop_back();
+  peak_in_use_ = std::max<int64_t>(peak_in_use_, capacity_ - free_.size());
+  return sample;
+}
+
+absl::Status CiphertextPool::Reserve(
+    const TFheGateBootstrappingParameterSet* params) {
+  absl::MutexLock lock(&lock_);
+  const int32_t dimension = params->in_out_params->n;
+  if (dimension != dimension_) {
+    if (reservations_ > 0 ||
+        static_cast<int64_t>(free_.size()) != capacity_) {
+      return absl::FailedPreconditionError(absl::StrCat(
+          "Ciphertext pool is in use for LWE dimension ", dimension_,
+          "; cannot also allocate for dimension ", dimension));
+    }
+    FreeSlabs();
+    dimension_ = dimension;
+  }
+  ++reservations_;
+  return absl::OkStatus();
+}
+
+void CiphertextPool::Unreserve() {
+  absl::MutexLock lock(&lock_);
+  XLS_CHECK_GT(reservations_, 0);
+  --reservations_;
+}
+
+void CiphertextPool::Release(LweSample* sample) {
+  absl::MutexLock lock(&lock_);
+  free_.push_back(sample);
+}
+
+int64_t CiphertextPool::capacity() const {
+  absl::MutexLock lock(&lock_);
+  return capacity_;
+}
+
+int64_t CiphertextPool::in_use() const {
+  absl::MutexLock lock(&lock_);
+  return capacity_ - free_.size();
+}
+
+int64_t CiphertextPool::peak_in_use() const {
+  absl::MutexLock lock(&lock_);
+  return peak_in_use_;
+}
+
+void CiphertextPool::AddSlab(const TFheGateBootstrappingParameterSet* params) {
+  const size_t mask_bytes = dimension_ * sizeof(Torus32);
+  Slab slab = {nullptr, options_.slab_size, nullptr, 0};
+  if (options_.huge_pages) {
+    slab.size = std::max<int>(slab.size, kHugePageBytes / mask_bytes);
+    slab.arena_bytes = (slab.size * mask_bytes + kHugePageBytes - 1) /
+                       kHugePageBytes * kHugePageBytes;
+    slab.arena = MapHugePages(slab.arena_bytes);
+    if (slab.arena == nullptr) {
+      XLS_LOG(WARNING) << "Could not map " << slab.arena_bytes
+                       << " bytes for ciphertexts; using the default heap.";
+      slab.arena_bytes = 0;
+    }
+  }
+
+  slab.samples =
+      slab.arena != nullptr
+          ? NewCiphertextArrayBackedBy(slab.size, params, slab.arena)
+          : new_gate_bootstrapping_ciphertext_array(slab.size, params);
+
+  slabs_.push_back(slab);
+  capacity_ += slab.size;
+  // Hand out the front of the slab first.
+  for (int i = slab.size - 1; i >= 0; --i) {
+    free_.push_back(&slab.samples[i]);
+  }
+}
+
+void CiphertextPool::FreeSlabs() {
+  for (Slab& slab : slabs_) {
+    if (slab.arena != nullptr) {
+      DeleteCiphertextArrayBackedBy(slab.size, slab.samples);
+      munmap(slab.arena, slab.arena_bytes);
+    } else {
+      delete_gate_bootstrapping_ciphertext_array(slab.size, slab.samples);
+    }
+  }
+  slabs_.clear();
+  free_.clear();
+  capacity_ = 0;
+  peak_in_use_ = 0;
+  dimension_ = -1;
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
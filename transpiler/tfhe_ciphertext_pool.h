@@ -0,0 +1,126 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A recycling allocator for the intermediate ciphertexts of TfheRunner.
+//
+// Ciphertexts are carved out of slabs allocated with
+// new_gate_bootstrapping_ciphertext_array(), and released ciphertexts are
+// handed out again (most recently released first, while still in cache)
+// rather than freed. Slabs are only returned to the system when the pool is
+// destroyed, so the pool's footprint tracks the peak number of live
+// ciphertexts, not the total number ever allocated.
+//
+// Optionally, the pool can back the mask vectors (LweSample::a, which hold
+// nearly all of a ciphertext's bytes) of each slab with huge pages, cutting
+// TLB misses when the live set is large. Huge pages are requested with
+// MAP_HUGETLB, falling back to transparent huge pages when none are reserved.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CIPHERTEXT_POOL_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CIPHERTEXT_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "tfhe/tfhe.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+// Like new_gate_bootstrapping_ciphertext_array(), but the masks of the
+// ciphertexts are consecutive slices of `masks` (which must hold `count`
+// masks of the LWE dimension of `params`) rather than heap-allocated.
+LweSample* NewCiphertextArrayBackedBy(
+    int count, const TFheGateBootstrappingParameterSet* params, void* masks);
+
+// Frees `samples`, from NewCiphertextArrayBackedBy(), leaving their masks'
+// storage to the caller.
+void DeleteCiphertextArrayBackedBy(int count, LweSample* samples);
+
+class CiphertextPool {
+ public:
+  struct Options {
+    // Number of ciphertexts allocated at a time. With huge pages, slabs are
+    // enlarged to fill at least one page.
+    int slab_size = 256;
+    bool huge_pages = false;
+  };
+
+  CiphertextPool();
+  explicit CiphertextPool(Options options);
+  ~CiphertextPool();
+
+  CiphertextPool(const CiphertextPool&) = delete;
+  CiphertextPool& operator=(const CiphertextPool&) = delete;
+
+  // Returns an uninitialized ciphertext for `params`. Thread-safe.
+  //
+  // All ciphertexts in use at once must share an LWE dimension; if a call
+  // asks for a different one while the pool is idle, the existing slabs are
+  // freed and the pool starts over. Callers that may race with others using
+  // a different dimension should hold a reservation (see Reserve()) while
+  // they allocate.
+  LweSample* Allocate(const TFheGateBootstrappingParameterSet* params);
+
+  // Pins the pool to the LWE dimension of `params` until the matching
+  // Unreserve(), so that every Allocate() for `params` in between succeeds.
+  // Fails with FailedPreconditionError if ciphertexts of another dimension
+  // are in use or reserved. Thread-safe.
+  absl::Status Reserve(const TFheGateBootstrappingParameterSet* params);
+  void Unreserve();
+
+  // Returns `sample`, which must have come from Allocate(), to the pool.
+  // Thread-safe.
+  void Release(LweSample* sample);
+
+  // The number of ciphertexts the pool holds (free or not), the number
+  // currently handed out, and the most ever handed out at once.
+  int64_t capacity() const;
+  int64_t in_use() const;
+  int64_t peak_in_use() const;
+
+ private:
+  struct Slab {
+    LweSample* samples;
+    int size;
+    // The huge-page mapping holding the samples' mask vectors, if any.
+    void* arena;
+    size_t arena_bytes;
+  };
+
+  void AddSlab(const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void FreeSlabs() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  const Options options_;
+
+  mutable absl::Mutex lock_;
+  // The LWE dimension of every ciphertext in the pool, or -1 when empty.
+  int32_t dimension_ ABSL_GUARDED_BY(lock_) = -1;
+  // Outstanding Reserve() calls, all for `dimension_`.
+  int64_t reservations_ ABSL_GUARDED_BY(lock_) = 0;
+  std::vector<Slab> slabs_ ABSL_GUARDED_BY(lock_);
+  std::vector<LweSample*> free_ ABSL_GUARDED_BY(lock_);
+  int64_t capacity_ ABSL_GUARDED_BY(lock_) = 0;
+  int64_t peak_in_use_ ABSL_GUARDED_BY(lock_) = 0;
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CIPHERTEXT_POOL_H_
@@ -0,0 +1,118 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_ciphertext_pool.h"
+
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gtest/gtest.h"
+#include "tfhe/tfhe.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+constexpr int kMainMinimumLambda = 120;
+
+class CiphertextPoolTest : public ::testing::Test {
+ protected:
+  CiphertextPoolTest()
+      : params_(new_default_gate_bootstrapping_parameters(kMainMinimumLambda)) {
+  }
+  ~CiphertextPoolTest() override {
+    delete_gate_bootstrapping_parameters(params_);
+  }
+
+  TFheGateBootstrappingParameterSet* params_;
+};
+
+TEST_F(CiphertextPoolTest, ReusesReleasedCiphertexts) {
+  CiphertextPool::Options options;
+  options.slab_size = 4;
+  CiphertextPool pool(options);
+
+  LweSample* first = pool.Allocate(params_);
+  EXPECT_EQ(pool.capacity(), 4);
+  pool.Release(first);
+  EXPECT_EQ(pool.Allocate(params_), first);
+  EXPECT_EQ(pool.in_use(), 1);
+  pool.Release(first);
+}
+
+TEST_F(CiphertextPoolTest, GrowsBySlab) {
+  CiphertextPool::Options options;
+  options.slab_size = 4;
+  CiphertextPool pool(options);
+
+  std::vector<LweSample*> samples;
+  for (int i = 0; i < 5; ++i) {
+    samples.push_back(pool.Allocate(params_));
+  }
+  EXPECT_EQ(pool.capacity(), 8);
+  EXPECT_EQ(pool.in_use(), 5);
+  for (LweSample* sample : samples) {
+    pool.Release(sample);
+  }
+  EXPECT_EQ(pool.in_use(), 0);
+  EXPECT_EQ(pool.peak_in_use(), 5);
+}
+
+TEST_F(CiphertextPoolTest, HugePageMasksAreUsable) {
+  CiphertextPool::Options options;
+  options.huge_pages = true;
+  CiphertextPool pool(options);
+
+  const int n = params_->in_out_params->n;
+  LweSample* a = pool.Allocate(params_);
+  LweSample* b = pool.Allocate(params_);
+  for (int i = 0; i < n; ++i) {
+    a->a[i] = i;
+    b->a[i] = -i;
+  }
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ(a->a[i], i);
+    EXPECT_EQ(b->a[i], -i);
+  }
+  // A slab fills at least a whole huge page.
+  EXPECT_GE(pool.capacity() * n * sizeof(Torus32), 2 << 20);
+  pool.Release(a);
+  pool.Release(b);
+}
+
+TEST_F(CiphertextPoolTest, ReservationRejectsOtherDimensions) {
+  CiphertextPool pool;
+  const LweParams wider_lwe{2 * params_->in_out_params->n,
+                            params_->in_out_params->alpha_min,
+                            params_->in_out_params->alpha_max};
+  const TFheGateBootstrappingParameterSet wider{
+      params_->ks_t, params_->ks_basebit, &wider_lwe, params_->tgsw_params};
+
+  ASSERT_TRUE(pool.Reserve(params_).ok());
+  LweSample* sample = pool.Allocate(params_);
+  EXPECT_EQ(pool.Reserve(&wider).code(),
+            absl::StatusCode::kFailedPrecondition);
+  pool.Release(sample);
+  // Still reserved, though idle.
+  EXPECT_EQ(pool.Reserve(&wider).code(),
+            absl::StatusCode::kFailedPrecondition);
+  pool.Unreserve();
+
+  // Once nothing holds the old dimension, the pool starts over.
+  ASSERT_TRUE(pool.Reserve(&wider).ok());
+  pool.Release(pool.Allocate(&wider));
+  pool.Unreserve();
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
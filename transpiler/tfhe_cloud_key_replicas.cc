@@ -0,0 +1,82 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_cloud_key_replicas.h"
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_numa.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+void DeleteDeserializedCloudKey(TFheGateBootstrappingCloudKeySet* key) {
+  auto* params = const_cast<TFheGateBootstrappingParameterSet*>(key->params);
+  delete_gate_bootstrapping_cloud_keyset(key);
+  delete_gate_bootstrapping_parameters(params);
+}
+
+absl::StatusOr<std::unique_ptr<CloudKeyReplicas>> CloudKeyReplicas::Create(
+    const TFheGateBootstrappingCloudKeySet* key,
+    absl::Span<const NumaNode> nodes) {
+  std::ostringstream out;
+  export_tfheGateBootstrappingCloudKeySet_toStream(out, key);
+  const std::string serialized = out.str();
+
+  auto replicas = absl::WrapUnique(new CloudKeyReplicas(key));
+  replicas->replicas_.assign(nodes.size(), nullptr);
+  std::vector<absl::Status> statuses(nodes.size());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nodes.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      statuses[i] = PinCurrentThread(nodes[i].cpus);
+      if (!statuses[i].ok()) {
+        return;
+      }
+      std::istringstream in(serialized);
+      replicas->replicas_[i] =
+          new_tfheGateBootstrappingCloudKeySet_fromStream(in);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (const absl::Status& status : statuses) {
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return replicas;
+}
+
+CloudKeyReplicas::~CloudKeyReplicas() {
+  for (TFheGateBootstrappingCloudKeySet* replica : replicas_) {
+    if (replica != nullptr) {
+      DeleteDeserializedCloudKey(replica);
+    }
+  }
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
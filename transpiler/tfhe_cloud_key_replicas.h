@@ -0,0 +1,82 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per-NUMA-node copies of a TFHE cloud key.
+//
+// Every bootstrap streams the whole FFT-domain bootstrapping key, so on a
+// multi-socket machine workers should read a copy held in their own node's
+// memory rather than the one the key happened to be loaded into.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CLOUD_KEY_REPLICAS_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CLOUD_KEY_REPLICAS_H_
+
+#include <memory>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "transpiler/tfhe_numa.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+// Deletes `key`, which new_tfheGateBootstrappingCloudKeySet_fromStream()
+// returned, together with the parameter set it owns:
+// delete_gate_bootstrapping_cloud_keyset() alone leaves the latter behind.
+void DeleteDeserializedCloudKey(TFheGateBootstrappingCloudKeySet* key);
+
+class CloudKeyReplicas {
+ public:
+  // Copies `key` once for each of `nodes`. Each copy is rebuilt from a
+  // serialized key by a thread pinned to its node, so that the kernel's
+  // first-touch policy allocates it there. This costs about as much as
+  // loading the key once per node (the copies are built in parallel).
+  //
+  // `key` is not retained, except as the value of original().
+  static absl::StatusOr<std::unique_ptr<CloudKeyReplicas>> Create(
+      const TFheGateBootstrappingCloudKeySet* key,
+      absl::Span<const NumaNode> nodes);
+
+  ~CloudKeyReplicas();
+
+  CloudKeyReplicas(const CloudKeyReplicas&) = delete;
+  CloudKeyReplicas& operator=(const CloudKeyReplicas&) = delete;
+
+  // The key the copies were made from.
+  const TFheGateBootstrappingCloudKeySet* original() const {
+    return original_;
+  }
+
+  // The number of nodes copied to.
+  int node_count() const { return replicas_.size(); }
+
+  // The copy on `nodes[node_index]`, or the original key if `node_index` is
+  // -1 (i.e., the caller is not on any particular node).
+  const TFheGateBootstrappingCloudKeySet* ForNode(int node_index) const {
+    return node_index < 0 ? original_ : replicas_[node_index];
+  }
+
+ private:
+  explicit CloudKeyReplicas(const TFheGateBootstrappingCloudKeySet* original)
+      : original_(original) {}
+
+  const TFheGateBootstrappingCloudKeySet* const original_;
+  std::vector<TFheGateBootstrappingCloudKeySet*> replicas_;
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_CLOUD_KEY_REPLICAS_H_
@@ -0,0 +1,56 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_cloud_key_replicas.h"
+
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tfhe/tfhe.h"
+#include "transpiler/tfhe_numa.h"
+#include "xls/common/status/matchers.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+constexpr int kMainMinimumLambda = 120;
+
+TEST(CloudKeyReplicasTest, CopiesKeyPerNode) {
+  TFheGateBootstrappingParameterSet* params =
+      new_default_gate_bootstrapping_parameters(kMainMinimumLambda);
+  TFheGateBootstrappingSecretKeySet* key =
+      new_random_gate_bootstrapping_secret_keyset(params);
+
+  const std::vector<int> cpus = DiscoverNumaNodes().front().cpus;
+  std::vector<NumaNode> nodes = {{0, cpus}, {1, cpus}};
+  XLS_ASSERT_OK_AND_ASSIGN(std::unique_ptr<CloudKeyReplicas> replicas,
+                           CloudKeyReplicas::Create(&key->cloud, nodes));
+  EXPECT_EQ(replicas->original(), &key->cloud);
+  EXPECT_EQ(replicas->ForNode(-1), &key->cloud);
+  for (int node = 0; node < nodes.size(); ++node) {
+    const TFheGateBootstrappingCloudKeySet* replica = replicas->ForNode(node);
+    EXPECT_NE(replica, &key->cloud);
+    EXPECT_EQ(replica->params->in_out_params->n,
+              key->cloud.params->in_out_params->n);
+  }
+  EXPECT_NE(replicas->ForNode(0), replicas->ForNode(1));
+
+  replicas.reset();
+  delete_gate_bootstrapping_secret_keyset(key);
+  delete_gate_bootstrapping_parameters(params);
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
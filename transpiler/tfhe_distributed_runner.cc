@@ -0,0 +1,717 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_distributed_runner.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_cloud_key_replicas.h"
+#include "transpiler/tfhe_executor.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "transpiler/tfhe_transport.h"
+#include "xls/common/status/status_macros.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+// Below this much evaluation time in the busiest worker, timings are too
+// noisy to rebalance by.
+constexpr absl::Duration kMinRebalanceBusy = absl::Milliseconds(100);
+
+// The requests a coordinator sends. Every one but kShutdown is answered with
+// a status, followed (if OK) by the payload listed here.
+enum MessageType : int64_t {
+  // The serialized cloud key.
+  kKey,
+  // The boundary size, the stage count, and the worker's serialized plan for
+  // each stage (empty for stages in which it has nothing to evaluate).
+  kPlans,
+  // The parameter count, then per parameter the number of leading bits sent
+  // (-1 for none) and their ciphertexts.
+  kCall,
+  // The stage, the boundary slots imported (each a slot then a ciphertext)
+  // and the slots to export. Answered with the evaluation time in
+  // nanoseconds and the exported ciphertexts.
+  kStage,
+  kShutdown,
+};
+
+class MessageWriter {
+ public:
+  void Int(int64_t value) {
+    out_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void String(absl::string_view value) {
+    Int(value.size());
+    out_.write(value.data(), value.size());
+  }
+  void Ciphertext(const LweSample* sample,
+                  const TFheGateBootstrappingParameterSet* params) {
+    export_gate_bootstrapping_ciphertext_toStream(out_, sample, params);
+  }
+  void Status(const absl::Status& status) {
+    Int(static_cast<int64_t>(status.code()));
+    String(status.message());
+  }
+
+  std::string Finish() { return out_.str(); }
+
+ private:
+  std::ostringstream out_;
+};
+
+// Reads a message written by MessageWriter. Reads past the end of the
+// message yield zeroes, and make status() an error.
+class MessageReader {
+ public:
+  explicit MessageReader(std::string message) : in_(std::move(message)) {}
+
+  int64_t Int() {
+    int64_t value = 0;
+    in_.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return in_ ? value : 0;
+  }
+  std::string String() {
+    const int64_t size = Int();
+    if (size < 0 || size > in_.rdbuf()->in_avail()) {
+      in_.setstate(std::ios::failbit);
+      return "";
+    }
+    std::string value(size, '\0');
+    in_.read(value.data(), size);
+    return value;
+  }
+  void Ciphertext(LweSample* sample,
+                  const TFheGateBootstrappingParameterSet* params) {
+    import_gate_bootstrapping_ciphertext_fromStream(in_, sample, params);
+  }
+  absl::Status Status() {
+    const int64_t code = Int();
+    std::string message = String();
+    XLS_RETURN_IF_ERROR(status());
+    return absl::Status(static_cast<absl::StatusCode>(code), message);
+  }
+
+  absl::Status status() const {
+    return in_ ? absl::OkStatus()
+               : absl::InvalidArgumentError("Truncated or corrupt message.");
+  }
+
+ private:
+  std::istringstream in_;
+};
+
+}  // namespace
+
+class DistributedTfheRunner::Worker {
+ public:
+  explicit Worker(TfheExecutor::Options executor_options)
+      : executor_(std::move(executor_options)) {}
+  ~Worker() {
+    FreeCall();
+    FreeBoundary();
+    FreeKey();
+  }
+
+  absl::Status Serve(TfheTransport* transport) {
+    while (true) {
+      XLS_ASSIGN_OR_RETURN(std::string message, transport->Receive());
+      MessageReader request(std::move(message));
+      const int64_t type = request.Int();
+      if (type == kShutdown) {
+        return absl::OkStatus();
+      }
+      MessageWriter payload;
+      absl::Status status;
+      switch (type) {
+        case kKey:
+          status = SetKey(&request);
+          break;
+        case kPlans:
+          status = SetPlans(&request);
+          break;
+        case kCall:
+          status = StartCall(&request);
+          break;
+        case kStage:
+          status = RunStage(&request, &payload);
+          break;
+        default:
+          status = absl::InvalidArgumentError(
+              absl::StrCat("Unknown message type: ", type));
+      }
+      MessageWriter reply;
+      reply.Status(status);
+      XLS_RETURN_IF_ERROR(transport->Send(
+          status.ok() ? reply.Finish() + payload.Finish() : reply.Finish()));
+    }
+  }
+
+ private:
+  absl::Status SetKey(MessageReader* request) {
+    std::istringstream serialized(request->String());
+    XLS_RETURN_IF_ERROR(request->status());
+    // The call's ciphertexts were allocated for the old key's parameters.
+    FreeCall();
+    FreeBoundary();
+    FreeKey();
+    key_ = new_tfheGateBootstrappingCloudKeySet_fromStream(serialized);
+    return absl::OkStatus();
+  }
+
+  absl::Status SetPlans(MessageReader* request) {
+    FreeCall();
+    FreeBoundary();
+    stages_.clear();
+    plan_buffers_.clear();
+    boundary_size_ = request->Int();
+    const int64_t stage_count = request->Int();
+    XLS_RETURN_IF_ERROR(request->status());
+    for (int64_t s = 0; s < stage_count; ++s) {
+      // The plans read their serialized bytes in place, which stay put in
+      // the string's heap buffer when the string itself is moved.
+      plan_buffers_.push_back(request->String());
+      XLS_RETURN_IF_ERROR(request->status());
+      if (plan_buffers_.back().empty()) {
+        stages_.push_back(nullptr);
+        continue;
+      }
+      XLS_ASSIGN_OR_RETURN(TfhePlan plan,
+                           TfhePlan::FromBuffer(plan_buffers_.back()));
+      TfheRunner::Options options;
+      options.executor = &executor_;
+      stages_.push_back(std::make_unique<TfheRunner>(std::move(plan), options));
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status StartCall(MessageReader* request) {
+    if (key_ == nullptr) {
+      return absl::FailedPreconditionError("No cloud key has been sent.");
+    }
+    FreeCall();
+    if (boundary_ == nullptr) {
+      boundary_ =
+          new_gate_bootstrapping_ciphertext_array(boundary_size_, key_->params);
+    }
+    const int64_t param_count = request->Int();
+    XLS_RETURN_IF_ERROR(request->status());
+    for (int64_t i = 0; i < param_count; ++i) {
+      const int64_t width = request->Int();
+      XLS_RETURN_IF_ERROR(request->status());
+      if (width < 0) {
+        args_.push_back({0, nullptr});
+        continue;
+      }
+      LweSample* bits =
+          new_gate_bootstrapping_ciphertext_array(width, key_->params);
+      args_.push_back({width, bits});
+      for (int64_t bit = 0; bit < width; ++bit) {
+        request->Ciphertext(&bits[bit], key_->params);
+      }
+      XLS_RETURN_IF_ERROR(request->status());
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status RunStage(MessageReader* request, MessageWriter* reply) {
+    if (boundary_ == nullptr) {
+      return absl::FailedPreconditionError("No call has been started.");
+    }
+    const int64_t stage = request->Int();
+    XLS_RETURN_IF_ERROR(request->status());
+    if (stage < 0 || stage >= stages_.size()) {
+      return absl::InvalidArgumentError(absl::StrCat("Bad stage: ", stage));
+    }
+    const int64_t import_count = request->Int();
+    for (int64_t i = 0; i < import_count && request->status().ok(); ++i) {
+      XLS_ASSIGN_OR_RETURN(int32_t slot, Slot(request->Int()));
+      request->Ciphertext(&boundary_[slot], key_->params);
+    }
+    const int64_t export_count = request->Int();
+    if (export_count < 0 || export_count > boundary_size_) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Bad export count: ", export_count));
+    }
+    std::vector<int32_t> exports(export_count);
+    for (int32_t& slot : exports) {
+      XLS_ASSIGN_OR_RETURN(slot, Slot(request->Int()));
+    }
+    XLS_RETURN_IF_ERROR(request->status());
+
+    const absl::Time start = absl::Now();
+    if (TfheRunner* runner = stages_[stage].get()) {
+      absl::Span<const std::string> names = runner->plan().param_names();
+      absl::flat_hash_map<std::string, LweSample*> args;
+      for (int32_t i = 0; i < args_.size() && i < names.size(); ++i) {
+        args[names[i]] = args_[i].second;
+      }
+      args[TfhePlan::kExtraParam] = boundary_;
+      XLS_RETURN_IF_ERROR(runner->Run(nullptr, std::move(args), key_));
+    }
+    reply->Int(absl::ToInt64Nanoseconds(absl::Now() - start));
+    for (int32_t slot : exports) {
+      reply->Ciphertext(&boundary_[slot], key_->params);
+    }
+    return absl::OkStatus();
+  }
+
+  absl::StatusOr<int32_t> Slot(int64_t slot) const {
+    if (slot < 0 || slot >= boundary_size_) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Bad boundary slot: ", slot));
+    }
+    return slot;
+  }
+
+  void FreeCall() {
+    for (const auto& [width, bits] : args_) {
+      if (bits != nullptr) {
+        delete_gate_bootstrapping_ciphertext_array(width, bits);
+      }
+    }
+    args_.clear();
+  }
+
+  void FreeBoundary() {
+    if (boundary_ != nullptr) {
+      delete_gate_bootstrapping_ciphertext_array(boundary_size_, boundary_);
+      boundary_ = nullptr;
+    }
+  }
+
+  void FreeKey() {
+    if (key_ != nullptr) {
+      DeleteDeserializedCloudKey(key_);
+      key_ = nullptr;
+    }
+  }
+
+  TfheExecutor executor_;
+  TFheGateBootstrappingCloudKeySet* key_ = nullptr;
+  // The serialized plans of the stages, and their runners (null for stages
+  // in which this worker has nothing to evaluate).
+  std::vector<std::string> plan_buffers_;
+  std::vector<std::unique_ptr<TfheRunner>> stages_;
+  int32_t boundary_size_ = 0;
+  LweSample* boundary_ = nullptr;
+  // The current call's arguments, by parameter: their width, and their bits
+  // (null for those not sent).
+  std::vector<std::pair<int64_t, LweSample*>> args_;
+};
+
+absl::StatusOr<std::unique_ptr<DistributedTfheRunner>>
+DistributedTfheRunner::Create(
+    TfhePlan plan, std::vector<std::unique_ptr<TfheTransport>> workers) {
+  return Create(std::move(plan), std::move(workers), Options());
+}
+
+absl::StatusOr<std::unique_ptr<DistributedTfheRunner>>
+DistributedTfheRunner::Create(
+    TfhePlan plan, std::vector<std::unique_ptr<TfheTransport>> workers,
+    Options options) {
+  if (workers.empty()) {
+    return absl::InvalidArgumentError("No workers.");
+  }
+  std::vector<double> capacities = options.capacities;
+  if (capacities.empty()) {
+    capacities.assign(workers.size(), 1.0);
+  } else if (capacities.size() != workers.size()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Expected ", workers.size(), " capacities, got ",
+                     capacities.size()));
+  }
+  auto runner = absl::WrapUnique(new DistributedTfheRunner(
+      std::move(plan), std::move(workers), std::move(options)));
+  {
+    absl::MutexLock lock(&runner->lock_);
+    XLS_RETURN_IF_ERROR(runner->Repartition(capacities));
+  }
+  return runner;
+}
+
+DistributedTfheRunner::DistributedTfheRunner(
+    TfhePlan plan, std::vector<std::unique_ptr<TfheTransport>> workers,
+    Options options)
+    : plan_(std::move(plan)),
+      options_(std::move(options)),
+      read_widths_(plan_.param_names().size(), 0),
+      workers_(std::move(workers)) {
+  for (const PlanNode& node : plan_.nodes()) {
+    if (node.op == PlanOp::kParamBit) {
+      read_widths_[node.param] =
+          std::max(read_widths_[node.param], node.param_bit + 1);
+    }
+  }
+}
+
+DistributedTfheRunner::~DistributedTfheRunner() {
+  absl::MutexLock lock(&lock_);
+  if (broken_.ok()) {
+    MessageWriter shutdown;
+    shutdown.Int(kShutdown);
+    const std::string message = shutdown.Finish();
+    for (const std::unique_ptr<TfheTransport>& worker : workers_) {
+      worker->Send(message).IgnoreError();
+    }
+  }
+  FreeBoundary();
+}
+
+absl::Status DistributedTfheRunner::Run(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  absl::MutexLock lock(&lock_);
+  XLS_RETURN_IF_ERROR(broken_);
+  if (args.size() != plan_.param_names().size()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Expected ", plan_.param_names().size(),
+                     " arguments, got ", args.size()));
+  }
+  std::vector<LweSample*> params;
+  for (const std::string& name : plan_.param_names()) {
+    auto found = args.find(name);
+    if (found == args.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Missing argument: ", name));
+    }
+    if (found->second == nullptr && read_widths_[params.size()] > 0) {
+      return absl::InvalidArgumentError(absl::StrCat("Null argument: ", name));
+    }
+    params.push_back(found->second);
+  }
+
+  // Keys are told apart by their serialized form rather than their address,
+  // which a freed key's successor may well reuse. Serializing costs a copy of
+  // the key, far less than sending it or a single bootstrap per worker.
+  std::ostringstream serialized;
+  export_tfheGateBootstrappingCloudKeySet_toStream(serialized, bk);
+  std::string serialized_key = serialized.str();
+  if (serialized_key != sent_key_) {
+    MessageWriter request;
+    request.Int(kKey);
+    request.String(serialized_key);
+    XLS_ASSIGN_OR_RETURN(
+        std::vector<absl::optional<std::string>> replies,
+        Exchange(std::vector<absl::optional<std::string>>(workers_.size(),
+                                                          request.Finish()),
+                 nullptr));
+    for (absl::optional<std::string>& reply : replies) {
+      XLS_RETURN_IF_ERROR(MessageReader(std::move(*reply)).Status());
+    }
+    sent_key_ = std::move(serialized_key);
+  }
+
+  AllocateBoundary(bk->params);
+  XLS_RETURN_IF_ERROR(RunStages(params, bk));
+  args[TfhePlan::kExtraParam] = boundary_;
+  XLS_RETURN_IF_ERROR(collect_->Run(result, std::move(args), bk));
+
+  // The outputs are written, so a failure here is left for the next call to
+  // report.
+  if (absl::optional<std::vector<double>> capacities =
+          RebalancedCapacities()) {
+    absl::Status status = Repartition(*capacities);
+    if (!status.ok()) {
+      broken_ = status;
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status DistributedTfheRunner::RunStages(
+    absl::Span<LweSample* const> args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  const int32_t worker_count = workers_.size();
+  std::vector<PartitionStats> stats(worker_count);
+  for (int32_t w = 0; w < worker_count; ++w) {
+    stats[w].bootstraps = partition_.bootstrap_counts[w];
+  }
+
+  // Each worker is sent the leading bits of each parameter its part reads.
+  std::vector<absl::optional<std::string>> requests(worker_count);
+  for (int32_t w = 0; w < worker_count; ++w) {
+    MessageWriter request;
+    request.Int(kCall);
+    request.Int(args.size());
+    for (int32_t i = 0; i < args.size(); ++i) {
+      if (!partition_.reads_param[w][i]) {
+        request.Int(-1);
+        continue;
+      }
+      request.Int(read_widths_[i]);
+      for (int32_t bit = 0; bit < read_widths_[i]; ++bit) {
+        request.Ciphertext(&args[i][bit], bk->params);
+      }
+    }
+    requests[w] = request.Finish();
+  }
+  XLS_ASSIGN_OR_RETURN(std::vector<absl::optional<std::string>> replies,
+                       Exchange(requests, &stats));
+  for (absl::optional<std::string>& reply : replies) {
+    XLS_RETURN_IF_ERROR(MessageReader(std::move(*reply)).Status());
+  }
+
+  for (int32_t s = 0; s < partition_.stages.size(); ++s) {
+    const PlanPartition::Stage& stage = partition_.stages[s];
+    std::vector<absl::optional<std::string>> requests(worker_count);
+    for (int32_t w = 0; w < worker_count; ++w) {
+      if (stage.plans[w].node_count() == 0) continue;
+      MessageWriter request;
+      request.Int(kStage);
+      request.Int(s);
+      request.Int(stage.imports[w].size());
+      for (int32_t slot : stage.imports[w]) {
+        request.Int(slot);
+        request.Ciphertext(&boundary_[slot], bk->params);
+      }
+      request.Int(stage.exports[w].size());
+      for (int32_t slot : stage.exports[w]) {
+        request.Int(slot);
+      }
+      requests[w] = request.Finish();
+    }
+    XLS_ASSIGN_OR_RETURN(std::vector<absl::optional<std::string>> replies,
+                         Exchange(requests, &stats));
+    for (int32_t w = 0; w < worker_count; ++w) {
+      if (!replies[w].has_value()) continue;
+      MessageReader reply(std::move(*replies[w]));
+      XLS_RETURN_IF_ERROR(reply.Status());
+      stats[w].busy += absl::Nanoseconds(reply.Int());
+      for (int32_t slot : stage.exports[w]) {
+        reply.Ciphertext(&boundary_[slot], bk->params);
+      }
+      XLS_RETURN_IF_ERROR(reply.status());
+    }
+  }
+  stats_ = std::move(stats);
+  return absl::OkStatus();
+}
+
+absl::Status DistributedTfheRunner::Repartition(
+    absl::Span<const double> capacities) {
+  XLS_ASSIGN_OR_RETURN(PlanPartition partition, plan_.Partition(capacities));
+  std::vector<absl::optional<std::string>> requests(workers_.size());
+  for (int32_t w = 0; w < workers_.size(); ++w) {
+    MessageWriter request;
+    request.Int(kPlans);
+    request.Int(partition.boundary_size);
+    request.Int(partition.stages.size());
+    for (const PlanPartition::Stage& stage : partition.stages) {
+      request.String(stage.plans[w].node_count() == 0
+                         ? std::string()
+                         : stage.plans[w].Serialize());
+    }
+    requests[w] = request.Finish();
+  }
+  XLS_ASSIGN_OR_RETURN(std::vector<absl::optional<std::string>> replies,
+                       Exchange(requests, nullptr));
+  for (absl::optional<std::string>& reply : replies) {
+    absl::Status status = MessageReader(std::move(*reply)).Status();
+    if (!status.ok()) {
+      // The workers may be left holding parts of different partitions.
+      broken_ = status;
+      return status;
+    }
+  }
+  collect_ = std::make_unique<TfheRunner>(partition.collect, options_.local);
+  partition_ = std::move(partition);
+  stats_.assign(workers_.size(), PartitionStats());
+  for (int32_t w = 0; w < workers_.size(); ++w) {
+    stats_[w].bootstraps = partition_.bootstrap_counts[w];
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::vector<absl::optional<std::string>>>
+DistributedTfheRunner::Exchange(
+    const std::vector<absl::optional<std::string>>& requests,
+    std::vector<PartitionStats>* stats) {
+  std::vector<absl::optional<std::string>> replies(workers_.size());
+  for (int32_t w = 0; w < workers_.size(); ++w) {
+    if (!requests[w].has_value()) continue;
+    absl::Status status = workers_[w]->Send(*requests[w]);
+    if (!status.ok()) {
+      broken_ = status;
+      return status;
+    }
+    if (stats != nullptr) {
+      (*stats)[w].bytes_sent += requests[w]->size();
+    }
+  }
+  for (int32_t w = 0; w < workers_.size(); ++w) {
+    if (!requests[w].has_value()) continue;
+    absl::StatusOr<std::string> reply = workers_[w]->Receive();
+    if (!reply.ok()) {
+      broken_ = reply.status();
+      return reply.status();
+    }
+    if (stats != nullptr) {
+      (*stats)[w].bytes_received += reply->size();
+    }
+    replies[w] = std::move(reply).value();
+  }
+  return replies;
+}
+
+absl::optional<std::vector<double>>
+DistributedTfheRunner::RebalancedCapacities() const {
+  if (options_.rebalance_threshold <= 0) {
+    return absl::nullopt;
+  }
+  absl::Duration max_busy;
+  absl::Duration total_busy;
+  for (const PartitionStats& stats : stats_) {
+    max_busy = std::max(max_busy, stats.busy);
+    total_busy += stats.busy;
+  }
+  const absl::Duration mean_busy = total_busy / stats_.size();
+  if (max_busy < kMinRebalanceBusy ||
+      max_busy <= mean_busy * options_.rebalance_threshold) {
+    return absl::nullopt;
+  }
+  // Each worker's speed is its bootstraps per second; those that did none
+  // are taken to be as fast as the average of the rest.
+  std::vector<double> speeds(stats_.size(), 0);
+  double total_speed = 0;
+  int measured = 0;
+  for (int32_t w = 0; w < stats_.size(); ++w) {
+    if (stats_[w].bootstraps > 0 && stats_[w].busy > absl::ZeroDuration()) {
+      speeds[w] = stats_[w].bootstraps / absl::ToDoubleSeconds(stats_[w].busy);
+      total_speed += speeds[w];
+      ++measured;
+    }
+  }
+  for (double& speed : speeds) {
+    if (speed == 0) {
+      speed = measured > 0 ? total_speed / measured : 1.0;
+    }
+  }
+  return speeds;
+}
+
+std::vector<DistributedTfheRunner::PartitionStats>
+DistributedTfheRunner::partition_stats() const {
+  absl::MutexLock lock(&lock_);
+  return stats_;
+}
+
+int64_t DistributedTfheRunner::cut_edges() const {
+  absl::MutexLock lock(&lock_);
+  return partition_.cut_edges;
+}
+
+int32_t DistributedTfheRunner::stage_count() const {
+  absl::MutexLock lock(&lock_);
+  return partition_.stages.size();
+}
+
+void DistributedTfheRunner::AllocateBoundary(
+    const TFheGateBootstrappingParameterSet* params) {
+  if (boundary_ != nullptr && boundary_params_ == params &&
+      boundary_size_ == partition_.boundary_size) {
+    return;
+  }
+  FreeBoundary();
+  boundary_size_ = partition_.boundary_size;
+  boundary_ = new_gate_bootstrapping_ciphertext_array(boundary_size_, params);
+  boundary_params_ = params;
+}
+
+void DistributedTfheRunner::FreeBoundary() {
+  if (boundary_ != nullptr) {
+    delete_gate_bootstrapping_ciphertext_array(boundary_size_, boundary_);
+    boundary_ = nullptr;
+  }
+}
+
+absl::StatusOr<std::vector<std::unique_ptr<TfheTransport>>>
+DistributedTfheRunner::ForkLocalWorkers(int count) {
+  return ForkLocalWorkers(count, TfheExecutor::Options());
+}
+
+absl::StatusOr<std::vector<std::unique_ptr<TfheTransport>>>
+DistributedTfheRunner::ForkLocalWorkers(
+    int count, TfheExecutor::Options executor_options) {
+  std::vector<std::unique_ptr<TfheTransport>> workers;
+  // The coordinator's ends of the sockets so far, which later workers must
+  // close: a worker sees its coordinator go away only once no process holds
+  // the other end of its socket.
+  std::vector<int> coordinator_fds;
+  for (int i = 0; i < count; ++i) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+      return absl::InternalError(
+          absl::StrCat("Failed to create socket pair: ", strerror(errno)));
+    }
+    const pid_t pid = fork();
+    if (pid == -1) {
+      close(fds[0]);
+      close(fds[1]);
+      return absl::InternalError(
+          absl::StrCat("Failed to fork: ", strerror(errno)));
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      for (int fd : coordinator_fds) {
+        close(fd);
+      }
+      SocketTransport transport(fds[1]);
+      absl::Status status = ServeWorker(&transport, executor_options);
+      // Skip the coordinator's exit handlers and static destructors.
+      _exit(status.ok() ? 0 : 1);
+    }
+    close(fds[1]);
+    coordinator_fds.push_back(fds[0]);
+    workers.push_back(std::make_unique<SocketTransport>(fds[0], pid));
+  }
+  return workers;
+}
+
+absl::Status DistributedTfheRunner::ServeWorker(
+    TfheTransport* transport, TfheExecutor::Options executor_options) {
+  Worker worker(std::move(executor_options));
+  return worker.Serve(transport);
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
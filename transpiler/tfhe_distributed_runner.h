@@ -0,0 +1,202 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Evaluation of one circuit across several worker processes, for circuits
+// that would keep more cores busy than a single process has.
+//
+// The coordinator (the process calling Run()) partitions the plan between
+// the workers so as to cut few edges (see TfhePlan::Partition()), and sends
+// each worker its part and a copy of the cloud key. A call then proceeds in
+// stages: every worker evaluates the gates of its part for the stage with a
+// TfheRunner of its own, returning the values other parts read, which the
+// coordinator passes on to the workers reading them before the next stage.
+// Finally the coordinator writes the outputs from the returned values.
+//
+// Workers talk to the coordinator only through a TfheTransport, so they may
+// be local processes (see ForkLocalWorkers()) or, given another transport,
+// processes on other machines running ServeWorker().
+//
+// Usage:
+//
+// XLS_ASSIGN_OR_RETURN(auto workers,
+//                      DistributedTfheRunner::ForkLocalWorkers(4));
+// XLS_ASSIGN_OR_RETURN(auto runner, DistributedTfheRunner::Create(
+//                                       std::move(plan), std::move(workers)));
+// XLS_RETURN_IF_ERROR(runner->Run(result, {{"x", x}}, bk));
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_DISTRIBUTED_RUNNER_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_DISTRIBUTED_RUNNER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_executor.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "transpiler/tfhe_transport.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+class DistributedTfheRunner {
+ public:
+  struct Options {
+    // The relative speeds of the workers, which their shares of the gates are
+    // first made proportional to. If empty, the workers are taken to be
+    // equally fast.
+    std::vector<double> capacities;
+
+    // If, in a call, the busiest worker spends more than this many times the
+    // mean time evaluating gates, the plan is partitioned anew before the
+    // next call, with capacities proportional to the speed each worker was
+    // measured at. Zero disables rebalancing.
+    double rebalance_threshold = 1.25;
+
+    // For writing the outputs in the coordinator, which evaluates no gates.
+    TfheRunner::Options local;
+  };
+
+  // What one worker did in the last call.
+  struct PartitionStats {
+    // The bootstraps its part of the circuit takes.
+    int64_t bootstraps = 0;
+    // The time it spent evaluating gates.
+    absl::Duration busy;
+    // The bytes sent to and received from it.
+    int64_t bytes_sent = 0;
+    int64_t bytes_received = 0;
+  };
+
+  // Partitions `plan` between `workers`, one part each, and sends each
+  // worker its part.
+  static absl::StatusOr<std::unique_ptr<DistributedTfheRunner>> Create(
+      TfhePlan plan, std::vector<std::unique_ptr<TfheTransport>> workers);
+  static absl::StatusOr<std::unique_ptr<DistributedTfheRunner>> Create(
+      TfhePlan plan, std::vector<std::unique_ptr<TfheTransport>> workers,
+      Options options);
+  // Shuts the workers down.
+  ~DistributedTfheRunner();
+
+  DistributedTfheRunner(const DistributedTfheRunner&) = delete;
+  DistributedTfheRunner& operator=(const DistributedTfheRunner&) = delete;
+
+  // Evaluates the circuit, as TfheRunner::Run() does. The workers are sent
+  // the cloud key whenever its contents differ from the last call's, so a
+  // key may be freed and another passed in its place. Calls are serialized. Once a transport has failed, this and every later
+  // call fail.
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk);
+
+  // Per worker, what it did in the last successful call.
+  std::vector<PartitionStats> partition_stats() const;
+
+  // The operand edges between gates in different parts, and the number of
+  // stages each call goes through, as currently partitioned.
+  int64_t cut_edges() const;
+  int32_t stage_count() const;
+
+  // Starts `count` worker processes by forking the calling process, each
+  // serving the other end of the returned transport (see ServeWorker()) on
+  // its own executor, configured by `executor_options`. Each worker's
+  // process is waited for when its transport is destroyed. Since only the
+  // calling thread survives in the workers, this is best called before
+  // starting other threads.
+  static absl::StatusOr<std::vector<std::unique_ptr<TfheTransport>>>
+  ForkLocalWorkers(int count);
+  static absl::StatusOr<std::vector<std::unique_ptr<TfheTransport>>>
+  ForkLocalWorkers(int count, TfheExecutor::Options executor_options);
+
+  // Serves a coordinator over `transport`, evaluating gates on a new
+  // executor configured by `executor_options`, until the coordinator shuts
+  // the worker down (returning OK) or the transport fails. For worker
+  // processes started by other means than ForkLocalWorkers().
+  static absl::Status ServeWorker(TfheTransport* transport,
+                                  TfheExecutor::Options executor_options);
+
+ private:
+  class Worker;
+
+  DistributedTfheRunner(TfhePlan plan,
+                        std::vector<std::unique_ptr<TfheTransport>> workers,
+                        Options options);
+
+  // Partitions the plan by `capacities` and sends the workers their parts.
+  absl::Status Repartition(absl::Span<const double> capacities)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Runs the stages of a call whose arguments, indexed like the plan's
+  // parameters, are `args`, leaving the exported values in boundary_.
+  absl::Status RunStages(absl::Span<LweSample* const> args,
+                         const TFheGateBootstrappingCloudKeySet* bk)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Sends each worker its entry of `requests`, skipping those without one,
+  // then returns the replies of those sent to, indexed the same way. The
+  // workers work on their requests concurrently. Adds the bytes exchanged to
+  // `stats`, if not null. A transport failure is recorded in broken_, since
+  // the workers' state is then unknown.
+  absl::StatusOr<std::vector<absl::optional<std::string>>> Exchange(
+      const std::vector<absl::optional<std::string>>& requests,
+      std::vector<PartitionStats>* stats) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Whether the last call calls for repartitioning, and if so with what
+  // capacities; see Options::rebalance_threshold.
+  absl::optional<std::vector<double>> RebalancedCapacities() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Makes sure boundary_ holds ciphertexts for `params`.
+  void AllocateBoundary(const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void FreeBoundary() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  const TfhePlan plan_;
+  const Options options_;
+  // Per parameter: how many of its leading bits the circuit reads, which are
+  // all a worker is sent.
+  std::vector<int32_t> read_widths_;
+  std::vector<std::unique_ptr<TfheTransport>> workers_;
+
+  mutable absl::Mutex lock_;
+  // Set once a transport has failed.
+  absl::Status broken_ ABSL_GUARDED_BY(lock_);
+  PlanPartition partition_ ABSL_GUARDED_BY(lock_);
+  std::unique_ptr<TfheRunner> collect_ ABSL_GUARDED_BY(lock_);
+  // The key the workers hold, serialized; empty before the first call.
+  std::string sent_key_ ABSL_GUARDED_BY(lock_);
+  // The coordinator's copy of the boundary, which gathers every export.
+  LweSample* boundary_ ABSL_GUARDED_BY(lock_) = nullptr;
+  int32_t boundary_size_ ABSL_GUARDED_BY(lock_) = 0;
+  const TFheGateBootstrappingParameterSet* boundary_params_
+      ABSL_GUARDED_BY(lock_) = nullptr;
+  std::vector<PartitionStats> stats_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_DISTRIBUTED_RUNNER_H_
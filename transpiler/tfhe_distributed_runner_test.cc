@@ -0,0 +1,142 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_distributed_runner.h"
+
+#include <array>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "transpiler/data/fhe_data.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_test_util.h"
+#include "transpiler/tfhe_transport.h"
+#include "xls/common/status/matchers.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::xls::status_testing::StatusIs;
+
+constexpr int kMainMinimumLambda = 120;
+
+TEST(DistributedTfheRunnerTest, AddsAcrossWorkerProcesses) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(RippleCarryAdderIr(8)));
+  XLS_ASSERT_OK_AND_ASSIGN(auto workers,
+                           DistributedTfheRunner::ForkLocalWorkers(3));
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto runner, DistributedTfheRunner::Create(plan, std::move(workers)));
+  EXPECT_GT(runner->cut_edges(), 0);
+  EXPECT_GT(runner->stage_count(), 1);
+
+  for (const auto& [x, y] : std::vector<std::pair<char, char>>{
+           {1, 2}, {100, 27}, {-1, 1}, {85, 85}}) {
+    auto x_ciphertext = FheValue<char>::Encrypt(x, key);
+    auto y_ciphertext = FheValue<char>::Encrypt(y, key);
+    FheValue<char> result(key.params());
+    XLS_ASSERT_OK(runner->Run(
+        result.get(), {{"x", x_ciphertext.get()}, {"y", y_ciphertext.get()}},
+        key.cloud()));
+    EXPECT_EQ(result.Decrypt(key), static_cast<char>(x + y));
+  }
+
+  // 15 XORs, 13 ANDs and 6 ORs, all accounted for exactly once.
+  std::vector<DistributedTfheRunner::PartitionStats> stats =
+      runner->partition_stats();
+  ASSERT_EQ(stats.size(), 3);
+  int64_t bootstraps = 0;
+  for (const DistributedTfheRunner::PartitionStats& worker : stats) {
+    bootstraps += worker.bootstraps;
+    EXPECT_GT(worker.bytes_sent, 0);
+    EXPECT_GT(worker.bytes_received, 0);
+  }
+  EXPECT_EQ(bootstraps, 34);
+
+  auto x_ciphertext = FheValue<char>::Encrypt(1, key);
+  FheValue<char> result(key.params());
+  EXPECT_THAT(
+      runner->Run(result.get(), {{"x", x_ciphertext.get()}}, key.cloud()),
+      StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(DistributedTfheRunnerTest, SharesGatesByCapacity) {
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(RippleCarryAdderIr(8)));
+  XLS_ASSERT_OK_AND_ASSIGN(auto workers,
+                           DistributedTfheRunner::ForkLocalWorkers(2));
+  DistributedTfheRunner::Options options;
+  options.capacities = {1, 3};
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto runner,
+      DistributedTfheRunner::Create(plan, std::move(workers), options));
+  std::vector<DistributedTfheRunner::PartitionStats> stats =
+      runner->partition_stats();
+  ASSERT_EQ(stats.size(), 2);
+  EXPECT_LT(stats[0].bootstraps, stats[1].bootstraps);
+
+  XLS_ASSERT_OK_AND_ASSIGN(workers, DistributedTfheRunner::ForkLocalWorkers(2));
+  options.capacities = {1};
+  EXPECT_THAT(
+      DistributedTfheRunner::Create(plan, std::move(workers), options).status(),
+      StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(DistributedTfheRunnerTest, ServesWorkersOverAnyTransport) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(RippleCarryAdderIr(8)));
+  // A worker served from a thread of this process, rather than forked.
+  XLS_ASSERT_OK_AND_ASSIGN(auto sockets, SocketTransport::Pair());
+  std::thread worker([&]() {
+    XLS_EXPECT_OK(DistributedTfheRunner::ServeWorker(sockets.second.get(),
+                                                     TfheExecutor::Options()));
+  });
+  std::vector<std::unique_ptr<TfheTransport>> workers;
+  workers.push_back(std::move(sockets.first));
+  {
+    XLS_ASSERT_OK_AND_ASSIGN(
+        auto runner, DistributedTfheRunner::Create(plan, std::move(workers)));
+    EXPECT_EQ(runner->cut_edges(), 0);
+    auto x = FheValue<char>::Encrypt(3, key);
+    auto y = FheValue<char>::Encrypt(4, key);
+    FheValue<char> result(key.params());
+    XLS_ASSERT_OK(runner->Run(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                              key.cloud()));
+    EXPECT_EQ(result.Decrypt(key), 7);
+  }
+  worker.join();
+}
+
+TEST(SocketTransportTest, RejectsOversizedMessages) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto sockets, SocketTransport::Pair(4));
+  XLS_ASSERT_OK(sockets.first->Send("abcd"));
+  XLS_ASSERT_OK_AND_ASSIGN(std::string message, sockets.second->Receive());
+  EXPECT_EQ(message, "abcd");
+  XLS_ASSERT_OK(sockets.first->Send("abcde"));
+  EXPECT_THAT(sockets.second->Receive().status(),
+              StatusIs(absl::StatusCode::kResourceExhausted));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
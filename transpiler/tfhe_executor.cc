@@ -0,0 +1,257 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_executor.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "xls/common/logging/logging.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+// The executor and worker index of the current thread, if it is a worker.
+struct CurrentWorker {
+  const TfheExecutor* executor;
+  int index;
+  int numa_node;
+};
+ABSL_CONST_INIT thread_local CurrentWorker current_worker = {nullptr, -1, -1};
+
+ABSL_CONST_INIT absl::Mutex default_lock(absl::kConstInit);
+TfheExecutor* default_executor ABSL_GUARDED_BY(default_lock) = nullptr;
+TfheExecutor::Options* default_options ABSL_GUARDED_BY(default_lock) = nullptr;
+
+int OnlineCpuCount() {
+  return std::max<int>(1, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+}  // namespace
+
+TfheExecutor::TfheExecutor(Options options) : options_(options) {
+  int initial_threads =
+      options.thread_count > 0 ? options.thread_count : OnlineCpuCount();
+  int max_threads = initial_threads;
+  if (options.adaptive) {
+    max_threads = std::max(initial_threads, options.max_thread_count > 0
+                                                ? options.max_thread_count
+                                                : OnlineCpuCount());
+  }
+
+  threads_should_exit_.store(false);
+  queued_.store(0);
+  idle_workers_.store(0);
+  next_queue_.store(0);
+  thread_count_.store(initial_threads);
+
+  if (options.pin_to_numa_nodes) {
+    numa_nodes_ = options.numa_nodes.empty() ? DiscoverNumaNodes()
+                                             : options.numa_nodes;
+  }
+
+  thread_args_.reserve(max_threads);
+  for (int c = 0; c < max_threads; ++c) {
+    queues_.push_back(std::make_unique<WorkQueue>());
+    thread_args_.emplace_back(this, c);
+    worker_numa_node_.push_back(
+        numa_nodes_.empty() ? -1 : c % static_cast<int>(numa_nodes_.size()));
+  }
+
+  absl::MutexLock lock(&grow_lock_);
+  for (int c = 0; c < initial_threads; ++c) {
+    StartWorker(c);
+  }
+}
+
+TfheExecutor::~TfheExecutor() { Shutdown(); }
+
+TfheExecutor* TfheExecutor::Default() {
+  absl::MutexLock lock(&default_lock);
+  if (default_executor == nullptr) {
+    default_executor = new TfheExecutor(
+        default_options != nullptr ? *default_options : Options());
+  }
+  return default_executor;
+}
+
+absl::Status TfheExecutor::ConfigureDefault(Options options) {
+  absl::MutexLock lock(&default_lock);
+  if (default_executor != nullptr) {
+    return absl::FailedPreconditionError(
+        "The default TfheExecutor has already been created.");
+  }
+  delete default_options;
+  default_options = new Options(options);
+  return absl::OkStatus();
+}
+
+int TfheExecutor::CurrentWorkerIndex() { return current_worker.index; }
+
+int TfheExecutor::CurrentNumaNode() { return current_worker.numa_node; }
+
+void TfheExecutor::StartWorker(int worker_index) {
+  pthread_t new_thread;
+  XLS_CHECK(0 == pthread_create(&new_thread, nullptr,
+                                TfheExecutor::ThreadBodyStatic,
+                                (void*)&thread_args_[worker_index]));
+  threads_.push_back(new_thread);
+}
+
+void TfheExecutor::Schedule(std::function<void()> task, int64_t priority) {
+  const bool on_worker = current_worker.executor == this;
+  // Workers may keep scheduling while a shutdown drains the queues, since
+  // they only ever add to work that is already in flight.
+  XLS_CHECK(on_worker || !threads_should_exit_.load())
+      << "TfheExecutor::Schedule called after Shutdown";
+
+  const int worker_index =
+      on_worker ? current_worker.index
+                : next_queue_.fetch_add(1) % thread_count_.load();
+  {
+    WorkQueue& queue = *queues_[worker_index];
+    absl::MutexLock lock(&queue.lock);
+    queue.ready.push_back({priority, queue.next_sequence++, std::move(task)});
+    std::push_heap(queue.ready.begin(), queue.ready.end());
+  }
+  queued_.fetch_add(1);
+  if (idle_workers_.load() > 0) {
+    absl::MutexLock lock(&idle_lock_);
+    idle_cv_.Signal();
+  } else if (options_.adaptive) {
+    MaybeGrow();
+  }
+}
+
+void TfheExecutor::MaybeGrow() {
+  // Workers draining a shutdown still schedule; they must not wait on
+  // `grow_lock_` while Shutdown() joins them.
+  if (threads_should_exit_.load() || thread_count_.load() >= queues_.size() ||
+      queued_.load() < thread_count_.load()) {
+    return;
+  }
+  absl::MutexLock lock(&grow_lock_);
+  const int count = thread_count_.load();
+  if (count >= queues_.size() || threads_should_exit_.load()) {
+    return;
+  }
+  thread_count_.store(count + 1);
+  StartWorker(count);
+}
+
+void TfheExecutor::Shutdown() {
+  std::vector<pthread_t> threads;
+  {
+    absl::MutexLock grow_lock(&grow_lock_);
+    {
+      absl::MutexLock lock(&idle_lock_);
+      threads_should_exit_.store(true);
+      idle_cv_.SignalAll();
+    }
+    // No worker starts once the flag is set, so `threads_` is complete.
+    threads.swap(threads_);
+  }
+  // Wait for exit
+  for (pthread_t pt : threads) {
+    pthread_join(pt, nullptr);
+  }
+}
+
+bool TfheExecutor::Pop(WorkQueue& queue, std::function<void()>* task) {
+  absl::MutexLock lock(&queue.lock);
+  if (queue.ready.empty()) {
+    return false;
+  }
+  std::pop_heap(queue.ready.begin(), queue.ready.end());
+  *task = std::move(queue.ready.back().run);
+  queue.ready.pop_back();
+  queued_.fetch_sub(1);
+  return true;
+}
+
+bool TfheExecutor::PopOrSteal(int worker_index, std::function<void()>* task) {
+  if (Pop(*queues_[worker_index], task)) {
+    return true;
+  }
+  // Steal within the worker's own NUMA node first.
+  const int count = thread_count_.load();
+  const int node = worker_numa_node_[worker_index];
+  for (bool same_node : {true, false}) {
+    for (int i = 1; i < count; ++i) {
+      const int victim = (worker_index + i) % count;
+      if ((worker_numa_node_[victim] == node) == same_node &&
+          Pop(*queues_[victim], task)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void* TfheExecutor::ThreadBodyStatic(void* worker) {
+  auto* executor_and_index =
+      reinterpret_cast<std::pair<TfheExecutor*, int>*>(worker);
+  executor_and_index->first->ThreadBody(executor_and_index->second);
+  return 0;
+}
+
+void TfheExecutor::ThreadBody(int worker_index) {
+  const int node = worker_numa_node_[worker_index];
+  if (node >= 0) {
+    absl::Status status = PinCurrentThread(numa_nodes_[node].cpus);
+    if (!status.ok()) {
+      XLS_LOG(WARNING) << "Could not pin worker " << worker_index
+                       << " to NUMA node " << numa_nodes_[node].id << ": "
+                       << status;
+    }
+  }
+  current_worker = {this, worker_index, node};
+  std::function<void()> task;
+  while (true) {
+    if (PopOrSteal(worker_index, &task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+
+    // Check if the signal is to exit; any work still queued was found empty
+    // above, so there is nothing left to drain.
+    if (threads_should_exit_.load()) {
+      return;
+    }
+
+    // Nothing to run or steal: park until a task is queued anywhere.
+    absl::MutexLock lock(&idle_lock_);
+    idle_workers_.fetch_add(1);
+    while (queued_.load() == 0 && !threads_should_exit_.load()) {
+      idle_cv_.Wait(&idle_lock_);
+    }
+    idle_workers_.fetch_sub(1);
+  }
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
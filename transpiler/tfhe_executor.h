@@ -0,0 +1,182 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A work-stealing thread pool for evaluating gates, shared by TfheRunners.
+//
+// Every TfheRunner schedules its gates on an executor (by default the
+// process-wide one returned by TfheExecutor::Default()), so a process hosting
+// many transpiled functions still runs only one set of worker threads.
+//
+// Usage:
+//
+// TfheExecutor::Options options;
+// options.thread_count = 16;
+// XLS_CHECK_OK(TfheExecutor::ConfigureDefault(options));
+// ... create runners ...
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_EXECUTOR_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_EXECUTOR_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "transpiler/tfhe_numa.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+class TfheExecutor {
+ public:
+  struct Options {
+    // Number of worker threads to start with. If zero, one per online CPU.
+    int thread_count = 0;
+
+    // If set, the pool starts with `thread_count` workers and adds more, up to
+    // `max_thread_count`, whenever the ready tasks outnumber the busy workers
+    // (i.e., a circuit level turns out to be wider than the pool). It never
+    // shrinks.
+    bool adaptive = false;
+    // Upper bound for adaptive growth. If zero, one per online CPU.
+    int max_thread_count = 0;
+
+    // If set, workers are dealt round-robin to the NUMA nodes in
+    // `numa_nodes` (if empty, every node of the machine; see
+    // DiscoverNumaNodes()) and each is pinned to the CPUs of its node. Idle
+    // workers steal from their own node before crossing to another.
+    bool pin_to_numa_nodes = false;
+    std::vector<NumaNode> numa_nodes;
+  };
+
+  explicit TfheExecutor(Options options);
+
+  // Equivalent to calling Shutdown().
+  ~TfheExecutor();
+
+  TfheExecutor(const TfheExecutor&) = delete;
+  TfheExecutor& operator=(const TfheExecutor&) = delete;
+
+  // Returns the process-wide executor, creating it on first use. It is never
+  // destroyed.
+  static TfheExecutor* Default();
+
+  // Sets the options used to create the process-wide executor. Must be called
+  // before the first call to Default().
+  static absl::Status ConfigureDefault(Options options);
+
+  // Queues `task` to run on a worker. When called from one of this
+  // executor's workers, the task goes onto that worker's own queue and is
+  // likely to run next on the same thread; otherwise the tasks are spread
+  // round-robin over all workers.
+  //
+  // Each worker runs the highest-`priority` task in its queue first (the
+  // most recently queued one among equals), and idle workers steal the
+  // highest-priority task of another queue.
+  void Schedule(std::function<void()> task, int64_t priority = 0);
+
+  // Runs every task that was already queued, then stops and joins all
+  // workers. Scheduling after Shutdown() is an error. Idempotent.
+  void Shutdown();
+
+  // The number of workers currently running.
+  int thread_count() const { return thread_count_.load(); }
+
+  // The index of the calling thread among its executor's workers, or -1 if
+  // it is not a worker.
+  static int CurrentWorkerIndex();
+
+  // The nodes the workers are pinned to; empty unless
+  // Options::pin_to_numa_nodes is set.
+  const std::vector<NumaNode>& numa_nodes() const { return numa_nodes_; }
+
+  // The index into numa_nodes() of the calling worker's node, or -1 if it is
+  // not a worker of an executor that pins its workers.
+  static int CurrentNumaNode();
+
+ private:
+  struct Task {
+    int64_t priority;
+    // Breaks ties in favor of the newest task (depth-first, so freshly
+    // produced operands are consumed while hot).
+    uint64_t sequence;
+    std::function<void()> run;
+
+    bool operator<(const Task& other) const {
+      return priority != other.priority ? priority < other.priority
+                                        : sequence < other.sequence;
+    }
+  };
+
+  // Ready tasks owned by one worker thread, as a max-heap.
+  struct WorkQueue {
+    absl::Mutex lock;
+    std::vector<Task> ready ABSL_GUARDED_BY(lock);
+    uint64_t next_sequence ABSL_GUARDED_BY(lock) = 0;
+  };
+
+  // Removes the top task of `queue`, if any, into `task`.
+  bool Pop(WorkQueue& queue, std::function<void()>* task);
+
+  static void* ThreadBodyStatic(void* worker);
+  void ThreadBody(int worker_index);
+
+  // Starts worker `worker_index`, whose queue must already exist.
+  void StartWorker(int worker_index) ABSL_EXCLUSIVE_LOCKS_REQUIRED(grow_lock_);
+
+  // In adaptive mode, adds a worker if every worker is busy and at least as
+  // many tasks are waiting as there are workers.
+  void MaybeGrow();
+
+  // Pops the top of the worker's own queue, or failing that steals the top of
+  // another worker's queue. Returns false if every queue is empty.
+  bool PopOrSteal(int worker_index, std::function<void()>* task);
+
+  const Options options_;
+  std::vector<NumaNode> numa_nodes_;
+  // Index into numa_nodes_ of each potential worker, or -1 if not pinned.
+  std::vector<int> worker_numa_node_;
+
+  // One queue per potential worker, allocated up front so that growing never
+  // moves a queue out from under a thief. Only the first thread_count_ are
+  // in use.
+  std::vector<std::unique_ptr<WorkQueue>> queues_;
+  std::atomic<int> thread_count_;
+  std::atomic<int> next_queue_;
+
+  // Number of tasks sitting in any WorkQueue, and number of workers parked
+  // on idle_cv_ waiting for that to become non-zero.
+  std::atomic<int> queued_;
+  std::atomic<int> idle_workers_;
+  absl::Mutex idle_lock_;
+  absl::CondVar idle_cv_;
+
+  std::atomic<bool> threads_should_exit_;
+
+  absl::Mutex grow_lock_;
+  std::vector<pthread_t> threads_ ABSL_GUARDED_BY(grow_lock_);
+  std::vector<std::pair<TfheExecutor*, int>> thread_args_;
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_EXECUTOR_H_
@@ -0,0 +1,192 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_executor.h"
+
+#include <atomic>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gtest/gtest.h"
+#include "transpiler/tfhe_numa.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+TEST(TfheExecutorTest, RunsNestedTasks) {
+  TfheExecutor::Options options;
+  options.thread_count = 4;
+  TfheExecutor executor(options);
+  EXPECT_EQ(executor.thread_count(), 4);
+
+  constexpr int kOuter = 100;
+  constexpr int kInner = 10;
+  std::atomic<int> ran(0);
+  absl::BlockingCounter done(kOuter * (kInner + 1));
+  for (int i = 0; i < kOuter; ++i) {
+    executor.Schedule([&]() {
+      for (int j = 0; j < kInner; ++j) {
+        executor.Schedule([&]() {
+          ran.fetch_add(1);
+          done.DecrementCount();
+        });
+      }
+      ran.fetch_add(1);
+      done.DecrementCount();
+    });
+  }
+  done.Wait();
+  EXPECT_EQ(ran.load(), kOuter * (kInner + 1));
+}
+
+TEST(TfheExecutorTest, AdaptiveGrowsUpToMax) {
+  TfheExecutor::Options options;
+  options.thread_count = 1;
+  options.adaptive = true;
+  options.max_thread_count = 4;
+  TfheExecutor executor(options);
+  EXPECT_EQ(executor.thread_count(), 1);
+
+  // Once the only worker is busy, anything else queued is wider than the
+  // pool.
+  constexpr int kTasks = 8;
+  absl::Notification started;
+  absl::Notification release;
+  absl::BlockingCounter done(kTasks);
+  executor.Schedule([&]() {
+    started.Notify();
+    release.WaitForNotification();
+    done.DecrementCount();
+  });
+  started.WaitForNotification();
+  for (int i = 1; i < kTasks; ++i) {
+    executor.Schedule([&]() {
+      release.WaitForNotification();
+      done.DecrementCount();
+    });
+  }
+  EXPECT_GT(executor.thread_count(), 1);
+  EXPECT_LE(executor.thread_count(), 4);
+  release.Notify();
+  done.Wait();
+}
+
+TEST(TfheExecutorTest, ShutdownDrainsQueuedTasks) {
+  TfheExecutor::Options options;
+  options.thread_count = 2;
+  TfheExecutor executor(options);
+
+  std::atomic<int> ran(0);
+  for (int i = 0; i < 50; ++i) {
+    executor.Schedule([&]() { ran.fetch_add(1); });
+  }
+  executor.Shutdown();
+  EXPECT_EQ(ran.load(), 50);
+  // A second shutdown is a no-op.
+  executor.Shutdown();
+}
+
+TEST(TfheExecutorTest, AdaptiveShutdownWhileTasksSchedule) {
+  TfheExecutor::Options options;
+  options.thread_count = 1;
+  options.adaptive = true;
+  options.max_thread_count = 4;
+  TfheExecutor executor(options);
+
+  // The busy worker only schedules its children once Shutdown() is joining
+  // it; with no idle worker, each of those would try to grow the pool.
+  constexpr int kChildren = 20;
+  std::atomic<int> ran(0);
+  absl::Notification started;
+  absl::Notification release;
+  executor.Schedule([&]() {
+    started.Notify();
+    release.WaitForNotification();
+    for (int i = 0; i < kChildren; ++i) {
+      executor.Schedule([&]() {
+        executor.Schedule([&]() { ran.fetch_add(1); });
+        ran.fetch_add(1);
+      });
+    }
+  });
+  started.WaitForNotification();
+  std::thread shutdown([&]() { executor.Shutdown(); });
+  absl::SleepFor(absl::Milliseconds(50));
+  release.Notify();
+  shutdown.join();
+  EXPECT_EQ(ran.load(), 2 * kChildren);
+}
+
+TEST(TfheExecutorTest, RunsHighestPriorityFirst) {
+  TfheExecutor::Options options;
+  options.thread_count = 1;
+  TfheExecutor executor(options);
+
+  // Hold the only worker while the prioritized tasks are queued.
+  absl::Notification release;
+  executor.Schedule([&]() { release.WaitForNotification(); });
+  absl::Mutex lock;
+  std::vector<int> order;
+  for (int priority : {1, 3, 2}) {
+    executor.Schedule(
+        [&, priority]() {
+          absl::MutexLock l(&lock);
+          order.push_back(priority);
+        },
+        priority);
+  }
+  release.Notify();
+  executor.Shutdown();
+  EXPECT_EQ(order, std::vector<int>({3, 2, 1}));
+}
+
+TEST(TfheExecutorTest, PinsWorkersToNumaNodes) {
+  // Two "nodes" sharing the CPUs of the first real one, so that the test runs
+  // on any machine.
+  const std::vector<int> cpus = DiscoverNumaNodes().front().cpus;
+  TfheExecutor::Options options;
+  options.thread_count = 4;
+  options.pin_to_numa_nodes = true;
+  options.numa_nodes = {{0, cpus}, {1, cpus}};
+  TfheExecutor executor(options);
+  ASSERT_EQ(executor.numa_nodes().size(), 2);
+  EXPECT_EQ(TfheExecutor::CurrentNumaNode(), -1);
+
+  constexpr int kTasks = 100;
+  absl::Mutex lock;
+  std::vector<int> task_nodes;
+  absl::BlockingCounter done(kTasks);
+  for (int i = 0; i < kTasks; ++i) {
+    executor.Schedule([&]() {
+      const int node = TfheExecutor::CurrentNumaNode();
+      // Workers are dealt to nodes round-robin.
+      EXPECT_EQ(node, TfheExecutor::CurrentWorkerIndex() % 2);
+      {
+        absl::MutexLock l(&lock);
+        task_nodes.push_back(node);
+      }
+      done.DecrementCount();
+    });
+  }
+  done.Wait();
+  EXPECT_EQ(task_nodes.size(), kTasks);
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
@@ -0,0 +1,132 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_incremental_runner.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "xls/common/status/status_macros.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+IncrementalTfheRunner::IncrementalTfheRunner(TfhePlan plan)
+    : IncrementalTfheRunner(std::move(plan), TfheRunner::Options()) {}
+
+IncrementalTfheRunner::IncrementalTfheRunner(TfhePlan plan,
+                                             TfheRunner::Options options)
+    : plan_(std::move(plan)), options_(options) {
+  std::vector<bool> written(plan_.param_names().size(), false);
+  for (const PlanOutputBit& output : plan_.outputs()) {
+    if (output.param != PlanOutputBit::kResult && !written[output.param]) {
+      written[output.param] = true;
+      written_params_.push_back({plan_.param_names()[output.param]});
+    }
+  }
+}
+
+IncrementalTfheRunner::~IncrementalTfheRunner() {
+  absl::MutexLock lock(&lock_);
+  FreeCache();
+}
+
+absl::Status IncrementalTfheRunner::Run(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  absl::MutexLock lock(&lock_);
+  AllocateCache(bk->params);
+  XLS_ASSIGN_OR_RETURN(std::shared_ptr<TfheRunner> runner,
+                       RunnerFor({}, /*recompute_all=*/true));
+  args[TfhePlan::kExtraParam] = cache_;
+  absl::Status status = runner->Run(result, std::move(args), bk);
+  cache_valid_ = status.ok();
+  return status;
+}
+
+absl::Status IncrementalTfheRunner::Update(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    absl::Span<const BitRange> changed,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  absl::MutexLock lock(&lock_);
+  AllocateCache(bk->params);
+  std::shared_ptr<TfheRunner> runner;
+  if (cache_valid_) {
+    std::vector<BitRange> all_changed(changed.begin(), changed.end());
+    all_changed.insert(all_changed.end(), written_params_.begin(),
+                       written_params_.end());
+    XLS_ASSIGN_OR_RETURN(runner,
+                         RunnerFor(all_changed, /*recompute_all=*/false));
+  } else {
+    XLS_ASSIGN_OR_RETURN(runner, RunnerFor({}, /*recompute_all=*/true));
+  }
+  args[TfhePlan::kExtraParam] = cache_;
+  // A failed call writes nothing, but the caller's next call names its
+  // changes relative to this one's arguments, which the cache does not hold.
+  absl::Status status = runner->Run(result, std::move(args), bk);
+  cache_valid_ = status.ok();
+  return status;
+}
+
+int IncrementalTfheRunner::cached_plan_count() { return runners_.size(); }
+
+absl::StatusOr<std::shared_ptr<TfheRunner>> IncrementalTfheRunner::RunnerFor(
+    absl::Span<const BitRange> changed, bool recompute_all) {
+  const std::vector<BitRange> canonical = Canonicalize(changed);
+  std::string key = recompute_all ? "*" : "";
+  absl::StrAppend(&key, CanonicalKey(canonical));
+  return runners_.GetOrCreate(
+      std::move(key), [&]() -> absl::StatusOr<std::unique_ptr<TfheRunner>> {
+        TfhePlan plan;
+        if (recompute_all) {
+          plan = plan_.Caching();
+        } else {
+          XLS_ASSIGN_OR_RETURN(plan, plan_.Incremental(canonical));
+        }
+        return std::make_unique<TfheRunner>(std::move(plan), options_);
+      });
+}
+
+void IncrementalTfheRunner::AllocateCache(
+    const TFheGateBootstrappingParameterSet* params) {
+  if (cache_ != nullptr && cache_params_ == params) {
+    return;
+  }
+  FreeCache();
+  cache_ = new_gate_bootstrapping_ciphertext_array(plan_.node_count(), params);
+  cache_params_ = params;
+  cache_valid_ = false;
+}
+
+void IncrementalTfheRunner::FreeCache() {
+  if (cache_ != nullptr) {
+    delete_gate_bootstrapping_ciphertext_array(plan_.node_count(), cache_);
+    cache_ = nullptr;
+  }
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
@@ -0,0 +1,113 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Incremental evaluation for callers that run a circuit over and over on
+// arguments that differ in only a few bits from one call to the next (e.g.,
+// one updated record of a database, or one more character of a string).
+//
+// Every gate's ciphertext from the last call is kept, and a call that names
+// the argument bits that changed re-evaluates only the gates those bits reach
+// (see TfhePlan::Incremental()), reading the rest from the kept values. Work
+// per call is then proportional to the affected part of the circuit rather
+// than to all of it.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_INCREMENTAL_RUNNER_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_INCREMENTAL_RUNNER_H_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+class IncrementalTfheRunner {
+ public:
+  IncrementalTfheRunner(TfhePlan plan, TfheRunner::Options options);
+  explicit IncrementalTfheRunner(TfhePlan plan);
+  ~IncrementalTfheRunner();
+
+  IncrementalTfheRunner(const IncrementalTfheRunner&) = delete;
+  IncrementalTfheRunner& operator=(const IncrementalTfheRunner&) = delete;
+
+  // Evaluates the whole circuit, as TfheRunner::Run() does, and keeps the
+  // value of every gate for later calls to Update().
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk);
+
+  // Evaluates the circuit for `args`, which hold the same values as in the
+  // previous call except in the bits listed in `changed`; only the gates
+  // those bits reach are re-evaluated. All outputs are written, as by Run().
+  // Bits of in/out parameters that the previous call wrote count as changed
+  // without being listed.
+  //
+  // Falls back to a full evaluation if there are no kept values to reuse:
+  // on the first call, after a failed call, or if `bk` uses different
+  // parameters than the previous call. The plan for each distinct set of
+  // changed bits (however `changed` orders or splits them) is built on first
+  // use, in time linear in the circuit but without evaluating anything; the
+  // few most recently used are kept for later calls.
+  absl::Status Update(LweSample* result,
+                      absl::flat_hash_map<std::string, LweSample*> args,
+                      absl::Span<const BitRange> changed,
+                      const TFheGateBootstrappingCloudKeySet* bk);
+
+  // The number of plans currently kept for reuse by Update().
+  int cached_plan_count();
+
+ private:
+  // Returns the runner for the plan recomputing the nodes `changed` reaches,
+  // or every node if `recompute_all`.
+  absl::StatusOr<std::shared_ptr<TfheRunner>> RunnerFor(
+      absl::Span<const BitRange> changed, bool recompute_all)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Makes sure the cache holds ciphertexts for `params`, invalidating it if
+  // they have to be reallocated.
+  void AllocateCache(const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void FreeCache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  const TfhePlan plan_;
+  const TfheRunner::Options options_;
+  // Each in/out parameter as a whole, all of whose bits change on every call.
+  std::vector<BitRange> written_params_;
+
+  // Calls are serialized, since each one builds on the last.
+  absl::Mutex lock_;
+  // Bit i holds the value of plan node i as of the last successful call.
+  LweSample* cache_ ABSL_GUARDED_BY(lock_) = nullptr;
+  const TFheGateBootstrappingParameterSet* cache_params_
+      ABSL_GUARDED_BY(lock_) = nullptr;
+  bool cache_valid_ ABSL_GUARDED_BY(lock_) = false;
+  // Runners by CanonicalKey() of the changed bits; see RunnerFor().
+  TfheRunnerCache runners_;
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_INCREMENTAL_RUNNER_H_
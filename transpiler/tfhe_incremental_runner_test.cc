@@ -0,0 +1,199 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_incremental_runner.h"
+
+#include <array>
+
+#include "absl/strings/string_view.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "transpiler/data/fhe_data.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "transpiler/tfhe_test_util.h"
+#include "transpiler/tfhe_trace.h"
+#include "xls/common/status/matchers.h"
+#include "xls/contrib/xlscc/metadata_output.pb.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::xls::status_testing::StatusIs;
+
+constexpr int kMainMinimumLambda = 120;
+
+// Bit 1 is x0 ^ x1, by way of three gates; bit 0 is y0 & y1.
+constexpr absl::string_view kIndependentHalves = R"(
+package my_package
+
+fn my_package(x: bits[2], y: bits[2]) -> bits[2] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(y, start=0, width=1, id=3)
+  bit_slice.4: bits[1] = bit_slice(y, start=1, width=1, id=4)
+  and.5: bits[1] = and(bit_slice.1, bit_slice.2, id=5)
+  or.6: bits[1] = or(and.5, bit_slice.1, id=6)
+  xor.7: bits[1] = xor(or.6, bit_slice.2, id=7)
+  and.8: bits[1] = and(bit_slice.3, bit_slice.4, id=8)
+  ret concat.9: bits[2] = concat(xor.7, and.8, id=9)
+}
+)";
+
+// Swaps the low two bits of the in/out param x.
+constexpr absl::string_view kSwapExample = R"(
+package my_package
+
+fn my_package(x: bits[2]) -> (bits[2]) {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  concat.3: bits[2] = concat(bit_slice.1, bit_slice.2, id=3)
+  ret tuple.4: (bits[2]) = tuple(concat.3, id=4)
+}
+)";
+
+TEST(IncrementalTfheRunnerTest, ReevaluatesOnlyChangedCone) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           CompilePlan(kIndependentHalves, metadata));
+  TraceRecorder trace;
+  TfheRunner::Options options;
+  options.trace = &trace;
+  IncrementalTfheRunner runner(std::move(plan), options);
+  int seen = 0;
+
+  auto x = FheValue<char>::Encrypt(1, key);
+  auto y = FheValue<char>::Encrypt(3, key);
+  FheValue<char> result(key.params());
+  XLS_ASSERT_OK(runner.Run(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                           key.cloud()));
+  EXPECT_EQ(result.Decrypt(key) & 3, 3);
+  EXPECT_EQ(GatesSince(trace, &seen), 4);
+
+  // Only and.8 reads y.
+  y = FheValue<char>::Encrypt(1, key);
+  XLS_ASSERT_OK(runner.Update(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                              {{"y"}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key) & 3, 2);
+  EXPECT_EQ(GatesSince(trace, &seen), 1);
+
+  // Bit 1 of x feeds all of and.5, or.6 and xor.7.
+  x = FheValue<char>::Encrypt(3, key);
+  XLS_ASSERT_OK(runner.Update(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                              {{"x", 1, 2}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key) & 3, 0);
+  EXPECT_EQ(GatesSince(trace, &seen), 3);
+
+  // A bad change list fails up front and leaves the kept values usable.
+  EXPECT_THAT(runner.Update(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                            {{"z"}}, key.cloud()),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  y = FheValue<char>::Encrypt(3, key);
+  XLS_ASSERT_OK(runner.Update(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                              {{"y", 1, 2}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key) & 3, 1);
+  EXPECT_EQ(GatesSince(trace, &seen), 1);
+
+  // Nothing changed: the outputs are rewritten from the kept values.
+  FheValue<char> copy(key.params());
+  XLS_ASSERT_OK(runner.Update(copy.get(), {{"x", x.get()}, {"y", y.get()}},
+                              {}, key.cloud()));
+  EXPECT_EQ(copy.Decrypt(key) & 3, 1);
+  EXPECT_EQ(GatesSince(trace, &seen), 0);
+}
+
+TEST(IncrementalTfheRunnerTest, FirstUpdateEvaluatesEverything) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           CompilePlan(kIndependentHalves, metadata));
+  IncrementalTfheRunner runner(std::move(plan));
+
+  auto x = FheValue<char>::Encrypt(2, key);
+  auto y = FheValue<char>::Encrypt(3, key);
+  FheValue<char> result(key.params());
+  XLS_ASSERT_OK(runner.Update(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                              {{"y"}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key) & 3, 3);
+}
+
+TEST(IncrementalTfheRunnerTest, CachesFewPlansByChangedBits) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           CompilePlan(kIndependentHalves, metadata));
+  IncrementalTfheRunner runner(std::move(plan));
+
+  auto x = FheValue<char>::Encrypt(1, key);
+  auto y = FheValue<char>::Encrypt(3, key);
+  FheValue<char> result(key.params());
+  XLS_ASSERT_OK(runner.Run(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                           key.cloud()));
+  EXPECT_EQ(runner.cached_plan_count(), 1);
+
+  // The same bits, listed in another order and split differently.
+  XLS_ASSERT_OK(runner.Update(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                              {{"y", 0, 2}, {"x", 1, 2}}, key.cloud()));
+  XLS_ASSERT_OK(runner.Update(result.get(), {{"x", x.get()}, {"y", y.get()}},
+                              {{"x", 1, 2}, {"y", 1, 2}, {"y", 0, 1}},
+                              key.cloud()));
+  EXPECT_EQ(runner.cached_plan_count(), 2);
+
+  // A new set of bits on every call keeps only the most recent plans.
+  for (int end = 1; end < 10; ++end) {
+    XLS_ASSERT_OK(runner.Update(result.get(),
+                                {{"x", x.get()}, {"y", y.get()}},
+                                {{"y", 0, end}}, key.cloud()));
+  }
+  EXPECT_LE(runner.cached_plan_count(), 4);
+  EXPECT_EQ(result.Decrypt(key) & 3, 3);
+}
+
+TEST(IncrementalTfheRunnerTest, WrittenParamsCountAsChanged) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_void();
+  auto* x = proto->add_params();
+  x->set_name("x");
+  x->set_is_reference(true);
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(kSwapExample, metadata));
+  IncrementalTfheRunner runner(std::move(plan));
+
+  auto value = FheValue<char>::Encrypt(1, key);
+  XLS_ASSERT_OK(runner.Run(nullptr, {{"x", value.get()}}, key.cloud()));
+  EXPECT_EQ(value.Decrypt(key), 2);
+  XLS_ASSERT_OK(runner.Update(nullptr, {{"x", value.get()}}, {}, key.cloud()));
+  EXPECT_EQ(value.Decrypt(key), 1);
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
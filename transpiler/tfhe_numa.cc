@@ -0,0 +1,149 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_numa.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "absl/types/span.h"
+#include "xls/common/file/filesystem.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+constexpr absl::string_view kNodeDirectory = "/sys/devices/system/node";
+
+// The CPUs the calling thread may run on.
+std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    return {0};
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// The ids of the node<N> entries of kNodeDirectory, in ascending order.
+std::vector<int> NodeIds() {
+  std::vector<int> ids;
+  DIR* dir = opendir(std::string(kNodeDirectory).c_str());
+  if (dir == nullptr) {
+    return ids;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    absl::string_view name = entry->d_name;
+    int id;
+    if (absl::ConsumePrefix(&name, "node") && absl::SimpleAtoi(name, &id)) {
+      ids.push_back(id);
+    }
+  }
+  closedir(dir);
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+}  // namespace
+
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view list) {
+  std::vector<int> cpus;
+  for (absl::string_view range :
+       absl::StrSplit(absl::StripAsciiWhitespace(list), ',',
+                      absl::SkipEmpty())) {
+    std::vector<absl::string_view> bounds = absl::StrSplit(range, '-');
+    int first, last;
+    if (bounds.size() > 2 || !absl::SimpleAtoi(bounds.front(), &first) ||
+        !absl::SimpleAtoi(bounds.back(), &last) || first < 0 ||
+        last < first) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Malformed CPU list: \"", list, "\""));
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<NumaNode> DiscoverNumaNodes() {
+  const std::vector<int> allowed = AllowedCpus();
+  std::vector<NumaNode> nodes;
+  for (int id : NodeIds()) {
+    absl::StatusOr<std::string> list = xls::GetFileContents(
+        absl::StrCat(kNodeDirectory, "/node", id, "/cpulist"));
+    if (!list.ok()) {
+      continue;
+    }
+    absl::StatusOr<std::vector<int>> cpus = ParseCpuList(*list);
+    if (!cpus.ok()) {
+      continue;
+    }
+    NumaNode node = {id, {}};
+    for (int cpu : *cpus) {
+      if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+        node.cpus.push_back(cpu);
+      }
+    }
+    // Memory-only nodes, and nodes this process is not allowed on, cannot
+    // host workers.
+    if (!node.cpus.empty()) {
+      nodes.push_back(std::move(node));
+    }
+  }
+  if (nodes.empty()) {
+    nodes.push_back({0, allowed});
+  }
+  return nodes;
+}
+
+absl::Status PinCurrentThread(absl::Span<const int> cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return absl::InvalidArgumentError(absl::StrCat("Invalid CPU ", cpu));
+    }
+    CPU_SET(cpu, &set);
+  }
+  const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (error != 0) {
+    return absl::InternalError(
+        absl::StrCat("pthread_setaffinity_np failed with error ", error));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
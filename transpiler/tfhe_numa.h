@@ -0,0 +1,52 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// NUMA topology discovery and thread pinning, for placing TfheExecutor
+// workers next to the memory they read.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_NUMA_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_NUMA_H_
+
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+struct NumaNode {
+  // The kernel's node number.
+  int id;
+  // The CPUs of the node that this process may run on.
+  std::vector<int> cpus;
+};
+
+// Parses a kernel CPU list such as "0-3,8-11".
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view list);
+
+// Returns the NUMA nodes that have CPUs this process may run on, from
+// /sys/devices/system/node. On machines (or containers) without that
+// information, returns a single node holding every allowed CPU. Never empty.
+std::vector<NumaNode> DiscoverNumaNodes();
+
+// Restricts the calling thread to `cpus`.
+absl::Status PinCurrentThread(absl::Span<const int> cpus);
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_NUMA_H_
@@ -0,0 +1,53 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_numa.h"
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "xls/common/status/matchers.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::xls::status_testing::IsOkAndHolds;
+using ::xls::status_testing::StatusIs;
+
+TEST(TfheNumaTest, ParsesCpuLists) {
+  EXPECT_THAT(ParseCpuList("0-3,8,10-11\n"),
+              IsOkAndHolds(ElementsAre(0, 1, 2, 3, 8, 10, 11)));
+  EXPECT_THAT(ParseCpuList("5"), IsOkAndHolds(ElementsAre(5)));
+  EXPECT_THAT(ParseCpuList("\n"), IsOkAndHolds(IsEmpty()));
+  EXPECT_THAT(ParseCpuList("3-1"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(ParseCpuList("0-1-2"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(ParseCpuList("a"), StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfheNumaTest, DiscoversAtLeastOneNode) {
+  std::vector<NumaNode> nodes = DiscoverNumaNodes();
+  ASSERT_FALSE(nodes.empty());
+  for (const NumaNode& node : nodes) {
+    EXPECT_FALSE(node.cpus.empty());
+  }
+  XLS_EXPECT_OK(PinCurrentThread(nodes.front().cpus));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
@@ -0,0 +1,227 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_out_of_core_runner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/magic.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "transpiler/tfhe_ciphertext_pool.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "xls/common/logging/logging.h"
+#include "xls/common/status/status_macros.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+absl::StatusOr<std::unique_ptr<OutOfCoreTfheRunner>>
+OutOfCoreTfheRunner::Create(TfhePlan plan, Options options) {
+  if (options.memory_budget_bytes <= 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Memory budget is not positive: ", options.memory_budget_bytes));
+  }
+  if (options.spill_directory.empty()) {
+    const char* tmpdir = getenv("TMPDIR");
+    options.spill_directory =
+        tmpdir != nullptr && *tmpdir != '\0' ? tmpdir : "/var/tmp";
+  }
+  return absl::WrapUnique(
+      new OutOfCoreTfheRunner(std::move(plan), std::move(options)));
+}
+
+OutOfCoreTfheRunner::OutOfCoreTfheRunner(TfhePlan plan, Options options)
+    : plan_(std::move(plan)), options_(std::move(options)) {}
+
+OutOfCoreTfheRunner::~OutOfCoreTfheRunner() {
+  absl::MutexLock lock(&lock_);
+  UnmapSpillFile();
+}
+
+absl::Status OutOfCoreTfheRunner::Run(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  return Run(result, std::move(args), bk, TfheRunner::RunOptions());
+}
+
+absl::Status OutOfCoreTfheRunner::Run(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk,
+    const TfheRunner::RunOptions& run_options) {
+  absl::MutexLock lock(&lock_);
+  XLS_RETURN_IF_ERROR(Prepare(bk->params));
+  stats_ = CallStats();
+  stats_.segment_count = segments_.size();
+  stats_.spill_file_bytes = spill_bytes_;
+
+  args[TfhePlan::kExtraParam] = frontier_;
+  for (int32_t s = 0; s < segments_.size(); ++s) {
+    // Page in what the next segment reads while this one is evaluated.
+    if (s + 1 < segments_.size()) {
+      Advise(reads_[s + 1], MADV_WILLNEED);
+    }
+    const bool last = s + 1 == segments_.size();
+    XLS_RETURN_IF_ERROR(
+        segments_[s]->Run(last ? result : nullptr, args, bk, run_options));
+    stats_.spilled_values += writes_[s].size();
+    // What this segment read and wrote is cold now. Dropping pages of a
+    // shared mapping keeps their contents in the file (dirty ones are
+    // written back), so this only gives the memory up; pages the next
+    // segment reads are faulted back in from the page cache.
+    Advise(reads_[s], MADV_DONTNEED);
+    Advise(writes_[s], MADV_DONTNEED);
+  }
+  return absl::OkStatus();
+}
+
+OutOfCoreTfheRunner::CallStats OutOfCoreTfheRunner::last_call_stats() const {
+  absl::MutexLock lock(&lock_);
+  return stats_;
+}
+
+absl::Status OutOfCoreTfheRunner::Prepare(
+    const TFheGateBootstrappingParameterSet* params) {
+  const int32_t dimension = params->in_out_params->n;
+  if (dimension == dimension_) {
+    return absl::OkStatus();
+  }
+  // The runners and pool go before anything else, so that a failure below
+  // leaves nothing cut for the old dimension.
+  segments_.clear();
+  pool_.reset();
+  UnmapSpillFile();
+  dimension_ = -1;
+
+  const int64_t ciphertext_bytes =
+      sizeof(LweSample) + int64_t{dimension} * sizeof(Torus32);
+  const int64_t max_values = options_.memory_budget_bytes / ciphertext_bytes;
+  absl::StatusOr<PlanSegments> cut = plan_.SegmentWithin(max_values);
+  if (!cut.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Memory budget of ", options_.memory_budget_bytes,
+        " bytes is too small: ", cut.status().message()));
+  }
+  PlanSegments segments = std::move(cut).value();
+
+  CiphertextPool::Options pool_options = options_.runner.pool;
+  pool_options.slab_size = static_cast<int>(
+      std::min<int64_t>(pool_options.slab_size, max_values));
+  pool_ = std::make_unique<CiphertextPool>(pool_options);
+  TfheRunner::Options runner_options = options_.runner;
+  runner_options.shared_pool = pool_.get();
+  for (TfhePlan& segment : segments.segments) {
+    segments_.push_back(
+        std::make_unique<TfheRunner>(std::move(segment), runner_options));
+  }
+  reads_ = std::move(segments.reads);
+  writes_ = std::move(segments.writes);
+  // At least one ciphertext, so that the spill parameter is never null.
+  frontier_size_ = std::max(segments.frontier_size, 1);
+  dimension_ = dimension;
+  XLS_RETURN_IF_ERROR(MapSpillFile(params));
+  return absl::OkStatus();
+}
+
+absl::Status OutOfCoreTfheRunner::MapSpillFile(
+    const TFheGateBootstrappingParameterSet* params) {
+  std::string path =
+      absl::StrCat(options_.spill_directory, "/tfhe_spill_XXXXXX");
+  const int fd = mkostemp(path.data(), O_CLOEXEC);
+  if (fd == -1) {
+    dimension_ = -1;
+    return absl::UnavailableError(absl::StrCat(
+        "Failed to create spill file ", path, ": ", strerror(errno)));
+  }
+  unlink(path.c_str());
+  struct statfs fs;
+  if (fstatfs(fd, &fs) == 0 && fs.f_type == TMPFS_MAGIC) {
+    XLS_LOG(WARNING) << "Spilling to " << options_.spill_directory
+                     << ", which is held in memory; set spill_directory to "
+                        "a directory on disk.";
+  }
+  const size_t mask_bytes = dimension_ * sizeof(Torus32);
+  const size_t bytes = frontier_size_ * mask_bytes;
+  void* spill = MAP_FAILED;
+  if (ftruncate(fd, bytes) == 0) {
+    spill = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  const int error = errno;
+  // The mapping keeps the file open.
+  close(fd);
+  if (spill == MAP_FAILED) {
+    dimension_ = -1;
+    return absl::ResourceExhaustedError(absl::StrCat(
+        "Failed to map a spill file of ", bytes, " bytes in ",
+        options_.spill_directory, ": ", strerror(error)));
+  }
+  spill_ = spill;
+  spill_bytes_ = bytes;
+
+  frontier_ = NewCiphertextArrayBackedBy(frontier_size_, params, spill_);
+  return absl::OkStatus();
+}
+
+void OutOfCoreTfheRunner::UnmapSpillFile() {
+  if (frontier_ == nullptr) {
+    return;
+  }
+  DeleteCiphertextArrayBackedBy(frontier_size_, frontier_);
+  frontier_ = nullptr;
+  munmap(spill_, spill_bytes_);
+  spill_ = nullptr;
+  spill_bytes_ = 0;
+}
+
+void OutOfCoreTfheRunner::Advise(absl::Span<const int32_t> slots,
+                                 int advice) {
+  const size_t page_bytes = sysconf(_SC_PAGESIZE);
+  const size_t mask_bytes = dimension_ * sizeof(Torus32);
+  char* const base = static_cast<char*>(spill_);
+  // Runs of consecutive slots are advised together, over the whole pages
+  // they touch.
+  for (int32_t begin = 0; begin < slots.size();) {
+    int32_t end = begin + 1;
+    while (end < slots.size() && slots[end] == slots[end - 1] + 1) {
+      ++end;
+    }
+    const size_t first = slots[begin] * mask_bytes / page_bytes * page_bytes;
+    const size_t last =
+        std::min(spill_bytes_, (slots[end - 1] + 1) * mask_bytes);
+    madvise(base + first, last - first, advice);
+    begin = end;
+  }
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
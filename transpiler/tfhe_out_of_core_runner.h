@@ -0,0 +1,151 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Evaluation within a memory budget, for circuits with more live
+// intermediate ciphertexts than fit in memory.
+//
+// The circuit is cut into segments that each need no more than the budget
+// (see TfhePlan::SegmentWithin()), and evaluated a segment at a time. Values
+// one segment leaves for later ones are spilled to a file, mapped into
+// memory so that the kernel pages them out as memory runs short, and pages
+// them back in, for each segment, while the segment before it is evaluated.
+// Between segments, the pages of values no longer needed soon are dropped
+// from memory.
+//
+// Usage:
+//
+// OutOfCoreTfheRunner::Options options;
+// options.memory_budget_bytes = int64_t{16} << 30;
+// XLS_ASSIGN_OR_RETURN(auto runner, OutOfCoreTfheRunner::Create(
+//                                       std::move(plan), options));
+// XLS_RETURN_IF_ERROR(runner->Run(result, {{"x", x}}, bk));
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_OUT_OF_CORE_RUNNER_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_OUT_OF_CORE_RUNNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "tfhe/tfhe.h"
+#include "transpiler/tfhe_ciphertext_pool.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+class OutOfCoreTfheRunner {
+ public:
+  struct Options {
+    // The most memory the ciphertexts of a segment may take: those it
+    // evaluates, and those it reads from the spill file. Ciphertexts outside
+    // the runner's control (the arguments and result) are not counted, nor
+    // are the spilled values' few bytes each of bookkeeping.
+    int64_t memory_budget_bytes = int64_t{1} << 30;
+
+    // Where the spill file is made; if empty, $TMPDIR or, failing that,
+    // /var/tmp. It should be on disk: on a memory-backed file system such as
+    // tmpfs (as /tmp often is) spilling frees no memory, so a warning is
+    // logged. The file is unlinked as soon as it is opened, so nothing is
+    // left behind should the process die.
+    std::string spill_directory;
+
+    // `runner.pool` and `runner.shared_pool` are overridden: the segments
+    // share a pool whose slabs fit the budget.
+    TfheRunner::Options runner;
+  };
+
+  // What the last call did.
+  struct CallStats {
+    int32_t segment_count = 0;
+    // The values written to the spill file, and the file's size.
+    int64_t spilled_values = 0;
+    int64_t spill_file_bytes = 0;
+  };
+
+  static absl::StatusOr<std::unique_ptr<OutOfCoreTfheRunner>> Create(
+      TfhePlan plan, Options options);
+  ~OutOfCoreTfheRunner();
+
+  OutOfCoreTfheRunner(const OutOfCoreTfheRunner&) = delete;
+  OutOfCoreTfheRunner& operator=(const OutOfCoreTfheRunner&) = delete;
+
+  // Evaluates the circuit, as TfheRunner::Run() does. The plan is cut into
+  // segments by the size of a ciphertext, so the first call (and any call
+  // with parameters of another LWE dimension than the last) cuts it anew.
+  // Calls are serialized. Fails if the budget is too small for even a
+  // single gate.
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk);
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk,
+                   const TfheRunner::RunOptions& run_options);
+
+  CallStats last_call_stats() const;
+
+ private:
+  OutOfCoreTfheRunner(TfhePlan plan, Options options);
+
+  // Cuts the plan into segments fitting the budget for ciphertexts of
+  // `params`, and maps a spill file for them, unless that is already done.
+  absl::Status Prepare(const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Maps a spill file with room for `frontier_size_` masks of `dimension_`
+  // coefficients, and points the masks of a new frontier_ into it.
+  absl::Status MapSpillFile(const TFheGateBootstrappingParameterSet* params)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void UnmapSpillFile() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Passes `advice` to madvise() for the pages holding the masks of `slots`
+  // (in increasing order).
+  void Advise(absl::Span<const int32_t> slots, int advice)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  const TfhePlan plan_;
+  const Options options_;
+
+  mutable absl::Mutex lock_;
+  // The LWE dimension the plan was last cut for, or -1.
+  int32_t dimension_ ABSL_GUARDED_BY(lock_) = -1;
+  // Declared before the segments, whose values it holds, so as to outlive
+  // them.
+  std::unique_ptr<CiphertextPool> pool_ ABSL_GUARDED_BY(lock_);
+  std::vector<std::unique_ptr<TfheRunner>> segments_ ABSL_GUARDED_BY(lock_);
+  std::vector<std::vector<int32_t>> reads_ ABSL_GUARDED_BY(lock_);
+  std::vector<std::vector<int32_t>> writes_ ABSL_GUARDED_BY(lock_);
+  int32_t frontier_size_ ABSL_GUARDED_BY(lock_) = 0;
+  // The spill file's mapping, and the ciphertexts whose masks live in it.
+  void* spill_ ABSL_GUARDED_BY(lock_) = nullptr;
+  size_t spill_bytes_ ABSL_GUARDED_BY(lock_) = 0;
+  LweSample* frontier_ ABSL_GUARDED_BY(lock_) = nullptr;
+  CallStats stats_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_OUT_OF_CORE_RUNNER_H_
@@ -0,0 +1,104 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_out_of_core_runner.h"
+
+#include <array>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "transpiler/data/fhe_data.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_test_util.h"
+#include "xls/common/status/matchers.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::xls::status_testing::StatusIs;
+
+constexpr int kMainMinimumLambda = 120;
+
+// The bytes of a ciphertext for `params`, as the runner counts them.
+int64_t CiphertextBytes(const TFheGateBootstrappingParameterSet* params) {
+  return sizeof(LweSample) + params->in_out_params->n * sizeof(Torus32);
+}
+
+TEST(OutOfCoreTfheRunnerTest, AddsWithinBudget) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(RippleCarryAdderIr(16)));
+
+  // Room for a handful of the adder's 74 gates at a time.
+  OutOfCoreTfheRunner::Options options;
+  options.memory_budget_bytes = 8 * CiphertextBytes(key.params());
+  XLS_ASSERT_OK_AND_ASSIGN(auto runner,
+                           OutOfCoreTfheRunner::Create(plan, options));
+  for (const auto& [x, y] : std::vector<std::pair<int16_t, int16_t>>{
+           {1, 2}, {12345, 4321}, {-1, 1}, {-32768, 32767}}) {
+    auto x_ciphertext = FheValue<int16_t>::Encrypt(x, key);
+    auto y_ciphertext = FheValue<int16_t>::Encrypt(y, key);
+    FheValue<int16_t> result(key.params());
+    XLS_ASSERT_OK(runner->Run(
+        result.get(), {{"x", x_ciphertext.get()}, {"y", y_ciphertext.get()}},
+        key.cloud()));
+    EXPECT_EQ(result.Decrypt(key), static_cast<int16_t>(x + y));
+  }
+  OutOfCoreTfheRunner::CallStats stats = runner->last_call_stats();
+  EXPECT_GT(stats.segment_count, 10);
+  EXPECT_GT(stats.spilled_values, 0);
+  EXPECT_GT(stats.spill_file_bytes, 0);
+
+  // With room for everything, there is nothing to spill.
+  options.memory_budget_bytes = 1000 * CiphertextBytes(key.params());
+  XLS_ASSERT_OK_AND_ASSIGN(runner, OutOfCoreTfheRunner::Create(plan, options));
+  auto x = FheValue<int16_t>::Encrypt(300, key);
+  auto y = FheValue<int16_t>::Encrypt(400, key);
+  FheValue<int16_t> result(key.params());
+  XLS_ASSERT_OK(
+      runner->Run(result.get(), {{"x", x.get()}, {"y", y.get()}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 700);
+  stats = runner->last_call_stats();
+  EXPECT_EQ(stats.segment_count, 1);
+  EXPECT_EQ(stats.spilled_values, 0);
+}
+
+TEST(OutOfCoreTfheRunnerTest, RejectsBudgetTooSmallForAGate) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(RippleCarryAdderIr(16)));
+
+  OutOfCoreTfheRunner::Options options;
+  options.memory_budget_bytes = 2 * CiphertextBytes(key.params());
+  XLS_ASSERT_OK_AND_ASSIGN(auto runner,
+                           OutOfCoreTfheRunner::Create(plan, options));
+  auto x = FheValue<int16_t>::Encrypt(1, key);
+  auto y = FheValue<int16_t>::Encrypt(2, key);
+  FheValue<int16_t> result(key.params());
+  EXPECT_THAT(
+      runner->Run(result.get(), {{"x", x.get()}, {"y", y.get()}}, key.cloud()),
+      StatusIs(absl::StatusCode::kInvalidArgument));
+
+  options.memory_budget_bytes = 0;
+  EXPECT_THAT(OutOfCoreTfheRunner::Create(plan, options).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
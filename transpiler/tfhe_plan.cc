@@ -0,0 +1,1724 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_plan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "xls/common/logging/logging.h"
+#include "xls/common/status/status_macros.h"
+#include "xls/contrib/xlscc/metadata_output.pb.h"
+#include "xls/ir/function.h"
+#include "xls/ir/node.h"
+#include "xls/ir/node_iterator.h"
+#include "xls/ir/nodes.h"
+#include "xls/ir/type.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+constexpr char kPlanMagic[8] = {'T', 'F', 'H', 'E', 'P', 'L', 'A', 'N'};
+// Bump whenever the layout of the header or of any section changes.
+constexpr uint32_t kPlanFormatVersion = 1;
+// Reads back as a different value on a machine of the other byte order.
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint64_t kSectionAlignment = 8;
+
+// The start of a serialized plan. The sections it points to follow it, in the
+// order they are listed here.
+struct PlanFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  // sizeof(PlanNode) and sizeof(PlanOutputBit) for the writer, which catches
+  // layout changes (e.g., from a different compiler) the version cannot.
+  uint32_t node_size;
+  uint32_t output_size;
+  int32_t level_count;
+  uint32_t has_return_value;
+  uint32_t node_count;
+  uint32_t operand_count;
+  uint32_t user_count;
+  uint32_t output_count;
+  uint32_t param_count;
+  uint32_t reserved;
+  // Byte offsets from the start of the header, each a multiple of
+  // kSectionAlignment.
+  uint64_t nodes_offset;
+  uint64_t operands_offset;
+  uint64_t users_offset;
+  uint64_t outputs_offset;
+  // Each parameter name is stored as a uint32_t length and then its bytes.
+  uint64_t param_names_offset;
+  // The size of the whole serialized plan.
+  uint64_t size;
+};
+static_assert(sizeof(PlanFileHeader) % kSectionAlignment == 0,
+              "Sections following the header would be misaligned");
+static_assert(std::is_trivially_copyable<PlanNode>::value &&
+                  std::is_trivially_copyable<PlanOutputBit>::value,
+              "Plan arrays are read in place from serialized plans");
+
+uint64_t AlignSection(uint64_t offset) {
+  return (offset + kSectionAlignment - 1) / kSectionAlignment *
+         kSectionAlignment;
+}
+
+// Returns the `count` elements of type T at `offset` in `data`, or an empty
+// span if they do not fit.
+template <typename T>
+absl::Span<const T> Section(absl::string_view data, uint64_t offset,
+                            uint64_t count) {
+  if (offset % kSectionAlignment != 0 || offset < sizeof(PlanFileHeader) ||
+      offset > data.size() || count > (data.size() - offset) / sizeof(T)) {
+    return {};
+  }
+  return absl::MakeConstSpan(reinterpret_cast<const T*>(data.data() + offset),
+                             count);
+}
+
+absl::Status CorruptPlanError(absl::string_view detail) {
+  return absl::InvalidArgumentError(
+      absl::StrCat("Corrupt serialized plan: ", detail));
+}
+
+// How far past its share of the bootstraps a part may be filled when
+// partitioning, to leave room for following the edges of the circuit.
+constexpr double kPartitionSlack = 1.05;
+
+// The number of bootstraps evaluating `op` takes.
+int BootstrapCount(PlanOp op) {
+  if (IsBootstrapFree(op)) {
+    return 0;
+  }
+  return op == PlanOp::kMux ? 2 : 1;
+}
+
+// The number of operands a node evaluating `op` reads.
+int OperandCount(PlanOp op) {
+  switch (op) {
+    case PlanOp::kConstant:
+    case PlanOp::kParamBit:
+      return 0;
+    case PlanOp::kNot:
+      return 1;
+    case PlanOp::kMux:
+      return 3;
+    default:
+      return 2;
+  }
+}
+
+}  // namespace
+
+absl::string_view PlanOpName(PlanOp op) {
+  switch (op) {
+    case PlanOp::kConstant:
+      return "constant";
+    case PlanOp::kParamBit:
+      return "param_bit";
+    case PlanOp::kNot:
+      return "not";
+    case PlanOp::kAnd:
+      return "and";
+    case PlanOp::kOr:
+      return "or";
+    case PlanOp::kXor:
+      return "xor";
+    case PlanOp::kNand:
+      return "nand";
+    case PlanOp::kNor:
+      return "nor";
+    case PlanOp::kMux:
+      return "mux";
+  }
+  return "unknown";
+}
+
+bool IsBootstrapFree(PlanOp op) {
+  switch (op) {
+    case PlanOp::kConstant:
+    case PlanOp::kParamBit:
+    case PlanOp::kNot:
+      return true;
+    default:
+      return false;
+  }
+}
+
+class TfhePlan::Compiler {
+ public:
+  Compiler(const xls::Function* function,
+           const xlscc_metadata::MetadataOutput& metadata, TfhePlan* plan)
+      : function_(function), metadata_(metadata), plan_(plan) {}
+
+  absl::Status Compile() {
+    for (const xls::Param* param : function_->params()) {
+      param_index_[param->name()] = plan_->param_names_.size();
+      plan_->param_names_.push_back(param->name());
+    }
+
+    // First pass: turn every value-producing node into a plan node, and
+    // record its operands as XLS nodes.
+    std::vector<std::vector<const xls::Node*>> xls_operands;
+    for (xls::Node* n : xls::TopoSort(const_cast<xls::Function*>(function_))) {
+      PlanNode node = {};
+      XLS_ASSIGN_OR_RETURN(bool produces_value, Lower(n, &node));
+      if (!produces_value) {
+        continue;
+      }
+      node_index_[n] = arrays_.nodes.size();
+      arrays_.nodes.push_back(node);
+      if (node.op == PlanOp::kConstant || node.op == PlanOp::kParamBit) {
+        xls_operands.emplace_back();
+      } else {
+        xls_operands.emplace_back(n->operands().begin(), n->operands().end());
+      }
+    }
+
+    // Second pass: resolve operands to plan node indices.
+    std::vector<std::vector<int32_t>> operands(arrays_.nodes.size());
+    for (int32_t i = 0; i < arrays_.nodes.size(); ++i) {
+      for (const xls::Node* operand : xls_operands[i]) {
+        auto found = node_index_.find(operand);
+        if (found == node_index_.end()) {
+          return absl::InvalidArgumentError(
+              absl::StrCat("Unsupported gate operand: ", operand->ToString()));
+        }
+        operands[i].push_back(found->second);
+      }
+    }
+
+    XLS_RETURN_IF_ERROR(CollectOutputs());
+    plan_->Link(std::move(arrays_), operands);
+    return absl::OkStatus();
+  }
+
+ private:
+  // Fills in `node` for `n`, or returns false if `n` produces no ciphertext of
+  // its own (i.e., it only serves to address bits of other values).
+  absl::StatusOr<bool> Lower(xls::Node* n, PlanNode* node) {
+    switch (n->op()) {
+      case xls::Op::kArray:
+      case xls::Op::kArrayIndex:
+      case xls::Op::kConcat:
+      case xls::Op::kParam:
+      case xls::Op::kShrl:
+      case xls::Op::kTuple:
+      case xls::Op::kTupleIndex:
+        // These are all handled as operands to slice nodes.
+        return false;
+      case xls::Op::kBitSlice:
+        XLS_RETURN_IF_ERROR(LowerBitSlice(n->As<xls::BitSlice>(), node));
+        return true;
+      case xls::Op::kLiteral: {
+        // Literals must be bits with width 1, or else used purely as array
+        // indices.
+        auto literal = n->As<xls::Literal>();
+        auto bits = literal->GetType()->AsBitsOrDie();
+        if (bits->bit_count() != 1) {
+          // We allow literals strictly for pulling values out of [param]
+          // arrays.
+          for (const xls::Node* user : literal->users()) {
+            if (!user->Is<xls::ArrayIndex>()) {
+              return absl::InvalidArgumentError(
+                  absl::StrCat("Unsupported literal: ", n->ToString()));
+            }
+          }
+          return false;
+        }
+        node->op = PlanOp::kConstant;
+        node->value = !literal->value().IsAllZeros();
+        return true;
+      }
+      case xls::Op::kAnd:
+        XLS_RETURN_IF_ERROR(CheckOperandCount(n, 2));
+        node->op = PlanOp::kAnd;
+        return true;
+      case xls::Op::kOr:
+        XLS_RETURN_IF_ERROR(CheckOperandCount(n, 2));
+        node->op = PlanOp::kOr;
+        return true;
+      case xls::Op::kNot:
+        XLS_RETURN_IF_ERROR(CheckOperandCount(n, 1));
+        node->op = PlanOp::kNot;
+        return true;
+      case xls::Op::kXor:
+        XLS_RETURN_IF_ERROR(CheckOperandCount(n, 2));
+        node->op = PlanOp::kXor;
+        return true;
+      case xls::Op::kNand:
+        XLS_RETURN_IF_ERROR(CheckOperandCount(n, 2));
+        node->op = PlanOp::kNand;
+        return true;
+      case xls::Op::kNor:
+        XLS_RETURN_IF_ERROR(CheckOperandCount(n, 2));
+        node->op = PlanOp::kNor;
+        return true;
+      case xls::Op::kSel:
+        XLS_RETURN_IF_ERROR(CheckBitSelect(n->As<xls::Select>()));
+        node->op = PlanOp::kMux;
+        return true;
+      default:
+        return absl::InvalidArgumentError(
+            absl::StrCat("Unsupported node: ", n->ToString()));
+    }
+  }
+
+  static absl::Status CheckOperandCount(const xls::Node* n, int count) {
+    if (n->operand_count() != count) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Expected ", count, " operands: ", n->ToString()));
+    }
+    return absl::OkStatus();
+  }
+
+  // Only selects that TFHE's MUX gate can evaluate directly are supported:
+  // a 1-bit selector choosing between exactly two cases.
+  static absl::Status CheckBitSelect(const xls::Select* select) {
+    if (select->selector()->GetType()->GetFlatBitCount() != 1 ||
+        select->cases().size() != 2 || select->default_value().has_value()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unsupported select: ", select->ToString()));
+    }
+    return absl::OkStatus();
+  }
+
+  // Resolves the parameter bit read by `bit_slice`.
+  absl::Status LowerBitSlice(const xls::BitSlice* bit_slice, PlanNode* node) {
+    xls::Node* operand = bit_slice->operand(0);
+    int slice_idx = 0;
+
+    if (operand->Is<xls::ArrayIndex>()) {
+      // If we're slicing into an array index, then we just need to get
+      // the bit offset of index in the bit vector that represents the array
+      // (in booleanified space).
+      const xls::ArrayIndex* array_index = operand->As<xls::ArrayIndex>();
+      XLS_ASSIGN_OR_RETURN(const xls::ArrayType* array_type,
+                           array_index->array()->GetType()->AsArray());
+
+      // TODO: Only literal indices into single-dimensional arrays
+      // are currently supported. To extend past 1-d, we'll need to walk up
+      // the array index chain, determining at each step the offset from
+      // element 0, and pass that back down here.
+      absl::Span<xls::Node* const> indices = array_index->indices();
+      if (indices.size() != 1) {
+        return absl::InvalidArgumentError(
+            "Only single-dimensional arrays/array indices are supported.");
+      }
+      if (!indices[0]->Is<xls::Literal>()) {
+        return absl::InvalidArgumentError(
+            "Only literal indexes into arrays are supported.");
+      }
+      xls::Literal* literal = indices[0]->As<xls::Literal>();
+
+      XLS_ASSIGN_OR_RETURN(int64_t concrete_index,
+                           literal->value().bits().ToUint64());
+      slice_idx =
+          array_type->element_type()->GetFlatBitCount() * concrete_index;
+      slice_idx += bit_slice->start();
+
+      while (!operand->Is<xls::Param>()) {
+        operand = operand->operand(0);
+        XLS_RETURN_IF_ERROR(CheckBitSliceChain(operand));
+      }
+    } else {
+      // TODO: Only single-dimensional indexes are supported at the
+      // moment.
+      auto is_special_node = [](xls::Node* operand) {
+        return operand->Is<xls::Param>() || operand->Is<xls::TupleIndex>();
+      };
+      if (is_special_node(operand)) {
+        slice_idx = bit_slice->start();
+      } else {
+        // Walk up the tree until a param is found.
+        while (!is_special_node(operand)) {
+          slice_idx++;
+          // Assuming SHR.
+          operand = operand->operand(0);
+          XLS_RETURN_IF_ERROR(CheckBitSliceChain(operand));
+        }
+      }
+    }
+
+    // Overflow SHR: the bit was shifted out, and so is zero.
+    if (operand->GetType()->GetFlatBitCount() == slice_idx) {
+      node->op = PlanOp::kConstant;
+      node->value = false;
+      return absl::OkStatus();
+    }
+
+    std::string param_name = operand->GetName();
+    if (operand->GetType()->GetFlatBitCount() == 1) {
+      if (operand->Is<xls::TupleIndex>() || operand->Is<xls::ArrayIndex>()) {
+        param_name = operand->operand(0)->GetName();
+      }
+    }
+    auto found_param = param_index_.find(param_name);
+    if (found_param == param_index_.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("BitSlice of unknown param: ", bit_slice->ToString()));
+    }
+    node->op = PlanOp::kParamBit;
+    node->param = found_param->second;
+    node->param_bit = slice_idx;
+    return absl::OkStatus();
+  }
+
+  // Verify that the only things allowed in a BitSlice chain are array
+  // indexes, tuple indexes, other bit slices, and the eventual params.
+  static absl::Status CheckBitSliceChain(const xls::Node* operand) {
+    if (operand->Is<xls::ArrayIndex>() || operand->Is<xls::BitSlice>() ||
+        operand->Is<xls::Param>() || operand->Is<xls::TupleIndex>()) {
+      return absl::OkStatus();
+    }
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid BitSlice operand: ", operand->ToString()));
+  }
+
+  // Array support will need to be updated when structs are added: it could be
+  // possible that there is padding present between subsequent elements in an
+  // array of these structs that is not captured by the corresponding XLS type
+  // - for example, a 56-byte struct will likely be padded out to 64 bytes
+  // internally. This code would assume that struct data is all packed, and
+  // thus the output would be garbled. Host layout will need to be considered
+  // here.
+  absl::Status CollectNodeValue(const xls::Node* node, int32_t output_param,
+                                int output_offset) {
+    xls::Type* type = node->GetType();
+    switch (type->kind()) {
+      case xls::TypeKind::kBits: {
+        // If this is a single bit, then we can [finally] emit the copy.
+        int64_t bit_count = type->GetFlatBitCount();
+        if (bit_count == 1) {
+          // We can't handle concats in the transpiler, so if our single-bit is
+          // one, walk up a level.
+          while (node->Is<xls::Concat>()) {
+            node = node->operand(0);
+          }
+          auto found = node_index_.find(node);
+          if (found == node_index_.end()) {
+            return absl::InvalidArgumentError(
+                absl::StrCat("Unsupported output bit: ", node->ToString()));
+          }
+          arrays_.outputs.push_back(
+              {output_param, output_offset, found->second});
+          break;
+        }
+
+        // Otherwise, keep drilling down. Note that we iterate over bits in
+        // "reverse" order, to match XLS' internal big-endian bit ordering (NOT
+        // BYTE ORDERING) to the currently assumed little-endian bit ordering
+        // of the host.
+        for (int i = 0; i < bit_count; i++) {
+          XLS_RETURN_IF_ERROR(CollectNodeValue(
+              node->operand(i), output_param,
+              output_offset + (bit_count - i - 1)));
+        }
+        break;
+      }
+      case xls::TypeKind::kArray: {
+        const xls::ArrayType* array_type = type->AsArrayOrDie();
+        int64_t stride = array_type->element_type()->GetFlatBitCount();
+        for (int i = 0; i < array_type->size(); i++) {
+          XLS_RETURN_IF_ERROR(CollectNodeValue(node->operand(i), output_param,
+                                               output_offset + i * stride));
+        }
+        break;
+      }
+      case xls::TypeKind::kTuple: {
+        // TODO: Populating output tuple types can be dangerous -
+        // if they correspond to C structures, then there could be strange
+        // issues such as host-native structure layout not matching the packed
+        // layout used inside XLS, e.g.,
+        // struct Foo {
+        //  char a;
+        //  short b;
+        //  int c;
+        // };
+        // may have padding inserted around some elements. User beware (for
+        // now, at least).
+        const xls::TupleType* tuple_type = type->AsTupleOrDie();
+        int64_t sub_offset = 0;
+        for (int i = 0; i < tuple_type->size(); i++) {
+          XLS_RETURN_IF_ERROR(CollectNodeValue(node->operand(i), output_param,
+                                               output_offset + sub_offset));
+          sub_offset += node->operand(i)->GetType()->GetFlatBitCount();
+        }
+        break;
+      }
+      default:
+        return absl::InvalidArgumentError(
+            absl::StrCat("Unsupported type kind: ", type->kind()));
+    }
+    return absl::OkStatus();
+  }
+
+  // Walks the type elements comprising the function's output type and records
+  // the copies needed to extract the data corresponding to each.
+  //
+  // At present, the output must be of the form (A, B), where A is bits- or
+  // array-typed, and B must be a tuple containing only bits- or array-typed
+  // elements. A corresponds to the output from the original C++ function
+  // itself, and the elements of B are the in/out params to the function.
+  absl::Status CollectOutputs() {
+    const xls::Node* return_value = function_->return_value();
+    if (return_value == nullptr) {
+      return absl::InvalidArgumentError("Function has no return value.");
+    }
+
+    std::vector<const xls::Node*> elements;
+    const xls::Type* type = return_value->GetType();
+    if (type->kind() == xls::TypeKind::kTuple) {
+      elements.insert(elements.begin(), return_value->operands().begin(),
+                      return_value->operands().end());
+    } else {
+      elements.push_back(return_value);
+    }
+
+    plan_->has_return_value_ =
+        !metadata_.top_func_proto().return_type().has_as_void();
+
+    if (elements.empty()) {
+      return absl::OkStatus();
+    }
+
+    int output_idx = 0;
+    if (plan_->has_return_value_) {
+      XLS_RETURN_IF_ERROR(CollectNodeValue(elements[output_idx++],
+                                           PlanOutputBit::kResult, 0));
+    }
+
+    const auto& fn_params = metadata_.top_func_proto().params();
+    int param_idx = 0;
+    for (; output_idx < elements.size(); output_idx++) {
+      const xlscc_metadata::FunctionParameter* param;
+      while (true) {
+        param = &fn_params[param_idx++];
+        if (!param->is_const() && param->is_reference()) {
+          break;
+        }
+
+        if (param_idx == fn_params.size()) {
+          return absl::InternalError(absl::StrCat(
+              "No matching in/out param for function param: ", param->name()));
+        }
+      }
+
+      auto found_param = param_index_.find(param->name());
+      if (found_param == param_index_.end()) {
+        return absl::InternalError(
+            absl::StrCat("No XLS param for in/out param: ", param->name()));
+      }
+      XLS_RETURN_IF_ERROR(
+          CollectNodeValue(elements[output_idx], found_param->second, 0));
+    }
+
+    return absl::OkStatus();
+  }
+
+  const xls::Function* function_;
+  const xlscc_metadata::MetadataOutput& metadata_;
+  TfhePlan* plan_;
+  Arrays arrays_;
+
+  absl::flat_hash_map<std::string, int32_t> param_index_;
+  absl::flat_hash_map<const xls::Node*, int32_t> node_index_;
+};
+
+// Folds public parameter bits through a plan, building the residual plan as
+// it goes. Nodes are visited in order, so every operand has been folded by the
+// time its users are.
+class TfhePlan::Specializer {
+ public:
+  Specializer(const TfhePlan& plan, const PublicParams& public_params,
+              TfhePlan* residual)
+      : plan_(plan), public_params_(public_params), residual_(residual) {}
+
+  absl::Status Specialize() {
+    std::vector<int32_t> param_map(plan_.param_names_.size(), -1);
+    public_bits_.resize(plan_.param_names_.size(), nullptr);
+    for (int32_t i = 0; i < plan_.param_names_.size(); ++i) {
+      const std::string& name = plan_.param_names_[i];
+      auto found = public_params_.find(name);
+      if (found != public_params_.end()) {
+        public_bits_[i] = &found->second;
+      } else {
+        param_map[i] = residual_->param_names_.size();
+        residual_->param_names_.push_back(name);
+      }
+    }
+    for (const auto& entry : public_params_) {
+      if (std::find(plan_.param_names_.begin(), plan_.param_names_.end(),
+                    entry.first) == plan_.param_names_.end()) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Unknown public parameter: ", entry.first));
+      }
+    }
+    for (const PlanOutputBit& output : plan_.outputs_) {
+      if (output.param != PlanOutputBit::kResult &&
+          public_bits_[output.param] != nullptr) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Public parameter is written by the function: ",
+                         plan_.param_names_[output.param]));
+      }
+    }
+
+    std::vector<Value> values;
+    values.reserve(plan_.nodes_.size());
+    for (int32_t i = 0; i < plan_.nodes_.size(); ++i) {
+      const PlanNode& node = plan_.nodes_[i];
+      std::vector<Value> in;
+      for (int32_t operand : plan_.operands(i)) {
+        in.push_back(values[operand]);
+      }
+      switch (node.op) {
+        case PlanOp::kConstant:
+          values.push_back(Constant(node.value));
+          break;
+        case PlanOp::kParamBit: {
+          const std::vector<bool>* bits = public_bits_[node.param];
+          if (bits == nullptr) {
+            PlanNode param_bit = {};
+            param_bit.op = PlanOp::kParamBit;
+            param_bit.param = param_map[node.param];
+            param_bit.param_bit = node.param_bit;
+            values.push_back(Add(param_bit, {}));
+          } else if (node.param_bit >= bits->size()) {
+            return absl::InvalidArgumentError(absl::StrCat(
+                "Public parameter ", plan_.param_names_[node.param], " has ",
+                bits->size(), " bits; the function reads bit ",
+                node.param_bit));
+          } else {
+            values.push_back(Constant((*bits)[node.param_bit]));
+          }
+          break;
+        }
+        case PlanOp::kNot:
+          values.push_back(Not(in[0]));
+          break;
+        case PlanOp::kAnd:
+          values.push_back(And(in[0], in[1]));
+          break;
+        case PlanOp::kOr:
+          values.push_back(Or(in[0], in[1]));
+          break;
+        case PlanOp::kXor:
+          values.push_back(Xor(in[0], in[1]));
+          break;
+        case PlanOp::kNand:
+          values.push_back(Nand(in[0], in[1]));
+          break;
+        case PlanOp::kNor:
+          values.push_back(Nor(in[0], in[1]));
+          break;
+        case PlanOp::kMux:
+          values.push_back(Mux(in[0], in[1], in[2]));
+          break;
+      }
+    }
+
+    std::vector<PlanOutputBit> outputs;
+    for (const PlanOutputBit& output : plan_.outputs_) {
+      const int32_t param = output.param == PlanOutputBit::kResult
+                                ? PlanOutputBit::kResult
+                                : param_map[output.param];
+      outputs.push_back({param, output.bit, Materialize(values[output.node])});
+    }
+    residual_->has_return_value_ = plan_.has_return_value_;
+    // Gates whose every user folded to a constant are left dead.
+    residual_->LinkLiveNodes(std::move(nodes_), operands_, std::move(outputs));
+    return absl::OkStatus();
+  }
+
+ private:
+  // A folded node: a known bit, or a node of the residual plan.
+  struct Value {
+    bool constant;
+    bool bit;
+    int32_t node;
+
+    bool SameAs(const Value& other) const {
+      return constant ? other.constant && bit == other.bit
+                      : !other.constant && node == other.node;
+    }
+  };
+
+  static Value Constant(bool bit) { return {true, bit, -1}; }
+
+  Value Add(PlanNode node, std::vector<int32_t> operands) {
+    nodes_.push_back(node);
+    operands_.push_back(std::move(operands));
+    return {false, false, static_cast<int32_t>(nodes_.size() - 1)};
+  }
+
+  Value Gate(PlanOp op, std::vector<int32_t> operands) {
+    PlanNode node = {};
+    node.op = op;
+    return Add(node, std::move(operands));
+  }
+
+  Value Not(Value a) {
+    if (a.constant) return Constant(!a.bit);
+    // NOT is free, but a double negation still costs a ciphertext.
+    if (nodes_[a.node].op == PlanOp::kNot) {
+      return {false, false, operands_[a.node][0]};
+    }
+    return Gate(PlanOp::kNot, {a.node});
+  }
+
+  Value And(Value a, Value b) {
+    if (a.constant) return a.bit ? b : a;
+    if (b.constant) return b.bit ? a : b;
+    if (a.node == b.node) return a;
+    return Gate(PlanOp::kAnd, {a.node, b.node});
+  }
+
+  Value Or(Value a, Value b) {
+    if (a.constant) return a.bit ? a : b;
+    if (b.constant) return b.bit ? b : a;
+    if (a.node == b.node) return a;
+    return Gate(PlanOp::kOr, {a.node, b.node});
+  }
+
+  Value Xor(Value a, Value b) {
+    if (a.constant) return a.bit ? Not(b) : b;
+    if (b.constant) return b.bit ? Not(a) : a;
+    if (a.node == b.node) return Constant(false);
+    return Gate(PlanOp::kXor, {a.node, b.node});
+  }
+
+  Value Nand(Value a, Value b) {
+    if (a.constant || b.constant || a.node == b.node) return Not(And(a, b));
+    return Gate(PlanOp::kNand, {a.node, b.node});
+  }
+
+  Value Nor(Value a, Value b) {
+    if (a.constant || b.constant || a.node == b.node) return Not(Or(a, b));
+    return Gate(PlanOp::kNor, {a.node, b.node});
+  }
+
+  Value Mux(Value selector, Value on_false, Value on_true) {
+    if (selector.constant) return selector.bit ? on_true : on_false;
+    if (on_false.SameAs(on_true)) return on_false;
+    if (on_false.constant && on_true.constant) {
+      return on_true.bit ? selector : Not(selector);
+    }
+    if (on_false.constant) {
+      return on_false.bit ? Or(Not(selector), on_true) : And(selector, on_true);
+    }
+    if (on_true.constant) {
+      return on_true.bit ? Or(selector, on_false)
+                         : And(Not(selector), on_false);
+    }
+    return Gate(PlanOp::kMux, {selector.node, on_false.node, on_true.node});
+  }
+
+  // Returns the residual node holding `value`, adding a constant node for it
+  // if need be.
+  int32_t Materialize(Value value) {
+    if (!value.constant) return value.node;
+    int32_t& node = constant_nodes_[value.bit];
+    if (node < 0) {
+      PlanNode constant = {};
+      constant.op = PlanOp::kConstant;
+      constant.value = value.bit;
+      node = Add(constant, {}).node;
+    }
+    return node;
+  }
+
+  const TfhePlan& plan_;
+  const PublicParams& public_params_;
+  TfhePlan* const residual_;
+
+  // Indexed by the original plan's parameter indices; null for secret ones.
+  std::vector<const std::vector<bool>*> public_bits_;
+  // The residual plan's nodes, before linking.
+  std::vector<PlanNode> nodes_;
+  std::vector<std::vector<int32_t>> operands_;
+  int32_t constant_nodes_[2] = {-1, -1};
+};
+
+void TfhePlan::LinkLiveNodes(std::vector<PlanNode> nodes,
+                             absl::Span<const std::vector<int32_t>> operands,
+                             std::vector<PlanOutputBit> outputs) {
+  std::vector<bool> live(nodes.size(), false);
+  for (const PlanOutputBit& output : outputs) {
+    live[output.node] = true;
+  }
+  for (int32_t i = nodes.size() - 1; i >= 0; --i) {
+    if (!live[i]) continue;
+    for (int32_t operand : operands[i]) {
+      live[operand] = true;
+    }
+  }
+
+  std::vector<int32_t> new_index(nodes.size(), -1);
+  Arrays arrays;
+  std::vector<std::vector<int32_t>> live_operands;
+  for (int32_t i = 0; i < nodes.size(); ++i) {
+    if (!live[i]) continue;
+    new_index[i] = arrays.nodes.size();
+    arrays.nodes.push_back(nodes[i]);
+    live_operands.emplace_back();
+    for (int32_t operand : operands[i]) {
+      live_operands.back().push_back(new_index[operand]);
+    }
+  }
+  for (PlanOutputBit& output : outputs) {
+    output.node = new_index[output.node];
+  }
+  arrays.outputs = std::move(outputs);
+  Link(std::move(arrays), live_operands);
+}
+
+void TfhePlan::Link(Arrays arrays,
+                    absl::Span<const std::vector<int32_t>> operands) {
+  std::vector<std::vector<int32_t>> users(arrays.nodes.size());
+  level_count_ = 0;
+  for (int32_t i = 0; i < arrays.nodes.size(); ++i) {
+    PlanNode& node = arrays.nodes[i];
+    node.operands_begin = arrays.operands.size();
+    node.operand_count = operands[i].size();
+    node.level = 0;
+    node.output_count = 0;
+    for (int32_t operand : operands[i]) {
+      arrays.operands.push_back(operand);
+      users[operand].push_back(i);
+      node.level = std::max(node.level, arrays.nodes[operand].level + 1);
+    }
+    level_count_ = std::max(level_count_, node.level + 1);
+  }
+  for (int32_t i = 0; i < arrays.nodes.size(); ++i) {
+    PlanNode& node = arrays.nodes[i];
+    node.users_begin = arrays.users.size();
+    node.user_count = users[i].size();
+    arrays.users.insert(arrays.users.end(), users[i].begin(), users[i].end());
+  }
+  for (const PlanOutputBit& output : arrays.outputs) {
+    ++arrays.nodes[output.node].output_count;
+  }
+
+  auto shared = std::make_shared<Arrays>(std::move(arrays));
+  nodes_ = shared->nodes;
+  operands_ = shared->operands;
+  users_ = shared->users;
+  outputs_ = shared->outputs;
+  storage_ = std::move(shared);
+}
+
+absl::StatusOr<TfhePlan> TfhePlan::Compile(
+    const xls::Function* function,
+    const xlscc_metadata::MetadataOutput& metadata) {
+  TfhePlan plan;
+  XLS_RETURN_IF_ERROR(Compiler(function, metadata, &plan).Compile());
+  return plan;
+}
+
+absl::StatusOr<TfhePlan> TfhePlan::Specialize(
+    const PublicParams& public_params) const {
+  TfhePlan residual;
+  XLS_RETURN_IF_ERROR(
+      Specializer(*this, public_params, &residual).Specialize());
+  return residual;
+}
+
+absl::StatusOr<TfhePlan> TfhePlan::Restrict(
+    absl::Span<const BitRange> mask) const {
+  for (const BitRange& range : mask) {
+    if (!range.param.empty() &&
+        std::find(param_names_.begin(), param_names_.end(), range.param) ==
+            param_names_.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown output parameter: ", range.param));
+    }
+  }
+  std::vector<PlanOutputBit> outputs;
+  for (const PlanOutputBit& output : outputs_) {
+    const absl::string_view name = output.param == PlanOutputBit::kResult
+                                       ? absl::string_view()
+                                       : param_names_[output.param];
+    for (const BitRange& range : mask) {
+      if (range.param == name && output.bit >= range.begin &&
+          output.bit < range.end) {
+        outputs.push_back(output);
+        break;
+      }
+    }
+  }
+
+  std::vector<std::vector<int32_t>> operands(nodes_.size());
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    operands[i].assign(this->operands(i).begin(), this->operands(i).end());
+  }
+  TfhePlan restricted;
+  restricted.param_names_ = param_names_;
+  restricted.has_return_value_ = has_return_value_;
+  restricted.LinkLiveNodes(std::vector<PlanNode>(nodes_.begin(), nodes_.end()),
+                           operands, std::move(outputs));
+  return restricted;
+}
+
+absl::StatusOr<PlanPartition> TfhePlan::Partition(
+    absl::Span<const double> capacities) const {
+  if (capacities.empty()) {
+    return absl::InvalidArgumentError("No parts to partition into.");
+  }
+  for (double capacity : capacities) {
+    if (!(capacity > 0)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Part capacity is not positive: ", capacity));
+    }
+  }
+  const int32_t parts = capacities.size();
+  const std::vector<int32_t> part = AssignParts(capacities);
+
+  // A gate's stage is the number of part crossings on the operand chain
+  // leading to it with the most of them, so every value a stage reads from
+  // another part comes from an earlier stage.
+  PlanPartition partition;
+  partition.bootstrap_counts.assign(parts, 0);
+  partition.reads_param.assign(parts,
+                               std::vector<bool>(param_names_.size(), false));
+  partition.cut_edges = 0;
+  std::vector<int32_t> stage(nodes_.size(), 0);
+  int32_t stage_count = 0;
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    if (part[i] < 0) continue;
+    partition.bootstrap_counts[part[i]] += BootstrapCount(nodes_[i].op);
+    for (int32_t operand : operands(i)) {
+      if (part[operand] < 0) {
+        if (nodes_[operand].op == PlanOp::kParamBit) {
+          partition.reads_param[part[i]][nodes_[operand].param] = true;
+        }
+      } else if (part[operand] != part[i]) {
+        ++partition.cut_edges;
+        stage[i] = std::max(stage[i], stage[operand] + 1);
+      } else {
+        stage[i] = std::max(stage[i], stage[operand]);
+      }
+    }
+    stage_count = std::max(stage_count, stage[i] + 1);
+  }
+
+  // Values read in another stage go through the boundary; those read in
+  // another part (or by an output) are exported as well.
+  std::vector<int32_t> slot(nodes_.size(), -1);
+  std::vector<bool> exported(nodes_.size(), false);
+  partition.boundary_size = 0;
+  auto add_slot = [&](int32_t i) {
+    if (slot[i] < 0) {
+      slot[i] = partition.boundary_size++;
+    }
+  };
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    if (part[i] < 0) continue;
+    for (int32_t user : users(i)) {
+      if (part[user] != part[i]) {
+        add_slot(i);
+        exported[i] = true;
+      } else if (stage[user] != stage[i]) {
+        add_slot(i);
+      }
+    }
+  }
+  for (const PlanOutputBit& output : outputs_) {
+    if (part[output.node] >= 0) {
+      add_slot(output.node);
+      exported[output.node] = true;
+    }
+  }
+
+  std::vector<std::vector<int32_t>> groups(stage_count * parts);
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    if (part[i] >= 0) {
+      groups[stage[i] * parts + part[i]].push_back(i);
+    }
+  }
+  std::vector<std::vector<bool>> imported(
+      parts, std::vector<bool>(partition.boundary_size, false));
+  partition.stages.resize(stage_count);
+  for (int32_t s = 0; s < stage_count; ++s) {
+    PlanPartition::Stage& stage_parts = partition.stages[s];
+    stage_parts.imports.resize(parts);
+    stage_parts.exports.resize(parts);
+    for (int32_t p = 0; p < parts; ++p) {
+      const std::vector<int32_t>& group = groups[s * parts + p];
+      for (int32_t i : group) {
+        for (int32_t operand : operands(i)) {
+          if (part[operand] >= 0 && part[operand] != p &&
+              !imported[p][slot[operand]]) {
+            imported[p][slot[operand]] = true;
+            stage_parts.imports[p].push_back(slot[operand]);
+          }
+        }
+        if (exported[i]) {
+          stage_parts.exports[p].push_back(slot[i]);
+        }
+      }
+      stage_parts.plans.push_back(
+          Recompute(group, slot, /*write_outputs=*/false));
+    }
+  }
+  partition.collect = Recompute({}, slot, /*write_outputs=*/true);
+  return partition;
+}
+
+absl::StatusOr<PlanSegments> TfhePlan::Segment(
+    int64_t segment_bootstraps) const {
+  if (segment_bootstraps <= 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Segment bootstraps is not positive: ", segment_bootstraps));
+  }
+  std::vector<int64_t> level_bootstraps(level_count_, 0);
+  for (const PlanNode& node : nodes_) {
+    level_bootstraps[node.level] += BootstrapCount(node.op);
+  }
+  std::vector<int32_t> level_segment(level_count_);
+  int32_t segment_count = 1;
+  int64_t bootstraps = 0;
+  for (int32_t level = 0; level < level_count_; ++level) {
+    level_segment[level] = segment_count - 1;
+    bootstraps += level_bootstraps[level];
+    if (bootstraps >= segment_bootstraps && level + 1 < level_count_) {
+      ++segment_count;
+      bootstraps = 0;
+    }
+  }
+  std::vector<int32_t> segment(nodes_.size(), -1);
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    const PlanOp op = nodes_[i].op;
+    if (op == PlanOp::kConstant || op == PlanOp::kParamBit) continue;
+    segment[i] = level_segment[nodes_[i].level];
+  }
+  return SegmentAt(segment, segment_count);
+}
+
+absl::StatusOr<PlanSegments> TfhePlan::SegmentWithin(
+    int64_t max_segment_values) const {
+  // Enough for a mux and its three operands.
+  if (max_segment_values < 4) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Too few values per segment: ", max_segment_values));
+  }
+  std::vector<std::vector<int32_t>> levels(level_count_);
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    const PlanOp op = nodes_[i].op;
+    if (op == PlanOp::kConstant || op == PlanOp::kParamBit) continue;
+    levels[nodes_[i].level].push_back(i);
+  }
+
+  // Gates join the current segment level by level, each costing a value of
+  // its own plus one per operand from an earlier segment not yet read into
+  // this one, until the next would take it over the limit.
+  std::vector<int32_t> segment(nodes_.size(), -1);
+  int32_t current = 0;
+  int64_t values = 0;
+  absl::flat_hash_set<int32_t> imported;
+  std::vector<int32_t> imports;
+  auto collect_imports = [&](int32_t i) {
+    imports.clear();
+    for (int32_t operand : operands(i)) {
+      if (segment[operand] >= 0 && segment[operand] < current &&
+          !imported.contains(operand) &&
+          std::find(imports.begin(), imports.end(), operand) ==
+              imports.end()) {
+        imports.push_back(operand);
+      }
+    }
+  };
+  for (const std::vector<int32_t>& level : levels) {
+    for (int32_t i : level) {
+      collect_imports(i);
+      if (values > 0 && values + 1 + imports.size() > max_segment_values) {
+        ++current;
+        values = 0;
+        imported.clear();
+        collect_imports(i);
+      }
+      segment[i] = current;
+      values += 1 + imports.size();
+      imported.insert(imports.begin(), imports.end());
+    }
+  }
+  return SegmentAt(segment, current + 1);
+}
+
+PlanSegments TfhePlan::SegmentAt(absl::Span<const int32_t> segment,
+                                 int32_t segment_count) const {
+  // Per gate: the last segment that reads it (its own, if no later one
+  // does). Constants and parameter bits are recreated wherever they are
+  // read, so they need none.
+  std::vector<std::vector<int32_t>> groups(segment_count);
+  std::vector<int32_t> last_use(nodes_.size(), -1);
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    if (segment[i] < 0) continue;
+    groups[segment[i]].push_back(i);
+    last_use[i] = segment[i];
+    for (int32_t user : users(i)) {
+      last_use[i] = std::max(last_use[i], segment[user]);
+    }
+  }
+  for (const PlanOutputBit& output : outputs_) {
+    if (last_use[output.node] >= 0) {
+      last_use[output.node] = segment_count - 1;
+    }
+  }
+
+  PlanSegments segments;
+  segments.frontier_size = 0;
+  std::vector<int32_t> slot(nodes_.size(), -1);
+  std::vector<int32_t> free_slots;
+  // Per segment: the values read for the last time in it.
+  std::vector<std::vector<int32_t>> expiring(segment_count);
+  absl::flat_hash_set<int32_t> live_slots;
+  for (int32_t s = 0; s < segment_count; ++s) {
+    std::vector<int32_t> writes;
+    absl::flat_hash_set<int32_t> reads;
+    for (int32_t i : groups[s]) {
+      for (int32_t operand : operands(i)) {
+        if (segment[operand] >= 0 && segment[operand] < s) {
+          reads.insert(slot[operand]);
+        }
+      }
+      if (last_use[i] == s) continue;
+      if (free_slots.empty()) {
+        slot[i] = segments.frontier_size++;
+      } else {
+        slot[i] = free_slots.back();
+        free_slots.pop_back();
+      }
+      expiring[last_use[i]].push_back(i);
+      live_slots.insert(slot[i]);
+      writes.push_back(slot[i]);
+    }
+    const bool last = s + 1 == segment_count;
+    if (last) {
+      for (const PlanOutputBit& output : outputs_) {
+        if (segment[output.node] >= 0 && segment[output.node] < s) {
+          reads.insert(slot[output.node]);
+        }
+      }
+    }
+    segments.segments.push_back(
+        Recompute(groups[s], slot, /*write_outputs=*/last));
+    segments.reads.emplace_back(reads.begin(), reads.end());
+    std::sort(segments.reads.back().begin(), segments.reads.back().end());
+    std::sort(writes.begin(), writes.end());
+    segments.writes.push_back(std::move(writes));
+    // Slots read for the last time here are free for the next segment's
+    // values, but not for this one's, which may overwrite them before
+    // they are read.
+    for (int32_t i : expiring[s]) {
+      free_slots.push_back(slot[i]);
+      live_slots.erase(slot[i]);
+    }
+    segments.live_after.emplace_back(live_slots.begin(), live_slots.end());
+    std::sort(segments.live_after.back().begin(),
+              segments.live_after.back().end());
+  }
+  return segments;
+}
+
+std::vector<int32_t> TfhePlan::AssignParts(
+    absl::Span<const double> capacities) const {
+  const int32_t parts = capacities.size();
+  const double total_capacity =
+      std::accumulate(capacities.begin(), capacities.end(), 0.0);
+  int64_t total_bootstraps = 0;
+  for (const PlanNode& node : nodes_) {
+    total_bootstraps += BootstrapCount(node.op);
+  }
+  std::vector<double> quota(parts);
+  for (int32_t p = 0; p < parts; ++p) {
+    quota[p] =
+        total_bootstraps * capacities[p] / total_capacity * kPartitionSlack + 1;
+  }
+  std::vector<int64_t> load(parts, 0);
+  std::vector<int32_t> part(nodes_.size(), -1);
+  std::vector<int32_t> neighbors(parts);
+
+  // A single streaming pass in topological order: each gate joins the part
+  // holding the most of its operands, discounted by how full that part is,
+  // and gates with no such pull go to the emptiest part. Bootstrap-free gates
+  // add no load, so they simply follow their operands.
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    const PlanOp op = nodes_[i].op;
+    if (op == PlanOp::kConstant || op == PlanOp::kParamBit) continue;
+    const int bootstraps = BootstrapCount(op);
+    std::fill(neighbors.begin(), neighbors.end(), 0);
+    for (int32_t operand : operands(i)) {
+      if (part[operand] >= 0) {
+        ++neighbors[part[operand]];
+      }
+    }
+    int32_t best = 0;
+    double best_score = 0;
+    double best_fill = 0;
+    for (int32_t p = 0; p < parts; ++p) {
+      const double fill = load[p] / quota[p];
+      const double score =
+          bootstraps == 0 ? neighbors[p] : neighbors[p] * (1 - fill);
+      if (p == 0 || score > best_score ||
+          (score == best_score && fill < best_fill)) {
+        best = p;
+        best_score = score;
+        best_fill = fill;
+      }
+    }
+    part[i] = best;
+    load[best] += bootstraps;
+  }
+
+  // Then a couple of passes moving single gates to the part holding the most
+  // of their operands and users, where that cuts edges and the part has
+  // room for them.
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int32_t i = 0; i < nodes_.size(); ++i) {
+      if (part[i] < 0) continue;
+      const int bootstraps = BootstrapCount(nodes_[i].op);
+      std::fill(neighbors.begin(), neighbors.end(), 0);
+      for (int32_t operand : operands(i)) {
+        if (part[operand] >= 0) {
+          ++neighbors[part[operand]];
+        }
+      }
+      for (int32_t user : users(i)) {
+        ++neighbors[part[user]];
+      }
+      int32_t best = part[i];
+      for (int32_t p = 0; p < parts; ++p) {
+        if (neighbors[p] > neighbors[best] &&
+            load[p] + bootstraps <= quota[p]) {
+          best = p;
+        }
+      }
+      load[part[i]] -= bootstraps;
+      load[best] += bootstraps;
+      part[i] = best;
+    }
+  }
+  return part;
+}
+
+std::vector<int32_t> TfhePlan::SetIndices(const std::vector<bool>& set) {
+  std::vector<int32_t> indices;
+  for (int32_t i = 0; i < set.size(); ++i) {
+    if (set[i]) {
+      indices.push_back(i);
+    }
+  }
+  return indices;
+}
+
+absl::StatusOr<std::vector<bool>> TfhePlan::ReachedFrom(
+    absl::Span<const BitRange> changed) const {
+  std::vector<std::vector<const BitRange*>> changed_by_param(
+      param_names_.size());
+  for (const BitRange& range : changed) {
+    auto found =
+        std::find(param_names_.begin(), param_names_.end(), range.param);
+    if (found == param_names_.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown parameter: ", range.param));
+    }
+    changed_by_param[found - param_names_.begin()].push_back(&range);
+  }
+
+  std::vector<bool> reached(nodes_.size(), false);
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    const PlanNode& node = nodes_[i];
+    if (node.op == PlanOp::kParamBit) {
+      for (const BitRange* range : changed_by_param[node.param]) {
+        if (node.param_bit >= range->begin && node.param_bit < range->end) {
+          reached[i] = true;
+        }
+      }
+    }
+    for (int32_t operand : operands(i)) {
+      if (reached[operand]) {
+        reached[i] = true;
+      }
+    }
+  }
+  return reached;
+}
+
+absl::StatusOr<TfhePlan> TfhePlan::Incremental(
+    absl::Span<const BitRange> changed) const {
+  XLS_ASSIGN_OR_RETURN(std::vector<bool> recompute, ReachedFrom(changed));
+  std::vector<int32_t> cache_slot(nodes_.size());
+  std::iota(cache_slot.begin(), cache_slot.end(), 0);
+  return Recompute(SetIndices(recompute), cache_slot, /*write_outputs=*/true);
+}
+
+TfhePlan TfhePlan::Caching() const {
+  std::vector<int32_t> cache_slot(nodes_.size());
+  std::iota(cache_slot.begin(), cache_slot.end(), 0);
+  // Node i is cached in slot i, so the slots also list every node.
+  return Recompute(/*recompute=*/cache_slot, cache_slot,
+                   /*write_outputs=*/true);
+}
+
+absl::StatusOr<PlanBinding> TfhePlan::Bind(
+    absl::Span<const std::string> bound) const {
+  for (const std::string& name : bound) {
+    if (std::find(param_names_.begin(), param_names_.end(), name) ==
+        param_names_.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown parameter: ", name));
+    }
+  }
+  std::vector<BitRange> unbound;
+  for (const std::string& name : param_names_) {
+    if (std::find(bound.begin(), bound.end(), name) == bound.end()) {
+      unbound.push_back({name});
+    }
+  }
+  for (const PlanOutputBit& output : outputs_) {
+    if (output.param != PlanOutputBit::kResult &&
+        std::find(bound.begin(), bound.end(), param_names_[output.param]) !=
+            bound.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Bound parameter is written by the function: ",
+                       param_names_[output.param]));
+    }
+  }
+
+  // Every node the unbound parameters reach is evaluated per call; the rest
+  // once. Of the latter, only those read per call need a cache entry.
+  XLS_ASSIGN_OR_RETURN(std::vector<bool> per_call, ReachedFrom(unbound));
+  PlanBinding binding;
+  binding.cache_size = 0;
+  std::vector<int32_t> cache_slot(nodes_.size(), -1);
+  auto keep = [&](int32_t i) {
+    const PlanOp op = nodes_[i].op;
+    if (!per_call[i] && cache_slot[i] < 0 && op != PlanOp::kConstant &&
+        op != PlanOp::kParamBit) {
+      cache_slot[i] = binding.cache_size++;
+    }
+  };
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    if (per_call[i]) {
+      for (int32_t operand : operands(i)) {
+        keep(operand);
+      }
+    }
+  }
+  for (const PlanOutputBit& output : outputs_) {
+    keep(output.node);
+  }
+
+  std::vector<bool> once = per_call;
+  once.flip();
+  binding.precompute =
+      Recompute(SetIndices(once), cache_slot, /*write_outputs=*/false);
+  binding.per_call =
+      Recompute(SetIndices(per_call), cache_slot, /*write_outputs=*/true);
+  return binding;
+}
+
+TfhePlan TfhePlan::Recompute(absl::Span<const int32_t> recompute,
+                             absl::Span<const int32_t> cache_slot,
+                             bool write_outputs) const {
+  TfhePlan plan;
+  plan.param_names_ = param_names_;
+  plan.param_names_.emplace_back(kExtraParam);
+  plan.has_return_value_ = has_return_value_ && write_outputs;
+  const int32_t cache = param_names_.size();
+
+  Arrays arrays;
+  std::vector<std::vector<int32_t>> operands;
+  // Per original node, the new node holding its value, once there is one.
+  // Kept sparse, so that the cost is proportional to the nodes recomputed and
+  // read rather than to the whole plan.
+  absl::flat_hash_map<int32_t, int32_t> new_index;
+  auto add = [&](PlanNode node, std::vector<int32_t> node_operands) {
+    arrays.nodes.push_back(node);
+    operands.push_back(std::move(node_operands));
+    return static_cast<int32_t>(arrays.nodes.size() - 1);
+  };
+  // Constants and parameter bits are as cheap to recreate as to fetch from
+  // the cache; other nodes not recomputed are read from it.
+  auto resolve = [&](int32_t i) {
+    auto found = new_index.find(i);
+    if (found != new_index.end()) {
+      return found->second;
+    }
+    PlanNode node = nodes_[i];
+    if (node.op != PlanOp::kConstant && node.op != PlanOp::kParamBit) {
+      XLS_CHECK_GE(cache_slot[i], 0);
+      node = {};
+      node.op = PlanOp::kParamBit;
+      node.param = cache;
+      node.param_bit = cache_slot[i];
+    }
+    return new_index[i] = add(node, {});
+  };
+
+  for (int32_t i : recompute) {
+    const PlanOp op = nodes_[i].op;
+    if (op == PlanOp::kConstant || op == PlanOp::kParamBit) {
+      continue;
+    }
+    std::vector<int32_t> node_operands;
+    for (int32_t operand : this->operands(i)) {
+      node_operands.push_back(resolve(operand));
+    }
+    new_index[i] = add(nodes_[i], std::move(node_operands));
+    if (cache_slot[i] >= 0) {
+      arrays.outputs.push_back({cache, cache_slot[i], new_index[i]});
+    }
+  }
+  if (write_outputs) {
+    for (const PlanOutputBit& output : outputs_) {
+      arrays.outputs.push_back(
+          {output.param, output.bit, resolve(output.node)});
+    }
+  }
+  // Recomputed nodes that neither reach an output nor are cached are dead.
+  plan.LinkLiveNodes(std::move(arrays.nodes), operands,
+                     std::move(arrays.outputs));
+  return plan;
+}
+
+std::string TfhePlan::Serialize() const {
+  PlanFileHeader header = {};
+  memcpy(header.magic, kPlanMagic, sizeof(header.magic));
+  header.version = kPlanFormatVersion;
+  header.byte_order_mark = kByteOrderMark;
+  header.node_size = sizeof(PlanNode);
+  header.output_size = sizeof(PlanOutputBit);
+  header.level_count = level_count_;
+  header.has_return_value = has_return_value_;
+  header.node_count = nodes_.size();
+  header.operand_count = operands_.size();
+  header.user_count = users_.size();
+  header.output_count = outputs_.size();
+  header.param_count = param_names_.size();
+
+  uint64_t offset = sizeof(PlanFileHeader);
+  header.nodes_offset = offset;
+  offset = AlignSection(offset + nodes_.size() * sizeof(PlanNode));
+  header.operands_offset = offset;
+  offset = AlignSection(offset + operands_.size() * sizeof(int32_t));
+  header.users_offset = offset;
+  offset = AlignSection(offset + users_.size() * sizeof(int32_t));
+  header.outputs_offset = offset;
+  offset = AlignSection(offset + outputs_.size() * sizeof(PlanOutputBit));
+  header.param_names_offset = offset;
+  for (const std::string& name : param_names_) {
+    offset += sizeof(uint32_t) + name.size();
+  }
+  header.size = offset;
+
+  std::string data(header.size, '\0');
+  memcpy(&data[0], &header, sizeof(header));
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    // Copy field by field, so that the padding bytes are zero and the output
+    // depends only on the plan.
+    const PlanNode& node = nodes_[i];
+    PlanNode copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.op = node.op;
+    copy.value = node.value;
+    copy.param = node.param;
+    copy.param_bit = node.param_bit;
+    copy.operands_begin = node.operands_begin;
+    copy.operand_count = node.operand_count;
+    copy.users_begin = node.users_begin;
+    copy.user_count = node.user_count;
+    copy.level = node.level;
+    copy.output_count = node.output_count;
+    memcpy(&data[header.nodes_offset + i * sizeof(PlanNode)], &copy,
+           sizeof(copy));
+  }
+  memcpy(&data[header.operands_offset], operands_.data(),
+         operands_.size() * sizeof(int32_t));
+  memcpy(&data[header.users_offset], users_.data(),
+         users_.size() * sizeof(int32_t));
+  memcpy(&data[header.outputs_offset], outputs_.data(),
+         outputs_.size() * sizeof(PlanOutputBit));
+  offset = header.param_names_offset;
+  for (const std::string& name : param_names_) {
+    const uint32_t length = name.size();
+    memcpy(&data[offset], &length, sizeof(length));
+    offset += sizeof(length);
+    memcpy(&data[offset], name.data(), name.size());
+    offset += name.size();
+  }
+  return data;
+}
+
+absl::StatusOr<TfhePlan> TfhePlan::FromBuffer(absl::string_view data) {
+  return Load(data, nullptr);
+}
+
+absl::StatusOr<TfhePlan> TfhePlan::MapFile(absl::string_view path) {
+  const std::string path_string(path);
+  const int fd = open(path_string.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    const std::string message =
+        absl::StrCat("Failed to open ", path, ": ", strerror(errno));
+    return errno == ENOENT ? absl::NotFoundError(message)
+                           : absl::InternalError(message);
+  }
+  struct stat stat_buffer;
+  if (fstat(fd, &stat_buffer) != 0) {
+    const std::string message =
+        absl::StrCat("Failed to stat ", path, ": ", strerror(errno));
+    close(fd);
+    return absl::InternalError(message);
+  }
+  const size_t size = stat_buffer.st_size;
+  if (size < sizeof(PlanFileHeader)) {
+    close(fd);
+    return CorruptPlanError(absl::StrCat(path, " is truncated"));
+  }
+  void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping keeps the file open.
+  close(fd);
+  if (address == MAP_FAILED) {
+    return absl::InternalError(
+        absl::StrCat("Failed to map ", path, ": ", strerror(errno)));
+  }
+  std::shared_ptr<const void> mapping(address, [size](const void* address) {
+    munmap(const_cast<void*>(address), size);
+  });
+  return Load(absl::string_view(static_cast<const char*>(address), size),
+              std::move(mapping));
+}
+
+absl::StatusOr<TfhePlan> TfhePlan::Load(absl::string_view data,
+                                        std::shared_ptr<const void> storage) {
+  if (reinterpret_cast<uintptr_t>(data.data()) % kSectionAlignment != 0) {
+    return absl::InvalidArgumentError(
+        "Serialized plan is not aligned to 8 bytes.");
+  }
+  PlanFileHeader header;
+  if (data.size() < sizeof(header)) {
+    return CorruptPlanError("truncated header");
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, kPlanMagic, sizeof(kPlanMagic)) != 0) {
+    return absl::InvalidArgumentError("Not a serialized plan.");
+  }
+  if (header.version != kPlanFormatVersion) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unsupported plan format version ", header.version,
+                     "; expected ", kPlanFormatVersion, "."));
+  }
+  if (header.byte_order_mark != kByteOrderMark ||
+      header.node_size != sizeof(PlanNode) ||
+      header.output_size != sizeof(PlanOutputBit)) {
+    return absl::InvalidArgumentError(
+        "Serialized plan was written by a machine with a different byte "
+        "order or struct layout.");
+  }
+  if (header.size != data.size()) {
+    return CorruptPlanError(absl::StrCat("expected ", header.size,
+                                         " bytes, got ", data.size()));
+  }
+
+  TfhePlan plan;
+  plan.nodes_ = Section<PlanNode>(data, header.nodes_offset, header.node_count);
+  plan.operands_ =
+      Section<int32_t>(data, header.operands_offset, header.operand_count);
+  plan.users_ = Section<int32_t>(data, header.users_offset, header.user_count);
+  plan.outputs_ =
+      Section<PlanOutputBit>(data, header.outputs_offset, header.output_count);
+  if (plan.nodes_.size() != header.node_count ||
+      plan.operands_.size() != header.operand_count ||
+      plan.users_.size() != header.user_count ||
+      plan.outputs_.size() != header.output_count) {
+    return CorruptPlanError("section out of bounds");
+  }
+
+  uint64_t offset = header.param_names_offset;
+  if (offset > data.size()) {
+    return CorruptPlanError("section out of bounds");
+  }
+  for (uint32_t i = 0; i < header.param_count; ++i) {
+    uint32_t length;
+    if (data.size() - offset < sizeof(length)) {
+      return CorruptPlanError("truncated parameter names");
+    }
+    memcpy(&length, data.data() + offset, sizeof(length));
+    offset += sizeof(length);
+    if (data.size() - offset < length) {
+      return CorruptPlanError("truncated parameter names");
+    }
+    plan.param_names_.emplace_back(data.substr(offset, length));
+    offset += length;
+  }
+  plan.level_count_ = header.level_count;
+  plan.has_return_value_ = header.has_return_value != 0;
+  plan.storage_ = std::move(storage);
+
+  XLS_RETURN_IF_ERROR(plan.Validate());
+  return plan;
+}
+
+absl::Status TfhePlan::Validate() const {
+  const int64_t node_count = nodes_.size();
+  const int64_t operand_count = operands_.size();
+  const int64_t user_count = users_.size();
+  const int64_t param_count = param_names_.size();
+  // The runner trusts the users lists to match the operand lists exactly, so
+  // rebuild them: Compile() lists each node's users in ascending order, so
+  // visiting the nodes in order must find them in the same order.
+  std::vector<int32_t> users_seen(node_count, 0);
+  std::vector<int32_t> outputs_seen(node_count, 0);
+  // Levels size per-level arrays (e.g., in Segment()), so they must be
+  // exactly what Link() computes rather than merely in range.
+  int32_t expected_level_count = 0;
+  for (int64_t i = 0; i < node_count; ++i) {
+    const PlanNode& node = nodes_[i];
+    if (static_cast<int>(node.op) >= kPlanOpCount) {
+      return CorruptPlanError(absl::StrCat("node ", i, " has an invalid op"));
+    }
+    if (node.op == PlanOp::kParamBit &&
+        (node.param < 0 || node.param >= param_count || node.param_bit < 0)) {
+      return CorruptPlanError(
+          absl::StrCat("node ", i, " reads an invalid parameter bit"));
+    }
+    if (node.operands_begin < 0 || node.operand_count < 0 ||
+        node.operands_begin > operand_count - node.operand_count ||
+        node.users_begin < 0 || node.user_count < 0 ||
+        node.users_begin > user_count - node.user_count) {
+      return CorruptPlanError(
+          absl::StrCat("node ", i, " has an out-of-bounds range"));
+    }
+    if (node.operand_count != OperandCount(node.op)) {
+      return CorruptPlanError(absl::StrCat("node ", i, " has ",
+                                           node.operand_count, " operands"));
+    }
+    int32_t expected_level = 0;
+    for (int32_t operand : operands(i)) {
+      // Operands must precede their users, which also rules out cycles.
+      if (operand < 0 || operand >= i) {
+        return CorruptPlanError(
+            absl::StrCat("node ", i, " has invalid operand ", operand));
+      }
+      const PlanNode& source = nodes_[operand];
+      if (users_seen[operand] >= source.user_count ||
+          users_[source.users_begin + users_seen[operand]] != i) {
+        return CorruptPlanError(
+            absl::StrCat("users of node ", operand, " do not match"));
+      }
+      ++users_seen[operand];
+      expected_level = std::max(expected_level, source.level + 1);
+    }
+    if (node.level != expected_level) {
+      return CorruptPlanError(absl::StrCat("node ", i, " has invalid level"));
+    }
+    expected_level_count = std::max(expected_level_count, node.level + 1);
+  }
+  if (level_count_ != expected_level_count) {
+    return CorruptPlanError("invalid level count");
+  }
+  for (const PlanOutputBit& output : outputs_) {
+    if (output.node < 0 || output.node >= node_count || output.bit < 0 ||
+        output.param < PlanOutputBit::kResult || output.param >= param_count) {
+      return CorruptPlanError("invalid output");
+    }
+    ++outputs_seen[output.node];
+  }
+  for (int64_t i = 0; i < node_count; ++i) {
+    if (users_seen[i] != nodes_[i].user_count ||
+        outputs_seen[i] != nodes_[i].output_count) {
+      return CorruptPlanError(
+          absl::StrCat("use counts of node ", i, " do not match"));
+    }
+  }
+  return absl::OkStatus();
+}
+
+std::vector<int64_t> TfhePlan::CriticalPathLengths(
+    absl::Span<const int64_t> op_latency) const {
+  XLS_CHECK_EQ(op_latency.size(), kPlanOpCount);
+  std::vector<int64_t> lengths(nodes_.size());
+  // Users always follow their operands, so walk backwards.
+  for (int32_t i = nodes_.size() - 1; i >= 0; --i) {
+    int64_t longest_user = 0;
+    for (int32_t user : users(i)) {
+      longest_user = std::max(longest_user, lengths[user]);
+    }
+    lengths[i] = op_latency[static_cast<int>(nodes_[i].op)] + longest_user;
+  }
+  return lengths;
+}
+
+DataflowGraph TfhePlan::ToDataflowGraph() const {
+  DataflowGraph graph;
+  for (int32_t i = 0; i < nodes_.size(); ++i) {
+    graph.AddNode(operands(i), nodes_[i].op != PlanOp::kParamBit,
+                  nodes_[i].output_count > 0);
+  }
+  return graph;
+}
+
+std::vector<BitRange> Canonicalize(absl::Span<const BitRange> ranges) {
+  std::vector<BitRange> sorted(ranges.begin(), ranges.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [](const BitRange& a, const BitRange& b) {
+              return std::tie(a.param, a.begin, a.end) <
+                     std::tie(b.param, b.begin, b.end);
+            });
+  std::vector<BitRange> merged;
+  for (BitRange& range : sorted) {
+    if (!merged.empty() && merged.back().param == range.param &&
+        range.begin <= merged.back().end) {
+      merged.back().end = std::max(merged.back().end, range.end);
+    } else {
+      merged.push_back(std::move(range));
+    }
+  }
+  return merged;
+}
+
+std::string CanonicalKey(absl::Span<const BitRange> ranges) {
+  std::string key;
+  for (const BitRange& range : Canonicalize(ranges)) {
+    absl::StrAppend(&key, range.param, ":", range.begin, ":", range.end, ";");
+  }
+  return key;
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
@@ -0,0 +1,402 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A flat, precompiled form of a booleanified XLS function, used by TfheRunner.
+//
+// Compiling resolves everything about the circuit that does not depend on the
+// ciphertexts: node ordering, operand wiring, which parameter bit each
+// BitSlice reads, literal values, and where each output bit is copied. The
+// structural XLS nodes (concat, tuple, array, array/tuple index, shift) only
+// ever serve to address bits, so they are resolved away entirely; every node
+// left in the plan produces exactly one ciphertext.
+//
+// Once compiled, a plan holds no references to the XLS IR, so the
+// xls::Package it came from can be dropped. A plan can also be serialized into
+// a flat binary form (see Serialize()) and loaded again without any parsing,
+// which is much cheaper than parsing and compiling a large IR package.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_PLAN_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_PLAN_H_
+
+#include <stdint.h>
+
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "transpiler/live_set_schedule.h"
+#include "xls/contrib/xlscc/metadata_output.pb.h"
+#include "xls/ir/function.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+// The gate-level operation a plan node performs.
+enum class PlanOp : uint8_t {
+  // A 1-bit literal; the value is in PlanNode::value.
+  kConstant,
+  // One bit of a parameter, at PlanNode::param / PlanNode::param_bit.
+  kParamBit,
+  kNot,
+  kAnd,
+  kOr,
+  kXor,
+  kNand,
+  kNor,
+  // A 1-bit select; the operands are the selector, then the values chosen
+  // when it is 0 and 1.
+  kMux,
+};
+constexpr int kPlanOpCount = static_cast<int>(PlanOp::kMux) + 1;
+
+// A short lowercase name for `op`, e.g. "and".
+absl::string_view PlanOpName(PlanOp op);
+
+// Whether `op` is evaluated without bootstrapping (constants, copies and NOT),
+// and so takes microseconds where the other gates take milliseconds.
+bool IsBootstrapFree(PlanOp op);
+
+struct PlanNode {
+  PlanOp op;
+  // kConstant only.
+  bool value;
+  // kParamBit only: the index of the parameter (see TfhePlan::param_names())
+  // and the bit offset within it.
+  int32_t param;
+  int32_t param_bit;
+  // Ranges within TfhePlan's flat operand and user arrays.
+  int32_t operands_begin;
+  int32_t operand_count;
+  int32_t users_begin;
+  int32_t user_count;
+  // The length of the longest operand chain leading to this node: 0 for
+  // nodes without operands, otherwise one more than the deepest operand.
+  int32_t level;
+  // The number of entries in TfhePlan::outputs() that read this node. Once its
+  // users have all run and its outputs have been copied, a value is dead.
+  int32_t output_count;
+};
+
+// Copies the value of plan node `node` into bit `bit` of an output: the
+// function's result if `param` is kResult, otherwise the in/out parameter with
+// that index.
+struct PlanOutputBit {
+  static constexpr int32_t kResult = -1;
+
+  int32_t param;
+  int32_t bit;
+  int32_t node;
+};
+
+// Selects bits [begin, end) of a parameter, or of the function's result if
+// `param` is empty.
+struct BitRange {
+  std::string param;
+  int32_t begin = 0;
+  int32_t end = std::numeric_limits<int32_t>::max();
+};
+
+// Sorts `ranges` and merges the overlapping or adjacent ones of each
+// parameter, so that equal sets of bits are listed alike.
+std::vector<BitRange> Canonicalize(absl::Span<const BitRange> ranges);
+
+// A string form of `ranges`, equal for equal sets of bits however they are
+// ordered or split; for keying caches of plans made from them.
+std::string CanonicalKey(absl::Span<const BitRange> ranges);
+
+struct PlanBinding;
+struct PlanPartition;
+struct PlanSegments;
+
+class TfhePlan {
+ public:
+  // Plaintext values for parameters that need not be encrypted, by name: bit i
+  // of a parameter's vector is the value of its i'th ciphertext.
+  using PublicParams = absl::flat_hash_map<std::string, std::vector<bool>>;
+
+  // The name of the extra parameter that Incremental(), Caching(), Bind(),
+  // Partition(), Segment() and SegmentWithin() append to param_names(), for
+  // the ciphertexts their plans carry between calls, stages or segments. Not
+  // a C++ identifier, so it cannot clash with the function's own parameters.
+  static constexpr char kExtraParam[] = "<extra>";
+
+  // Compiles the plan for `function`, whose in/out parameters are described by
+  // `metadata`. The IR must satisfy the requirements listed in tfhe_runner.h.
+  static absl::StatusOr<TfhePlan> Compile(
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata);
+
+  // Returns the plan in its binary form: a versioned header followed by the
+  // node, operand, user and output arrays exactly as they are laid out in
+  // memory, and the parameter names. The format is specific to the byte order
+  // and struct layout of the machine that wrote it; loading on a mismatched
+  // machine fails rather than misreading.
+  std::string Serialize() const;
+
+  // Loads a plan from the output of Serialize() without copying its arrays:
+  // the plan reads them in place, so `data` must outlive it (and all copies of
+  // it) and be aligned to 8 bytes. The plan is validated first, in time linear
+  // in its size, so a corrupt or truncated buffer yields an error rather than
+  // out-of-range accesses at run time.
+  static absl::StatusOr<TfhePlan> FromBuffer(absl::string_view data);
+
+  // Like FromBuffer(), but for a file written from Serialize(), which is
+  // mapped read-only rather than read. Processes loading the same file share
+  // its pages. The mapping lives as long as the plan (or any copy of it).
+  static absl::StatusOr<TfhePlan> MapFile(absl::string_view path);
+
+  // Returns the plan left once the parameters in `public_params` are fixed to
+  // the given bits. Their values are propagated through the circuit: a gate
+  // with a constant operand becomes a constant, a copy of its other operand
+  // or a NOT of it (AND with 0 is 0, AND with 1 is the other operand, XOR
+  // with 1 its negation, and so on), and gates no output depends on any more
+  // are dropped. The public parameters are removed from param_names(). Fails
+  // if a public parameter is unknown, too short, or written by the function.
+  absl::StatusOr<TfhePlan> Specialize(const PublicParams& public_params) const;
+
+  // Returns the plan that writes only the output bits selected by `mask`, and
+  // so keeps only the nodes those depend on: their transitive fan-in. The
+  // parameters are kept as they are, even those no selected bit reads. Fails
+  // if `mask` names an unknown parameter.
+  absl::StatusOr<TfhePlan> Restrict(absl::Span<const BitRange> mask) const;
+
+  // For incremental evaluation, where every node's value from the last run is
+  // kept in an array of ciphertexts passed as the extra parameter
+  // kExtraParam, bit i holding node i. Returns
+  // the plan that recomputes only the nodes reachable from the parameter bits
+  // in `changed`, reading every other node's value from the cache, and writes
+  // the recomputed values back into it as well as writing all the usual
+  // outputs. Fails if `changed` names an unknown parameter (or the result).
+  absl::StatusOr<TfhePlan> Incremental(
+      absl::Span<const BitRange> changed) const;
+
+  // Like Incremental(), but recomputes every node, filling the cache in from
+  // scratch.
+  TfhePlan Caching() const;
+
+  // For evaluating with some parameters bound to the same ciphertexts across
+  // calls (see TfheSession): splits the plan into the nodes that depend on
+  // no parameter outside `bound`, which need only be evaluated once, and the
+  // rest; see PlanBinding. Fails if `bound` names an unknown parameter or one
+  // the function writes.
+  absl::StatusOr<PlanBinding> Bind(absl::Span<const std::string> bound) const;
+
+  // For evaluating the plan across several processes (see
+  // DistributedTfheRunner): deals the gates out to `capacities.size()` parts,
+  // each getting a share of the bootstraps in proportion to its capacity, so
+  // as to cut as few operand edges between parts as it can, and splits each
+  // part into stages such that whatever a stage reads from another part was
+  // written in an earlier stage; see PlanPartition. Fails if there are no
+  // capacities or one is not positive.
+  absl::StatusOr<PlanPartition> Partition(
+      absl::Span<const double> capacities) const;
+
+  // For evaluating the plan a piece at a time, with checkpoints in between
+  // (see CheckpointingTfheRunner): cuts it into segments of consecutive
+  // levels, each taking at least `segment_bootstraps` bootstraps (but the
+  // last, which may take fewer); see PlanSegments. Fails if
+  // `segment_bootstraps` is not positive.
+  absl::StatusOr<PlanSegments> Segment(int64_t segment_bootstraps) const;
+
+  // As Segment(), but for evaluating the plan in bounded memory (see
+  // OutOfCoreTfheRunner): cuts it so that no segment holds more than
+  // `max_segment_values` values at once, counting a value per gate it
+  // evaluates and per frontier value it reads. Fails if that is too few for
+  // any gate and its operands.
+  absl::StatusOr<PlanSegments> SegmentWithin(int64_t max_segment_values) const;
+
+  // Nodes, in topological order: every operand precedes its users.
+  absl::Span<const PlanNode> nodes() const { return nodes_; }
+  int32_t node_count() const { return nodes_.size(); }
+
+  // The plan nodes read by, and reading, `node`. An operand used twice by the
+  // same node appears twice in both lists.
+  absl::Span<const int32_t> operands(int32_t node) const {
+    return operands_.subspan(nodes_[node].operands_begin,
+                             nodes_[node].operand_count);
+  }
+  absl::Span<const int32_t> users(int32_t node) const {
+    return users_.subspan(nodes_[node].users_begin, nodes_[node].user_count);
+  }
+
+  // For each node, the length of the longest path from the start of its
+  // evaluation to the end of the circuit, weighting each node on the path by
+  // the latency of its op: the node's own latency plus the largest such
+  // length among its users. `op_latency` is indexed by PlanOp.
+  std::vector<int64_t> CriticalPathLengths(
+      absl::Span<const int64_t> op_latency) const;
+
+  // The circuit as a dataflow graph of its nodes, for ordering by how many
+  // ciphertexts are live at once (see live_set_schedule.h). Parameter bits
+  // are taken to alias their arguments, and nodes with outputs to be kept
+  // to the end.
+  DataflowGraph ToDataflowGraph() const;
+
+  // One more than the highest PlanNode::level, i.e., the circuit depth.
+  int32_t level_count() const { return level_count_; }
+
+  // Parameter names, in the order of the XLS function's parameters.
+  absl::Span<const std::string> param_names() const { return param_names_; }
+
+  // Whether the source function returns a value (as opposed to void).
+  bool has_return_value() const { return has_return_value_; }
+
+  absl::Span<const PlanOutputBit> outputs() const { return outputs_; }
+
+ private:
+  class Compiler;
+  class Specializer;
+
+  // The arrays of a compiled plan. A loaded plan reads them from the
+  // serialized bytes instead.
+  struct Arrays {
+    std::vector<PlanNode> nodes;
+    std::vector<int32_t> operands;
+    std::vector<int32_t> users;
+    std::vector<PlanOutputBit> outputs;
+  };
+
+  // Fills in the plan's arrays from `arrays`, whose nodes and outputs are set
+  // but not yet linked: computes each node's operand and user ranges from
+  // `operands` (the operand indices of each node), its level, and its output
+  // count, as well as level_count().
+  void Link(Arrays arrays, absl::Span<const std::vector<int32_t>> operands);
+
+  // Like Link(), but first drops the nodes that `outputs` do not depend on,
+  // renumbering the rest.
+  void LinkLiveNodes(std::vector<PlanNode> nodes,
+                     absl::Span<const std::vector<int32_t>> operands,
+                     std::vector<PlanOutputBit> outputs);
+
+  // Implements the first half of Partition(): returns the part of each node,
+  // or -1 for constants and parameter bits, which every part can recreate.
+  std::vector<int32_t> AssignParts(absl::Span<const double> capacities) const;
+
+  // The indices of the set entries of `set`, in increasing order.
+  static std::vector<int32_t> SetIndices(const std::vector<bool>& set);
+
+  // Cuts the plan into `segment_count` segments, gate i going to segment
+  // `segment[i]` (-1 for constants and parameter bits), which must be no
+  // earlier than its operands'; see Segment().
+  PlanSegments SegmentAt(absl::Span<const int32_t> segment,
+                         int32_t segment_count) const;
+
+  // Which nodes the parameter bits in `changed` reach, themselves included.
+  absl::StatusOr<std::vector<bool>> ReachedFrom(
+      absl::Span<const BitRange> changed) const;
+
+  // Implements Incremental(), Caching() and Bind(): returns the plan that
+  // evaluates the nodes in `recompute` (indices, in increasing order), reading
+  // other nodes' values from bit `cache_slot[node]` of the cache, and writing
+  // those it evaluates to their slots (where they have one), as well as the
+  // function's outputs if `write_outputs`. Takes time proportional to the
+  // nodes evaluated and read, not to the whole plan.
+  TfhePlan Recompute(absl::Span<const int32_t> recompute,
+                     absl::Span<const int32_t> cache_slot,
+                     bool write_outputs) const;
+
+  // Loads a plan from `data`, which `storage` keeps alive.
+  static absl::StatusOr<TfhePlan> Load(absl::string_view data,
+                                       std::shared_ptr<const void> storage);
+
+  // Checks that a loaded plan is well formed: that every index is in range,
+  // operands precede their users, and the user lists and output counts agree
+  // with the operand lists and outputs.
+  absl::Status Validate() const;
+
+  // Owns the memory the spans below point into: an Arrays, or serialized
+  // bytes. Shared, so that copies of a plan are cheap.
+  std::shared_ptr<const void> storage_;
+  absl::Span<const PlanNode> nodes_;
+  absl::Span<const int32_t> operands_;
+  absl::Span<const int32_t> users_;
+  int32_t level_count_ = 0;
+  std::vector<std::string> param_names_;
+  bool has_return_value_ = false;
+  absl::Span<const PlanOutputBit> outputs_;
+};
+
+// The two halves of a plan split by TfhePlan::Bind(). Both take the extra
+// parameter TfhePlan::kExtraParam, holding `cache_size` ciphertexts: the
+// values of the once-only nodes that the rest of the circuit reads.
+struct PlanBinding {
+  // Evaluates the once-only nodes, and writes the cache and nothing else.
+  // Reads only the bound parameters, so the others' arguments may be null.
+  TfhePlan precompute;
+  // Evaluates everything else, reading the cache but not writing it.
+  TfhePlan per_call;
+  int32_t cache_size;
+};
+
+// A plan split by TfhePlan::Partition() into parts that are evaluated in
+// lockstep stages: every part runs its plan for a stage, then the values read
+// across parts are exchanged, then the next stage starts. Each plan takes the
+// extra parameter TfhePlan::kExtraParam, holding `boundary_size` ciphertexts:
+// the values read across parts or stages. Every part keeps its own copy, which its plans
+// write and read, and into which the values it reads from other parts must be
+// copied before the stage that first reads them.
+struct PlanPartition {
+  struct Stage {
+    // Per part: the plan evaluating its nodes in this stage, writing to the
+    // boundary and nothing else. Has no nodes if the part has none here.
+    std::vector<TfhePlan> plans;
+    // Per part: the boundary slots written by other parts that it reads in
+    // this stage, and in no earlier one.
+    std::vector<std::vector<int32_t>> imports;
+    // Per part: the boundary slots it writes in this stage that another
+    // part, or `collect`, reads.
+    std::vector<std::vector<int32_t>> exports;
+  };
+  std::vector<Stage> stages;
+  // Writes the function's outputs from a boundary holding every export,
+  // without evaluating any gates.
+  TfhePlan collect;
+  int32_t boundary_size;
+  // Per part: the number of bootstraps its gates take, and whether it reads
+  // each of the function's parameters.
+  std::vector<int64_t> bootstrap_counts;
+  std::vector<std::vector<bool>> reads_param;
+  // The number of operand edges between gates in different parts.
+  int64_t cut_edges;
+};
+
+// A plan cut by TfhePlan::Segment() into segments that are evaluated one
+// after another. Each takes the extra parameter TfhePlan::kExtraParam,
+// holding `frontier_size` ciphertexts: the values that later segments read.
+// A slot is reused once the value in it has been read for the last time, so
+// the frontier is only as wide as the most values live across any one cut.
+struct PlanSegments {
+  // Each evaluates its levels and writes the frontier; the last writes the
+  // function's outputs as well.
+  std::vector<TfhePlan> segments;
+  // Per segment: the frontier slots holding values that later segments read,
+  // once it has been evaluated. Together they are the state of an evaluation
+  // stopped after that segment.
+  std::vector<std::vector<int32_t>> live_after;
+  // Per segment: the frontier slots it reads, and those it writes.
+  std::vector<std::vector<int32_t>> reads;
+  std::vector<std::vector<int32_t>> writes;
+  int32_t frontier_size;
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_PLAN_H_
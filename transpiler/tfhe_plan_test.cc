@@ -0,0 +1,603 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_plan.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "transpiler/util/temp_file.h"
+#include "xls/common/file/filesystem.h"
+#include "xls/common/status/matchers.h"
+#include "xls/contrib/xlscc/metadata_output.pb.h"
+#include "xls/ir/ir_parser.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+using ::testing::IsEmpty;
+using ::xls::status_testing::StatusIs;
+
+// Returns x with its low bit cleared if y is set, and then sets y to the low
+// bit of x.
+constexpr absl::string_view kInOutExample = R"(
+package my_package
+
+fn my_package(x: bits[2], y: bits[1]) -> (bits[2], (bits[1])) {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(y, start=0, width=1, id=3)
+  not.4: bits[1] = not(bit_slice.3, id=4)
+  and.5: bits[1] = and(bit_slice.1, not.4, id=5)
+  and.6: bits[1] = and(not.4, bit_slice.1, id=6)
+  or.7: bits[1] = or(and.5, and.6, id=7)
+  literal.8: bits[1] = literal(value=0, id=8)
+  or.9: bits[1] = or(bit_slice.2, literal.8, id=9)
+  concat.10: bits[2] = concat(or.9, or.7, id=10)
+  tuple.11: (bits[1]) = tuple(bit_slice.1, id=11)
+  ret tuple.12: (bits[2], (bits[1])) = tuple(concat.10, tuple.11, id=12)
+}
+)";
+
+xlscc_metadata::MetadataOutput InOutMetadata() {
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_int();
+  auto* x = proto->add_params();
+  x->set_name("x");
+  x->set_is_const(true);
+  auto* y = proto->add_params();
+  y->set_name("y");
+  y->set_is_reference(true);
+  return metadata;
+}
+
+TEST(TfhePlanTest, ResolvesStructuralNodes) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // Params, concat and tuples produce no ciphertexts of their own: the slices
+  // read the params directly and the rest is folded into the output list.
+  EXPECT_EQ(plan.node_count(), 9);
+  EXPECT_THAT(plan.param_names(), ElementsAre("x", "y"));
+  EXPECT_TRUE(plan.has_return_value());
+
+  const PlanNode& slice = plan.nodes()[1];
+  EXPECT_EQ(slice.op, PlanOp::kParamBit);
+  EXPECT_EQ(slice.param, 0);
+  EXPECT_EQ(slice.param_bit, 1);
+
+  // not.4 feeds both ANDs.
+  EXPECT_EQ(plan.nodes()[3].op, PlanOp::kNot);
+  EXPECT_EQ(plan.nodes()[3].level, 1);
+  EXPECT_EQ(plan.nodes()[6].level, 3);
+  EXPECT_EQ(plan.level_count(), 4);
+  EXPECT_THAT(plan.users(3), ElementsAre(4, 5));
+  EXPECT_THAT(plan.operands(6), ElementsAre(4, 5));
+
+  ASSERT_EQ(plan.outputs().size(), 3);
+  // concat's first operand is the most significant bit.
+  EXPECT_EQ(plan.outputs()[0].param, PlanOutputBit::kResult);
+  EXPECT_EQ(plan.outputs()[0].bit, 1);
+  EXPECT_EQ(plan.outputs()[0].node, 8);
+  EXPECT_EQ(plan.outputs()[1].bit, 0);
+  EXPECT_EQ(plan.outputs()[1].node, 6);
+  // The in/out param is y, the second parameter.
+  EXPECT_EQ(plan.outputs()[2].param, 1);
+  EXPECT_EQ(plan.outputs()[2].bit, 0);
+  EXPECT_EQ(plan.outputs()[2].node, 0);
+  EXPECT_EQ(plan.nodes()[0].output_count, 1);
+  EXPECT_EQ(plan.nodes()[3].output_count, 0);
+}
+
+TEST(TfhePlanTest, CriticalPathLengths) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // Indexed by PlanOp: constant, param bit, not, and, or, xor, nand, nor, mux.
+  std::vector<int64_t> lengths =
+      plan.CriticalPathLengths({1, 2, 4, 10, 20, 30, 40, 50, 60});
+  // or.7 and or.9 end the circuit.
+  EXPECT_EQ(lengths[6], 20);
+  EXPECT_EQ(lengths[8], 20);
+  // bit_slice.3 -> not.4 -> and -> or.7 is the longest chain.
+  EXPECT_EQ(lengths[2], 2 + 4 + 10 + 20);
+  EXPECT_EQ(lengths[0], 2 + 10 + 20);
+  EXPECT_EQ(lengths[7], 1 + 20);
+}
+
+TEST(TfhePlanTest, LowersCompoundGates) {
+  constexpr absl::string_view kGates = R"(
+package my_package
+
+fn my_package(x: bits[3]) -> bits[4] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(x, start=2, width=1, id=3)
+  xor.4: bits[1] = xor(bit_slice.1, bit_slice.2, id=4)
+  nand.5: bits[1] = nand(bit_slice.1, bit_slice.2, id=5)
+  nor.6: bits[1] = nor(bit_slice.1, bit_slice.2, id=6)
+  sel.7: bits[1] = sel(bit_slice.3, cases=[bit_slice.1, bit_slice.2], id=7)
+  ret concat.8: bits[4] = concat(xor.4, nand.5, nor.6, sel.7, id=8)
+}
+)";
+  XLS_ASSERT_OK_AND_ASSIGN(auto package, xls::Parser::ParsePackage(kGates));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_int();
+  proto->add_params()->set_name("x");
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+
+  ASSERT_EQ(plan.node_count(), 7);
+  EXPECT_EQ(plan.nodes()[3].op, PlanOp::kXor);
+  EXPECT_EQ(plan.nodes()[4].op, PlanOp::kNand);
+  EXPECT_EQ(plan.nodes()[5].op, PlanOp::kNor);
+  EXPECT_EQ(plan.nodes()[6].op, PlanOp::kMux);
+  // The selector comes first, then the cases in order.
+  EXPECT_THAT(plan.operands(6), ElementsAre(2, 0, 1));
+}
+
+// The IR must be inlined: calls are not kept as sub-plans.
+TEST(TfhePlanTest, RejectsInvokes) {
+  constexpr absl::string_view kInvokeExample = R"(
+package my_package
+
+fn negate(a: bits[1]) -> bits[1] {
+  ret not.1: bits[1] = not(a, id=1)
+}
+
+fn my_package(x: bits[1]) -> bits[1] {
+  ret invoke.2: bits[1] = invoke(x, to_apply=negate, id=2)
+}
+)";
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInvokeExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_int();
+  proto->add_params()->set_name("x");
+  EXPECT_THAT(TfhePlan::Compile(function, metadata).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfhePlanTest, RejectsUnsupportedOps) {
+  constexpr absl::string_view kIdentity = R"(
+package my_package
+
+fn my_package(x: bits[2]) -> bits[1] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  ret identity.2: bits[1] = identity(bit_slice.1, id=2)
+}
+)";
+  XLS_ASSERT_OK_AND_ASSIGN(auto package, xls::Parser::ParsePackage(kIdentity));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  EXPECT_THAT(TfhePlan::Compile(function, metadata).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+void ExpectSamePlan(const TfhePlan& actual, const TfhePlan& expected) {
+  ASSERT_EQ(actual.node_count(), expected.node_count());
+  for (int32_t i = 0; i < expected.node_count(); ++i) {
+    const PlanNode& a = actual.nodes()[i];
+    const PlanNode& e = expected.nodes()[i];
+    EXPECT_EQ(a.op, e.op);
+    EXPECT_EQ(a.value, e.value);
+    EXPECT_EQ(a.param, e.param);
+    EXPECT_EQ(a.param_bit, e.param_bit);
+    EXPECT_EQ(a.level, e.level);
+    EXPECT_EQ(a.output_count, e.output_count);
+    EXPECT_THAT(actual.operands(i), ElementsAreArray(expected.operands(i)));
+    EXPECT_THAT(actual.users(i), ElementsAreArray(expected.users(i)));
+  }
+  EXPECT_EQ(actual.level_count(), expected.level_count());
+  EXPECT_THAT(actual.param_names(), ElementsAreArray(expected.param_names()));
+  EXPECT_EQ(actual.has_return_value(), expected.has_return_value());
+  ASSERT_EQ(actual.outputs().size(), expected.outputs().size());
+  for (int i = 0; i < expected.outputs().size(); ++i) {
+    EXPECT_EQ(actual.outputs()[i].param, expected.outputs()[i].param);
+    EXPECT_EQ(actual.outputs()[i].bit, expected.outputs()[i].bit);
+    EXPECT_EQ(actual.outputs()[i].node, expected.outputs()[i].node);
+  }
+}
+
+TEST(TfhePlanTest, SerializationRoundTrips) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // std::string's buffer comes from operator new, and so is suitably aligned.
+  const std::string serialized = plan.Serialize();
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan loaded, TfhePlan::FromBuffer(serialized));
+  ExpectSamePlan(loaded, plan);
+  // The arrays are read in place.
+  const char* nodes = reinterpret_cast<const char*>(loaded.nodes().data());
+  EXPECT_GT(nodes, serialized.data());
+  EXPECT_LT(nodes, serialized.data() + serialized.size());
+  EXPECT_EQ(loaded.Serialize(), serialized);
+
+  XLS_ASSERT_OK_AND_ASSIGN(TempFile file, TempFile::Create());
+  XLS_ASSERT_OK(xls::SetFileContents(file.path(), serialized));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan mapped,
+                           TfhePlan::MapFile(file.path().string()));
+  ExpectSamePlan(mapped, plan);
+}
+
+TEST(TfhePlanTest, RejectsCorruptSerializedPlans) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+  const std::string serialized = plan.Serialize();
+
+  std::string bad_magic = serialized;
+  bad_magic[0] = 'X';
+  EXPECT_THAT(TfhePlan::FromBuffer(bad_magic).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  std::string truncated = serialized.substr(0, serialized.size() - 1);
+  EXPECT_THAT(TfhePlan::FromBuffer(truncated).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // Point the first operand of or.7 (node 6) at itself.
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan loaded, TfhePlan::FromBuffer(serialized));
+  const size_t operand_offset =
+      reinterpret_cast<const char*>(loaded.operands(6).data()) -
+      serialized.data();
+  std::string cyclic = serialized;
+  const int32_t self = 6;
+  memcpy(&cyclic[operand_offset], &self, sizeof(self));
+  EXPECT_THAT(TfhePlan::FromBuffer(cyclic).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // Make or.7 a mux, which would read a third operand it doesn't have.
+  const size_t op_offset =
+      reinterpret_cast<const char*>(&loaded.nodes()[6].op) -
+      serialized.data();
+  std::string wrong_arity = serialized;
+  wrong_arity[op_offset] = static_cast<char>(PlanOp::kMux);
+  EXPECT_THAT(TfhePlan::FromBuffer(wrong_arity).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // Levels size per-level arrays, so they must be exact, not just in range.
+  const size_t level_offset =
+      reinterpret_cast<const char*>(&loaded.nodes()[6].level) -
+      serialized.data();
+  std::string wrong_level = serialized;
+  const int32_t level = loaded.nodes()[6].level - 1;
+  memcpy(&wrong_level[level_offset], &level, sizeof(level));
+  EXPECT_THAT(TfhePlan::FromBuffer(wrong_level).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  // level_count follows the magic, version, byte order mark and sizes.
+  std::string huge_level_count = serialized;
+  const int32_t level_count = 1 << 30;
+  memcpy(&huge_level_count[24], &level_count, sizeof(level_count));
+  EXPECT_THAT(TfhePlan::FromBuffer(huge_level_count).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  EXPECT_THAT(TfhePlan::MapFile("/nonexistent/plan").status(),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST(TfhePlanTest, SpecializesPublicParams) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // With x = 0b01, both ANDs pass not.4 through, or.7 of two copies is one
+  // more, and or.9 is 0 | 0.
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan specialized,
+                           plan.Specialize({{"x", {true, false}}}));
+  EXPECT_THAT(specialized.param_names(), ElementsAre("y"));
+  ASSERT_EQ(specialized.node_count(), 4);
+  EXPECT_EQ(specialized.nodes()[0].op, PlanOp::kParamBit);
+  EXPECT_EQ(specialized.nodes()[0].param, 0);
+  EXPECT_EQ(specialized.nodes()[1].op, PlanOp::kNot);
+  EXPECT_EQ(specialized.level_count(), 2);
+
+  ASSERT_EQ(specialized.outputs().size(), 3);
+  const PlanNode& high = specialized.nodes()[specialized.outputs()[0].node];
+  EXPECT_EQ(high.op, PlanOp::kConstant);
+  EXPECT_FALSE(high.value);
+  EXPECT_EQ(specialized.outputs()[1].node, 1);
+  // y is still written, with the constant low bit of x.
+  EXPECT_EQ(specialized.outputs()[2].param, 0);
+  const PlanNode& y = specialized.nodes()[specialized.outputs()[2].node];
+  EXPECT_EQ(y.op, PlanOp::kConstant);
+  EXPECT_TRUE(y.value);
+
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan loaded,
+                           TfhePlan::FromBuffer(specialized.Serialize()));
+  ExpectSamePlan(loaded, specialized);
+
+  // y is written by the function, so it cannot be fixed.
+  EXPECT_THAT(plan.Specialize({{"y", {true}}}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(plan.Specialize({{"z", {true}}}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(plan.Specialize({{"x", {true}}}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfhePlanTest, RestrictsToRequestedOutputs) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // y is just a copy of bit_slice.1.
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan y_only, plan.Restrict({{"y"}}));
+  EXPECT_EQ(y_only.node_count(), 1);
+  EXPECT_THAT(y_only.param_names(), ElementsAre("x", "y"));
+  ASSERT_EQ(y_only.outputs().size(), 1);
+  EXPECT_EQ(y_only.outputs()[0].param, 1);
+  EXPECT_EQ(y_only.outputs()[0].node, 0);
+
+  // The high result bit is or.9 of bit_slice.2 and literal.8.
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan high_bit, plan.Restrict({{"", 1, 2}}));
+  EXPECT_EQ(high_bit.node_count(), 3);
+  ASSERT_EQ(high_bit.outputs().size(), 1);
+  EXPECT_EQ(high_bit.outputs()[0].param, PlanOutputBit::kResult);
+  EXPECT_EQ(high_bit.outputs()[0].bit, 1);
+  EXPECT_EQ(high_bit.nodes()[high_bit.outputs()[0].node].op, PlanOp::kOr);
+  EXPECT_EQ(high_bit.level_count(), 2);
+
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan everything,
+                           plan.Restrict({{""}, {"y"}}));
+  ExpectSamePlan(everything, plan);
+
+  EXPECT_THAT(plan.Restrict({{"z"}}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfhePlanTest, IncrementalRecomputesChangedCone) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // y reaches not.4, both ANDs and or.7, but not or.9.
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan incremental,
+                           plan.Incremental({{"y"}}));
+  EXPECT_THAT(incremental.param_names(),
+              ElementsAre("x", "y", TfhePlan::kExtraParam));
+  int gates = 0;
+  for (const PlanNode& node : incremental.nodes()) {
+    if (!IsBootstrapFree(node.op)) ++gates;
+  }
+  EXPECT_EQ(gates, 3);
+  // The four recomputed nodes are written back, then the usual outputs.
+  ASSERT_EQ(incremental.outputs().size(), 4 + 3);
+  EXPECT_EQ(incremental.outputs()[0].param, 2);
+  EXPECT_EQ(incremental.outputs()[0].bit, 3);
+  EXPECT_EQ(incremental.outputs()[3].bit, 6);
+  // or.9 is read from the cache.
+  const PlanNode& high = incremental.nodes()[incremental.outputs()[4].node];
+  EXPECT_EQ(high.op, PlanOp::kParamBit);
+  EXPECT_EQ(high.param, 2);
+  EXPECT_EQ(high.param_bit, 8);
+
+  // Recomputing everything writes every gate.
+  EXPECT_EQ(plan.Caching().outputs().size(), 5 + 3);
+  EXPECT_THAT(plan.Incremental({{"z"}}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfhePlanTest, BindSplitsOffBoundOnlyNodes) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // or.9 reads only x; everything else on the way to an output reads y.
+  XLS_ASSERT_OK_AND_ASSIGN(PlanBinding binding,
+                           plan.Bind({"x"}));
+  EXPECT_EQ(binding.cache_size, 1);
+  EXPECT_THAT(binding.precompute.param_names(),
+              ElementsAre("x", "y", TfhePlan::kExtraParam));
+  ASSERT_EQ(binding.precompute.outputs().size(), 1);
+  EXPECT_EQ(binding.precompute.outputs()[0].param, 2);
+  EXPECT_EQ(binding.precompute.nodes()[binding.precompute.outputs()[0].node].op,
+            PlanOp::kOr);
+  const TfhePlan& per_call = binding.per_call;
+  EXPECT_EQ(per_call.outputs().size(), 3);
+  const PlanNode& high = per_call.nodes()[per_call.outputs()[0].node];
+  EXPECT_EQ(high.op, PlanOp::kParamBit);
+  EXPECT_EQ(high.param, 2);
+  EXPECT_EQ(high.param_bit, 0);
+
+  // y is written, so it cannot be bound.
+  EXPECT_THAT(plan.Bind({"y"}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(plan.Bind({"z"}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfhePlanTest, PartitionsIntoStages) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  XLS_ASSERT_OK_AND_ASSIGN(PlanPartition partition,
+                           plan.Partition({1, 1}));
+  ASSERT_EQ(partition.bootstrap_counts.size(), 2);
+  EXPECT_EQ(partition.bootstrap_counts[0] + partition.bootstrap_counts[1], 4);
+  // Every gate is evaluated in exactly one part and stage, and whatever a
+  // part reads from another was exported by it in an earlier stage.
+  int gates = 0;
+  std::vector<std::vector<bool>> exported(
+      2, std::vector<bool>(partition.boundary_size, false));
+  for (const PlanPartition::Stage& stage : partition.stages) {
+    for (int part = 0; part < 2; ++part) {
+      EXPECT_THAT(stage.plans[part].param_names(),
+                  ElementsAre("x", "y", TfhePlan::kExtraParam));
+      for (const PlanNode& node : stage.plans[part].nodes()) {
+        if (!IsBootstrapFree(node.op)) ++gates;
+      }
+      for (int32_t slot : stage.imports[part]) {
+        EXPECT_TRUE(exported[1 - part][slot]);
+      }
+    }
+    for (int part = 0; part < 2; ++part) {
+      for (int32_t slot : stage.exports[part]) {
+        exported[part][slot] = true;
+      }
+    }
+  }
+  EXPECT_EQ(gates, 4);
+  EXPECT_EQ(partition.collect.outputs().size(), 3);
+  for (const PlanNode& node : partition.collect.nodes()) {
+    EXPECT_TRUE(IsBootstrapFree(node.op));
+  }
+
+  // A single part cuts nothing, and needs a single stage.
+  XLS_ASSERT_OK_AND_ASSIGN(partition, plan.Partition({1}));
+  EXPECT_EQ(partition.cut_edges, 0);
+  EXPECT_EQ(partition.stages.size(), 1);
+  EXPECT_EQ(partition.bootstrap_counts[0], 4);
+  EXPECT_THAT(partition.reads_param, ElementsAre(ElementsAre(true, true)));
+
+  EXPECT_THAT(plan.Partition({}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(plan.Partition({1, 0}).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfhePlanTest, SegmentsByLevel) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // A segment per level of gates. Every gate is evaluated in exactly one
+  // segment, only the last writes the outputs, and nothing is live after it.
+  XLS_ASSERT_OK_AND_ASSIGN(PlanSegments segments, plan.Segment(1));
+  ASSERT_GT(segments.segments.size(), 1);
+  ASSERT_EQ(segments.live_after.size(), segments.segments.size());
+  int gates = 0;
+  for (int s = 0; s < segments.segments.size(); ++s) {
+    const TfhePlan& segment = segments.segments[s];
+    EXPECT_THAT(segment.param_names(),
+                ElementsAre("x", "y", TfhePlan::kExtraParam));
+    for (const PlanNode& node : segment.nodes()) {
+      if (!IsBootstrapFree(node.op)) ++gates;
+    }
+    // The frontier is written as outputs to its parameter.
+    int function_outputs = 0;
+    for (const PlanOutputBit& output : segment.outputs()) {
+      if (output.param != 2) ++function_outputs;
+    }
+    const bool last = s + 1 == segments.segments.size();
+    EXPECT_EQ(function_outputs, last ? 3 : 0);
+    if (!last) {
+      EXPECT_FALSE(segments.live_after[s].empty());
+    }
+    for (int32_t slot : segments.live_after[s]) {
+      EXPECT_LT(slot, segments.frontier_size);
+    }
+  }
+  EXPECT_EQ(gates, 4);
+  EXPECT_THAT(segments.live_after.back(), IsEmpty());
+
+  // A single segment has no frontier to keep.
+  XLS_ASSERT_OK_AND_ASSIGN(segments, plan.Segment(1000));
+  EXPECT_EQ(segments.segments.size(), 1);
+  EXPECT_EQ(segments.frontier_size, 0);
+
+  EXPECT_THAT(plan.Segment(0).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TfhePlanTest, SegmentsWithinValueLimit) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(auto function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan,
+                           TfhePlan::Compile(function, InOutMetadata()));
+
+  // Five gates and the two ANDs read back into the last segment don't fit
+  // in one segment of four values.
+  XLS_ASSERT_OK_AND_ASSIGN(PlanSegments segments,
+                           plan.SegmentWithin(4));
+  ASSERT_EQ(segments.segments.size(), 2);
+  ASSERT_EQ(segments.reads.size(), 2);
+  ASSERT_EQ(segments.writes.size(), 2);
+  int gates = 0;
+  for (const TfhePlan& segment : segments.segments) {
+    for (const PlanNode& node : segment.nodes()) {
+      if (node.op != PlanOp::kConstant && node.op != PlanOp::kParamBit) {
+        ++gates;
+      }
+    }
+  }
+  EXPECT_EQ(gates, 5);
+  // The ANDs and the OR feeding an output are passed on; the last segment
+  // reads them all and writes nothing.
+  EXPECT_THAT(segments.reads[0], IsEmpty());
+  EXPECT_EQ(segments.writes[0].size(), 3);
+  EXPECT_EQ(segments.reads[1], segments.writes[0]);
+  EXPECT_THAT(segments.writes[1], IsEmpty());
+  EXPECT_EQ(segments.frontier_size, 3);
+
+  XLS_ASSERT_OK_AND_ASSIGN(segments, plan.SegmentWithin(100));
+  EXPECT_EQ(segments.segments.size(), 1);
+  EXPECT_THAT(plan.SegmentWithin(3).status(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
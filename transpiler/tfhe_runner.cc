@@ -14,278 +14,215 @@
 
 #include "transpiler/tfhe_runner.h"
 
-#include <pthread.h>
-
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <future>  // NOLINT
+#include <limits>
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
+#include "absl/container/inlined_vector.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/types/span.h"
 #include "google/protobuf/text_format.h"
 #include "tfhe/tfhe.h"
 #include "tfhe/tfhe_io.h"
+#include "transpiler/live_set_schedule.h"
+#include "transpiler/tfhe_ciphertext_pool.h"
+#include "transpiler/tfhe_executor.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_trace.h"
 #include "xls/common/file/filesystem.h"
 #include "xls/common/status/status_macros.h"
 #include "xls/contrib/xlscc/metadata_output.pb.h"
 #include "xls/ir/function.h"
 #include "xls/ir/ir_parser.h"
-#include "xls/ir/node.h"
-#include "xls/ir/node_iterator.h"
-#include "xls/ir/nodes.h"
 #include "xls/ir/package.h"
-#include "xls/ir/type.h"
 
 namespace fully_homomorphic_encryption {
 namespace transpiler {
 
-TfheRunner::TfheRunner(std::unique_ptr<xls::Package> package,
-                       xlscc_metadata::MetadataOutput metadata)
-    : package_(std::move(package)), metadata_(metadata) {
-  threads_should_exit_.store(false);
-
-  XLS_CHECK(0 == pthread_mutex_init(&lock_, nullptr));
-  XLS_CHECK(0 == sem_init(&input_sem_, 1, 0));
-  XLS_CHECK(0 == sem_init(&output_sem_, 1, 0));
-
-  // *2 for hyperthreading opportunities
-  const int numCPU = sysconf(_SC_NPROCESSORS_ONLN) * 2;
-  for (int c = 0; c < numCPU; ++c) {
-    pthread_t new_thread;
-    XLS_CHECK(0 == pthread_create(&new_thread, nullptr,
-                                  TfheRunner::ThreadBodyStatic, (void*)this));
-    threads_.push_back(new_thread);
+namespace {
+
+// Default latency estimates, indexed by PlanOp. The binary gates bootstrap
+// once and MUX twice; the rest are linear-time copies and negations.
+constexpr int64_t kBootstrapLatencyNs = 10'000'000;
+constexpr int64_t kLinearLatencyNs = 10'000;
+constexpr std::array<int64_t, kPlanOpCount> kDefaultOpLatencyNs = {
+    kLinearLatencyNs,         // kConstant
+    kLinearLatencyNs,         // kParamBit
+    kLinearLatencyNs,         // kNot
+    kBootstrapLatencyNs,      // kAnd
+    kBootstrapLatencyNs,      // kOr
+    kBootstrapLatencyNs,      // kXor
+    kBootstrapLatencyNs,      // kNand
+    kBootstrapLatencyNs,      // kNor
+    2 * kBootstrapLatencyNs,  // kMux
+};
+
+// Turns per-node critical path lengths into scheduling priorities: minus how
+// long after the start of a run each node can start at the latest without
+// delaying the end of the run. Within a run this orders nodes as the lengths
+// do; see TfheRunner::Schedule() for how runs are ordered against each other.
+std::shared_ptr<const std::vector<int64_t>> MakePriorities(
+    std::vector<int64_t> critical_path_ns) {
+  int64_t longest_ns = 0;
+  for (int64_t length_ns : critical_path_ns) {
+    longest_ns = std::max(longest_ns, length_ns);
   }
+  for (int64_t& length_ns : critical_path_ns) {
+    length_ns -= longest_ns;
+  }
+  return std::make_shared<const std::vector<int64_t>>(
+      std::move(critical_path_ns));
 }
 
-TfheRunner::~TfheRunner() {
-  threads_should_exit_.store(true);
-
-  // Wake up threads
-  for (pthread_t pt : threads_) {
-    (void)pt;
-    sem_post(&input_sem_);
+// A string form of `public_params`, equal for equal values however the map
+// happens to order them; for keying TfheRunner::specialized_.
+std::string PublicParamsKey(const TfhePlan::PublicParams& public_params) {
+  std::vector<const std::pair<const std::string, std::vector<bool>>*> entries;
+  for (const auto& entry : public_params) {
+    entries.push_back(&entry);
   }
-  // Wait for exit
-  for (pthread_t pt : threads_) {
-    pthread_join(pt, nullptr);
+  std::sort(entries.begin(), entries.end(),
+            [](const auto* a, const auto* b) { return a->first < b->first; });
+  std::string key;
+  for (const auto* entry : entries) {
+    absl::StrAppend(&key, entry->first, "=");
+    for (bool bit : entry->second) {
+      key.push_back(bit ? '1' : '0');
+    }
+    key.push_back(';');
   }
+  return key;
+}
 
-  XLS_CHECK(0 == pthread_mutex_destroy(&lock_));
-  XLS_CHECK(0 == sem_destroy(&input_sem_));
-  XLS_CHECK(0 == sem_destroy(&output_sem_));
+TfhePlan CompileOrDie(std::unique_ptr<xls::Package> package,
+                      const xlscc_metadata::MetadataOutput& metadata) {
+  auto entry = package->GetFunction(metadata.top_func_proto().name().name());
+  XLS_CHECK(entry.ok()) << entry.status();
+  auto plan = TfhePlan::Compile(*entry, metadata);
+  XLS_CHECK(plan.ok()) << plan.status();
+  return *std::move(plan);
 }
 
-absl::Status TfheRunner::HandleBitSlice(
-    LweSample* result, const xls::BitSlice* bit_slice,
-    const absl::flat_hash_map<std::string, LweSample*> args,
-    const TFheGateBootstrappingCloudKeySet* bk) {
-  xls::Node* operand = bit_slice->operand(0);
-  int slice_idx = 0;
-
-  if (operand->Is<xls::ArrayIndex>()) {
-    // If we're slicing into an array index, then we just need to get
-    // the bit offset of index in the bit vector that represents the array
-    // (in booleanified space).
-    const xls::ArrayIndex* array_index = operand->As<xls::ArrayIndex>();
-    XLS_ASSIGN_OR_RETURN(const xls::ArrayType* array_type,
-                         array_index->array()->GetType()->AsArray());
-
-    // TODO: Only literal indices into single-dimensional arrays
-    // are currently supported. To extend past 1-d, we'll need to walk up the
-    // array index chain, determining at each step the offset from element 0,
-    // and pass that back down here.
-    absl::Span<xls::Node* const> indices = array_index->indices();
-    if (indices.size() != 1) {
-      return absl::InvalidArgumentError(
-          "Only single-dimensional arrays/array indices are supported.");
-    }
-    if (!indices[0]->Is<xls::Literal>()) {
-      return absl::InvalidArgumentError(
-          "Only literal indexes into arrays are supported.");
-    }
-    xls::Literal* literal = indices[0]->As<xls::Literal>();
-
-    XLS_ASSIGN_OR_RETURN(int64_t concrete_index,
-                         literal->value().bits().ToUint64());
-    slice_idx = array_type->element_type()->GetFlatBitCount() * concrete_index;
-    slice_idx += bit_slice->start();
-
-    while (!operand->Is<xls::Param>()) {
-      operand = operand->operand(0);
-      // Verify that the only things allowed in a BitSlice chain are array
-      // indexes, tuple indexes, other bit slices, and the eventual params.
-      XLS_CHECK(operand->Is<xls::ArrayIndex>() ||
-                operand->Is<xls::BitSlice>() || operand->Is<xls::Param>() ||
-                operand->Is<xls::TupleIndex>())
-          << "Invalid BitSlice operand: " << operand->ToString();
-    }
-  } else {
-    // TODO: Only single-dimensional indexes are supported at the
-    // moment.
-    auto is_special_node = [](xls::Node* operand) {
-      return operand->Is<xls::Param>() || operand->Is<xls::TupleIndex>();
-    };
-    if (is_special_node(operand)) {
-      slice_idx = bit_slice->start();
-    } else {
-      // Walk up the tree until a param is found.
-      while (!is_special_node(operand)) {
-        slice_idx++;
-        // Assuming SHR.
-        operand = operand->operand(0);
-
-        // Verify that the only things allowed in a BitSlice chain are array
-        // indexes, tuple indexes, other bit slices, and the eventual params.
-        XLS_CHECK(operand->Is<xls::ArrayIndex>() ||
-                  operand->Is<xls::BitSlice>() || operand->Is<xls::Param>() ||
-                  operand->Is<xls::TupleIndex>())
-            << "Invalid BitSlice operand: " << operand->ToString();
-      }
-    }
-  }
+}  // namespace
 
-  // Overflow SHR, can be ignored.
-  if (operand->GetType()->GetFlatBitCount() == slice_idx) {
-    return absl::OkStatus();
+TfheRunner::TfheRunner(std::unique_ptr<xls::Package> package,
+                       xlscc_metadata::MetadataOutput metadata)
+    : TfheRunner(CompileOrDie(std::move(package), metadata)) {}
+
+absl::StatusOr<std::shared_ptr<TfheRunner>> TfheRunnerCache::GetOrCreate(
+    std::string key,
+    const std::function<absl::StatusOr<std::unique_ptr<TfheRunner>>()>&
+        create) {
+  // Held while creating, so that concurrent first uses of a key create it
+  // once.
+  absl::MutexLock lock(&lock_);
+  auto found = std::find_if(
+      runners_.begin(), runners_.end(),
+      [&key](const auto& entry) { return entry.first == key; });
+  if (found != runners_.end()) {
+    std::rotate(runners_.begin(), found, found + 1);
+    return runners_.front().second;
   }
-
-  std::string param_name = operand->GetName();
-  if (operand->GetType()->GetFlatBitCount() == 1) {
-    if (operand->Is<xls::TupleIndex>() || operand->Is<xls::ArrayIndex>()) {
-      param_name = operand->operand(0)->GetName();
-    }
+  XLS_ASSIGN_OR_RETURN(std::unique_ptr<TfheRunner> runner, create());
+  if (runners_.size() == kMaxCachedRunners) {
+    runners_.pop_back();
   }
-  auto found_arg = args.find(param_name);
-  XLS_CHECK(found_arg != args.end());
-  bootsCOPY(result, &found_arg->second[slice_idx], bk);
-  return absl::OkStatus();
+  runners_.emplace(runners_.begin(), std::move(key), std::move(runner));
+  return runners_.front().second;
 }
 
-absl::Status TfheRunner::CollectNodeValue(
-    const xls::Node* node, LweSample* output_arg, int output_offset,
-    const absl::flat_hash_map</*id=*/uint64_t, LweSample*>& values,
-    const TFheGateBootstrappingCloudKeySet* bk) {
-  xls::Type* type = node->GetType();
-  std::string outputs;
-  switch (type->kind()) {
-    case xls::TypeKind::kBits: {
-      // If this is a single bit, then we can [finally] emit the copy.
-      int64_t bit_count = type->GetFlatBitCount();
-      if (bit_count == 1) {
-        // We can't handle concats in the transpiler, so if our single-bit is
-        // one, walk up a level.
-        while (node->Is<xls::Concat>()) {
-          node = node->operand(0);
-        }
-        // Copy this node to the appropriate bit of the output.
-        bootsCOPY(&output_arg[output_offset], values.at(node->id()), bk);
-        break;
-      }
+int TfheRunnerCache::size() {
+  absl::MutexLock lock(&lock_);
+  return runners_.size();
+}
 
-      // Otherwise, keep drilling down. Note that we iterate over bits in
-      // "reverse" order, to match XLS' internal big-endian bit ordering (NOT
-      // BYTE ORDERING) to the currently assumed little-endian bit ordering of
-      // the host.
-      for (int i = 0; i < bit_count; i++) {
-        XLS_RETURN_IF_ERROR(
-            CollectNodeValue(node->operand(i), output_arg,
-                             output_offset + (bit_count - i - 1), values, bk));
-      }
-      break;
+TfheRunner::TfheRunner(TfhePlan plan) : TfheRunner(std::move(plan), Options()) {}
+
+TfheRunner::TfheRunner(TfhePlan plan, Options options)
+    : plan_(std::move(plan)),
+      options_(options),
+      executor_(options.executor != nullptr ? options.executor
+                                            : TfheExecutor::Default()),
+      own_pool_(options.pool),
+      pool_(options.shared_pool != nullptr ? options.shared_pool
+                                           : &own_pool_),
+      trace_(options.trace),
+      measure_op_latencies_(options.measure_op_latencies) {
+  // Bits of in/out parameters are still copied, since writing the outputs
+  // could otherwise clobber a bit before another output reads it.
+  std::vector<bool> written_params(plan_.param_names().size(), false);
+  for (const PlanOutputBit& output : plan_.outputs()) {
+    if (output.param != PlanOutputBit::kResult) {
+      written_params[output.param] = true;
     }
-    case xls::TypeKind::kArray: {
-      const xls::ArrayType* array_type = type->AsArrayOrDie();
-      int64_t stride = array_type->element_type()->GetFlatBitCount();
-      for (int i = 0; i < array_type->size(); i++) {
-        XLS_RETURN_IF_ERROR(CollectNodeValue(node->operand(i), output_arg,
-                                             output_offset + i * stride, values,
-                                             bk));
+  }
+  const int node_count = plan_.node_count();
+  aliases_arg_.assign(node_count, false);
+  evaluated_operand_count_.assign(node_count, 0);
+  for (int i = 0; i < node_count; ++i) {
+    const PlanNode& node = plan_.nodes()[i];
+    aliases_arg_[i] =
+        node.op == PlanOp::kParamBit && !written_params[node.param];
+    for (int32_t operand : plan_.operands(i)) {
+      if (!aliases_arg_[operand]) {
+        ++evaluated_operand_count_[i];
       }
-      break;
     }
-    case xls::TypeKind::kTuple: {
-      // TODO: Populating output tuple types can be dangerous -
-      // if they correspond to C structures, then there could be strange
-      // issues such as host-native structure layout not matching the packed
-      // layout used inside XLS, e.g.,
-      // struct Foo {
-      //  char a;
-      //  short b;
-      //  int c;
-      // };
-      // may have padding inserted around some elements. User beware (for now,
-      // at least).
-      const xls::TupleType* tuple_type = type->AsTupleOrDie();
-      int64_t sub_offset = 0;
-      for (int i = 0; i < tuple_type->size(); i++) {
-        XLS_RETURN_IF_ERROR(CollectNodeValue(node->operand(i), output_arg,
-                                             output_offset + sub_offset, values,
-                                             bk));
-        sub_offset += node->operand(i)->GetType()->GetFlatBitCount();
-      }
-      break;
+  }
+  runs_inline_.assign(node_count, false);
+  for (int i = 0; i < node_count; ++i) {
+    runs_inline_[i] = IsBootstrapFree(plan_.nodes()[i].op);
+    if (!aliases_arg_[i] && evaluated_operand_count_[i] == 0) {
+      (runs_inline_[i] ? inline_seeds_ : scheduled_seeds_).push_back(i);
     }
-    default:
-      return absl::InvalidArgumentError(
-          absl::StrCat("Unsupported type kind: ", type->kind()));
   }
-  return absl::OkStatus();
-}
 
-absl::Status TfheRunner::CollectOutputs(
-    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
-    const absl::flat_hash_map</*id=*/uint64_t, LweSample*>& values,
-    const TFheGateBootstrappingCloudKeySet* bk) {
-  XLS_ASSIGN_OR_RETURN(auto function, GetEntry());
-  const xls::Node* return_value = function->return_value();
-
-  std::vector<const xls::Node*> elements;
-  const xls::Type* type = return_value->GetType();
-  if (type->kind() == xls::TypeKind::kTuple) {
-    elements.insert(elements.begin(), return_value->operands().begin(),
-                    return_value->operands().end());
-  } else {
-    elements.push_back(return_value);
+  next_trace_run_.store(0);
+  for (int op = 0; op < kPlanOpCount; ++op) {
+    op_total_ns_[op].store(0);
+    op_count_[op].store(0);
   }
-
-  if (elements.empty()) {
-    return absl::OkStatus();
+  if (options_.schedule == Options::Schedule::kMinLiveSet) {
+    min_live_order_ = MinLiveOrder(plan_.ToDataflowGraph());
   }
+  absl::MutexLock lock(&priorities_lock_);
+  priorities_ = PrioritiesFor(kDefaultOpLatencyNs);
+}
 
-  int output_idx = 0;
-  if (metadata_.top_func_proto().return_type().has_as_void()) {
-    if (result != nullptr) {
-      return absl::FailedPreconditionError(
-          "return value requested for a void-returning function");
-    }
-  } else {
-    XLS_RETURN_IF_ERROR(
-        CollectNodeValue(elements[output_idx++], result, 0, values, bk));
-  }
-
-  const auto& fn_params = metadata_.top_func_proto().params();
-  int param_idx = 0;
-  for (; output_idx < elements.size(); output_idx++) {
-    const xlscc_metadata::FunctionParameter* param;
-    while (true) {
-      param = &fn_params[param_idx++];
-      if (!param->is_const() && param->is_reference()) {
-        break;
-      }
-
-      if (param_idx == fn_params.size()) {
-        return absl::InternalError(absl::StrCat(
-            "No matching in/out param for function param: ", param->name()));
-      }
-    }
+TfheRunner::~TfheRunner() {}
 
-    XLS_RETURN_IF_ERROR(CollectNodeValue(elements[output_idx],
-                                         args[param->name()], 0, values, bk));
+void TfheRunner::CollectOutputs(RunState* state) {
+  for (const PlanOutputBit& output : plan_.outputs()) {
+    LweSample* destination = output.param == PlanOutputBit::kResult
+                                 ? state->result
+                                 : state->args[output.param];
+    bootsCOPY(&destination[output.bit], state->values[output.node],
+              state->bk);
+    ReleaseUse(state, output.node);
   }
+}
 
-  return absl::OkStatus();
+absl::StatusOr<std::unique_ptr<TfheRunner>> TfheRunner::Create(
+    std::unique_ptr<xls::Package> package,
+    const xlscc_metadata::MetadataOutput& metadata) {
+  XLS_ASSIGN_OR_RETURN(
+      xls::Function * entry,
+      package->GetFunction(metadata.top_func_proto().name().name()));
+  XLS_ASSIGN_OR_RETURN(TfhePlan plan, TfhePlan::Compile(entry, metadata));
+  return std::make_unique<TfheRunner>(std::move(plan));
 }
 
 absl::StatusOr<std::unique_ptr<TfheRunner>> TfheRunner::CreateFromFile(
@@ -300,7 +237,7 @@ absl::StatusOr<std::unique_ptr<TfheRunner>> TfheRunner::CreateFromFile(
     return absl::InvalidArgumentError(
         "Could not parse function metadata proto.");
   }
-  return std::make_unique<TfheRunner>(std::move(package), std::move(metadata));
+  return Create(std::move(package), metadata);
 }
 
 absl::StatusOr<std::unique_ptr<TfheRunner>> TfheRunner::CreateFromStrings(
@@ -314,204 +251,470 @@ absl::StatusOr<std::unique_ptr<TfheRunner>> TfheRunner::CreateFromStrings(
         "Could not parse function metadata proto.");
   }
 
-  return std::make_unique<TfheRunner>(std::move(package), std::move(metadata));
+  return Create(std::move(package), metadata);
 }
 
-absl::StatusOr<LweSample*> TfheRunner::EvalSingleOp(
-    xls::Node* n, std::vector<LweSample*> operands,
-    const absl::flat_hash_map<std::string, LweSample*> args,
-    const TFheGateBootstrappingCloudKeySet* bk) {
-  XLS_CHECK(n != nullptr);
-  auto node_type = n->op();
-  if (node_type == xls::Op::kArray || node_type == xls::Op::kArrayIndex ||
-      node_type == xls::Op::kConcat || node_type == xls::Op::kParam ||
-      node_type == xls::Op::kShrl || node_type == xls::Op::kTuple ||
-      node_type == xls::Op::kTupleIndex) {
-    // These are all handled as operands to slice nodes.
-    return nullptr;
-  }
-
-  auto out = new_gate_bootstrapping_ciphertext(bk->params);
-  switch (node_type) {
-    case xls::Op::kBitSlice: {
-      // Slices should be of parameters with width 1.
-      auto slice = n->As<xls::BitSlice>();
-      XLS_RETURN_IF_ERROR(HandleBitSlice(out, slice, args, bk));
-    } break;
-    case xls::Op::kLiteral: {
-      // Literals must be bits with width 1, or else used purely as array
-      // indices.
-      auto literal = n->As<xls::Literal>();
-      auto bits = literal->GetType()->AsBitsOrDie();
-      if (bits->bit_count() == 1) {
-        bootsCONSTANT(out, literal->value().IsAllZeros() ? 0 : 1, bk);
-      } else {
-        // We allow literals strictly for pulling values out of [param]
-        // arrays.
-        for (const xls::Node* user : literal->users()) {
-          if (!user->Is<xls::ArrayIndex>()) {
-            XLS_LOG(FATAL) << "Unsupported literal: " << n->ToString();
-          }
-        }
-        delete_gate_bootstrapping_ciphertext(out);
-        return nullptr;
-      }
-    } break;
-    case xls::Op::kAnd: {
-      XLS_CHECK(operands.size() == 2);
-      XLS_CHECK(operands[0] != nullptr);
-      XLS_CHECK(operands[1] != nullptr);
+absl::StatusOr<std::unique_ptr<TfheRunner>> TfheRunner::CreateFromPlanFile(
+    absl::string_view plan_path) {
+  XLS_ASSIGN_OR_RETURN(TfhePlan plan, TfhePlan::MapFile(plan_path));
+  return std::make_unique<TfheRunner>(std::move(plan));
+}
+
+absl::StatusOr<std::unique_ptr<TfheRunner>> TfheRunner::Specialize(
+    const TfhePlan::PublicParams& public_params) const {
+  XLS_ASSIGN_OR_RETURN(TfhePlan plan, plan_.Specialize(public_params));
+  return std::make_unique<TfheRunner>(std::move(plan), options_);
+}
+
+absl::StatusOr<std::shared_ptr<TfheRunner>> TfheRunner::ForOutputs(
+    absl::Span<const BitRange> mask) {
+  const std::vector<BitRange> canonical = Canonicalize(mask);
+  return restricted_.GetOrCreate(
+      CanonicalKey(canonical),
+      [&]() -> absl::StatusOr<std::unique_ptr<TfheRunner>> {
+        XLS_ASSIGN_OR_RETURN(TfhePlan plan, plan_.Restrict(canonical));
+        return std::make_unique<TfheRunner>(std::move(plan), options_);
+      });
+}
+
+void TfheRunner::EvalSingleOp(const PlanNode& node,
+                              absl::Span<LweSample* const> operands,
+                              absl::Span<LweSample* const> params,
+                              LweSample* out,
+                              const TFheGateBootstrappingCloudKeySet* bk) {
+  switch (node.op) {
+    case PlanOp::kConstant:
+      bootsCONSTANT(out, node.value ? 1 : 0, bk);
+      break;
+    case PlanOp::kParamBit:
+      // Only bits of in/out params get here; the rest are read in place.
+      bootsCOPY(out, &params[node.param][node.param_bit], bk);
+      break;
+    case PlanOp::kAnd:
       bootsAND(out, operands[0], operands[1], bk);
-    } break;
-    case xls::Op::kOr: {
-      XLS_CHECK(operands.size() == 2);
-      XLS_CHECK(operands[0] != nullptr);
-      XLS_CHECK(operands[1] != nullptr);
+      break;
+    case PlanOp::kOr:
       bootsOR(out, operands[0], operands[1], bk);
-    } break;
-    case xls::Op::kNot: {
-      XLS_CHECK(operands.size() == 1);
-      XLS_CHECK(operands[0] != nullptr);
+      break;
+    case PlanOp::kNot:
       bootsNOT(out, operands[0], bk);
-    } break;
-    default:
-      delete_gate_bootstrapping_ciphertext(out);
-      XLS_LOG(FATAL) << "Unsupported node: " << n->ToString();
-      return nullptr;
+      break;
+    case PlanOp::kXor:
+      bootsXOR(out, operands[0], operands[1], bk);
+      break;
+    case PlanOp::kNand:
+      bootsNAND(out, operands[0], operands[1], bk);
+      break;
+    case PlanOp::kNor:
+      bootsNOR(out, operands[0], operands[1], bk);
+      break;
+    case PlanOp::kMux:
+      // bootsMUX takes the value for a set selector first.
+      bootsMUX(out, operands[0], operands[2], operands[1], bk);
+      break;
   }
-  return out;
 }
 
 absl::Status TfheRunner::Run(LweSample* result,
                              absl::flat_hash_map<std::string, LweSample*> args,
                              const TFheGateBootstrappingCloudKeySet* bk) {
-  XLS_CHECK(input_queue_.empty());
-  XLS_CHECK(output_queue_.empty());
-
-  const_args_ = args;
-  const_bk_ = bk;
+  return Run(result, std::move(args), bk, RunOptions());
+}
 
-  XLS_ASSIGN_OR_RETURN(auto entry, GetEntry());
-  auto type = entry->GetType();
+absl::Status TfheRunner::Run(LweSample* result,
+                             absl::flat_hash_map<std::string, LweSample*> args,
+                             const TFheGateBootstrappingCloudKeySet* bk,
+                             const RunOptions& run_options) {
+  std::vector<absl::Status> item_statuses;
+  XLS_RETURN_IF_ERROR(
+      RunBatch({result}, {args}, bk, run_options, &item_statuses));
+  return item_statuses[0];
+}
 
-  // Arguments must match and all types must be bits.
-  XLS_CHECK(type->parameter_count() == args.size());
-  for (auto n : entry->params()) {
-    XLS_CHECK(n != nullptr);
-    XLS_CHECK(args.contains(n->name()));
+absl::Status TfheRunner::Run(LweSample* result,
+                             absl::flat_hash_map<std::string, LweSample*> args,
+                             const TfhePlan::PublicParams& public_params,
+                             const TFheGateBootstrappingCloudKeySet* bk) {
+  XLS_ASSIGN_OR_RETURN(
+      std::shared_ptr<TfheRunner> specialized,
+      specialized_.GetOrCreate(PublicParamsKey(public_params),
+                               [&]() { return Specialize(public_params); }));
+  for (const auto& entry : public_params) {
+    args.erase(entry.first);
   }
+  return specialized->Run(result, std::move(args), bk);
+}
 
-  auto return_value = entry->return_value();
-  XLS_CHECK(return_value != nullptr);
+void TfheRunner::RunAsync(LweSample* result,
+                          absl::flat_hash_map<std::string, LweSample*> args,
+                          const TFheGateBootstrappingCloudKeySet* bk,
+                          std::function<void(absl::Status)> done) {
+  RunAsync(result, std::move(args), bk, RunOptions(), std::move(done));
+}
 
-  // Map of intermediate LweSample, indexed by node id.
-  absl::flat_hash_map<uint64_t, LweSample*> values;
+void TfheRunner::RunAsync(LweSample* result,
+                          absl::flat_hash_map<std::string, LweSample*> args,
+                          const TFheGateBootstrappingCloudKeySet* bk,
+                          const RunOptions& run_options,
+                          std::function<void(absl::Status)> done) {
+  // The batch fills in the item's status before any of its nodes can finish,
+  // so the callback can safely read it.
+  auto item_statuses = std::make_shared<std::vector<absl::Status>>();
+  absl::Status status = StartBatch(
+      {result}, {args}, bk, run_options, item_statuses.get(),
+      [item_statuses, done]() { done((*item_statuses)[0]); });
+  if (!status.ok()) {
+    done(status);
+  }
+}
 
-  std::set<xls::Node*> unevaluated;
-  unevaluated.insert(entry->nodes().begin(), entry->nodes().end());
+std::future<absl::Status> TfheRunner::RunAsync(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  return RunAsync(result, std::move(args), bk, RunOptions());
+}
 
-  while (!unevaluated.empty()) {
-    // Threads should not be running right now
-    XLS_CHECK(input_queue_.empty());
-    XLS_CHECK(output_queue_.empty());
+std::future<absl::Status> TfheRunner::RunAsync(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk,
+    const RunOptions& run_options) {
+  auto promise = std::make_shared<std::promise<absl::Status>>();
+  std::future<absl::Status> future = promise->get_future();
+  RunAsync(result, std::move(args), bk, run_options,
+           [promise](absl::Status status) { promise->set_value(status); });
+  return future;
+}
 
-    // Scan ahead and find nodes that are ready to be evaluated
-    for (xls::Node* n : unevaluated) {
-      std::vector<LweSample*> operands;
-      operands.resize(n->operand_count());
+absl::Status TfheRunner::BindArgs(
+    const absl::flat_hash_map<std::string, LweSample*>& args,
+    RunState* state) {
+  if (!plan_.has_return_value() && state->result != nullptr) {
+    return absl::FailedPreconditionError(
+        "return value requested for a void-returning function");
+  }
+  if (plan_.has_return_value() && state->result == nullptr) {
+    return absl::InvalidArgumentError("Missing result buffer.");
+  }
+  // Arguments must match the function's parameters.
+  if (args.size() != plan_.param_names().size()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Expected ", plan_.param_names().size(),
+                     " arguments, got ", args.size()));
+  }
+  for (const std::string& name : plan_.param_names()) {
+    auto found = args.find(name);
+    if (found == args.end()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Missing argument: ", name));
+    }
+    state->args.push_back(found->second);
+  }
+  return absl::OkStatus();
+}
 
-      bool all_operands_ready = true;
+absl::Status TfheRunner::RunBatch(
+    absl::Span<LweSample* const> results,
+    absl::Span<const absl::flat_hash_map<std::string, LweSample*>> args,
+    const TFheGateBootstrappingCloudKeySet* bk,
+    std::vector<absl::Status>* item_statuses) {
+  return RunBatch(results, args, bk, RunOptions(), item_statuses);
+}
 
-      for (int opi = 0; opi < n->operand_count(); ++opi) {
-        xls::Node* opn = n->operand(opi);
-        auto found_val = values.find(opn->id());
-        if (found_val == values.end()) {
-          all_operands_ready = false;
-          break;
-        }
-        operands[opi] = found_val->second;
-      }
+absl::Status TfheRunner::RunBatch(
+    absl::Span<LweSample* const> results,
+    absl::Span<const absl::flat_hash_map<std::string, LweSample*>> args,
+    const TFheGateBootstrappingCloudKeySet* bk, const RunOptions& run_options,
+    std::vector<absl::Status>* item_statuses) {
+  absl::Notification done;
+  XLS_RETURN_IF_ERROR(StartBatch(results, args, bk, run_options,
+                                 item_statuses,
+                                 [&done]() { done.Notify(); }));
+  done.WaitForNotification();
+  return absl::OkStatus();
+}
 
-      if (all_operands_ready) {
-        input_queue_.push(NodeToEval(n, operands));
+absl::Status TfheRunner::StartBatch(
+    absl::Span<LweSample* const> results,
+    absl::Span<const absl::flat_hash_map<std::string, LweSample*>> args,
+    const TFheGateBootstrappingCloudKeySet* bk, const RunOptions& run_options,
+    std::vector<absl::Status>* item_statuses, std::function<void()> on_done) {
+  if (!results.empty() && results.size() != args.size()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Got ", results.size(), " result buffers for ",
+                     args.size(), " argument sets"));
+  }
+  // Shed calls that could not finish in time anyway before doing any work.
+  XLS_RETURN_IF_ERROR(
+      CheckLimits(run_options.deadline, run_options.cancellation));
+
+  auto invocation = std::make_unique<Invocation>();
+  invocation->item_statuses = item_statuses;
+  invocation->on_done = std::move(on_done);
+  invocation->deadline = run_options.deadline;
+  invocation->cancellation = run_options.cancellation;
+  {
+    absl::MutexLock lock(&priorities_lock_);
+    invocation->priorities = priorities_;
+  }
+  invocation->start_ns = absl::GetCurrentTimeNanos();
+  if (run_options.key_replicas != nullptr) {
+    if (run_options.key_replicas->original() != bk ||
+        run_options.key_replicas->node_count() !=
+            executor_->numa_nodes().size()) {
+      return absl::InvalidArgumentError(
+          "Cloud key replicas were not made from this key for this executor's "
+          "NUMA nodes");
+    }
+  }
+  invocation->key_replicas = run_options.key_replicas;
+  // Held until Finish(), so that a concurrent call with a key of another
+  // LWE dimension fails here instead of in the pool.
+  XLS_RETURN_IF_ERROR(pool_->Reserve(bk->params));
+  const int node_count = plan_.node_count();
+  item_statuses->assign(args.size(), absl::OkStatus());
+  for (int item = 0; item < args.size(); ++item) {
+    auto state = std::make_unique<RunState>(
+        invocation.get(), item, node_count,
+        results.empty() ? nullptr : results[item], bk);
+    absl::Status status = BindArgs(args[item], state.get());
+    if (!status.ok()) {
+      (*item_statuses)[item] = status;
+      continue;
+    }
+    for (int i = 0; i < node_count; ++i) {
+      const PlanNode& node = plan_.nodes()[i];
+      state->remaining_operands[i].store(evaluated_operand_count_[i]);
+      state->remaining_uses[i].store(node.user_count + node.output_count);
+      if (aliases_arg_[i]) {
+        state->values[i] = &state->args[node.param][node.param_bit];
       }
     }
-
-    const int n_to_run = input_queue_.size();
-
-    // Unblock the worker threads
-    for (int i = 0; i < n_to_run; ++i) {
-      sem_post(&input_sem_);
+    if (trace_ != nullptr) {
+      state->trace_run = next_trace_run_.fetch_add(1);
+      state->ready_ns.assign(node_count, absl::GetCurrentTimeNanos());
     }
+    invocation->states.push_back(std::move(state));
+  }
 
-    // Wait for output from the worker threads
-    for (int i = 0; i < n_to_run; ++i) {
-      sem_wait(&output_sem_);
+  // Seed the executor with every node that has no operands left to wait for,
+  // alternating between items so that each gets started early; from here on
+  // each task schedules the nodes it makes ready. The last task to finish
+  // takes ownership of the invocation.
+  int64_t inline_seed_priority = std::numeric_limits<int64_t>::min();
+  for (int32_t seed : inline_seeds_) {
+    inline_seed_priority =
+        std::max(inline_seed_priority, Priority(invocation.get(), seed));
+  }
+  const int64_t tasks_per_state =
+      scheduled_seeds_.size() + (inline_seeds_.empty() ? 0 : 1);
+  const int64_t task_count = tasks_per_state * invocation->states.size();
+  if (task_count == 0) {
+    Finish(invocation.release());
+    return absl::OkStatus();
+  }
+  invocation->pending_tasks.store(task_count);
+  Invocation* started = invocation.release();
+  if (!inline_seeds_.empty()) {
+    for (auto& state : started->states) {
+      executor_->Schedule(
+          [this, state = state.get()]() { RunTask(state, inline_seeds_); },
+          inline_seed_priority);
+    }
+  }
+  for (int32_t seed : scheduled_seeds_) {
+    for (auto& state : started->states) {
+      Schedule(state.get(), seed);
     }
+  }
+  return absl::OkStatus();
+}
 
-    // Process output
-    while (!output_queue_.empty()) {
-      NodeFromEval from_eval = output_queue_.front();
-      output_queue_.pop();
+int64_t TfheRunner::Priority(const Invocation* invocation, int node_index) {
+  // Offsetting by the start time makes this minus the latest time at which
+  // the node can start without its run finishing later than it would have
+  // uncontended: earliest deadline first. Runs therefore share the workers in
+  // proportion to their length, and however many are started later, each
+  // one's nodes eventually become the most urgent.
+  return (*invocation->priorities)[node_index] - invocation->start_ns;
+}
 
-      xls::Node* n = std::get<0>(from_eval);
+void TfheRunner::Schedule(RunState* state, int node_index) {
+  executor_->Schedule(
+      [this, state, node_index]() {
+        RunTask(state, absl::MakeConstSpan(&node_index, 1));
+      },
+      Priority(state->invocation, node_index));
+}
 
-      // Even if the result was nullptr, mark the op as complete
-      XLS_CHECK(!values.contains(n->id()));
-      values[n->id()] = std::get<1>(from_eval);
+std::shared_ptr<const std::vector<int64_t>> TfheRunner::PrioritiesFor(
+    absl::Span<const int64_t> op_latency_ns) const {
+  if (options_.schedule == Options::Schedule::kCriticalPath) {
+    return MakePriorities(plan_.CriticalPathLengths(op_latency_ns));
+  }
+  // Each node gets the latency of the nodes after it in the order, as
+  // though the order were one long critical path; so runs are still
+  // interleaved by deadline (see Priority()).
+  std::vector<int64_t> remaining_ns(plan_.node_count());
+  int64_t total_ns = 0;
+  for (auto it = min_live_order_.rbegin(); it != min_live_order_.rend();
+       ++it) {
+    total_ns += op_latency_ns[static_cast<int>(plan_.nodes()[*it].op)];
+    remaining_ns[*it] = total_ns;
+  }
+  return MakePriorities(std::move(remaining_ns));
+}
 
-      unevaluated.erase(n);
+void TfheRunner::UpdatePriorities() {
+  std::array<int64_t, kPlanOpCount> op_latency_ns = kDefaultOpLatencyNs;
+  for (int op = 0; op < kPlanOpCount; ++op) {
+    const int64_t count = op_count_[op].load();
+    if (count > 0) {
+      op_latency_ns[op] = op_total_ns_[op].load() / count;
     }
   }
+  auto priorities = PrioritiesFor(op_latency_ns);
+  absl::MutexLock lock(&priorities_lock_);
+  priorities_ = std::move(priorities);
+}
+
+absl::Status TfheRunner::CheckLimits(absl::Time deadline,
+                                     const CancellationToken* cancellation) {
+  if (cancellation != nullptr && cancellation->cancelled()) {
+    return absl::CancelledError("Run cancelled.");
+  }
+  if (deadline != absl::InfiniteFuture() && absl::Now() >= deadline) {
+    return absl::DeadlineExceededError("Run deadline exceeded.");
+  }
+  return absl::OkStatus();
+}
 
-  // Copy the return value.
-  XLS_RETURN_IF_ERROR(CollectOutputs(result, args, values, bk));
+bool TfheRunner::Abandoned(Invocation* invocation) {
+  if (invocation->abandoned.load(std::memory_order_relaxed)) {
+    return true;
+  }
+  absl::Status status =
+      CheckLimits(invocation->deadline, invocation->cancellation);
+  if (status.ok()) {
+    return false;
+  }
+  absl::MutexLock lock(&invocation->abandon_lock);
+  // Keep the reason first noticed.
+  if (invocation->abandon_status.ok()) {
+    invocation->abandon_status = std::move(status);
+  }
+  invocation->abandoned.store(true, std::memory_order_relaxed);
+  return true;
+}
 
-  // Clean up intermediate values.
-  for (auto& [_, v] : values) {
-    if (v == nullptr) {
-      continue;
+void TfheRunner::Finish(Invocation* invocation) {
+  absl::Status abandon_status;
+  {
+    absl::MutexLock lock(&invocation->abandon_lock);
+    abandon_status = invocation->abandon_status;
+  }
+  if (abandon_status.ok()) {
+    // Copy the return values; this releases the last live intermediate
+    // values.
+    for (auto& state : invocation->states) {
+      CollectOutputs(state.get());
     }
-    delete_gate_bootstrapping_ciphertext(v);
+  } else {
+    // Nothing is running any more, so every value still in use can go.
+    for (auto& state : invocation->states) {
+      for (int i = 0; i < plan_.node_count(); ++i) {
+        if (!aliases_arg_[i] && state->values[i] != nullptr &&
+            state->remaining_uses[i].load() > 0) {
+          pool_->Release(state->values[i]);
+        }
+      }
+      (*invocation->item_statuses)[state->item] = abandon_status;
+    }
+  }
+  pool_->Unreserve();
+  std::function<void()> on_done = std::move(invocation->on_done);
+  delete invocation;
+  if (measure_op_latencies_) {
+    UpdatePriorities();
   }
+  on_done();
+}
 
-  return absl::OkStatus();
+void TfheRunner::ReleaseUse(RunState* state, int node_index) {
+  if (state->remaining_uses[node_index].fetch_sub(1) == 1 &&
+      !aliases_arg_[node_index]) {
+    pool_->Release(state->values[node_index]);
+  }
 }
 
-void* TfheRunner::ThreadBodyStatic(void* runner) {
-  XLS_CHECK(reinterpret_cast<TfheRunner*>(runner)->ThreadBody().ok());
-  return 0;
+void TfheRunner::RunTask(RunState* state, absl::Span<const int32_t> nodes) {
+  Invocation* invocation = state->invocation;
+  // If abandoned, leave the values to Finish(), and schedule nothing further.
+  if (!Abandoned(invocation)) {
+    absl::InlinedVector<int32_t, 8> ready(nodes.begin(), nodes.end());
+    while (!ready.empty()) {
+      const int32_t node_index = ready.back();
+      ready.pop_back();
+      EvalAndRelease(state, node_index);
+      for (int32_t user : plan_.users(node_index)) {
+        if (state->remaining_operands[user].fetch_sub(1) != 1) {
+          continue;
+        }
+        if (trace_ != nullptr) {
+          state->ready_ns[user] = absl::GetCurrentTimeNanos();
+        }
+        if (runs_inline_[user]) {
+          ready.push_back(user);
+        } else {
+          // Counted before this task's own completion below, so that the
+          // count cannot reach zero while work remains.
+          invocation->pending_tasks.fetch_add(1);
+          Schedule(state, user);
+        }
+      }
+    }
+  }
+  if (invocation->pending_tasks.fetch_sub(1) == 1) {
+    Finish(invocation);
+  }
 }
 
-absl::Status TfheRunner::ThreadBody() {
-  while (true) {
-    // Wait for the signal from the main thread
-    sem_wait(&input_sem_);
+void TfheRunner::EvalAndRelease(RunState* state, int node_index) {
+  // Every operand has published its value before releasing this node, so
+  // these reads need no locking.
+  absl::Span<const int32_t> operand_indices = plan_.operands(node_index);
+  absl::InlinedVector<LweSample*, 3> operands;
+  for (int32_t operand : operand_indices) {
+    operands.push_back(state->values[operand]);
+  }
 
-    // Check if the signal is to exit
-    if (threads_should_exit_.load()) {
-      return absl::OkStatus();
+  const PlanNode& node = plan_.nodes()[node_index];
+  LweSample* out = pool_->Allocate(state->bk->params);
+  const bool timed = trace_ != nullptr || measure_op_latencies_;
+  const int64_t start_ns = timed ? absl::GetCurrentTimeNanos() : 0;
+  const CloudKeyReplicas* key_replicas = state->invocation->key_replicas;
+  EvalSingleOp(node, operands, state->args, out,
+               key_replicas != nullptr
+                   ? key_replicas->ForNode(TfheExecutor::CurrentNumaNode())
+                   : state->bk);
+  state->values[node_index] = out;
+  if (timed) {
+    const int64_t end_ns = absl::GetCurrentTimeNanos();
+    if (measure_op_latencies_) {
+      op_total_ns_[static_cast<int>(node.op)].fetch_add(end_ns - start_ns);
+      op_count_[static_cast<int>(node.op)].fetch_add(1);
+    }
+    if (trace_ != nullptr) {
+      trace_->Record({state->trace_run, node_index, node.op, node.level,
+                      TfheExecutor::CurrentWorkerIndex(),
+                      state->ready_ns[node_index], start_ns, end_ns});
     }
+  }
 
-    // Get an input safely
-    pthread_mutex_lock(&lock_);
-    NodeToEval to_eval = input_queue_.front();
-    input_queue_.pop();
-    pthread_mutex_unlock(&lock_);
-
-    // Process the input
-    xls::Node* n = std::get<0>(to_eval);
-    LweSample* out = nullptr;
-    XLS_ASSIGN_OR_RETURN(
-        out, EvalSingleOp(n, std::get<1>(to_eval), const_args_, const_bk_));
-
-    // Save the output safely
-    pthread_mutex_lock(&lock_);
-    output_queue_.push(NodeFromEval(n, out));
-    pthread_mutex_unlock(&lock_);
-
-    // Signal the main thread
-    sem_post(&output_sem_);
+  for (int32_t operand : operand_indices) {
+    ReleaseUse(state, operand);
+  }
+  if (node.user_count + node.output_count == 0) {
+    pool_->Release(out);
   }
 }
 
@@ -19,6 +19,7 @@
 // * Every data type is bits.
 // * Only params and return values have width > 1.
 // * The return value is a CONCAT node.
+// * There are no invokes: the optimizer has inlined every called function.
 
 // Usage:
 //
@@ -33,37 +34,248 @@
 #ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_RUNNER_H_
 #define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_RUNNER_H_
 
-#include <pthread.h>
-#include <semaphore.h>
-
+#include <array>
+#include <atomic>
+#include <functional>
+#include <future>  // NOLINT
 #include <memory>
-#include <queue>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tfhe/tfhe.h"
 #include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_ciphertext_pool.h"
+#include "transpiler/tfhe_cloud_key_replicas.h"
+#include "transpiler/tfhe_executor.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_trace.h"
 #include "xls/contrib/xlscc/metadata_output.pb.h"
-#include "xls/ir/function.h"
 #include "xls/ir/package.h"
 
 namespace fully_homomorphic_encryption {
 namespace transpiler {
 
+// Lets a caller abandon runs it has started; see TfheRunner::RunOptions. May be
+// shared by any number of runs, and cancelled from any thread.
+class CancellationToken {
+ public:
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<bool> cancelled_{false};
+};
+
+class TfheRunner;
+
+// A few runners derived from one plan (e.g., for different output masks or
+// changed bits), by a string key, most recently used first. Callers typically
+// move on to other keys over time, so older keys are unlikely to recur, while
+// each runner holds a plan (and pool) the size of the circuit: once more than
+// kMaxCachedRunners are cached, the least recently used is dropped. A dropped
+// runner lives on while a caller still holds it. Thread-safe.
+class TfheRunnerCache {
+ public:
+  static constexpr int kMaxCachedRunners = 4;
+
+  // Returns the runner for `key`, making it with `create` if it is not
+  // cached. Concurrent calls for the same key make it once.
+  absl::StatusOr<std::shared_ptr<TfheRunner>> GetOrCreate(
+      std::string key,
+      const std::function<absl::StatusOr<std::unique_ptr<TfheRunner>>()>&
+          create);
+
+  // The number of runners currently cached.
+  int size();
+
+ private:
+  absl::Mutex lock_;
+  std::vector<std::pair<std::string, std::shared_ptr<TfheRunner>>> runners_
+      ABSL_GUARDED_BY(lock_);
+};
+
 class TfheRunner {
  public:
+  // Limits on a single call. Workers check them between gates (a gate already
+  // being evaluated runs to completion); once either trips, the call's
+  // remaining gates are skipped, its intermediate ciphertexts are freed, and
+  // it fails without writing any outputs. A call whose limit has tripped
+  // before it starts fails without scheduling anything.
+  struct RunOptions {
+    // Past this, the call fails with DeadlineExceeded.
+    absl::Time deadline = absl::InfiniteFuture();
+    // Once this is cancelled, the call fails with Cancelled. Must outlive the
+    // call.
+    const CancellationToken* cancellation = nullptr;
+    // If set, every gate reads the copy of the cloud key local to the worker
+    // evaluating it rather than the key passed in. Must have been made from
+    // that key for the executor's numa_nodes() (see
+    // TfheExecutor::Options::pin_to_numa_nodes), and must outlive the call.
+    // The caller owns the copies, and so decides when a key is a new one:
+    // the runner keeps nothing of a key between calls.
+    const CloudKeyReplicas* key_replicas = nullptr;
+  };
+
+  struct Options {
+    // The executor to schedule gates on, which must outlive the runner. If
+    // null, TfheExecutor::Default().
+    TfheExecutor* executor = nullptr;
+    // How intermediate ciphertexts are allocated.
+    CiphertextPool::Options pool;
+    // If set, intermediate ciphertexts come from this pool, which must
+    // outlive the runner, instead of one of the runner's own (and `pool` is
+    // ignored). Runners evaluating parts of one circuit in turn can so reuse
+    // the same ciphertexts rather than each holding on to its own.
+    CiphertextPool* shared_pool = nullptr;
+    // If set, every node evaluation is recorded here. Must outlive the
+    // runner.
+    TraceRecorder* trace = nullptr;
+
+    // The order in which a call's ready nodes are dispatched.
+    enum class Schedule {
+      // Longest critical path first: those with the most latency left
+      // between them and the end of the circuit start first. Finishes
+      // soonest, but a wide circuit has most of its intermediate
+      // ciphertexts live at once.
+      kCriticalPath,
+      // In the order of MinLiveOrder() (see live_set_schedule.h), which
+      // frees each value as soon after it is made as it can: ready nodes
+      // that come earliest in that order start first. Every worker is still
+      // kept busy while any node is ready, so peak memory rises with the
+      // worker count, but far more slowly than under kCriticalPath.
+      kMinLiveSet,
+    };
+    Schedule schedule = Schedule::kCriticalPath;
+
+    // Priorities are derived from fixed per-op latency estimates unless this
+    // is set, in which case each run times its ops and later runs use the
+    // averages.
+    bool measure_op_latencies = false;
+  };
+
+  // Compiles the entry function of `package` (named by `metadata`) into an
+  // execution plan; the package itself is not retained.
   TfheRunner(std::unique_ptr<xls::Package> package,
              xlscc_metadata::MetadataOutput metadata);
+  explicit TfheRunner(TfhePlan plan);
+  TfheRunner(TfhePlan plan, Options options);
   ~TfheRunner();
 
+  // Evaluates the circuit. Safe to call from multiple threads: concurrent
+  // calls, on this runner or any other, have their gates multiplexed onto the
+  // executor's workers. Calls are interleaved earliest deadline first, each
+  // node's deadline being the latest it can start without delaying its
+  // call's critical path; so each call gets a share of the workers, and none
+  // is starved by a stream of calls started after it.
   absl::Status Run(LweSample* result,
                    absl::flat_hash_map<std::string, LweSample*> args,
                    const TFheGateBootstrappingCloudKeySet* bk);
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk,
+                   const RunOptions& run_options);
+
+  // Evaluates the circuit with the parameters in `public_params` given as
+  // plaintext bits rather than ciphertexts; entries for them in `args` are
+  // ignored. Their values are folded into the circuit before anything is
+  // scheduled (see Specialize()), so only the gates that still depend on an
+  // encrypted input are bootstrapped. The folding takes time linear in the
+  // circuit; its result for each distinct set of public values is kept among
+  // the few most recently used (see TfheRunnerCache), so calls repeating
+  // recent values cost a lookup.
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TfhePlan::PublicParams& public_params,
+                   const TFheGateBootstrappingCloudKeySet* bk);
+
+  // Starts evaluating the circuit and returns immediately. Once the outputs
+  // have been written, `done` is called with the status of the run, either on
+  // an executor worker or (if the call fails up front) on the calling thread.
+  // `done` must not block, since it holds up a worker. `result` and the
+  // argument ciphertexts must stay valid until then; the map itself need not.
+  //
+  // Any number of calls may be in flight on a runner at once.
+  void RunAsync(LweSample* result,
+                absl::flat_hash_map<std::string, LweSample*> args,
+                const TFheGateBootstrappingCloudKeySet* bk,
+                std::function<void(absl::Status)> done);
+  void RunAsync(LweSample* result,
+                absl::flat_hash_map<std::string, LweSample*> args,
+                const TFheGateBootstrappingCloudKeySet* bk,
+                const RunOptions& run_options,
+                std::function<void(absl::Status)> done);
+
+  // As above, but returns a future for the status instead.
+  std::future<absl::Status> RunAsync(
+      LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+      const TFheGateBootstrappingCloudKeySet* bk);
+  std::future<absl::Status> RunAsync(
+      LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+      const TFheGateBootstrappingCloudKeySet* bk,
+      const RunOptions& run_options);
+
+  // Evaluates the circuit once per entry of `args`, writing the i'th return
+  // value to `results[i]` (`results` may be empty if the function returns
+  // void). The gates of all items are interleaved in a single schedule, so
+  // even narrow circuits keep every worker busy.
+  //
+  // Errors specific to one item (e.g., a missing argument) are reported in
+  // the matching entry of `item_statuses`, and that item is skipped; the
+  // returned status only covers the batch as a whole. `run_options` apply to
+  // the batch as a whole: if it is abandoned, every item fails.
+  absl::Status RunBatch(
+      absl::Span<LweSample* const> results,
+      absl::Span<const absl::flat_hash_map<std::string, LweSample*>> args,
+      const TFheGateBootstrappingCloudKeySet* bk,
+      std::vector<absl::Status>* item_statuses);
+  absl::Status RunBatch(
+      absl::Span<LweSample* const> results,
+      absl::Span<const absl::flat_hash_map<std::string, LweSample*>> args,
+      const TFheGateBootstrappingCloudKeySet* bk, const RunOptions& run_options,
+      std::vector<absl::Status>* item_statuses);
+
+  // Returns a runner for the circuit left once the parameters in
+  // `public_params` are fixed to the given bits (see TfhePlan::Specialize());
+  // its calls take the remaining parameters only. It has this runner's
+  // Options, but is otherwise independent of it.
+  absl::StatusOr<std::unique_ptr<TfheRunner>> Specialize(
+      const TfhePlan::PublicParams& public_params) const;
+
+  // Returns a runner that writes only the output bits selected by `mask`,
+  // leaving the other bits of the result and in/out parameters untouched, and
+  // so evaluates only the gates those bits depend on (see
+  // TfhePlan::Restrict()). It takes the same arguments as this runner. The
+  // runner for each distinct set of bits (however `mask` orders or splits
+  // them) is built on first use, and the few most recently used are kept
+  // (see TfheRunnerCache), so later calls with the same bits cost a lookup.
+  absl::StatusOr<std::shared_ptr<TfheRunner>> ForOutputs(
+      absl::Span<const BitRange> mask);
+
+  // The number of runners currently kept by ForOutputs() and by Run() with
+  // public values.
+  int cached_runner_count() {
+    return restricted_.size() + specialized_.size();
+  }
+
+  // The most intermediate ciphertexts held at once so far, over all calls
+  // (and, with Options::shared_pool, all other users of the pool).
+  int64_t peak_live_ciphertexts() const { return pool_->peak_in_use(); }
+
+  const TfhePlan& plan() const { return plan_; }
+  const Options& options() const { return options_; }
+
+  static absl::StatusOr<std::unique_ptr<TfheRunner>> Create(
+      std::unique_ptr<xls::Package> package,
+      const xlscc_metadata::MetadataOutput& metadata);
 
   static absl::StatusOr<std::unique_ptr<TfheRunner>> CreateFromFile(
       absl::string_view ir_path, absl::string_view metadata_path);
@@ -71,74 +283,190 @@ class TfheRunner {
   static absl::StatusOr<std::unique_ptr<TfheRunner>> CreateFromStrings(
       absl::string_view xls_package, absl::string_view metadata_text);
 
+  // Loads a plan written by TfhePlan::Serialize() (e.g., by transpiler_main's
+  // --output_plan_path), which skips parsing and compiling the IR; see
+  // TfhePlan::MapFile().
+  static absl::StatusOr<std::unique_ptr<TfheRunner>> CreateFromPlanFile(
+      absl::string_view plan_path);
+
  private:
-  absl::StatusOr<xls::Function*> GetEntry() {
-    return package_->GetFunction(metadata_.top_func_proto().name().name());
-  }
+  struct Invocation;
 
-  // This method copies the relevant bit from input params into the result.
-  static absl::Status HandleBitSlice(
-      LweSample* result, const xls::BitSlice* bit_slice,
-      absl::flat_hash_map<std::string, LweSample*> args,
-      const TFheGateBootstrappingCloudKeySet* bk);
+  // State of one item of an in-progress call.
+  struct RunState {
+    RunState(Invocation* invocation, int item, int node_count,
+             LweSample* result, const TFheGateBootstrappingCloudKeySet* bk)
+        : invocation(invocation),
+          item(item),
+          result(result),
+          bk(bk),
+          values(node_count, nullptr),
+          remaining_operands(node_count),
+          remaining_uses(node_count) {}
 
-  // Array support will need to be updated when structs are added: it could be
-  // possible that there is padding present between subsequent elements in an
-  // array of these structs that is not captured by the corresponding XLS type -
-  // for example, a 56-byte struct will likely be padded out to 64 bytes
-  // internally. This code would assume that struct data is all packed, and thus
-  // the output would be garbled. Host layout will need to be considered here.
-  absl::Status CollectNodeValue(
-      const xls::Node* node, LweSample* output_arg, int output_offset,
-      const absl::flat_hash_map</*id=*/uint64_t, LweSample*>& values,
-      const TFheGateBootstrappingCloudKeySet* bk);
+    Invocation* const invocation;
+    // The index of this item in the batch.
+    const int item;
+    LweSample* const result;
+    // Argument ciphertexts, indexed like plan_.param_names().
+    std::vector<LweSample*> args;
+    const TFheGateBootstrappingCloudKeySet* const bk;
 
-  // Walks the type elements comprising `function`'s output type and generates
-  // FHE copy operations to extract the data corresponding to each.
-  //
-  // At present, `function`'s output must be of the form (A, B), where A is
-  // bits- or array-typed, and B must be a tuple containing only bits- or
-  // array-typed elements. A corresponds to the output from the original C++
-  // function itself, and the elements of B are the in/out params to the
-  // function. We don't currently have the ability to traverse the definition of
-  // any given [C/C++] struct, so struct/tuple types are not _currently_
-  // supported, though this is intended to change in the near future.
-  absl::Status CollectOutputs(
-      LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
-      const absl::flat_hash_map</*id=*/uint64_t, LweSample*>& values,
-      const TFheGateBootstrappingCloudKeySet* bk);
+    std::vector<LweSample*> values;
+    std::vector<std::atomic<int>> remaining_operands;
+    // Users yet to run plus output copies yet to be made, per node.
+    std::vector<std::atomic<int>> remaining_uses;
+
+    // Only used when tracing: this item's TraceEvent::run, and when each
+    // node became ready.
+    int64_t trace_run = 0;
+    std::vector<int64_t> ready_ns;
+  };
+
+  // One Run(), RunAsync() or RunBatch() call, from when its nodes are first
+  // scheduled until its outputs are written. Owned by the worker that
+  // finishes its last node.
+  struct Invocation {
+    // Scheduling priority of each node relative to the start of the call;
+    // see Priority().
+    std::shared_ptr<const std::vector<int64_t>> priorities;
+    // When the call started, from absl::GetCurrentTimeNanos().
+    int64_t start_ns;
+    // Per-node copies of the cloud key; see RunOptions.
+    const CloudKeyReplicas* key_replicas;
+    std::vector<std::unique_ptr<RunState>> states;
+    // Tasks scheduled on the executor but not yet run, across all states.
+    // Whoever takes this to zero finishes the invocation: at that point
+    // either every node has been evaluated, or the invocation was abandoned
+    // and nothing more will be scheduled.
+    std::atomic<int64_t> pending_tasks;
+    std::vector<absl::Status>* item_statuses;
+    std::function<void()> on_done;
+
+    // See RunOptions.
+    absl::Time deadline;
+    const CancellationToken* cancellation;
+    // Set once a limit has tripped, after which nodes are skipped rather
+    // than evaluated.
+    std::atomic<bool> abandoned{false};
+    absl::Mutex abandon_lock;
+    absl::Status abandon_status ABSL_GUARDED_BY(abandon_lock);
+  };
+
+  // Checks `args` against the function's parameters and stores them, in
+  // parameter order, in `state`.
+  absl::Status BindArgs(
+      const absl::flat_hash_map<std::string, LweSample*>& args,
+      RunState* state);
+
+  // Validates the items of a batch and schedules the valid ones, recording
+  // each item's status in `item_statuses`. `on_done` is called, exactly once,
+  // after the last item's outputs are written (or the batch is abandoned) -
+  // unless the batch as a whole is rejected, in which case this returns an
+  // error and never calls it.
+  absl::Status StartBatch(
+      absl::Span<LweSample* const> results,
+      absl::Span<const absl::flat_hash_map<std::string, LweSample*>> args,
+      const TFheGateBootstrappingCloudKeySet* bk, const RunOptions& run_options,
+      std::vector<absl::Status>* item_statuses, std::function<void()> on_done);
+
+  // Writes the outputs of every item (or, if `invocation` was abandoned,
+  // frees whatever values are still live and fails every item), runs the
+  // completion callback and frees `invocation`.
+  void Finish(Invocation* invocation);
+
+  // Returns the error a call limited by `deadline` and `cancellation` should
+  // fail with now, or OK if neither limit has tripped.
+  static absl::Status CheckLimits(absl::Time deadline,
+                                  const CancellationToken* cancellation);
 
-  static void* ThreadBodyStatic(void* runner);
-  absl::Status ThreadBody();
+  // Returns whether `invocation` has been abandoned, abandoning it first if
+  // one of its limits has tripped.
+  static bool Abandoned(Invocation* invocation);
+
+  // The executor priority of node `node_index` of `invocation`.
+  static int64_t Priority(const Invocation* invocation, int node_index);
+
+  // Queues node `node_index` of `state` on the executor.
+  void Schedule(RunState* state, int node_index);
+
+  // Returns the priorities of Options::schedule, given per-op latencies.
+  std::shared_ptr<const std::vector<int64_t>> PrioritiesFor(
+      absl::Span<const int64_t> op_latency_ns) const;
+
+  // Recomputes priorities_ from the op latencies measured so far.
+  void UpdatePriorities();
+
+  // Copies each output bit recorded in the plan from its node's value into
+  // the result or the matching in/out param, releasing each value after its
+  // last copy.
+  void CollectOutputs(RunState* state);
 
   // This is static to ensure no access to lock-protected state
-  // Can return nullptr for no-ops
-  static absl::StatusOr<LweSample*> EvalSingleOp(
-      xls::Node* n, std::vector<LweSample*> operands,
-      const absl::flat_hash_map<std::string, LweSample*> args,
-      const TFheGateBootstrappingCloudKeySet* bk);
+  static void EvalSingleOp(const PlanNode& node,
+                           absl::Span<LweSample* const> operands,
+                           absl::Span<LweSample* const> params,
+                           LweSample* out,
+                           const TFheGateBootstrappingCloudKeySet* bk);
 
-  absl::flat_hash_map<std::string, LweSample*> const_args_;
-  const TFheGateBootstrappingCloudKeySet* const_bk_;
+  // Evaluates `nodes` of `state`, which must all be ready, followed by every
+  // bootstrap-free node they make ready in turn; bootstrapped nodes that
+  // become ready are scheduled instead. Takes the place of one of the
+  // invocation's pending nodes.
+  //
+  // Queueing a node costs a few microseconds of synchronization, which is
+  // nothing next to a bootstrap but dominates a NOT or a copy, so only nodes
+  // that bootstrap go through the executor.
+  void RunTask(RunState* state, absl::Span<const int32_t> nodes);
 
-  typedef std::tuple<xls::Node*, std::vector<LweSample*>> NodeToEval;
+  // Evaluates node `node_index` of `state` and publishes its value. Operands
+  // (and the node itself, if nothing reads it) go back to the pool once no
+  // reader remains.
+  void EvalAndRelease(RunState* state, int node_index);
 
-  pthread_mutex_t lock_;  // Only used by worker threads
+  // Drops one reference to the value of `node_index`, returning it to the
+  // pool if that was the last (and it is not an argument alias).
+  void ReleaseUse(RunState* state, int node_index);
 
-  sem_t input_sem_;
-  std::queue<NodeToEval> input_queue_;  // Protected by lock_ in worker threads
+  const TfhePlan plan_;
+  // As passed in, for Specialize() and the like.
+  const Options options_;
+  // Per node: whether it is a bit of a parameter that no output overwrites.
+  // Such nodes are not evaluated; readers use the argument bit in place.
+  std::vector<bool> aliases_arg_;
+  // Per node: how many of its operands are evaluated (not aliases), i.e. its
+  // initial RunState::remaining_operands.
+  std::vector<int32_t> evaluated_operand_count_;
+  // Per node: whether it is bootstrap-free, and so evaluated by whichever task
+  // makes it ready rather than queued on its own; see RunTask().
+  std::vector<bool> runs_inline_;
+  // The evaluated nodes that are ready from the start: the bootstrap-free
+  // ones, which each run starts as a single task, and the rest, which are
+  // scheduled individually.
+  std::vector<int32_t> inline_seeds_;
+  std::vector<int32_t> scheduled_seeds_;
+  // The nodes in MinLiveOrder(), if Options::schedule is kMinLiveSet.
+  std::vector<int32_t> min_live_order_;
 
-  typedef std::tuple<xls::Node*, LweSample*> NodeFromEval;
-  sem_t output_sem_;
-  std::queue<NodeFromEval>
-      output_queue_;  // Protected by lock_ in worker threads
+  TfheExecutor* const executor_;
+  // Unused if Options::shared_pool is set.
+  CiphertextPool own_pool_;
+  CiphertextPool* const pool_;
+  TraceRecorder* const trace_;
+  std::atomic<int64_t> next_trace_run_;
 
-  std::atomic<bool> threads_should_exit_;
+  const bool measure_op_latencies_;
+  // Total evaluation time and count per PlanOp, when measuring.
+  std::array<std::atomic<int64_t>, kPlanOpCount> op_total_ns_;
+  std::array<std::atomic<int64_t>, kPlanOpCount> op_count_;
+  absl::Mutex priorities_lock_;
+  std::shared_ptr<const std::vector<int64_t>> priorities_
+      ABSL_GUARDED_BY(priorities_lock_);
 
-  std::unique_ptr<xls::Package> package_;
-  std::string function_name_;
-  std::vector<pthread_t> threads_;
-  xlscc_metadata::MetadataOutput metadata_;
+  // ForOutputs() runners, by CanonicalKey() of their mask.
+  TfheRunnerCache restricted_;
+  // Runners specialized for public values, by PublicParamsKey() of them.
+  TfheRunnerCache specialized_;
 };
 
 }  // namespace transpiler
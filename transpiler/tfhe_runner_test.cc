@@ -14,21 +14,48 @@
 
 #include "transpiler/tfhe_runner.h"
 
+#include <algorithm>
+#include <memory>
+#include <future>  // NOLINT
+#include <thread>  // NOLINT
+#include <vector>
+
 #include "absl/container/flat_hash_map.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "transpiler/data/fhe_data.h"
+#include "transpiler/gate_fusion.h"
+#include "transpiler/tfhe_cloud_key_replicas.h"
+#include "transpiler/tfhe_executor.h"
+#include "transpiler/tfhe_numa.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_trace.h"
 #include "xls/common/status/matchers.h"
 #include "xls/contrib/xlscc/metadata_output.pb.h"
 #include "xls/ir/ir_parser.h"
 
 constexpr int kMainMinimumLambda = 120;
 
+using fully_homomorphic_encryption::transpiler::CancellationToken;
+using fully_homomorphic_encryption::transpiler::CloudKeyReplicas;
+using fully_homomorphic_encryption::transpiler::DiscoverNumaNodes;
+using fully_homomorphic_encryption::transpiler::FuseGates;
+using fully_homomorphic_encryption::transpiler::PlanNode;
+using fully_homomorphic_encryption::transpiler::PlanOp;
+using fully_homomorphic_encryption::transpiler::TfheExecutor;
+using fully_homomorphic_encryption::transpiler::TfhePlan;
 using fully_homomorphic_encryption::transpiler::TfheRunner;
+using fully_homomorphic_encryption::transpiler::TfheRunnerCache;
+using fully_homomorphic_encryption::transpiler::TraceEvent;
+using fully_homomorphic_encryption::transpiler::TraceRecorder;
 
 // Increments the argument char.
 constexpr absl::string_view kEndToEndExample = R"(
@@ -102,6 +129,69 @@ fn my_package(x: bits[8]) -> bits[8] {
 }
 )";
 
+// Returns the AND of the low two bits of x, computed by a chain of `length`
+// dependent gates, so that evaluation takes a while even with many workers.
+std::string AndChain(int length) {
+  std::string ir = R"(
+package my_package
+
+fn my_package(x: bits[2]) -> bits[1] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  and.3: bits[1] = and(bit_slice.1, bit_slice.2, id=3)
+)";
+  for (int id = 4; id < length + 3; ++id) {
+    absl::StrAppend(&ir, "  and.", id, ": bits[1] = and(and.", id - 1,
+                    ", bit_slice.2, id=", id, ")\n");
+  }
+  absl::StrAppend(&ir, "  ret and.", length + 3,
+                  ": bits[1] = and(and.", length + 2, ", bit_slice.1, id=",
+                  length + 3, ")\n}\n");
+  return ir;
+}
+
+// Returns the parity of the 16 bits of x, computed by a balanced tree of
+// XORs, whose wide first levels make for many values live at once when
+// evaluated level by level.
+std::string XorTree() {
+  std::string ir = R"(
+package my_package
+
+fn my_package(x: bits[16]) -> bits[1] {
+)";
+  std::vector<std::string> level;
+  int id = 0;
+  for (int bit = 0; bit < 16; ++bit) {
+    level.push_back(absl::StrCat("bit_slice.", ++id));
+    absl::StrAppend(&ir, "  ", level.back(), ": bits[1] = bit_slice(x, start=",
+                    bit, ", width=1, id=", id, ")\n");
+  }
+  while (level.size() > 1) {
+    std::vector<std::string> next;
+    for (int i = 0; i < level.size(); i += 2) {
+      next.push_back(absl::StrCat("xor.", ++id));
+      absl::StrAppend(&ir, level.size() == 2 ? "  ret " : "  ", next.back(),
+                      ": bits[1] = xor(", level[i], ", ", level[i + 1],
+                      ", id=", id, ")\n");
+    }
+    level = next;
+  }
+  absl::StrAppend(&ir, "}\n");
+  return ir;
+}
+
+// Swaps the low two bits of the in/out param x.
+constexpr absl::string_view kSwapExample = R"(
+package my_package
+
+fn my_package(x: bits[2]) -> (bits[2]) {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  concat.3: bits[2] = concat(bit_slice.1, bit_slice.2, id=3)
+  ret tuple.4: (bits[2]) = tuple(concat.3, id=4)
+}
+)";
+
 TEST(TfheRunnerTest, EndToEnd) {
   TFHEParameters params(kMainMinimumLambda);
   std::array<uint32_t, 3> seed = {314, 1592, 657};
@@ -121,3 +211,652 @@ TEST(TfheRunnerTest, EndToEnd) {
   auto r = result.Decrypt(key);
   EXPECT_EQ(r, 'b');
 }
+
+TEST(TfheRunnerTest, EndToEndWithFusedGates) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan unfused,
+                           TfhePlan::Compile(function, metadata));
+  XLS_ASSERT_OK_AND_ASSIGN(bool changed, FuseGates(function));
+  EXPECT_TRUE(changed);
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan fused,
+                           TfhePlan::Compile(function, metadata));
+  EXPECT_LT(fused.node_count(), unfused.node_count());
+  EXPECT_TRUE(std::any_of(
+      fused.nodes().begin(), fused.nodes().end(),
+      [](const PlanNode& node) { return node.op == PlanOp::kXor; }));
+
+  TfheRunner runner{std::move(package), metadata};
+  for (char c : {'a', '\x7f', '\xff'}) {
+    auto ciphertext = FheValue<char>::Encrypt(c, key);
+    FheValue<char> result(key.params());
+    XLS_ASSERT_OK(
+        runner.Run(result.get(), {{"x", ciphertext.get()}}, key.cloud()));
+    EXPECT_EQ(result.Decrypt(key), static_cast<char>(c + 1));
+  }
+}
+
+TEST(TfheRunnerTest, FoldsPublicArgs) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  // Bit 0 is x0 & k0, bit 1 is x1 ^ k1, and bit 2 is k0 ? x1 : x0.
+  constexpr absl::string_view kMixed = R"(
+package my_package
+
+fn my_package(x: bits[2], k: bits[2]) -> bits[3] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(k, start=0, width=1, id=3)
+  bit_slice.4: bits[1] = bit_slice(k, start=1, width=1, id=4)
+  and.5: bits[1] = and(bit_slice.1, bit_slice.3, id=5)
+  xor.6: bits[1] = xor(bit_slice.2, bit_slice.4, id=6)
+  sel.7: bits[1] = sel(bit_slice.3, cases=[bit_slice.1, bit_slice.2], id=7)
+  ret concat.8: bits[3] = concat(sel.7, xor.6, and.5, id=8)
+}
+)";
+  XLS_ASSERT_OK_AND_ASSIGN(auto package, xls::Parser::ParsePackage(kMixed));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  TfheRunner runner{std::move(package), metadata};
+
+  for (int k = 0; k < 4; ++k) {
+    const TfhePlan::PublicParams public_params = {
+        {"k", {(k & 1) != 0, (k & 2) != 0}}};
+    XLS_ASSERT_OK_AND_ASSIGN(std::unique_ptr<TfheRunner> specialized,
+                             runner.Specialize(public_params));
+    for (int x = 0; x < 4; ++x) {
+      const int x0 = x & 1, x1 = (x >> 1) & 1;
+      const int k0 = k & 1, k1 = (k >> 1) & 1;
+      const int expected = (x0 & k0) | ((x1 ^ k1) << 1) | ((k0 ? x1 : x0) << 2);
+
+      auto ciphertext = FheValue<char>::Encrypt(x, key);
+      FheValue<char> result(key.params());
+      XLS_ASSERT_OK(specialized->Run(result.get(), {{"x", ciphertext.get()}},
+                                     key.cloud()));
+      EXPECT_EQ(result.Decrypt(key) & 7, expected) << "x=" << x << " k=" << k;
+
+      // The one-off form ignores any ciphertext passed for k.
+      FheValue<char> one_off(key.params());
+      XLS_ASSERT_OK(runner.Run(one_off.get(),
+                               {{"x", ciphertext.get()}, {"k", nullptr}},
+                               public_params, key.cloud()));
+      EXPECT_EQ(one_off.Decrypt(key) & 7, expected) << "x=" << x << " k=" << k;
+    }
+  }
+  // The one-off form specialized once per value of k.
+  EXPECT_EQ(runner.cached_runner_count(), 4);
+
+  // k is fixed, so the specialized runner takes x alone.
+  XLS_ASSERT_OK_AND_ASSIGN(std::unique_ptr<TfheRunner> specialized,
+                           runner.Specialize({{"k", {true, true}}}));
+  auto ciphertext = FheValue<char>::Encrypt(0, key);
+  FheValue<char> result(key.params());
+  EXPECT_FALSE(specialized
+                   ->Run(result.get(),
+                         {{"x", ciphertext.get()}, {"k", ciphertext.get()}},
+                         key.cloud())
+                   .ok());
+}
+
+TEST(TfheRunnerTest, EvaluatesOnlyRequestedOutputs) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  TraceRecorder trace;
+  TfheRunner::Options options;
+  options.trace = &trace;
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+  TfheRunner runner(std::move(plan), options);
+
+  // The low bit of x + 1 is just NOT of the low bit of x.
+  XLS_ASSERT_OK_AND_ASSIGN(std::shared_ptr<TfheRunner> low_bit,
+                           runner.ForOutputs({{"", 0, 1}}));
+  auto ciphertext = FheValue<char>::Encrypt('a', key);
+  auto result = FheValue<char>::Encrypt('@', key);
+  XLS_ASSERT_OK(
+      low_bit->Run(result.get(), {{"x", ciphertext.get()}}, key.cloud()));
+  // 'b' is 0x62: bit 0 is written, and the rest of '@' (0x40) is left alone.
+  EXPECT_EQ(result.Decrypt(key), '@');
+  ciphertext = FheValue<char>::Encrypt('b', key);
+  XLS_ASSERT_OK(
+      low_bit->Run(result.get(), {{"x", ciphertext.get()}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 'A');
+  EXPECT_EQ(trace.events().size(), 2);
+
+  // The cone is built once per set of bits, however the mask lists them.
+  XLS_ASSERT_OK_AND_ASSIGN(std::shared_ptr<TfheRunner> again,
+                           runner.ForOutputs({{"", 0, 1}}));
+  EXPECT_EQ(again, low_bit);
+  XLS_ASSERT_OK_AND_ASSIGN(std::shared_ptr<TfheRunner> split,
+                           runner.ForOutputs({{"", 1, 3}, {"", 0, 2}}));
+  XLS_ASSERT_OK_AND_ASSIGN(std::shared_ptr<TfheRunner> merged,
+                           runner.ForOutputs({{"", 0, 3}}));
+  EXPECT_EQ(split, merged);
+  XLS_ASSERT_OK_AND_ASSIGN(std::shared_ptr<TfheRunner> everything,
+                           runner.ForOutputs({{""}}));
+  EXPECT_NE(everything, low_bit);
+  XLS_ASSERT_OK(
+      everything->Run(result.get(), {{"x", ciphertext.get()}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 'c');
+
+  EXPECT_FALSE(runner.ForOutputs({{"y"}}).ok());
+
+  // Only the most recently used cones are kept; the rest are rebuilt.
+  for (int32_t bit = 1; bit <= TfheRunnerCache::kMaxCachedRunners; ++bit) {
+    XLS_ASSERT_OK(runner.ForOutputs({{"", bit, bit + 1}}).status());
+  }
+  XLS_ASSERT_OK_AND_ASSIGN(std::shared_ptr<TfheRunner> rebuilt,
+                           runner.ForOutputs({{"", 0, 1}}));
+  EXPECT_NE(rebuilt, low_bit);
+  // The evicted runner still works for whoever holds it.
+  result = FheValue<char>::Encrypt('@', key);
+  XLS_ASSERT_OK(
+      low_bit->Run(result.get(), {{"x", ciphertext.get()}}, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 'A');
+}
+
+TEST(TfheRunnerTest, InOutParamReadsItself) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kSwapExample));
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_void();
+  auto* x = proto->add_params();
+  x->set_name("x");
+  x->set_is_reference(true);
+  TfheRunner runner{std::move(package), metadata};
+
+  // Each output bit must see x as it was on entry, not as partially updated.
+  auto value = FheValue<char>::Encrypt(1, key);
+  XLS_ASSERT_OK(runner.Run(nullptr, {{"x", value.get()}}, key.cloud()));
+  EXPECT_EQ(value.Decrypt(key), 2);
+}
+
+TEST(TfheRunnerTest, RepeatedRuns) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  TfheRunner runner{std::move(package), metadata};
+
+  // Each call must start from a clean schedule, regardless of how the
+  // previous one was spread over the workers.
+  for (char c : {'a', 'z', '\x7f', '\xff'}) {
+    auto ciphertext = FheValue<char>::Encrypt(c, key);
+    FheValue<char> result(key.params());
+    absl::flat_hash_map<std::string, LweSample*> args = {
+        {"x", ciphertext.get()}};
+    XLS_ASSERT_OK(runner.Run(result.get(), args, key.cloud()));
+    EXPECT_EQ(result.Decrypt(key), static_cast<char>(c + 1));
+  }
+}
+
+TEST(TfheRunnerTest, ConcurrentRuns) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  TfheRunner runner{std::move(package), metadata};
+
+  // A runner shared by generated code may be called from several threads.
+  const std::vector<char> inputs = {'a', 'm', 'y'};
+  std::vector<FheValue<char>> ciphertexts;
+  std::vector<FheValue<char>> results;
+  for (char c : inputs) {
+    ciphertexts.push_back(FheValue<char>::Encrypt(c, key));
+    results.emplace_back(key.params());
+  }
+  std::vector<std::thread> callers;
+  for (int i = 0; i < inputs.size(); ++i) {
+    callers.emplace_back([&, i]() {
+      absl::flat_hash_map<std::string, LweSample*> args = {
+          {"x", ciphertexts[i].get()}};
+      XLS_CHECK(runner.Run(results[i].get(), args, key.cloud()).ok());
+    });
+  }
+  for (std::thread& caller : callers) {
+    caller.join();
+  }
+  for (int i = 0; i < inputs.size(); ++i) {
+    EXPECT_EQ(results[i].Decrypt(key), static_cast<char>(inputs[i] + 1));
+  }
+}
+
+TEST(TfheRunnerTest, LaterRunsDoNotStarveEarlierOnes) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  constexpr int kLength = 60;
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(AndChain(kLength)));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  metadata.mutable_top_func_proto()->mutable_return_type()->mutable_as_int();
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto function,
+      package->GetFunction(metadata.top_func_proto().name().name()));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+
+  TfheExecutor::Options executor_options;
+  executor_options.thread_count = 1;
+  TfheExecutor executor(executor_options);
+  TraceRecorder trace;
+  TfheRunner::Options options;
+  options.executor = &executor;
+  options.trace = &trace;
+  options.measure_op_latencies = true;
+  TfheRunner runner(std::move(plan), options);
+
+  auto ciphertext = FheValue<char>::Encrypt(3, key);
+  FheValue<char> first_result(key.params());
+  FheValue<char> second_result(key.params());
+  absl::flat_hash_map<std::string, LweSample*> args = {{"x", ciphertext.get()}};
+  // Calibrates the latency estimates, so that deadlines track real time.
+  XLS_ASSERT_OK(runner.Run(first_result.get(), args, key.cloud()));
+
+  // Start a second call once the first is halfway through.
+  std::future<absl::Status> first =
+      runner.RunAsync(first_result.get(), args, key.cloud());
+  while (trace.events().size() < kLength + kLength / 2) {
+    absl::SleepFor(absl::Microseconds(50));
+  }
+  std::future<absl::Status> second =
+      runner.RunAsync(second_result.get(), args, key.cloud());
+  XLS_ASSERT_OK(first.get());
+  XLS_ASSERT_OK(second.get());
+
+  // Ordered by critical path alone, the second call would have the single
+  // worker to itself until it was as close to done as the first. Instead the
+  // two should take turns.
+  std::vector<TraceEvent> events = trace.events();
+  std::sort(events.begin(), events.end(),
+            [](const TraceEvent& a, const TraceEvent& b) {
+              return a.start_ns < b.start_ns;
+            });
+  int streak = 0;
+  int longest_streak = 0;
+  int first_remaining = kLength;
+  for (const TraceEvent& event : events) {
+    if (event.run == 1) {
+      streak = 0;
+      --first_remaining;
+    } else if (event.run == 2 && first_remaining > 0) {
+      longest_streak = std::max(longest_streak, ++streak);
+    }
+  }
+  EXPECT_LT(longest_streak, kLength / 4);
+}
+
+TEST(TfheRunnerTest, RunBatch) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  TfheRunner runner{std::move(package), metadata};
+
+  const std::vector<char> inputs = {'a', 'z', '\x7f', '0'};
+  std::vector<FheValue<char>> ciphertexts;
+  std::vector<FheValue<char>> results;
+  std::vector<LweSample*> result_buffers;
+  std::vector<absl::flat_hash_map<std::string, LweSample*>> args;
+  for (char c : inputs) {
+    ciphertexts.push_back(FheValue<char>::Encrypt(c, key));
+    results.emplace_back(key.params());
+  }
+  for (int i = 0; i < inputs.size(); ++i) {
+    result_buffers.push_back(results[i].get());
+    args.push_back({{"x", ciphertexts[i].get()}});
+  }
+  // A bad item fails on its own, without affecting the rest of the batch.
+  args[2] = {{"y", ciphertexts[2].get()}};
+
+  std::vector<absl::Status> item_statuses;
+  XLS_ASSERT_OK(
+      runner.RunBatch(result_buffers, args, key.cloud(), &item_statuses));
+  ASSERT_EQ(item_statuses.size(), inputs.size());
+  EXPECT_THAT(item_statuses[2],
+              xls::status_testing::StatusIs(absl::StatusCode::kInvalidArgument));
+  for (int i : {0, 1, 3}) {
+    XLS_EXPECT_OK(item_statuses[i]);
+    EXPECT_EQ(results[i].Decrypt(key), static_cast<char>(inputs[i] + 1));
+  }
+}
+
+TEST(TfheRunnerTest, RunAsync) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  TfheRunner runner{std::move(package), metadata};
+
+  // Several requests in flight on the same runner at once.
+  const std::vector<char> inputs = {'a', 'k', 'x'};
+  std::vector<FheValue<char>> ciphertexts;
+  std::vector<FheValue<char>> results;
+  std::vector<std::future<absl::Status>> futures;
+  for (char c : inputs) {
+    ciphertexts.push_back(FheValue<char>::Encrypt(c, key));
+    results.emplace_back(key.params());
+  }
+  for (int i = 0; i < inputs.size(); ++i) {
+    futures.push_back(runner.RunAsync(
+        results[i].get(), {{"x", ciphertexts[i].get()}}, key.cloud()));
+  }
+  for (int i = 0; i < inputs.size(); ++i) {
+    XLS_EXPECT_OK(futures[i].get());
+    EXPECT_EQ(results[i].Decrypt(key), static_cast<char>(inputs[i] + 1));
+  }
+
+  // Up-front failures are reported through the callback too.
+  absl::Notification failed;
+  runner.RunAsync(results[0].get(), {}, key.cloud(),
+                  [&failed](absl::Status status) {
+                    EXPECT_EQ(status.code(),
+                              absl::StatusCode::kInvalidArgument);
+                    failed.Notify();
+                  });
+  failed.WaitForNotification();
+}
+
+TEST(TfheRunnerTest, MeasuredOpLatencies) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto function,
+      package->GetFunction(metadata.top_func_proto().name().name()));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+
+  TfheRunner::Options options;
+  options.measure_op_latencies = true;
+  TfheRunner runner(std::move(plan), options);
+
+  // Later runs are scheduled with the latencies measured by earlier ones,
+  // which must not change their results.
+  for (char c : {'a', 'z', '\x7f'}) {
+    auto ciphertext = FheValue<char>::Encrypt(c, key);
+    FheValue<char> result(key.params());
+    XLS_ASSERT_OK(
+        runner.Run(result.get(), {{"x", ciphertext.get()}}, key.cloud()));
+    EXPECT_EQ(result.Decrypt(key), static_cast<char>(c + 1));
+  }
+}
+
+TEST(TfheRunnerTest, MinLiveSetSchedule) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package, xls::Parser::ParsePackage(XorTree()));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  metadata.mutable_top_func_proto()->mutable_return_type()->mutable_as_int();
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto function,
+      package->GetFunction(metadata.top_func_proto().name().name()));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+
+  // With a single worker, the order nodes are dispatched in is the order
+  // they are evaluated in.
+  TfheExecutor::Options executor_options;
+  executor_options.thread_count = 1;
+  TfheExecutor executor(executor_options);
+  auto x = FheValue<int16_t>::Encrypt(0x1234, key);
+  auto peak = [&](TfheRunner::Options::Schedule schedule) -> int64_t {
+    TfheRunner::Options options;
+    options.executor = &executor;
+    options.schedule = schedule;
+    TfheRunner runner(plan, options);
+    FheValue<char> result(key.params());
+    XLS_CHECK(runner.Run(result.get(), {{"x", x.get()}}, key.cloud()).ok());
+    // 0x1234 has five bits set.
+    EXPECT_EQ(result.Decrypt(key) & 1, 1);
+    return runner.peak_live_ciphertexts();
+  };
+
+  // The eight XORs of the first level are all live together when evaluated
+  // level by level, but no more than one per level when depth first.
+  EXPECT_GE(peak(TfheRunner::Options::Schedule::kCriticalPath), 8);
+  EXPECT_LE(peak(TfheRunner::Options::Schedule::kMinLiveSet), 5);
+}
+
+TEST(TfheRunnerTest, ReplicatesCloudKey) {
+  TFHEParameters params(kMainMinimumLambda);
+
+  // Two "nodes" sharing the CPUs of the first real one, so that the test runs
+  // on any machine.
+  const std::vector<int> cpus = DiscoverNumaNodes().front().cpus;
+  TfheExecutor::Options executor_options;
+  executor_options.thread_count = 4;
+  executor_options.pin_to_numa_nodes = true;
+  executor_options.numa_nodes = {{0, cpus}, {1, cpus}};
+  TfheExecutor executor(executor_options);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto function,
+      package->GetFunction(metadata.top_func_proto().name().name()));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+
+  TfheRunner::Options options;
+  options.executor = &executor;
+  TfheRunner runner(std::move(plan), options);
+
+  // Each key is freed before the next is made, so the allocator may well
+  // hand the second the first one's address; the runner must not mistake it
+  // for the first.
+  for (uint32_t seed_start : {314, 2718}) {
+    std::array<uint32_t, 3> seed = {seed_start, 1592, 657};
+    auto key = std::make_unique<TFHESecretKeySet>(params, seed);
+    XLS_ASSERT_OK_AND_ASSIGN(
+        std::unique_ptr<CloudKeyReplicas> replicas,
+        CloudKeyReplicas::Create(key->cloud(), executor.numa_nodes()));
+    TfheRunner::RunOptions run_options;
+    run_options.key_replicas = replicas.get();
+
+    for (char c : {'a', 'z'}) {
+      auto ciphertext = FheValue<char>::Encrypt(c, *key);
+      FheValue<char> result(key->params());
+      XLS_ASSERT_OK(runner.Run(result.get(), {{"x", ciphertext.get()}},
+                               key->cloud(), run_options));
+      EXPECT_EQ(result.Decrypt(*key), static_cast<char>(c + 1));
+    }
+
+    // Copies made for other nodes than the executor's are refused.
+    XLS_ASSERT_OK_AND_ASSIGN(
+        std::unique_ptr<CloudKeyReplicas> one_node,
+        CloudKeyReplicas::Create(key->cloud(), {executor.numa_nodes()[0]}));
+    run_options.key_replicas = one_node.get();
+    auto ciphertext = FheValue<char>::Encrypt('a', *key);
+    FheValue<char> result(key->params());
+    EXPECT_THAT(runner.Run(result.get(), {{"x", ciphertext.get()}},
+                           key->cloud(), run_options),
+                xls::status_testing::StatusIs(
+                    absl::StatusCode::kInvalidArgument));
+  }
+}
+
+TEST(TfheRunnerTest, Trace) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto function,
+      package->GetFunction(metadata.top_func_proto().name().name()));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+  // Parameter bits are read in place rather than evaluated.
+  int evaluated_count = 0;
+  for (const PlanNode& node : plan.nodes()) {
+    if (node.op != PlanOp::kParamBit) {
+      ++evaluated_count;
+    }
+  }
+
+  TraceRecorder trace;
+  TfheRunner::Options options;
+  options.trace = &trace;
+  TfheRunner runner(std::move(plan), options);
+
+  auto ciphertext = FheValue<char>::Encrypt('a', key);
+  FheValue<char> result(key.params());
+  XLS_ASSERT_OK(runner.Run(result.get(), {{"x", ciphertext.get()}},
+                           key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 'b');
+
+  std::vector<TraceEvent> events = trace.events();
+  ASSERT_EQ(events.size(), evaluated_count);
+  for (const TraceEvent& event : events) {
+    EXPECT_NE(event.op, PlanOp::kParamBit);
+  }
+  for (const TraceEvent& event : events) {
+    EXPECT_LE(event.ready_ns, event.start_ns);
+    EXPECT_LE(event.start_ns, event.end_ns);
+    EXPECT_GE(event.worker, 0);
+  }
+}
+
+TEST(TfheRunnerTest, RunsBootstrapFreeNodesInline) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kEndToEndExample));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  XLS_ASSERT_OK_AND_ASSIGN(
+      auto function,
+      package->GetFunction(metadata.top_func_proto().name().name()));
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+
+  TraceRecorder trace;
+  TfheRunner::Options options;
+  options.trace = &trace;
+  TfheRunner runner(plan, options);
+  auto ciphertext = FheValue<char>::Encrypt('a', key);
+  FheValue<char> result(key.params());
+  XLS_ASSERT_OK(runner.Run(result.get(), {{"x", ciphertext.get()}},
+                           key.cloud()));
+  EXPECT_EQ(result.Decrypt(key), 'b');
+
+  // A NOT of a gate runs on the gate's worker, straight after it.
+  absl::flat_hash_map<int, TraceEvent> events;
+  for (const TraceEvent& event : trace.events()) {
+    events[event.node] = event;
+  }
+  int inline_count = 0;
+  for (const auto& [node, event] : events) {
+    if (event.op != PlanOp::kNot) {
+      continue;
+    }
+    auto operand = events.find(plan.operands(node)[0]);
+    if (operand == events.end()) {
+      // It reads an argument bit in place.
+      continue;
+    }
+    EXPECT_EQ(event.worker, operand->second.worker);
+    EXPECT_GE(event.start_ns, operand->second.end_ns);
+    ++inline_count;
+  }
+  EXPECT_GT(inline_count, 0);
+}
+
+TEST(TfheRunnerTest, CancelsAndTimesOut) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(AndChain(200)));
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  metadata.mutable_top_func_proto()->mutable_return_type()->mutable_as_int();
+  TfheRunner runner{std::move(package), metadata};
+
+  auto ciphertext = FheValue<char>::Encrypt(3, key);
+  FheValue<char> result(key.params());
+  absl::flat_hash_map<std::string, LweSample*> args = {{"x", ciphertext.get()}};
+
+  // Calls whose limits have already tripped are turned away up front.
+  CancellationToken cancelled;
+  cancelled.Cancel();
+  TfheRunner::RunOptions run_options;
+  run_options.cancellation = &cancelled;
+  EXPECT_EQ(runner.Run(result.get(), args, key.cloud(), run_options).code(),
+            absl::StatusCode::kCancelled);
+  run_options = TfheRunner::RunOptions();
+  run_options.deadline = absl::Now() - absl::Seconds(1);
+  EXPECT_EQ(runner.Run(result.get(), args, key.cloud(), run_options).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // Cancelling a call in flight abandons its remaining gates.
+  CancellationToken token;
+  run_options = TfheRunner::RunOptions();
+  run_options.cancellation = &token;
+  std::future<absl::Status> future =
+      runner.RunAsync(result.get(), args, key.cloud(), run_options);
+  token.Cancel();
+  EXPECT_EQ(future.get().code(), absl::StatusCode::kCancelled);
+
+  // As does passing the deadline, here after the first gate or so.
+  run_options = TfheRunner::RunOptions();
+  run_options.deadline = absl::Now() + absl::Milliseconds(1);
+  EXPECT_EQ(runner.Run(result.get(), args, key.cloud(), run_options).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // None of which gets in the way of later calls.
+  XLS_ASSERT_OK(runner.Run(result.get(), args, key.cloud()));
+  EXPECT_EQ(result.Decrypt(key) & 1, 1);
+}
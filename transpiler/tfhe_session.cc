@@ -0,0 +1,87 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_session.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "xls/common/status/status_macros.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+absl::StatusOr<std::unique_ptr<TfheSession>> TfheSession::Create(
+    const TfheRunner& runner,
+    absl::flat_hash_map<std::string, LweSample*> bound_args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  std::vector<std::string> bound;
+  for (const auto& entry : bound_args) {
+    bound.push_back(entry.first);
+  }
+  XLS_ASSIGN_OR_RETURN(PlanBinding binding, runner.plan().Bind(bound));
+  auto session = absl::WrapUnique(
+      new TfheSession(std::move(bound_args), binding.cache_size, bk->params));
+
+  absl::flat_hash_map<std::string, LweSample*> args = session->bound_args_;
+  for (const std::string& name : runner.plan().param_names()) {
+    args.emplace(name, nullptr);
+  }
+  TfheRunner precompute(std::move(binding.precompute), runner.options());
+  XLS_RETURN_IF_ERROR(precompute.Run(nullptr, std::move(args), bk));
+
+  session->runner_ = std::make_unique<TfheRunner>(std::move(binding.per_call),
+                                                  runner.options());
+  return session;
+}
+
+TfheSession::TfheSession(
+    absl::flat_hash_map<std::string, LweSample*> bound_args,
+    int32_t cache_size, const TFheGateBootstrappingParameterSet* params)
+    : bound_args_(std::move(bound_args)),
+      cache_size_(cache_size),
+      cache_(new_gate_bootstrapping_ciphertext_array(cache_size, params)) {
+  bound_args_[TfhePlan::kExtraParam] = cache_;
+}
+
+TfheSession::~TfheSession() {
+  delete_gate_bootstrapping_ciphertext_array(cache_size_, cache_);
+}
+
+absl::Status TfheSession::Run(
+    LweSample* result, absl::flat_hash_map<std::string, LweSample*> args,
+    const TFheGateBootstrappingCloudKeySet* bk) {
+  for (const auto& entry : args) {
+    if (bound_args_.contains(entry.first)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Parameter is bound by the session: ", entry.first));
+    }
+  }
+  args.insert(bound_args_.begin(), bound_args_.end());
+  return runner_->Run(result, std::move(args), bk);
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
@@ -0,0 +1,85 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sessions over a TfheRunner, for servers that hold some arguments of a
+// function themselves (e.g., an encrypted database) and take only the rest
+// with each call.
+//
+// Creating a session binds those parameters to their ciphertexts for its
+// lifetime, and evaluates right away every gate that depends on nothing else
+// (see TfhePlan::Bind()). Calls then pass only the unbound arguments, and
+// evaluate only the gates that depend on them: the bound ciphertexts and the
+// precomputed values are read in place, with nothing copied per call.
+//
+// Usage:
+//
+// XLS_ASSIGN_OR_RETURN(auto session,
+//                      TfheSession::Create(runner, {{"db", db}}, bk));
+// XLS_RETURN_IF_ERROR(session->Run(result, {{"index", index}}, bk));
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_SESSION_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_SESSION_H_
+
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+#include "transpiler/tfhe_runner.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+class TfheSession {
+ public:
+  // Binds the parameters in `bound_args` to those ciphertexts, which must
+  // stay valid and unchanged for the life of the session, and evaluates the
+  // gates that depend only on them with `bk`. Calls use `runner`'s options.
+  // Fails if a bound parameter is unknown or written by the function.
+  static absl::StatusOr<std::unique_ptr<TfheSession>> Create(
+      const TfheRunner& runner,
+      absl::flat_hash_map<std::string, LweSample*> bound_args,
+      const TFheGateBootstrappingCloudKeySet* bk);
+  ~TfheSession();
+
+  TfheSession(const TfheSession&) = delete;
+  TfheSession& operator=(const TfheSession&) = delete;
+
+  // Evaluates the circuit, with `args` holding the arguments for the unbound
+  // parameters only. `bk` must be a cloud key for the same secret key as the
+  // one the session was created with. Thread-safe, as TfheRunner::Run() is.
+  absl::Status Run(LweSample* result,
+                   absl::flat_hash_map<std::string, LweSample*> args,
+                   const TFheGateBootstrappingCloudKeySet* bk);
+
+ private:
+  TfheSession(absl::flat_hash_map<std::string, LweSample*> bound_args,
+              int32_t cache_size,
+              const TFheGateBootstrappingParameterSet* params);
+
+  // Including the cache.
+  absl::flat_hash_map<std::string, LweSample*> bound_args_;
+  // The precomputed values the per-call plan reads.
+  const int32_t cache_size_;
+  LweSample* const cache_;
+  std::unique_ptr<TfheRunner> runner_;
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_SESSION_H_
@@ -0,0 +1,104 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_session.h"
+
+#include <array>
+#include <memory>
+
+#include "absl/strings/string_view.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "transpiler/data/fhe_data.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_runner.h"
+#include "transpiler/tfhe_test_util.h"
+#include "transpiler/tfhe_trace.h"
+#include "xls/common/status/matchers.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::xls::status_testing::StatusIs;
+
+constexpr int kMainMinimumLambda = 120;
+
+// Bit 0 is bit `index` of db. Bit 1 is ((db0 & db1) ^ db2) & index0, whose
+// first two gates depend on db alone.
+constexpr absl::string_view kLookup = R"(
+package my_package
+
+fn my_package(db: bits[4], index: bits[2]) -> bits[2] {
+  bit_slice.1: bits[1] = bit_slice(db, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(db, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(db, start=2, width=1, id=3)
+  bit_slice.4: bits[1] = bit_slice(db, start=3, width=1, id=4)
+  bit_slice.5: bits[1] = bit_slice(index, start=0, width=1, id=5)
+  bit_slice.6: bits[1] = bit_slice(index, start=1, width=1, id=6)
+  sel.7: bits[1] = sel(bit_slice.5, cases=[bit_slice.1, bit_slice.2], id=7)
+  sel.8: bits[1] = sel(bit_slice.5, cases=[bit_slice.3, bit_slice.4], id=8)
+  sel.9: bits[1] = sel(bit_slice.6, cases=[sel.7, sel.8], id=9)
+  and.10: bits[1] = and(bit_slice.1, bit_slice.2, id=10)
+  xor.11: bits[1] = xor(and.10, bit_slice.3, id=11)
+  and.12: bits[1] = and(xor.11, bit_slice.5, id=12)
+  ret concat.13: bits[2] = concat(and.12, sel.9, id=13)
+}
+)";
+
+TEST(TfheSessionTest, EvaluatesBoundOnlyGatesOnce) {
+  TFHEParameters params(kMainMinimumLambda);
+  std::array<uint32_t, 3> seed = {314, 1592, 657};
+  TFHESecretKeySet key(params, seed);
+
+  XLS_ASSERT_OK_AND_ASSIGN(TfhePlan plan, CompilePlan(kLookup));
+  TraceRecorder trace;
+  TfheRunner::Options options;
+  options.trace = &trace;
+  TfheRunner runner(std::move(plan), options);
+  int seen = 0;
+
+  const int db_plaintext = 0b1011;
+  auto db = FheValue<char>::Encrypt(db_plaintext, key);
+  XLS_ASSERT_OK_AND_ASSIGN(std::unique_ptr<TfheSession> session,
+                           TfheSession::Create(runner, {{"db", db.get()}},
+                                               key.cloud()));
+  // and.10 and xor.11.
+  EXPECT_EQ(GatesSince(trace, &seen), 2);
+
+  for (int index = 0; index < 4; ++index) {
+    auto index_ciphertext = FheValue<char>::Encrypt(index, key);
+    FheValue<char> result(key.params());
+    XLS_ASSERT_OK(session->Run(result.get(),
+                               {{"index", index_ciphertext.get()}},
+                               key.cloud()));
+    const int expected = ((db_plaintext >> index) & 1) | ((index & 1) << 1);
+    EXPECT_EQ(result.Decrypt(key) & 3, expected) << "index=" << index;
+    // The three selects and and.12.
+    EXPECT_EQ(GatesSince(trace, &seen), 4);
+  }
+
+  auto index_ciphertext = FheValue<char>::Encrypt(0, key);
+  FheValue<char> result(key.params());
+  EXPECT_THAT(
+      session->Run(result.get(),
+                   {{"index", index_ciphertext.get()}, {"db", db.get()}},
+                   key.cloud()),
+      StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(
+      TfheSession::Create(runner, {{"table", db.get()}}, key.cloud()).status(),
+      StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
@@ -0,0 +1,101 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_test_util.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/substitute.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_trace.h"
+#include "xls/common/status/status_macros.h"
+#include "xls/contrib/xlscc/metadata_output.pb.h"
+#include "xls/ir/function.h"
+#include "xls/ir/ir_parser.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+
+std::string RippleCarryAdderIr(int width) {
+  std::string ir = absl::Substitute(R"(
+package my_package
+
+fn my_package(x: bits[$0], y: bits[$0]) -> bits[$0] {
+)",
+                                    width);
+  int id = 0;
+  // Appends a 1-bit node computing `op(args)`, and returns its name.
+  auto add = [&](absl::string_view op, absl::string_view args) {
+    const std::string name = absl::StrCat(op, ".", ++id);
+    absl::StrAppend(&ir, "  ", name, ": bits[1] = ", op, "(", args,
+                    ", id=", id, ")\n");
+    return name;
+  };
+  std::string carry;
+  std::vector<std::string> sum;
+  for (int bit = 0; bit < width; ++bit) {
+    const std::string x =
+        add("bit_slice", absl::StrCat("x, start=", bit, ", width=1"));
+    const std::string y =
+        add("bit_slice", absl::StrCat("y, start=", bit, ", width=1"));
+    const std::string half = add("xor", absl::StrCat(x, ", ", y));
+    if (bit == 0) {
+      sum.push_back(half);
+      carry = add("and", absl::StrCat(x, ", ", y));
+      continue;
+    }
+    sum.push_back(add("xor", absl::StrCat(half, ", ", carry)));
+    if (bit < width - 1) {
+      carry = add("or", absl::StrCat(add("and", absl::StrCat(x, ", ", y)),
+                                     ", ",
+                                     add("and", absl::StrCat(half, ", ",
+                                                             carry))));
+    }
+  }
+  absl::StrAppend(&ir, "  ret concat.", ++id, ": bits[", width, "] = concat(");
+  for (int bit = width - 1; bit >= 0; --bit) {
+    absl::StrAppend(&ir, sum[bit], ", ");
+  }
+  absl::StrAppend(&ir, "id=", id, ")\n}\n");
+  return ir;
+}
+
+absl::StatusOr<TfhePlan> CompilePlan(
+    absl::string_view ir, const xlscc_metadata::MetadataOutput& metadata) {
+  XLS_ASSIGN_OR_RETURN(auto package, xls::Parser::ParsePackage(ir));
+  XLS_ASSIGN_OR_RETURN(xls::Function * function,
+                       package->GetFunction("my_package"));
+  return TfhePlan::Compile(function, metadata);
+}
+
+absl::StatusOr<TfhePlan> CompilePlan(absl::string_view ir) {
+  xlscc_metadata::MetadataOutput metadata;
+  metadata.mutable_top_func_proto()->mutable_name()->set_name("my_package");
+  return CompilePlan(ir, metadata);
+}
+
+int GatesSince(const TraceRecorder& trace, int* seen) {
+  std::vector<TraceEvent> events = trace.events();
+  const int gates = std::count_if(
+      events.begin() + *seen, events.end(),
+      [](const TraceEvent& event) { return !IsBootstrapFree(event.op); });
+  *seen = events.size();
+  return gates;
+}
+
+}  // namespace fully_homomorphic_encryption::transpiler
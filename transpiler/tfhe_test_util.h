@@ -0,0 +1,48 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Helpers shared by the tests of TfhePlan and the runners built on it.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TEST_UTIL_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TEST_UTIL_H_
+
+#include <string>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "transpiler/tfhe_plan.h"
+#include "transpiler/tfhe_trace.h"
+#include "xls/contrib/xlscc/metadata_output.pb.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+
+// Returns the IR of `my_package(x: bits[width], y: bits[width]) ->
+// bits[width]`, which adds x and y by way of a ripple-carry adder. Its carry
+// chain makes for a circuit many levels deep, with values live across most
+// of them, that cannot be split without cutting edges.
+std::string RippleCarryAdderIr(int width);
+
+// Compiles the function `my_package` of `ir`. Without `metadata`, it is
+// taken to return its value and to write none of its parameters.
+absl::StatusOr<TfhePlan> CompilePlan(
+    absl::string_view ir, const xlscc_metadata::MetadataOutput& metadata);
+absl::StatusOr<TfhePlan> CompilePlan(absl::string_view ir);
+
+// The number of bootstrapped gates `trace` has recorded since `*seen` events,
+// which is then advanced past them.
+int GatesSince(const TraceRecorder& trace, int* seen);
+
+}  // namespace fully_homomorphic_encryption::transpiler
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TEST_UTIL_H_
@@ -0,0 +1,127 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_trace.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "xls/common/file/filesystem.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+namespace {
+
+double Microseconds(int64_t ns) { return ns / 1000.0; }
+
+}  // namespace
+
+void TraceRecorder::Record(const TraceEvent& event) {
+  absl::MutexLock lock(&lock_);
+  events_.push_back(event);
+}
+
+std::vector<TraceEvent> TraceRecorder::events() const {
+  absl::MutexLock lock(&lock_);
+  return events_;
+}
+
+void TraceRecorder::Clear() {
+  absl::MutexLock lock(&lock_);
+  events_.clear();
+}
+
+std::string TraceRecorder::ToChromeTraceJson() const {
+  std::vector<TraceEvent> events = this->events();
+  int64_t origin = std::numeric_limits<int64_t>::max();
+  std::set<int> workers;
+  for (const TraceEvent& event : events) {
+    origin = std::min(origin, event.ready_ns);
+    workers.insert(event.worker);
+  }
+
+  std::vector<std::string> entries;
+  for (int worker : workers) {
+    entries.push_back(absl::StrFormat(
+        R"({"name": "thread_name", "ph": "M", "pid": 0, "tid": %d, )"
+        R"("args": {"name": "worker %d"}})",
+        worker, worker));
+  }
+  for (const TraceEvent& event : events) {
+    entries.push_back(absl::StrFormat(
+        R"({"name": "%s", "cat": "gate", "ph": "X", "pid": 0, "tid": %d, )"
+        R"("ts": %.3f, "dur": %.3f, "args": {"run": %d, "node": %d, )"
+        R"("level": %d, "queue_us": %.3f}})",
+        PlanOpName(event.op), event.worker,
+        Microseconds(event.start_ns - origin),
+        Microseconds(event.end_ns - event.start_ns), event.run, event.node,
+        event.level, Microseconds(event.start_ns - event.ready_ns)));
+  }
+  return absl::StrCat("{\"traceEvents\": [\n",
+                      absl::StrJoin(entries, ",\n"), "\n]}\n");
+}
+
+absl::Status TraceRecorder::WriteChromeTrace(absl::string_view path) const {
+  return xls::SetFileContents(std::string(path), ToChromeTraceJson());
+}
+
+std::string TraceRecorder::LevelSummary() const {
+  struct LevelStats {
+    int64_t nodes = 0;
+    int64_t total_eval_ns = 0;
+    int64_t max_eval_ns = 0;
+    int64_t total_queue_ns = 0;
+    int64_t max_queue_ns = 0;
+    std::set<int> workers;
+  };
+  std::map<int32_t, LevelStats> levels;
+  for (const TraceEvent& event : events()) {
+    LevelStats& stats = levels[event.level];
+    const int64_t eval_ns = event.end_ns - event.start_ns;
+    const int64_t queue_ns = event.start_ns - event.ready_ns;
+    ++stats.nodes;
+    stats.total_eval_ns += eval_ns;
+    stats.max_eval_ns = std::max(stats.max_eval_ns, eval_ns);
+    stats.total_queue_ns += queue_ns;
+    stats.max_queue_ns = std::max(stats.max_queue_ns, queue_ns);
+    stats.workers.insert(event.worker);
+  }
+
+  std::string summary = absl::StrFormat(
+      "%6s %8s %14s %12s %13s %12s %8s\n", "level", "nodes", "eval_total_us",
+      "eval_max_us", "queue_mean_us", "queue_max_us", "workers");
+  for (const auto& [level, stats] : levels) {
+    absl::StrAppendFormat(
+        &summary, "%6d %8d %14.1f %12.1f %13.1f %12.1f %8d\n", level,
+        stats.nodes, Microseconds(stats.total_eval_ns),
+        Microseconds(stats.max_eval_ns),
+        Microseconds(stats.total_queue_ns) / stats.nodes,
+        Microseconds(stats.max_queue_ns), stats.workers.size());
+  }
+  return summary;
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
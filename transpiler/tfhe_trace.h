@@ -0,0 +1,92 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per-gate execution traces of TfheRunner.
+//
+// Usage:
+//
+// TraceRecorder trace;
+// TfheRunner::Options options;
+// options.trace = &trace;
+// TfheRunner runner(std::move(plan), options);
+// ... run ...
+// XLS_CHECK_OK(trace.WriteChromeTrace("/tmp/trace.json"));
+// std::cout << trace.LevelSummary();
+//
+// The JSON can be loaded in chrome://tracing or https://ui.perfetto.dev, and
+// shows one track per worker thread.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRACE_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRACE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "transpiler/tfhe_plan.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+// The evaluation of one plan node in one run.
+struct TraceEvent {
+  // Distinguishes concurrent or batched runs: unique per run item within a
+  // runner.
+  int64_t run;
+  int32_t node;
+  PlanOp op;
+  int32_t level;
+  // TfheExecutor::CurrentWorkerIndex() of the evaluating thread.
+  int worker;
+  // When the node's last operand became available (and it was queued, unless
+  // it is bootstrap-free and so ran inline), and when its evaluation started
+  // and ended, from absl::GetCurrentTimeNanos().
+  int64_t ready_ns;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+// Collects TraceEvents. Thread-safe.
+class TraceRecorder {
+ public:
+  void Record(const TraceEvent& event);
+
+  std::vector<TraceEvent> events() const;
+  void Clear();
+
+  // Renders the events in the Chrome trace event format: a complete ("X")
+  // event per node on its worker's track, with the node, level, run and
+  // queueing delay as arguments. Times are relative to the earliest event.
+  std::string ToChromeTraceJson() const;
+  absl::Status WriteChromeTrace(absl::string_view path) const;
+
+  // Renders a table with one row per circuit level: how many nodes it has,
+  // the total and longest evaluation time, the mean and longest queueing
+  // delay, and the number of distinct workers involved.
+  std::string LevelSummary() const;
+
+ private:
+  mutable absl::Mutex lock_;
+  std::vector<TraceEvent> events_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRACE_H_
@@ -0,0 +1,67 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_trace.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_split.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "transpiler/tfhe_plan.h"
+
+namespace fully_homomorphic_encryption::transpiler {
+namespace {
+
+using ::testing::HasSubstr;
+
+void RecordExample(TraceRecorder* trace) {
+  // Two level-0 nodes on different workers feeding a level-1 AND.
+  trace->Record({0, 0, PlanOp::kParamBit, 0, 0, 1000, 2000, 3000});
+  trace->Record({0, 1, PlanOp::kParamBit, 0, 1, 1000, 4000, 5000});
+  trace->Record({0, 2, PlanOp::kAnd, 1, 1, 5000, 5000, 15000});
+}
+
+TEST(TraceRecorderTest, ChromeTraceJson) {
+  TraceRecorder trace;
+  RecordExample(&trace);
+  std::string json = trace.ToChromeTraceJson();
+  EXPECT_THAT(json, HasSubstr(R"("name": "worker 1")"));
+  // Times are in microseconds, relative to the first ready node.
+  EXPECT_THAT(json, HasSubstr(R"("name": "and", "cat": "gate", "ph": "X", )"
+                              R"("pid": 0, "tid": 1, "ts": 4.000, )"
+                              R"("dur": 10.000, "args": {"run": 0, )"
+                              R"("node": 2, "level": 1, "queue_us": 0.000})"));
+  EXPECT_THAT(json, HasSubstr(R"("node": 1, "level": 0, "queue_us": 3.000})"));
+}
+
+TEST(TraceRecorderTest, LevelSummary) {
+  TraceRecorder trace;
+  RecordExample(&trace);
+  std::vector<std::string> lines =
+      absl::StrSplit(trace.LevelSummary(), '\n', absl::SkipEmpty());
+  ASSERT_EQ(lines.size(), 3);
+  std::vector<std::string> level0 =
+      absl::StrSplit(lines[1], ' ', absl::SkipEmpty());
+  EXPECT_THAT(level0, testing::ElementsAre("0", "2", "2.0", "1.0", "2.0",
+                                           "3.0", "2"));
+  std::vector<std::string> level1 =
+      absl::StrSplit(lines[2], ' ', absl::SkipEmpty());
+  EXPECT_THAT(level1, testing::ElementsAre("1", "1", "10.0", "10.0", "0.0",
+                                           "0.0", "1"));
+}
+
+}  // namespace
+}  // namespace fully_homomorphic_encryption::transpiler
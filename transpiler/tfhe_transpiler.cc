@@ -14,16 +14,21 @@
 
 #include "transpiler/tfhe_transpiler.h"
 
+#include <algorithm>
+#include <numeric>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/substitute.h"
+#include "transpiler/live_set_schedule.h"
 #include "xls/common/status/status_macros.h"
 #include "xls/ir/function.h"
 #include "xls/ir/node.h"
@@ -75,14 +80,27 @@ std::string TfheTranspiler::CopyTo(std::string destination,
   return absl::Substitute("  bootsCOPY($0, $1, bk);\n", destination, source);
 }
 
+// Points `destination` at the param bit `source` itself, without allocating
+// or copying a ciphertext.
+std::string TfheTranspiler::AliasTo(std::string destination,
+                                    std::string source) {
+  return absl::Substitute("  $0 = $1;\n", destination, source);
+}
+
 // Input: Node(id = 5)
-// Output: temp_nodes[5] = new new_gate_bootstrapping_ciphertext(bk->params);
+// Output: temp_nodes[5] = owned_nodes.emplace_back(
+//             new_gate_bootstrapping_ciphertext(bk->params));
 std::string TfheTranspiler::InitializeNode(const Node* node) {
   return absl::Substitute(
-      "  $0 = new_gate_bootstrapping_ciphertext(bk->params);\n",
+      "  $0 = owned_nodes.emplace_back(\n"
+      "      new_gate_bootstrapping_ciphertext(bk->params));\n",
       NodeReference(node));
 }
 
+std::string TfheTranspiler::SetToZero(std::string destination) {
+  return absl::Substitute("  bootsCONSTANT($0, 0, bk);\n", destination);
+}
+
 // Input: Node(id = 5, op = kNot, operands = Node(id = 2))
 // Output: "  bootsNOT(temp_nodes[5], temp_nodes[2], bk);\n\n"
 absl::StatusOr<std::string> TfheTranspiler::Execute(const Node* node) {
@@ -90,6 +108,10 @@ absl::StatusOr<std::string> TfheTranspiler::Execute(const Node* node) {
       {Op::kAnd, "bootsAND"},
       {Op::kOr, "bootsOR"},
       {Op::kNot, "bootsNOT"},
+      {Op::kXor, "bootsXOR"},
+      {Op::kNand, "bootsNAND"},
+      {Op::kNor, "bootsNOR"},
+      {Op::kSel, "bootsMUX"},
       {Op::kLiteral, "bootsCONSTANT"},
   };
   auto it = kFHEOps.find(node->op());
@@ -116,6 +138,19 @@ absl::StatusOr<std::string> TfheTranspiler::Execute(const Node* node) {
       }
       return "";
     }
+  } else if (node->Is<xls::Select>()) {
+    // As in TfhePlan, only a 1-bit selector choosing between exactly two
+    // cases maps onto bootsMUX.
+    const xls::Select* select = node->As<xls::Select>();
+    if (select->selector()->GetType()->GetFlatBitCount() != 1 ||
+        select->cases().size() != 2 || select->default_value().has_value()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unsupported select: ", select->ToString()));
+    }
+    // bootsMUX takes the value for a set selector first.
+    absl::StrAppend(&operation, NodeReference(select->selector()), ", ",
+                    NodeReference(select->cases()[1]), ", ",
+                    NodeReference(select->cases()[0]), ", ");
   } else {
     for (const Node* operand_node : node->operands()) {
       absl::StrAppend(&operation, NodeReference(operand_node), ", ");
@@ -126,6 +161,134 @@ absl::StatusOr<std::string> TfheTranspiler::Execute(const Node* node) {
   return operation;
 }
 
+absl::StatusOr<TfheTranspiler::ScheduledNodes> TfheTranspiler::ScheduleNodes(
+    const xls::Function* function,
+    const xlscc_metadata::MetadataOutput& metadata, Schedule schedule) {
+  const absl::flat_hash_set<std::string> out_params = OutParams(metadata);
+
+  ScheduledNodes scheduled;
+  std::vector<Node*>& nodes = scheduled.nodes;
+  absl::flat_hash_map<const Node*, int32_t>& indices = scheduled.indices;
+  for (Node* node : xls::TopoSort(const_cast<Function*>(function))) {
+    if (IsEvaluated(node)) {
+      indices[node] = nodes.size();
+      nodes.push_back(node);
+    }
+  }
+  DataflowGraph& graph = scheduled.graph;
+  for (const Node* node : nodes) {
+    std::vector<int32_t> operands;
+    for (const Node* operand : node->operands()) {
+      if (auto it = indices.find(operand); it != indices.end()) {
+        operands.push_back(it->second);
+      }
+    }
+    XLS_ASSIGN_OR_RETURN(const bool aliased,
+                         AliasesParamBit(node, out_params));
+    // Anything else reading a node selects it for an output.
+    bool kept = node == function->return_value();
+    for (const Node* user : node->users()) {
+      kept |= !IsEvaluated(user);
+    }
+    graph.AddNode(operands, !aliased, kept);
+  }
+
+  if (schedule == Schedule::kMinLiveSet) {
+    scheduled.order = MinLiveOrder(graph);
+    scheduled.peak_live = PeakLiveValues(graph, scheduled.order);
+  } else {
+    scheduled.order.resize(nodes.size());
+    std::iota(scheduled.order.begin(), scheduled.order.end(), 0);
+    scheduled.peak_live = std::count(graph.allocates.begin(),
+                                     graph.allocates.end(), true);
+  }
+  return scheduled;
+}
+
+absl::StatusOr<int64_t> TfheTranspiler::PeakLiveCiphertexts(
+    const xls::Function* function,
+    const xlscc_metadata::MetadataOutput& metadata, Schedule schedule) {
+  XLS_ASSIGN_OR_RETURN(ScheduledNodes scheduled,
+                       ScheduleNodes(function, metadata, schedule));
+  return scheduled.peak_live;
+}
+
+absl::StatusOr<std::string> TfheTranspiler::Translate(
+    const xls::Function* function,
+    const xlscc_metadata::MetadataOutput& metadata, Schedule schedule) {
+  const absl::flat_hash_set<std::string> out_params = OutParams(metadata);
+  XLS_ASSIGN_OR_RETURN(ScheduledNodes scheduled,
+                       ScheduleNodes(function, metadata, schedule));
+  const std::vector<Node*>& nodes = scheduled.nodes;
+  absl::flat_hash_map<const Node*, int32_t>& indices = scheduled.indices;
+  const DataflowGraph& graph = scheduled.graph;
+  const std::vector<int32_t>& order = scheduled.order;
+  const int64_t peak_live = scheduled.peak_live;
+
+  std::string body = absl::StrFormat(
+      "  // At most %d intermediate ciphertexts are live at once.\n\n",
+      peak_live);
+  // Per node: its distinct readers yet to be emitted, and where in
+  // owned_nodes its ciphertext is.
+  std::vector<int32_t> remaining_readers(nodes.size(), 0);
+  for (const Node* node : nodes) {
+    for (const Node* user : node->users()) {
+      remaining_readers[indices[node]] += IsEvaluated(user);
+    }
+  }
+  std::vector<int32_t> owned_index(nodes.size(), -1);
+  int32_t owned_count = 0;
+  for (int32_t i : order) {
+    XLS_ASSIGN_OR_RETURN(const std::string operation,
+                         TranslateNode(nodes[i], out_params));
+    absl::StrAppend(&body, operation);
+    if (graph.allocates[i]) {
+      owned_index[i] = owned_count++;
+    }
+    if (schedule != Schedule::kMinLiveSet) {
+      continue;
+    }
+    auto releasable = [&](int32_t node) {
+      return remaining_readers[node] == 0 && graph.allocates[node] &&
+             !graph.kept[node];
+    };
+    // Each distinct operand once, as Node::users() lists each reader once.
+    absl::flat_hash_set<const Node*> seen;
+    for (const Node* operand : nodes[i]->operands()) {
+      auto it = indices.find(operand);
+      if (it == indices.end() || !seen.insert(operand).second) {
+        continue;
+      }
+      if (--remaining_readers[it->second] == 0 && releasable(it->second)) {
+        absl::StrAppend(&body, ReleaseNode(owned_index[it->second]));
+      }
+    }
+    if (releasable(i)) {
+      absl::StrAppend(&body, ReleaseNode(owned_index[i]));
+    }
+  }
+
+  XLS_ASSIGN_OR_RETURN(const std::string prelude,
+                       Prelude(function, metadata));
+  XLS_ASSIGN_OR_RETURN(const std::string handle_outputs,
+                       CollectOutputs(function, metadata));
+  std::string conclusion;
+  if (schedule == Schedule::kMinLiveSet) {
+    conclusion = R"(  for (LweSample* node : owned_nodes) {
+    // Those already released are null.
+    if (node != nullptr) {
+      delete_gate_bootstrapping_ciphertext(node);
+    }
+  }
+  return absl::OkStatus();
+}
+)";
+  } else {
+    XLS_ASSIGN_OR_RETURN(conclusion, Conclusion());
+  }
+  return absl::StrCat(prelude, body, handle_outputs, conclusion);
+}
+
 absl::StatusOr<std::string> TfheTranspiler::TranslateHeader(
     const xls::Function* function,
     const xlscc_metadata::MetadataOutput& metadata,
@@ -148,6 +311,36 @@ $0;
   return absl::Substitute(kHeaderTemplate, signature, header_guard);
 }
 
+absl::StatusOr<std::string> TfheTranspiler::TranslateHeader(
+    const xls::Function* function,
+    const xlscc_metadata::MetadataOutput& metadata,
+    absl::string_view header_path, Schedule schedule) {
+  XLS_ASSIGN_OR_RETURN(const std::string header_guard,
+                       PathToHeaderGuard(header_path));
+  static constexpr absl::string_view kHeaderTemplate =
+      R"(#ifndef $1
+#define $1
+
+#include <stdint.h>
+
+#include "absl/status/status.h"
+#include "tfhe/tfhe.h"
+#include "tfhe/tfhe_io.h"
+
+// The most intermediate ciphertexts $2() holds at once.
+constexpr int64_t $2_kPeakLiveCiphertexts = $3;
+
+$0;
+#endif  // $1
+)";
+  XLS_ASSIGN_OR_RETURN(std::string signature,
+                       FunctionSignature(function, metadata));
+  XLS_ASSIGN_OR_RETURN(const int64_t peak_live,
+                       PeakLiveCiphertexts(function, metadata, schedule));
+  return absl::Substitute(kHeaderTemplate, signature, header_guard,
+                          function->name(), peak_live);
+}
+
 absl::StatusOr<std::string> TfheTranspiler::FunctionSignature(
     const Function* function, const xlscc_metadata::MetadataOutput& metadata) {
   std::vector<std::string> param_signatures;
@@ -174,6 +367,7 @@ absl::StatusOr<std::string> TfheTranspiler::Prelude(
   // $1: non-key parameter string
   static constexpr absl::string_view kPrelude =
       R"(#include <unordered_map>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "tfhe/tfhe.h"
@@ -181,6 +375,8 @@ absl::StatusOr<std::string> TfheTranspiler::Prelude(
 
 $0 {
   std::unordered_map<int, LweSample*> temp_nodes;
+  // The ciphertexts allocated for temp_nodes; the rest alias param bits.
+  std::vector<LweSample*> owned_nodes;
 
 )";
   XLS_ASSIGN_OR_RETURN(std::string signature,
@@ -189,13 +385,20 @@ $0 {
 }
 
 absl::StatusOr<std::string> TfheTranspiler::Conclusion() {
-  return R"(  for (auto pair : temp_nodes) {
-    delete_gate_bootstrapping_ciphertext(pair.second);
+  return R"(  for (LweSample* node : owned_nodes) {
+    delete_gate_bootstrapping_ciphertext(node);
   }
   return absl::OkStatus();
 }
 )";
 }
 
+std::string TfheTranspiler::ReleaseNode(int owned_index) {
+  return absl::Substitute(
+      "  delete_gate_bootstrapping_ciphertext(owned_nodes[$0]);\n"
+      "  owned_nodes[$0] = nullptr;\n\n",
+      owned_index);
+}
+
 }  // namespace transpiler
 }  // namespace fully_homomorphic_encryption
@@ -17,11 +17,16 @@
 #ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRANSPILER_H_
 #define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRANSPILER_H_
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
 #include "transpiler/abstract_xls_transpiler.h"
+#include "transpiler/live_set_schedule.h"
 #include "xls/ir/function.h"
 #include "xls/ir/node.h"
 
@@ -32,11 +37,49 @@ namespace transpiler {
 // from the TFHE library.
 class TfheTranspiler : public AbstractXLSTranspiler<TfheTranspiler> {
  public:
+  // The order in which the generated function evaluates the circuit's nodes.
+  enum class Schedule {
+    // XLS's topological order. Every intermediate ciphertext is held until
+    // the function returns.
+    kTopological,
+    // The order of MinLiveOrder() (see live_set_schedule.h). Each
+    // intermediate ciphertext is freed after its last reader, or, if it is
+    // an output, once the outputs are written.
+    kMinLiveSet,
+  };
+
+  using AbstractXLSTranspiler::Translate;
+
+  // As Translate(), but evaluating nodes in the order of `schedule`, and
+  // noting in a comment how many intermediate ciphertexts the generated
+  // function holds at once at most (see PeakLiveCiphertexts()).
+  static absl::StatusOr<std::string> Translate(
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata, Schedule schedule);
+
   static absl::StatusOr<std::string> TranslateHeader(
       const xls::Function* function,
       const xlscc_metadata::MetadataOutput& metadata,
       absl::string_view header_path);
 
+  // As above, but also declaring
+  //
+  //   constexpr int64_t <function>_kPeakLiveCiphertexts = ...;
+  //
+  // the PeakLiveCiphertexts() of the function Translate() generates for
+  // `schedule`, so that callers can size memory for it as they would by a
+  // runner's peak_live_ciphertexts().
+  static absl::StatusOr<std::string> TranslateHeader(
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata,
+      absl::string_view header_path, Schedule schedule);
+
+  // The most intermediate ciphertexts the function Translate() generates for
+  // `schedule` holds at once.
+  static absl::StatusOr<int64_t> PeakLiveCiphertexts(
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata, Schedule schedule);
+
   static absl::StatusOr<std::string> FunctionSignature(
       const xls::Function* function,
       const xlscc_metadata::MetadataOutput& metadata);
@@ -46,7 +89,9 @@ class TfheTranspiler : public AbstractXLSTranspiler<TfheTranspiler> {
   static std::string OutputBitReference(absl::string_view output_arg,
                                         int offset);
   static std::string CopyTo(std::string destination, std::string source);
+  static std::string AliasTo(std::string destination, std::string source);
   static std::string InitializeNode(const xls::Node* node);
+  static std::string SetToZero(std::string destination);
 
   static absl::StatusOr<std::string> Execute(const xls::Node* node);
 
@@ -55,6 +100,28 @@ class TfheTranspiler : public AbstractXLSTranspiler<TfheTranspiler> {
       const xlscc_metadata::MetadataOutput& metadata);
 
   static absl::StatusOr<std::string> Conclusion();
+
+ private:
+  // The nodes code is generated for, and the order `schedule` evaluates them
+  // in.
+  struct ScheduledNodes {
+    std::vector<xls::Node*> nodes;
+    // Index of each node in `nodes`.
+    absl::flat_hash_map<const xls::Node*, int32_t> indices;
+    // `nodes` as a dataflow graph, with the same indices.
+    DataflowGraph graph;
+    // Indices into `nodes`, in evaluation order.
+    std::vector<int32_t> order;
+    // The most intermediate ciphertexts live at once in that order.
+    int64_t peak_live;
+  };
+  static absl::StatusOr<ScheduledNodes> ScheduleNodes(
+      const xls::Function* function,
+      const xlscc_metadata::MetadataOutput& metadata, Schedule schedule);
+
+  // Frees the ciphertext at `owned_index` of owned_nodes, and clears its
+  // entry.
+  static std::string ReleaseNode(int owned_index);
 };
 
 }  // namespace transpiler
@@ -49,7 +49,10 @@
 namespace fully_homomorphic_encryption::transpiler {
 namespace {
 
+using ::testing::HasSubstr;
+using ::testing::Not;
 using ::testing::UnorderedElementsAreArray;
+using ::xls::status_testing::IsOkAndHolds;
 using ::xls::status_testing::StatusIs;
 
 absl::StatusOr<std::unique_ptr<xls::Package>> BooleanizeIr(xls::Package* p) {
@@ -492,6 +495,7 @@ TEST(FheIrTranspilerLibTest, Prelude_OnlyPure) {
 
   static constexpr absl::string_view expected_prelude =
       R"(#include <unordered_map>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "tfhe/tfhe.h"
@@ -500,6 +504,8 @@ TEST(FheIrTranspilerLibTest, Prelude_OnlyPure) {
 absl::Status test_fn(LweSample* result,
   const TFheGateBootstrappingCloudKeySet* bk) {
   std::unordered_map<int, LweSample*> temp_nodes;
+  // The ciphertexts allocated for temp_nodes; the rest alias param bits.
+  std::vector<LweSample*> owned_nodes;
 
 )";
 
@@ -513,8 +519,8 @@ TEST(FheIrTranspilerLibTest, Conclusion) {
                            TfheTranspiler::Conclusion());
 
   static constexpr absl::string_view expected_conclusion =
-      R"(  for (auto pair : temp_nodes) {
-    delete_gate_bootstrapping_ciphertext(pair.second);
+      R"(  for (LweSample* node : owned_nodes) {
+    delete_gate_bootstrapping_ciphertext(node);
   }
   return absl::OkStatus();
 }
@@ -664,9 +670,9 @@ TEST(FheIrTranspilerLibTest, InitializeNode) {
   std::string actual = TfheTranspiler::InitializeNode(param.node());
   EXPECT_EQ(
       actual,
-      absl::Substitute(
-          "  temp_nodes[$0] = new_gate_bootstrapping_ciphertext(bk->params);\n",
-          param.node()->id()));
+      absl::Substitute("  temp_nodes[$0] = owned_nodes.emplace_back(\n"
+                       "      new_gate_bootstrapping_ciphertext(bk->params));\n",
+                       param.node()->id()));
 }
 
 TEST(FheIrTranspilerLibTest, Execute_AndOp) {
@@ -724,6 +730,65 @@ TEST(FheIrTranspilerLibTest, Execute_NotOp) {
                         not_op.node()->id(), param.node()->id()));
 }
 
+TEST(FheIrTranspilerLibTest, Execute_XorOp) {
+  constexpr int kInOutWidth = 8;
+  xls::Package package("test_package");
+  xls::FunctionBuilder builder("test_fn", &package);
+  xls::BValue lhs =
+      CreateOutputElement(&builder, kInOutWidth, absl::StrCat("param_", 0));
+  xls::BValue rhs =
+      CreateOutputElement(&builder, kInOutWidth, absl::StrCat("param_", 1));
+  xls::BValue xor_op =
+      builder.Xor(lhs, rhs, /*loc=*/absl::nullopt, "param_0_xor_param_1");
+
+  XLS_ASSERT_OK_AND_ASSIGN(std::string actual,
+                           TfheTranspiler::Execute(xor_op.node()));
+  EXPECT_EQ(
+      actual,
+      absl::Substitute(
+          "  bootsXOR(temp_nodes[$0], temp_nodes[$1], temp_nodes[$2], bk);\n\n",
+          xor_op.node()->id(), lhs.node()->id(), rhs.node()->id()));
+}
+
+TEST(FheIrTranspilerLibTest, Execute_SelectOp) {
+  constexpr int kInOutWidth = 1;
+  xls::Package package("test_package");
+  xls::FunctionBuilder builder("test_fn", &package);
+  xls::BValue selector =
+      CreateOutputElement(&builder, kInOutWidth, "selector");
+  xls::BValue on_false =
+      CreateOutputElement(&builder, kInOutWidth, "on_false");
+  xls::BValue on_true = CreateOutputElement(&builder, kInOutWidth, "on_true");
+  xls::BValue sel_op =
+      builder.Select(selector, {on_false, on_true},
+                     /*default_value=*/absl::nullopt, /*loc=*/absl::nullopt,
+                     "select");
+
+  XLS_ASSERT_OK_AND_ASSIGN(std::string actual,
+                           TfheTranspiler::Execute(sel_op.node()));
+  // bootsMUX takes the value for a set selector first.
+  EXPECT_EQ(actual,
+            absl::Substitute("  bootsMUX(temp_nodes[$0], temp_nodes[$1], "
+                             "temp_nodes[$2], temp_nodes[$3], bk);\n\n",
+                             sel_op.node()->id(), selector.node()->id(),
+                             on_true.node()->id(), on_false.node()->id()));
+}
+
+TEST(FheIrTranspilerLibTest, Execute_UnsupportedSelect) {
+  xls::Package package("test_package");
+  xls::FunctionBuilder builder("test_fn", &package);
+  xls::BValue selector = CreateOutputElement(&builder, 2, "selector");
+  xls::BValue on_zero = CreateOutputElement(&builder, 1, "on_zero");
+  xls::BValue on_one = CreateOutputElement(&builder, 1, "on_one");
+  xls::BValue otherwise = CreateOutputElement(&builder, 1, "otherwise");
+  xls::BValue sel_op =
+      builder.Select(selector, {on_zero, on_one}, otherwise,
+                     /*loc=*/absl::nullopt, "select");
+
+  EXPECT_THAT(TfheTranspiler::Execute(sel_op.node()),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
 TEST(FheIrTranspilerLibTest, Execute_InvalidOp) {
   constexpr int kInOutWidth = 16;
   xls::Package package("test_package");
@@ -778,6 +843,136 @@ TEST(FheIrTranspilerLibTest, Execute_UnsupportedLiteral) {
               StatusIs(absl::StatusCode::kInvalidArgument));
 }
 
+// Clears the low bit of x if y is set, and sets y to the low bit of x.
+constexpr absl::string_view kInOutExample = R"(
+package my_package
+
+fn my_package(x: bits[2], y: bits[1]) -> (bits[2], (bits[1])) {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(y, start=0, width=1, id=3)
+  not.4: bits[1] = not(bit_slice.3, id=4)
+  and.5: bits[1] = and(bit_slice.1, not.4, id=5)
+  concat.6: bits[2] = concat(bit_slice.2, and.5, id=6)
+  tuple.7: (bits[1]) = tuple(bit_slice.1, id=7)
+  ret tuple.8: (bits[2], (bits[1])) = tuple(concat.6, tuple.7, id=8)
+}
+)";
+
+// This test verifies that bits of const params are aliased rather than copied,
+// while bits of in/out params are still copied.
+TEST(FheIrTranspilerLibTest, AliasesConstParamBits) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kInOutExample));
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_int();
+  auto* x = proto->add_params();
+  x->set_name("x");
+  x->set_is_const(true);
+  auto* y = proto->add_params();
+  y->set_name("y");
+  y->set_is_reference(true);
+
+  XLS_ASSERT_OK_AND_ASSIGN(std::string actual,
+                           TfheTranspiler::Translate(function, metadata));
+  EXPECT_THAT(actual, HasSubstr("  temp_nodes[1] = &x[0];\n"));
+  EXPECT_THAT(actual, HasSubstr("  temp_nodes[2] = &x[1];\n"));
+  EXPECT_THAT(actual, Not(HasSubstr("bootsCOPY(temp_nodes[1]")));
+  EXPECT_THAT(actual, HasSubstr("  temp_nodes[3] = owned_nodes.emplace_back("));
+  EXPECT_THAT(actual, HasSubstr("  bootsCOPY(temp_nodes[3], y, bk);\n"));
+}
+
+// The AND of the four bits of x, by a chain of gates.
+constexpr absl::string_view kAndChainExample = R"(
+package my_package
+
+fn my_package(x: bits[4]) -> bits[1] {
+  bit_slice.1: bits[1] = bit_slice(x, start=0, width=1, id=1)
+  bit_slice.2: bits[1] = bit_slice(x, start=1, width=1, id=2)
+  bit_slice.3: bits[1] = bit_slice(x, start=2, width=1, id=3)
+  bit_slice.4: bits[1] = bit_slice(x, start=3, width=1, id=4)
+  and.5: bits[1] = and(bit_slice.1, bit_slice.2, id=5)
+  and.6: bits[1] = and(and.5, bit_slice.3, id=6)
+  ret and.7: bits[1] = and(and.6, bit_slice.4, id=7)
+}
+)";
+
+// This test verifies that the min-live-set schedule frees each intermediate
+// ciphertext after its last reader, and that both schedules report their
+// peak.
+TEST(FheIrTranspilerLibTest, MinLiveSetScheduleFreesEarly) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kAndChainExample));
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_int();
+  proto->add_params()->set_name("x");
+
+  XLS_ASSERT_OK_AND_ASSIGN(
+      std::string topological,
+      TfheTranspiler::Translate(function, metadata,
+                                TfheTranspiler::Schedule::kTopological));
+  EXPECT_THAT(topological,
+              HasSubstr("At most 3 intermediate ciphertexts are live"));
+  EXPECT_THAT(topological, Not(HasSubstr("owned_nodes[0] = nullptr;")));
+
+  XLS_ASSERT_OK_AND_ASSIGN(
+      std::string min_live,
+      TfheTranspiler::Translate(function, metadata,
+                                TfheTranspiler::Schedule::kMinLiveSet));
+  EXPECT_THAT(min_live,
+              HasSubstr("At most 2 intermediate ciphertexts are live"));
+  // and.5 goes once and.6 has read it, and and.6 once and.7 has; and.7 is
+  // the result, so is kept until it has been copied out.
+  EXPECT_THAT(min_live, HasSubstr("  bootsAND(temp_nodes[6], temp_nodes[5], "
+                                  "temp_nodes[3], bk);\n\n"
+                                  "  delete_gate_bootstrapping_ciphertext("
+                                  "owned_nodes[0]);\n"
+                                  "  owned_nodes[0] = nullptr;\n"));
+  EXPECT_THAT(min_live, HasSubstr("  owned_nodes[1] = nullptr;\n"));
+  EXPECT_THAT(min_live, Not(HasSubstr("owned_nodes[2] = nullptr;")));
+}
+
+// This test verifies that the header exports the peak of the function
+// generated for the same schedule.
+TEST(FheIrTranspilerLibTest, TranslateHeader_PeakLiveCiphertexts) {
+  XLS_ASSERT_OK_AND_ASSIGN(auto package,
+                           xls::Parser::ParsePackage(kAndChainExample));
+  XLS_ASSERT_OK_AND_ASSIGN(xls::Function * function,
+                           package->GetFunction("my_package"));
+  xlscc_metadata::MetadataOutput metadata;
+  auto* proto = metadata.mutable_top_func_proto();
+  proto->mutable_name()->set_name("my_package");
+  proto->mutable_return_type()->mutable_as_int();
+  proto->add_params()->set_name("x");
+
+  XLS_ASSERT_OK_AND_ASSIGN(
+      std::string topological,
+      TfheTranspiler::TranslateHeader(function, metadata, "a/b.h",
+                                      TfheTranspiler::Schedule::kTopological));
+  EXPECT_THAT(topological,
+              HasSubstr("constexpr int64_t my_package_kPeakLiveCiphertexts "
+                        "= 3;\n"));
+
+  XLS_ASSERT_OK_AND_ASSIGN(
+      std::string min_live,
+      TfheTranspiler::TranslateHeader(function, metadata, "a/b.h",
+                                      TfheTranspiler::Schedule::kMinLiveSet));
+  EXPECT_THAT(min_live,
+              HasSubstr("constexpr int64_t my_package_kPeakLiveCiphertexts "
+                        "= 2;\n"));
+  EXPECT_THAT(TfheTranspiler::PeakLiveCiphertexts(
+                  function, metadata, TfheTranspiler::Schedule::kMinLiveSet),
+              IsOkAndHolds(2));
+}
+
 // This test verifies that CollectOutputValues can properly handle a
 // two-dimensional array_index.
 // Takes in a bits[2][3][4][5] and outputs a bits[2].
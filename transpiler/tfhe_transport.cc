@@ -0,0 +1,116 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transpiler/tfhe_transport.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "xls/common/status/status_macros.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+SocketTransport::SocketTransport(int fd, pid_t child,
+                                 uint64_t max_message_size)
+    : fd_(fd), child_(child), max_message_size_(max_message_size) {}
+
+SocketTransport::~SocketTransport() {
+  close(fd_);
+  if (child_ != -1) {
+    while (waitpid(child_, nullptr, 0) == -1 && errno == EINTR) {
+    }
+  }
+}
+
+absl::StatusOr<std::pair<std::unique_ptr<SocketTransport>,
+                         std::unique_ptr<SocketTransport>>>
+SocketTransport::Pair(uint64_t max_message_size) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+    return absl::InternalError(
+        absl::StrCat("Failed to create socket pair: ", strerror(errno)));
+  }
+  return std::make_pair(
+      std::make_unique<SocketTransport>(fds[0], -1, max_message_size),
+      std::make_unique<SocketTransport>(fds[1], -1, max_message_size));
+}
+
+absl::Status SocketTransport::Send(absl::string_view message) {
+  const uint64_t size = message.size();
+  XLS_RETURN_IF_ERROR(
+      WriteFully(reinterpret_cast<const char*>(&size), sizeof(size)));
+  return WriteFully(message.data(), message.size());
+}
+
+absl::StatusOr<std::string> SocketTransport::Receive() {
+  uint64_t size;
+  XLS_RETURN_IF_ERROR(ReadFully(reinterpret_cast<char*>(&size), sizeof(size)));
+  if (size > max_message_size_) {
+    return absl::ResourceExhaustedError(
+        absl::StrCat("Message of ", size, " bytes exceeds the maximum of ",
+                     max_message_size_));
+  }
+  std::string message(size, '\0');
+  XLS_RETURN_IF_ERROR(ReadFully(message.data(), size));
+  return message;
+}
+
+absl::Status SocketTransport::WriteFully(const char* data, size_t size) {
+  while (size > 0) {
+    // MSG_NOSIGNAL: a closed peer is an error here, not a SIGPIPE.
+    const ssize_t written = send(fd_, data, size, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return absl::UnavailableError(
+          absl::StrCat("Failed to send: ", strerror(errno)));
+    }
+    data += written;
+    size -= written;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status SocketTransport::ReadFully(char* data, size_t size) {
+  while (size > 0) {
+    const ssize_t read = recv(fd_, data, size, 0);
+    if (read < 0) {
+      if (errno == EINTR) continue;
+      return absl::UnavailableError(
+          absl::StrCat("Failed to receive: ", strerror(errno)));
+    }
+    if (read == 0) {
+      return absl::UnavailableError("Connection closed by peer.");
+    }
+    data += read;
+    size -= read;
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
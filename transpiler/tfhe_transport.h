@@ -0,0 +1,94 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Message channels between a DistributedTfheRunner and its workers.
+
+#ifndef THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRANSPORT_H_
+#define THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRANSPORT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+
+namespace fully_homomorphic_encryption {
+namespace transpiler {
+
+// One end of a reliable, ordered connection carrying whole messages. Each end
+// is used by one thread at a time.
+class TfheTransport {
+ public:
+  virtual ~TfheTransport() = default;
+
+  // Sends `message` to the other end.
+  virtual absl::Status Send(absl::string_view message) = 0;
+
+  // Blocks until the next message from the other end arrives, and returns
+  // it. Fails with Unavailable once the other end has closed the connection.
+  virtual absl::StatusOr<std::string> Receive() = 0;
+};
+
+// A transport over a connected stream socket, e.g., one end of a Unix domain
+// socket pair, which frames each message with its length.
+class SocketTransport : public TfheTransport {
+ public:
+  // The default cap on the size of a received message: well above that of a
+  // serialized cloud key, the largest message a DistributedTfheRunner sends.
+  static constexpr uint64_t kDefaultMaxMessageSize = uint64_t{1} << 30;
+
+  // Takes ownership of the socket `fd`. If `child` is a process ID, it is the
+  // process at the other end, which the destructor waits for once the socket
+  // is closed. Receive() refuses messages longer than `max_message_size`
+  // bytes, rather than allocating whatever a corrupt or hostile length
+  // prefix asks for.
+  explicit SocketTransport(int fd, pid_t child = -1,
+                           uint64_t max_message_size = kDefaultMaxMessageSize);
+  ~SocketTransport() override;
+
+  SocketTransport(const SocketTransport&) = delete;
+  SocketTransport& operator=(const SocketTransport&) = delete;
+
+  // Returns both ends of a new Unix domain socket pair.
+  static absl::StatusOr<std::pair<std::unique_ptr<SocketTransport>,
+                                  std::unique_ptr<SocketTransport>>>
+  Pair(uint64_t max_message_size = kDefaultMaxMessageSize);
+
+  absl::Status Send(absl::string_view message) override;
+  // Fails with ResourceExhausted if the next message is longer than the
+  // maximum size. Its body is left unread, so the connection is then of no
+  // further use.
+  absl::StatusOr<std::string> Receive() override;
+
+  int fd() const { return fd_; }
+
+ private:
+  // Writes or reads exactly `size` bytes.
+  absl::Status WriteFully(const char* data, size_t size);
+  absl::Status ReadFully(char* data, size_t size);
+
+  const int fd_;
+  const pid_t child_;
+  const uint64_t max_message_size_;
+};
+
+}  // namespace transpiler
+}  // namespace fully_homomorphic_encryption
+
+#endif  // THIRD_PARTY_FULLY_HOMOMORPHIC_ENCRYPTION_TRANSPILER_TFHE_TRANSPORT_H_
@@ -30,7 +30,9 @@
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
 #include "transpiler/cc_transpiler.h"
+#include "transpiler/gate_fusion.h"
 #include "transpiler/interpreted_tfhe_transpiler.h"
+#include "transpiler/tfhe_plan.h"
 #include "transpiler/tfhe_transpiler.h"
 #include "transpiler/util/subprocess.h"
 #include "transpiler/util/temp_file.h"
@@ -51,8 +53,11 @@ ABSL_FLAG(std::string, metadata_path, "",
           "Path to a [binary-format] xlscc MetadataOutput protobuf "
           "containing data about the function to transpile.");
 ABSL_FLAG(std::string, output_ir_path, "",
-          "Path to place the processed XLS IR (booleanified and, if requested, "
-          "optimized).");
+          "Path to place the processed XLS IR (booleanified, with compound "
+          "gates fused and, if requested, optimized).");
+ABSL_FLAG(std::string, output_plan_path, "",
+          "Path to place the processed XLS IR compiled into a TfhePlan, in the "
+          "binary form TfheRunner::CreateFromPlanFile loads without parsing.");
 ABSL_FLAG(std::string, header_path, "-",
           "Path to generate the C++ header file. If unspecified, output to "
           "stdout");
@@ -64,6 +69,11 @@ ABSL_FLAG(std::string, transpiler_type, "tfhe",
           "Sets the transpiler type; must be one of {tfhe, interpreted_tfhe, "
           "bool}. 'bool' uses native Boolean operations on plaintext rather "
           "than an FHE library, so is mostly useful for debugging.");
+ABSL_FLAG(std::string, tfhe_schedule, "topological",
+          "For --transpiler_type=tfhe, the order the generated function "
+          "evaluates gates in; must be one of {topological, min_live_set}. "
+          "'min_live_set' orders them to hold as few ciphertexts at once as "
+          "it can, freeing each after its last use.");
 
 namespace fully_homomorphic_encryption {
 namespace transpiler {
@@ -123,6 +133,7 @@ absl::Status OptimizeAndBooleanify(
 
 absl::Status RealMain(const std::filesystem::path& ir_path,
                       absl::optional<std::filesystem::path> output_ir_path,
+                      absl::optional<std::filesystem::path> output_plan_path,
                       const std::filesystem::path& header_path,
                       const std::filesystem::path& cc_path,
                       const std::filesystem::path& booleanify_main_path,
@@ -157,6 +168,20 @@ absl::Status RealMain(const std::filesystem::path& ir_path,
   XLS_ASSIGN_OR_RETURN(xls::Function * function,
                        package->GetFunction(function_name));
 
+  // The booleanifier spells out XOR, select, NAND and NOR in and/or/not;
+  // gather them back into single gates before anything is generated.
+  XLS_ASSIGN_OR_RETURN(bool fused, FuseGates(function));
+  if (fused && output_ir_path.has_value()) {
+    XLS_RETURN_IF_ERROR(
+        xls::SetFileContents(output_ir_path.value(), package->DumpIr()));
+  }
+
+  if (output_plan_path.has_value()) {
+    XLS_ASSIGN_OR_RETURN(TfhePlan plan, TfhePlan::Compile(function, metadata));
+    XLS_RETURN_IF_ERROR(
+        xls::SetFileContents(output_plan_path.value(), plan.Serialize()));
+  }
+
   std::string fn_body, fn_header;
   std::string transpiler_type = absl::GetFlag(FLAGS_transpiler_type);
   if (transpiler_type == "bool") {
@@ -171,11 +196,21 @@ absl::Status RealMain(const std::filesystem::path& ir_path,
                          InterpretedTfheTranspiler::TranslateHeader(
                              function, metadata, header_path.string()));
   } else if (transpiler_type == "tfhe") {
-    XLS_ASSIGN_OR_RETURN(fn_body,
-                         TfheTranspiler::Translate(function, metadata));
-    XLS_ASSIGN_OR_RETURN(fn_header,
-                         TfheTranspiler::TranslateHeader(function, metadata,
-                                                         header_path.string()));
+    const std::string schedule_name = absl::GetFlag(FLAGS_tfhe_schedule);
+    TfheTranspiler::Schedule schedule;
+    if (schedule_name == "topological") {
+      schedule = TfheTranspiler::Schedule::kTopological;
+    } else if (schedule_name == "min_live_set") {
+      schedule = TfheTranspiler::Schedule::kMinLiveSet;
+    } else {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid TFHE schedule: ", schedule_name));
+    }
+    XLS_ASSIGN_OR_RETURN(
+        fn_body, TfheTranspiler::Translate(function, metadata, schedule));
+    XLS_ASSIGN_OR_RETURN(
+        fn_header, TfheTranspiler::TranslateHeader(
+                       function, metadata, header_path.string(), schedule));
   } else {
     return absl::InvalidArgumentError(
         absl::StrCat("Invalid transpiler type: ", transpiler_type));
@@ -212,9 +247,13 @@ int main(int argc, char* argv[]) {
   if (!absl::GetFlag(FLAGS_output_ir_path).empty()) {
     output_ir_path = absl::GetFlag(FLAGS_output_ir_path);
   }
+  absl::optional<std::filesystem::path> output_plan_path;
+  if (!absl::GetFlag(FLAGS_output_plan_path).empty()) {
+    output_plan_path = absl::GetFlag(FLAGS_output_plan_path);
+  }
 
   absl::Status status = fully_homomorphic_encryption::transpiler::RealMain(
-      absl::GetFlag(FLAGS_ir_path), output_ir_path,
+      absl::GetFlag(FLAGS_ir_path), output_ir_path, output_plan_path,
       absl::GetFlag(FLAGS_header_path), absl::GetFlag(FLAGS_cc_path),
       absl::GetFlag(FLAGS_booleanify_main_path),
       absl::GetFlag(FLAGS_opt_main_path), metadata_path,